@@ -0,0 +1,518 @@
+#include "geneticProgramming.h"
+#include "grammar.h"
+#include "treeGenerator.h"
+#include "treeEvaluator.h"
+#include "rampedHalfAndHalfInitializer.h"
+#include "iterativeTreeGenerator.h"
+#include "treeProgram.h"
+#include "staticGrammar.h"
+#include "genomeCodec.h"
+#include "treePrinter.h"
+
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+
+// Count the allocations, so that every benchmark can report the number of allocations per operation. Every
+// replaceable form of the allocation functions is replaced, so that no allocation bypasses the counter and every
+// form of delete matches its form of new.
+static std::atomic<size_t> allocationCount(0);
+
+static void *countedAllocation(size_t size) {
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	if (void *pointer = std::malloc(size ? size : 1)) {
+		return pointer;
+	}
+	throw std::bad_alloc();
+}
+
+void *operator new(size_t size) {
+	return countedAllocation(size);
+}
+
+void *operator new[](size_t size) {
+	return countedAllocation(size);
+}
+
+void operator delete(void *pointer) noexcept {
+	std::free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept {
+	std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept {
+	std::free(pointer);
+}
+
+void operator delete[](void *pointer, size_t) noexcept {
+	std::free(pointer);
+}
+
+#if __cpp_aligned_new
+static void *countedAlignedAllocation(size_t size, std::align_val_t alignment) {
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	void *pointer = nullptr;
+	if (posix_memalign(&pointer, std::max(size_t(alignment), sizeof(void *)), size ? size : 1) == 0) {
+		return pointer;
+	}
+	throw std::bad_alloc();
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+	return countedAlignedAllocation(size, alignment);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment) {
+	return countedAlignedAllocation(size, alignment);
+}
+
+void operator delete(void *pointer, std::align_val_t) noexcept {
+	std::free(pointer);
+}
+
+void operator delete[](void *pointer, std::align_val_t) noexcept {
+	std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t, std::align_val_t) noexcept {
+	std::free(pointer);
+}
+
+void operator delete[](void *pointer, size_t, std::align_val_t) noexcept {
+	std::free(pointer);
+}
+#endif
+
+namespace {
+
+using namespace genetic;
+
+// Report the allocations that happened since the given allocation count, and the number of nodes that were
+// processed, per iteration of the benchmark.
+void reportCounters(benchmark::State &state, size_t firstAllocationCount, size_t nodeCount) {
+	state.counters["allocs/op"] = benchmark::Counter(double(allocationCount.load() - firstAllocationCount), benchmark::Counter::kAvgIterations);
+	state.counters["nodes/s"] = benchmark::Counter(double(nodeCount), benchmark::Counter::kIsRate);
+}
+
+// An arithmetic grammar with binary functions only, so that a full tree of depth d has 2^d - 1 nodes.
+// The weights are multiplied by the given scale, which grows the range of the raw node values and so the
+// definition lookup tables.
+grammar::Grammar makeArithmeticGrammar(TreeGenomeValue scale = 1) {
+	using namespace grammar;
+	const Type number = type("number");
+	return Grammar({ number }, {
+		terminal("x", number, 2 * scale),
+		terminal("one", number, 1 * scale),
+		binaryFunction("+", number, {number, number}, 2 * scale),
+		binaryFunction("-", number, {number, number}, 2 * scale),
+		binaryFunction("*", number, {number, number}, 1 * scale),
+	});
+}
+
+TreeGenome makeFullTree(const grammar::Grammar &grammar, int depth, unsigned seed = 1) {
+	std::mt19937 rng(seed);
+	TreeGenerator<std::mt19937> generator(grammar, rng);
+	TreeGenome genome;
+	{
+		TreeGenome::Builder builder(genome);
+		generator.generateFull(builder, depth);
+	}
+	return genome;
+}
+
+struct ArithmeticEvaluator : TreeGenomeEvaluator<float> {
+	unsigned x, add, sub;
+
+	ArithmeticEvaluator(const grammar::Grammar &grammar) : TreeGenomeEvaluator<float>(grammar) {
+		auto definitions = grammar::GrammarDefinitionAccessor(grammar);
+		x = definitions["x"].getDefinitionId();
+		add = definitions["+"].getDefinitionId();
+		sub = definitions["-"].getDefinitionId();
+	}
+
+	float evaluteTerminal(unsigned definitionId, const TreeGenome::Node &node) override {
+		return definitionId == x ? 0.5f : 1.0f;
+	}
+	float evaluateBinaryFunction(unsigned definitionId, const TreeGenome::Node &node, float a, float b) override {
+		return definitionId == add ? a + b : definitionId == sub ? a - b : a * b;
+	}
+};
+
+// Evolves arithmetic trees that evaluate to 42.
+class ArithmeticEvolver : public EvolvingPopulationDelegate {
+public:
+	EvolutionParameters &params;
+	grammar::Grammar grammar;
+	ArithmeticEvaluator evaluator;
+
+	ArithmeticEvolver(EvolutionParameters &params) : params(params), grammar(makeArithmeticGrammar()), evaluator(grammar) { }
+
+	void computeFitness(const std::vector<TreeGenome> &individuals, std::vector<float> &fitnesses) override {
+		for (size_t i = 0; i < individuals.size(); ++i) {
+			fitnesses[i] = -std::abs(evaluator(individuals[i]) - 42.0f) - float(individuals[i].getNodeCount()) * 0.01f;
+		}
+	}
+
+	TreeGenome generateRandomTreeOfType(TreeGenomeType type) override {
+		TreeGenome genome;
+		TreeGenerator<EvolutionParameters::RNG> generator(grammar, params.rng);
+		TreeGenome::Builder builder(genome);
+		generator.generateGrow(builder, 3, type);
+		return genome;
+	}
+
+	const grammar::Grammar &genomeGrammar() override {
+		return grammar;
+	}
+};
+
+size_t totalNodeCount(Population &population) {
+	size_t count = 0;
+	for (size_t i = 0; i < population.size(); ++i) {
+		count += population[i].getNodeCount();
+	}
+	return count;
+}
+
+// The tree benchmarks take the depth of a full binary tree: 4, 7, 10 and 13 give 15 to 8191 nodes.
+#define TREE_DEPTHS ->Arg(4)->Arg(7)->Arg(10)->Arg(13)
+
+void BM_TreeReplace(benchmark::State &state) {
+	auto grammar = makeArithmeticGrammar();
+	auto tree = makeFullTree(grammar, int(state.range(0)));
+	auto other = makeFullTree(grammar, int(state.range(0)), 2);
+	// The left sub-trees of the root have the same size, so the tree keeps its size.
+	auto subTree = other.getSubTree(1);
+	size_t nodeCount = 0;
+	size_t firstAllocationCount = allocationCount.load();
+	for (auto _ : state) {
+		tree.replace(1, subTree);
+		benchmark::DoNotOptimize(tree.nodeData());
+		nodeCount += subTree.getNodeCount();
+	}
+	reportCounters(state, firstAllocationCount, nodeCount);
+}
+BENCHMARK(BM_TreeReplace) TREE_DEPTHS;
+
+void BM_TreeGetSubTree(benchmark::State &state) {
+	auto grammar = makeArithmeticGrammar();
+	auto tree = makeFullTree(grammar, int(state.range(0)));
+	size_t nodeCount = 0;
+	size_t firstAllocationCount = allocationCount.load();
+	for (auto _ : state) {
+		auto subTree = tree.getSubTree(1);
+		benchmark::DoNotOptimize(subTree.nodeData());
+		nodeCount += subTree.getNodeCount();
+	}
+	reportCounters(state, firstAllocationCount, nodeCount);
+}
+BENCHMARK(BM_TreeGetSubTree) TREE_DEPTHS;
+
+// Takes the scale of the grammar's weights: the larger grammars don't fit into the direct lookup table.
+void BM_GrammarDefinitionLookup(benchmark::State &state) {
+	auto grammar = makeArithmeticGrammar(TreeGenomeValue(state.range(0)));
+	std::mt19937 rng(3);
+	std::vector<TreeGenomeValue> values(4096);
+	for (auto &value : values) {
+		value = std::uniform_int_distribution<TreeGenomeValue>(0, grammar.getNodeLimit() - 1)(rng);
+	}
+	size_t nodeCount = 0;
+	size_t firstAllocationCount = allocationCount.load();
+	for (auto _ : state) {
+		unsigned sum = 0;
+		for (auto value : values) {
+			sum += grammar.definitionIdForTreeGenomeValue(value);
+		}
+		benchmark::DoNotOptimize(sum);
+		nodeCount += values.size();
+	}
+	reportCounters(state, firstAllocationCount, nodeCount);
+}
+BENCHMARK(BM_GrammarDefinitionLookup)->Arg(1)->Arg(100)->Arg(10000);
+
+void BM_TreeGenomeEvaluator(benchmark::State &state) {
+	auto grammar = makeArithmeticGrammar();
+	auto tree = makeFullTree(grammar, int(state.range(0)));
+	ArithmeticEvaluator evaluator(grammar);
+	size_t nodeCount = 0;
+	size_t firstAllocationCount = allocationCount.load();
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(evaluator(tree));
+		nodeCount += tree.getNodeCount();
+	}
+	reportCounters(state, firstAllocationCount, nodeCount);
+}
+BENCHMARK(BM_TreeGenomeEvaluator) TREE_DEPTHS;
+
+// Evaluates the arithmetic grammar by comparing the definition ids of the instructions.
+struct ArithmeticProgramEvaluator : TreeGenomeProgramEvaluator<float, ArithmeticProgramEvaluator> {
+	unsigned x, add, sub;
+
+	ArithmeticProgramEvaluator(const grammar::Grammar &grammar) {
+		auto definitions = grammar::GrammarDefinitionAccessor(grammar);
+		x = definitions["x"].getDefinitionId();
+		add = definitions["+"].getDefinitionId();
+		sub = definitions["-"].getDefinitionId();
+	}
+
+	float evaluateTerminal(unsigned definitionId, TreeGenomeValue value) {
+		return definitionId == x ? 0.5f : 1.0f;
+	}
+	float evaluateBinaryFunction(unsigned definitionId, float a, float b) {
+		return definitionId == add ? a + b : definitionId == sub ? a - b : a * b;
+	}
+};
+
+// The arithmetic grammar as a static grammar.
+struct ArithmeticContext { };
+
+struct StaticArithmeticX : grammar::StaticTerminal<2> {
+	static const char *name() { return "x"; }
+	template<typename T>
+	static T evaluate(ArithmeticContext &, TreeGenomeValue, size_t) { return 0.5f; }
+};
+
+struct StaticArithmeticOne : grammar::StaticTerminal<1> {
+	static const char *name() { return "one"; }
+	template<typename T>
+	static T evaluate(ArithmeticContext &, TreeGenomeValue, size_t) { return 1.0f; }
+};
+
+struct StaticArithmeticAdd : grammar::StaticBinaryFunction<2> {
+	static const char *name() { return "+"; }
+	template<typename T>
+	static T evaluate(T a, T b) { return a + b; }
+};
+
+struct StaticArithmeticSubtract : grammar::StaticBinaryFunction<2> {
+	static const char *name() { return "-"; }
+	template<typename T>
+	static T evaluate(T a, T b) { return a - b; }
+};
+
+struct StaticArithmeticMultiply : grammar::StaticBinaryFunction<1> {
+	static const char *name() { return "*"; }
+	template<typename T>
+	static T evaluate(T a, T b) { return a * b; }
+};
+
+typedef grammar::StaticGrammar<StaticArithmeticX, StaticArithmeticOne, StaticArithmeticAdd, StaticArithmeticSubtract, StaticArithmeticMultiply> StaticArithmeticGrammar;
+
+void BM_TreeGenomeProgramEvaluator(benchmark::State &state) {
+	auto grammar = makeArithmeticGrammar();
+	auto tree = makeFullTree(grammar, int(state.range(0)));
+	TreeGenomeProgram program(grammar, tree);
+	ArithmeticProgramEvaluator evaluator(grammar);
+	size_t nodeCount = 0;
+	size_t firstAllocationCount = allocationCount.load();
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(evaluator(program));
+		nodeCount += tree.getNodeCount();
+	}
+	reportCounters(state, firstAllocationCount, nodeCount);
+}
+BENCHMARK(BM_TreeGenomeProgramEvaluator) TREE_DEPTHS;
+
+void BM_StaticTreeGenomeProgramEvaluator(benchmark::State &state) {
+	auto grammar = StaticArithmeticGrammar::makeGrammar({ grammar::type("number") });
+	auto tree = makeFullTree(grammar, int(state.range(0)));
+	TreeGenomeProgram program;
+	StaticArithmeticGrammar::compile(tree, program);
+	StaticTreeGenomeProgramEvaluator<float, StaticArithmeticGrammar, ArithmeticContext> evaluator;
+	ArithmeticContext context;
+	size_t nodeCount = 0;
+	size_t firstAllocationCount = allocationCount.load();
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(evaluator(program, context));
+		nodeCount += tree.getNodeCount();
+	}
+	reportCounters(state, firstAllocationCount, nodeCount);
+}
+BENCHMARK(BM_StaticTreeGenomeProgramEvaluator) TREE_DEPTHS;
+
+template <TreeGenerator<std::mt19937>::Strategy strategy>
+void BM_TreeGenerator(benchmark::State &state) {
+	auto grammar = makeArithmeticGrammar();
+	std::mt19937 rng(4);
+	TreeGenerator<std::mt19937> generator(grammar, rng);
+	size_t nodeCount = 0;
+	size_t firstAllocationCount = allocationCount.load();
+	for (auto _ : state) {
+		TreeGenome genome;
+		{
+			TreeGenome::Builder builder(genome);
+			generator.generate(builder, int(state.range(0)), strategy);
+		}
+		nodeCount += genome.getNodeCount();
+	}
+	reportCounters(state, firstAllocationCount, nodeCount);
+}
+BENCHMARK_TEMPLATE(BM_TreeGenerator, TreeGenerator<std::mt19937>::Strategy::Full) TREE_DEPTHS;
+BENCHMARK_TEMPLATE(BM_TreeGenerator, TreeGenerator<std::mt19937>::Strategy::Grow) TREE_DEPTHS;
+
+template <IterativeTreeGenerator<std::mt19937>::Strategy strategy>
+void BM_IterativeTreeGenerator(benchmark::State &state) {
+	auto grammar = makeArithmeticGrammar();
+	std::mt19937 rng(4);
+	IterativeTreeGenerator<std::mt19937> generator(grammar, rng);
+	IterativeTreeGenerator<std::mt19937>::NodeBuffer nodes;
+	size_t nodeCount = 0;
+	size_t firstAllocationCount = allocationCount.load();
+	for (auto _ : state) {
+		generator.generate(nodes, int(state.range(0)), strategy);
+		nodeCount += nodes.size();
+	}
+	reportCounters(state, firstAllocationCount, nodeCount);
+}
+BENCHMARK_TEMPLATE(BM_IterativeTreeGenerator, IterativeTreeGenerator<std::mt19937>::Strategy::Full) TREE_DEPTHS;
+BENCHMARK_TEMPLATE(BM_IterativeTreeGenerator, IterativeTreeGenerator<std::mt19937>::Strategy::Grow) TREE_DEPTHS;
+
+// Takes the population size.
+void BM_RampedHalfAndHalfInitializer(benchmark::State &state) {
+	auto grammar = makeArithmeticGrammar();
+	std::mt19937 rng(5);
+	RampedHalfAndHalfInitializer<std::mt19937> initializer(grammar, rng);
+	InitializationOptions options;
+	options.maxTreeGenomeDepth = 8;
+	options.populationSize = size_t(state.range(0));
+	size_t nodeCount = 0;
+	size_t firstAllocationCount = allocationCount.load();
+	for (auto _ : state) {
+		initializer.initialize(options, [&] (TreeGenome genome) {
+			nodeCount += genome.getNodeCount();
+		});
+	}
+	reportCounters(state, firstAllocationCount, nodeCount);
+}
+BENCHMARK(BM_RampedHalfAndHalfInitializer)->Arg(100)->Arg(1000);
+
+void BM_IterativeRampedHalfAndHalfInitializer(benchmark::State &state) {
+	auto grammar = makeArithmeticGrammar();
+	std::mt19937 rng(5);
+	IterativeRampedHalfAndHalfInitializer<std::mt19937> initializer(grammar, rng);
+	InitializationOptions options;
+	options.maxTreeGenomeDepth = 8;
+	options.populationSize = size_t(state.range(0));
+	size_t nodeCount = 0;
+	size_t firstAllocationCount = allocationCount.load();
+	for (auto _ : state) {
+		initializer.initialize(options, [&] (TreeGenome genome) {
+			nodeCount += genome.getNodeCount();
+		});
+	}
+	reportCounters(state, firstAllocationCount, nodeCount);
+}
+BENCHMARK(BM_IterativeRampedHalfAndHalfInitializer)->Arg(100)->Arg(1000);
+
+void BM_TreeGenomeEncode(benchmark::State &state) {
+	auto grammar = makeArithmeticGrammar();
+	auto tree = makeFullTree(grammar, int(state.range(0)));
+	std::vector<uint8_t> bytes;
+	size_t nodeCount = 0;
+	size_t firstAllocationCount = allocationCount.load();
+	for (auto _ : state) {
+		bytes.clear();
+		codec::encode(tree, bytes);
+		benchmark::DoNotOptimize(bytes.data());
+		nodeCount += tree.getNodeCount();
+	}
+	reportCounters(state, firstAllocationCount, nodeCount);
+}
+BENCHMARK(BM_TreeGenomeEncode) TREE_DEPTHS;
+
+void BM_TreeGenomeDecode(benchmark::State &state) {
+	auto grammar = makeArithmeticGrammar();
+	auto tree = makeFullTree(grammar, int(state.range(0)));
+	std::vector<uint8_t> bytes;
+	codec::encode(tree, bytes);
+	codec::Decoder<> decoder(grammar);
+	TreeGenome decoded = tree.copy();
+	size_t nodeCount = 0;
+	size_t firstAllocationCount = allocationCount.load();
+	for (auto _ : state) {
+		const uint8_t *position = bytes.data();
+		bool isDecoded = decoder.decode(position, bytes.data() + bytes.size(), decoded);
+		benchmark::DoNotOptimize(isDecoded);
+		nodeCount += decoded.getNodeCount();
+	}
+	reportCounters(state, firstAllocationCount, nodeCount);
+}
+BENCHMARK(BM_TreeGenomeDecode) TREE_DEPTHS;
+
+// Print into a reused buffer, or recursively through a stream as the root node, which is how the trees were printed.
+template<bool isBuffered>
+void BM_TreeGenomePrinter(benchmark::State &state) {
+	auto grammar = makeArithmeticGrammar();
+	auto tree = makeFullTree(grammar, int(state.range(0)));
+	TreeGenomePrinter printer(grammar);
+	std::string buffer;
+	std::stringstream stream;
+	size_t nodeCount = 0;
+	size_t firstAllocationCount = allocationCount.load();
+	for (auto _ : state) {
+		if (isBuffered) {
+			buffer.clear();
+			printer.print(tree, buffer);
+			benchmark::DoNotOptimize(buffer.data());
+		} else {
+			stream.seekp(0);
+			printer.print(tree[0], stream);
+		}
+		nodeCount += tree.getNodeCount();
+	}
+	reportCounters(state, firstAllocationCount, nodeCount);
+}
+BENCHMARK_TEMPLATE(BM_TreeGenomePrinter, true) TREE_DEPTHS;
+BENCHMARK_TEMPLATE(BM_TreeGenomePrinter, false) TREE_DEPTHS;
+
+void BM_PopulationSelect(benchmark::State &state) {
+	EvolutionParameters params;
+	params.rng = std::mt19937(6);
+	ArithmeticEvolver evolver(params);
+	const size_t size = size_t(state.range(0));
+	Population population(size, params, evolver);
+	RampedHalfAndHalfInitializer<EvolutionParameters::RNG> initializer(evolver.grammar, params.rng);
+	population.initialize(6, initializer);
+	population.evaluateGeneration();
+	std::vector<TreeGenome> selected;
+	selected.reserve(size);
+	size_t nodeCount = 0;
+	size_t firstAllocationCount = allocationCount.load();
+	for (auto _ : state) {
+		selected.clear();
+		population.select(selected, size);
+		for (const auto &genome : selected) {
+			nodeCount += genome.getNodeCount();
+		}
+	}
+	reportCounters(state, firstAllocationCount, nodeCount);
+}
+BENCHMARK(BM_PopulationSelect)->Arg(100)->Arg(1000);
+
+void BM_PopulationNextGeneration(benchmark::State &state) {
+	EvolutionParameters params;
+	params.rng = std::mt19937(7);
+	params.mutationRate = 0.1f;
+	params.crossoverRate = 0.8f;
+	ArithmeticEvolver evolver(params);
+	Population population(size_t(state.range(0)), params, evolver);
+	RampedHalfAndHalfInitializer<EvolutionParameters::RNG> initializer(evolver.grammar, params.rng);
+	population.initialize(6, initializer);
+	size_t nodeCount = 0;
+	size_t firstAllocationCount = allocationCount.load();
+	for (auto _ : state) {
+		nodeCount += totalNodeCount(population);
+		population.nextGeneration(false);
+	}
+	reportCounters(state, firstAllocationCount, nodeCount);
+}
+BENCHMARK(BM_PopulationNextGeneration)->Arg(100)->Arg(1000);
+
+} // end anonymous namespace
+
+BENCHMARK_MAIN();
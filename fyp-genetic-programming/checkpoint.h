@@ -0,0 +1,321 @@
+#pragma once
+
+#include "genome.h"
+#include "grammar.h"
+#include "geneticProgramming.h"
+#include <vector>
+#include <deque>
+#include <string>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace genetic {
+
+/// A binary snapshot of the state of a population: its generation, the genomes and the fitness of its individuals,
+/// and the state of the random number generator. The file starts with a header, followed by the sections that are
+/// aligned to 8 bytes: the fitness array, the node offset of every genome, the node arrays of all of the genomes
+/// written one after another, and the text state of the random number generator.
+/// The values are stored in the byte order of the machine, which is checked when the checkpoint is loaded.
+namespace checkpoint {
+
+static const char magic[8] = { 'G', 'P', 'C', 'H', 'K', 'P', 'T', 0 };
+static const uint32_t currentVersion = 1;
+static const uint32_t byteOrderMark = 0x01020304;
+
+struct Header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrderMark;
+	uint64_t grammarFingerprint;
+	int64_t generation;
+	uint64_t individualCount;
+	uint64_t nodeCount;
+	uint64_t rngStateSize;
+	uint64_t fitnessOffset, genomeOffsetsOffset, nodesOffset, rngStateOffset;
+	uint64_t fileSize;
+};
+
+/// A genome node as it's stored in a checkpoint, which matches the layout of TreeNodeStorage<TreeGenomeValue>.
+struct Node {
+	uint32_t value;
+	uint32_t childCount;
+	uint32_t subTreeSize;
+};
+
+inline uint64_t alignOffset(uint64_t offset) {
+	return (offset + 7) & ~uint64_t(7);
+}
+
+static_assert(sizeof(Node) == sizeof(TreeGenome::NodeStorageType) && sizeof(TreeGenomeValue) == sizeof(uint32_t), "The node storage doesn't match the checkpoint layout");
+
+// Serialize the state of the given population into a checkpoint. The generation is evaluated first,
+// so that the fitness doesn't have to be computed again when the checkpoint is restored.
+inline void serialize(Population &population, const EvolutionParameters &params, const grammar::Grammar &grammar, std::vector<uint8_t> &bytes) {
+	population.evaluateGeneration();
+	std::ostringstream rngState;
+	rngState << params.rng;
+	const auto rngString = rngState.str();
+	const size_t count = population.size();
+	uint64_t nodeCount = 0;
+	for (size_t i = 0; i < count; ++i) {
+		nodeCount += population[i].getNodeCount();
+	}
+
+	Header header;
+	std::memcpy(header.magic, magic, sizeof(magic));
+	header.version = currentVersion;
+	header.byteOrderMark = byteOrderMark;
+	header.grammarFingerprint = grammar.fingerprint();
+	header.generation = population.generation;
+	header.individualCount = count;
+	header.nodeCount = nodeCount;
+	header.rngStateSize = rngString.size();
+	header.fitnessOffset = alignOffset(sizeof(Header));
+	header.genomeOffsetsOffset = alignOffset(header.fitnessOffset + count * sizeof(float));
+	header.nodesOffset = alignOffset(header.genomeOffsetsOffset + (count + 1) * sizeof(uint64_t));
+	header.rngStateOffset = alignOffset(header.nodesOffset + nodeCount * sizeof(Node));
+	header.fileSize = header.rngStateOffset + rngString.size();
+
+	bytes.assign(header.fileSize, 0);
+	std::memcpy(bytes.data(), &header, sizeof(header));
+	float *fitnesses = reinterpret_cast<float *>(bytes.data() + header.fitnessOffset);
+	uint64_t *genomeOffsets = reinterpret_cast<uint64_t *>(bytes.data() + header.genomeOffsetsOffset);
+	uint8_t *nodes = bytes.data() + header.nodesOffset;
+	uint64_t offset = 0;
+	for (size_t i = 0; i < count; ++i) {
+		const auto &genome = population[i];
+		fitnesses[i] = population.getFitness(i);
+		genomeOffsets[i] = offset;
+		std::memcpy(nodes + offset * sizeof(Node), genome.nodeData(), genome.getNodeCount() * sizeof(Node));
+		offset += genome.getNodeCount();
+	}
+	genomeOffsets[count] = offset;
+	std::memcpy(bytes.data() + header.rngStateOffset, rngString.data(), rngString.size());
+}
+
+// Write the given bytes to the file at the given path. The bytes are written to a temporary file first, which then
+// replaces the file, so a crash never leaves a partially written checkpoint behind.
+inline bool writeFile(const std::string &path, const std::vector<uint8_t> &bytes) {
+	auto temporaryPath = path + ".tmp";
+	FILE *file = std::fopen(temporaryPath.c_str(), "wb");
+	if (!file) {
+		return false;
+	}
+	bool isWritten = std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+	isWritten = std::fflush(file) == 0 && isWritten;
+	isWritten = fsync(fileno(file)) == 0 && isWritten;
+	isWritten = std::fclose(file) == 0 && isWritten;
+	if (!isWritten || std::rename(temporaryPath.c_str(), path.c_str()) != 0) {
+		std::remove(temporaryPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+} // end namespace checkpoint
+
+/// Writes checkpoints on a background thread. The population is serialized into memory on the calling thread,
+/// which is a copy of the node arrays, and the file is written by the background thread while the evolution goes on.
+class CheckpointWriter {
+	struct Request {
+		std::string path;
+		std::vector<uint8_t> bytes;
+	};
+	std::deque<Request> requests;
+	std::mutex mutex;
+	std::condition_variable wakeCondition, doneCondition;
+	bool isStopping = false, isWriting = false;
+	size_t failureCount = 0;
+	std::thread thread;
+
+	void writerMain() {
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			wakeCondition.wait(lock, [this] { return isStopping || !requests.empty(); });
+			if (requests.empty()) {
+				return;
+			}
+			Request request = std::move(requests.front());
+			requests.pop_front();
+			isWriting = true;
+			lock.unlock();
+			bool isWritten = checkpoint::writeFile(request.path, request.bytes);
+			lock.lock();
+			isWriting = false;
+			failureCount += !isWritten;
+			doneCondition.notify_all();
+		}
+	}
+public:
+	CheckpointWriter() : thread([this] { writerMain(); }) { }
+	CheckpointWriter(const CheckpointWriter &) = delete;
+	CheckpointWriter &operator = (const CheckpointWriter &) = delete;
+
+	// Write the pending checkpoints and stop the background thread.
+	~CheckpointWriter() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			isStopping = true;
+		}
+		wakeCondition.notify_one();
+		thread.join();
+	}
+
+	// Snapshot the given population and write it to the file at the given path in the background.
+	void write(const std::string &path, Population &population, const EvolutionParameters &params, const grammar::Grammar &grammar) {
+		Request request;
+		request.path = path;
+		checkpoint::serialize(population, params, grammar, request.bytes);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			requests.push_back(std::move(request));
+		}
+		wakeCondition.notify_one();
+	}
+
+	// Wait until all of the checkpoints were written. Return false if any of the writes failed.
+	bool wait() {
+		std::unique_lock<std::mutex> lock(mutex);
+		doneCondition.wait(lock, [this] { return requests.empty() && !isWriting; });
+		return failureCount == 0;
+	}
+};
+
+/// A checkpoint file that's mapped into memory. Restoring a population copies the node arrays straight from the
+/// mapping, without parsing the genomes or evaluating them again.
+class MappedCheckpoint {
+	const uint8_t *data = nullptr;
+	size_t size = 0;
+	checkpoint::Header header;
+	bool isValid = false;
+
+	bool validate() {
+		using namespace checkpoint;
+		if (size < sizeof(Header)) {
+			return false;
+		}
+		std::memcpy(&header, data, sizeof(header));
+		if (std::memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != currentVersion || header.byteOrderMark != byteOrderMark || header.fileSize != size) {
+			return false;
+		}
+		const uint64_t count = header.individualCount;
+		// The bounds are compared by dividing the space that's left, as the products of corrupted counts overflow.
+		auto fits = [this] (uint64_t offset, uint64_t elementCount, uint64_t elementSize) {
+			return offset <= size && elementCount <= (size - offset) / elementSize;
+		};
+		if (!fits(header.fitnessOffset, count, sizeof(float)) || !fits(header.genomeOffsetsOffset, count, sizeof(uint64_t)) ||
+		    (size - header.genomeOffsetsOffset) / sizeof(uint64_t) == count || !fits(header.nodesOffset, header.nodeCount, sizeof(Node)) ||
+		    !fits(header.rngStateOffset, header.rngStateSize, 1) ||
+		    header.fitnessOffset % 8 || header.genomeOffsetsOffset % 8 || header.nodesOffset % 8) {
+			return false;
+		}
+		auto offsets = genomeOffsets();
+		if (offsets[0] != 0 || offsets[count] != header.nodeCount) {
+			return false;
+		}
+		for (uint64_t i = 0; i < count; ++i) {
+			if (offsets[i] >= offsets[i + 1] || !TreeGenome::isValidNodeArray(nodes() + offsets[i], size_t(offsets[i + 1] - offsets[i]))) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	const uint64_t *genomeOffsets() const {
+		return reinterpret_cast<const uint64_t *>(data + header.genomeOffsetsOffset);
+	}
+
+	const TreeGenome::NodeStorageType *nodes() const {
+		return reinterpret_cast<const TreeGenome::NodeStorageType *>(data + header.nodesOffset);
+	}
+public:
+	// Map the checkpoint at the given path. Check isLoaded to see whether it's a valid checkpoint.
+	explicit MappedCheckpoint(const std::string &path) {
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return;
+		}
+		struct stat status;
+		if (fstat(fd, &status) == 0 && status.st_size > 0) {
+			void *mapping = mmap(nullptr, size_t(status.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapping != MAP_FAILED) {
+				data = static_cast<const uint8_t *>(mapping);
+				size = size_t(status.st_size);
+			}
+		}
+		close(fd);
+		isValid = data && validate();
+	}
+
+	MappedCheckpoint(const MappedCheckpoint &) = delete;
+	MappedCheckpoint &operator = (const MappedCheckpoint &) = delete;
+
+	~MappedCheckpoint() {
+		if (data) {
+			munmap(const_cast<uint8_t *>(data), size);
+		}
+	}
+
+	bool isLoaded() const {
+		return isValid;
+	}
+
+	int generation() const {
+		assert(isValid);
+		return int(header.generation);
+	}
+
+	size_t individualCount() const {
+		assert(isValid);
+		return size_t(header.individualCount);
+	}
+
+	uint64_t grammarFingerprint() const {
+		assert(isValid);
+		return header.grammarFingerprint;
+	}
+
+	// Restore the given population and the random number generator of the given parameters. Return false if the
+	// checkpoint was made with a different grammar or a population of a different size.
+	bool restore(Population &population, EvolutionParameters &params, const grammar::Grammar &grammar) const {
+		if (!isValid || header.grammarFingerprint != grammar.fingerprint() || header.individualCount != population.size()) {
+			return false;
+		}
+		std::istringstream rngState(std::string(reinterpret_cast<const char *>(data + header.rngStateOffset), size_t(header.rngStateSize)));
+		EvolutionParameters::RNG rng;
+		if (!(rngState >> rng)) {
+			return false;
+		}
+		// The shape of the genomes was validated when the checkpoint was mapped, but a corrupted checkpoint with the
+		// same fingerprint may still have nodes that aren't valid for the grammar.
+		const auto *checkpointNodes = nodes();
+		for (uint64_t i = 0; i < header.nodeCount; ++i) {
+			const auto &node = checkpointNodes[i];
+			if (node.value >= grammar.getNodeLimit() || node.childCount != grammar[grammar.definitionIdForTreeGenomeValue(node.value)].getNumArguments()) {
+				return false;
+			}
+		}
+		const size_t count = size_t(header.individualCount);
+		std::vector<TreeGenome> individuals(count);
+		std::vector<float> fitnesses(count);
+		std::memcpy(fitnesses.data(), data + header.fitnessOffset, count * sizeof(float));
+		auto offsets = genomeOffsets();
+		for (size_t i = 0; i < count; ++i) {
+			individuals[i].assignNodes(nodes() + offsets[i], size_t(offsets[i + 1] - offsets[i]));
+		}
+		population.restore(int(header.generation), std::move(individuals), fitnesses);
+		params.rng = rng;
+		return true;
+	}
+};
+
+} // end namespace genetic
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <cassert>
+
+namespace genetic {
+namespace core {
+
+/// A bounded, lock-free queue that's safe to use from one producer thread and one consumer thread at the same time.
+template <typename T>
+class SingleProducerSingleConsumerQueue {
+	std::vector<T> slots;
+	// The positions only grow, and they're reduced modulo the capacity to index the slots.
+	std::atomic<size_t> head, tail;
+public:
+	explicit SingleProducerSingleConsumerQueue(size_t capacity) : slots(capacity), head(0), tail(0) {
+		assert(capacity != 0);
+	}
+
+	SingleProducerSingleConsumerQueue(const SingleProducerSingleConsumerQueue &) = delete;
+	SingleProducerSingleConsumerQueue &operator = (const SingleProducerSingleConsumerQueue &) = delete;
+
+	size_t capacity() const {
+		return slots.size();
+	}
+
+	// Append the given value to the queue. Return false if the queue is full.
+	// This must only be called by the producer thread.
+	bool push(T value) {
+		size_t position = tail.load(std::memory_order_relaxed);
+		if (position - head.load(std::memory_order_acquire) == slots.size()) {
+			return false;
+		}
+		slots[position % slots.size()] = std::move(value);
+		tail.store(position + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Remove the oldest value from the queue. Return false if the queue is empty.
+	// This must only be called by the consumer thread.
+	bool pop(T &value) {
+		size_t position = head.load(std::memory_order_relaxed);
+		if (position == tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		value = std::move(slots[position % slots.size()]);
+		head.store(position + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool isEmpty() const {
+		return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+	}
+};
+
+} // end namespace core
+} // end namespace genetic
@@ -0,0 +1,299 @@
+#pragma once
+
+#include "genome.h"
+#include "grammar.h"
+#include "profiler.h"
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+namespace genetic {
+
+/// Tells TreeGenomeDAG how the definitions of a grammar relate to the functions of a genome.
+/// A genome can start with a function set root, whose first arguments are the bodies of automatically defined
+/// functions and whose last argument is the main body. The bodies call the functions with call nodes, and the
+/// terminals that are parameters take the arguments of the call, or the parameters of the fitness case in the
+/// main body. Every other definition must be a pure function of its arguments.
+class TreeGenomeDAGDelegate {
+public:
+	virtual ~TreeGenomeDAGDelegate() { }
+
+	// Return the number of function bodies when the given definition is a function set root, or 0 otherwise.
+	virtual unsigned functionCountForRoot(unsigned definitionId) {
+		return 0;
+	}
+
+	// Return the index of the function that's called by the given definition, or -1 if it's not a call.
+	// A function body can only call the functions that come before it.
+	virtual int functionIndexForCall(unsigned definitionId) {
+		return -1;
+	}
+
+	// Return the index of the parameter that's taken by the given terminal, or -1 if it's not a parameter.
+	virtual int parameterIndexForTerminal(unsigned definitionId, TreeGenomeValue value) {
+		return -1;
+	}
+
+	// Return the same raw value for the terminals that evaluate to the same value, which allows
+	// them to be merged.
+	virtual TreeGenomeValue canonicalValueForTerminal(unsigned definitionId, TreeGenomeValue value) {
+		return value;
+	}
+};
+
+/// A GP tree that's hash-consed into a directed acyclic graph, so that every distinct sub-tree is a single node
+/// that's evaluated once. The nodes of every function body are stored after the nodes of their arguments.
+struct TreeGenomeDAG {
+	struct Node {
+		enum class Kind : unsigned char {
+			Terminal,
+			Parameter,
+			Function,
+			Call
+		};
+		Kind kind;
+		unsigned argumentCount;
+		unsigned definitionId;
+		// The raw value of a terminal, the index of a parameter or the index of the called function.
+		TreeGenomeValue value;
+		// The arguments of the node start at this index in arguments.
+		size_t firstArgument;
+	};
+	// The nodes of one function.
+	struct Body {
+		size_t firstNode, nodeCount;
+		// The number of value slots that are needed to evaluate this body, including the nested calls.
+		size_t requiredValueCount;
+	};
+	std::vector<Node> nodes;
+	// The indices of the argument nodes, relative to the first node of their body.
+	std::vector<unsigned> arguments;
+	// The bodies of the functions, followed by the main body.
+	std::vector<Body> bodies;
+private:
+	// Maps the hashes of the nodes of the current body to their indices, using linear probing.
+	std::vector<uint32_t> table;
+	static constexpr uint32_t emptySlot = ~0u;
+	size_t tableMask = 0;
+
+	static uint64_t hashNode(const Node &node, const unsigned *arguments) {
+		uint64_t hash = (uint64_t(node.kind) << 56) ^ (uint64_t(node.definitionId) << 32) ^ node.value;
+		for (unsigned i = 0; i < node.argumentCount; ++i) {
+			hash = (hash ^ arguments[i]) * 0x9e3779b97f4a7c15ull;
+			hash ^= hash >> 29;
+		}
+		return hash * 0xbf58476d1ce4e5b9ull;
+	}
+
+	bool isEqual(const Node &node, const Node &other) const {
+		if (node.kind != other.kind || node.definitionId != other.definitionId || node.value != other.value || node.argumentCount != other.argumentCount) {
+			return false;
+		}
+		return std::equal(arguments.begin() + node.firstArgument, arguments.begin() + node.firstArgument + node.argumentCount, arguments.begin() + other.firstArgument);
+	}
+
+	// Return the index of the given node in the current body, which is added unless an equal node exists.
+	// The arguments of the node are the last ones in arguments.
+	unsigned intern(const Node &node) {
+		auto &body = bodies.back();
+		uint64_t hash = hashNode(node, arguments.data() + node.firstArgument);
+		for (size_t slot = size_t(hash) & tableMask; ; slot = (slot + 1) & tableMask) {
+			if (table[slot] == emptySlot) {
+				table[slot] = uint32_t(body.nodeCount);
+				nodes.push_back(node);
+				return unsigned(body.nodeCount++);
+			}
+			if (isEqual(nodes[body.firstNode + table[slot]], node)) {
+				arguments.resize(node.firstArgument);
+				return table[slot];
+			}
+		}
+	}
+
+	template<typename NodeType>
+	unsigned compileNode(const grammar::Grammar &grammar, TreeGenomeDAGDelegate &delegate, const NodeType &treeNode) {
+		const auto &definition = grammar[grammar.definitionIdForTreeGenomeValue(treeNode.value)];
+		assert(treeNode.size() == definition.getNumArguments());
+		Node node;
+		node.definitionId = definition.getDefinitionId();
+		node.argumentCount = definition.getNumArguments();
+		node.value = 0;
+		if (definition.isTerminal()) {
+			int parameter = delegate.parameterIndexForTerminal(node.definitionId, treeNode.value);
+			node.kind = parameter < 0 ? Node::Kind::Terminal : Node::Kind::Parameter;
+			node.value = parameter < 0 ? delegate.canonicalValueForTerminal(node.definitionId, treeNode.value) : TreeGenomeValue(parameter);
+			node.firstArgument = arguments.size();
+			return intern(node);
+		}
+		int function = delegate.functionIndexForCall(node.definitionId);
+		if (function < 0) {
+			node.kind = Node::Kind::Function;
+		} else {
+			assert(size_t(function) + 1 < bodies.size() && "A function can only call the functions before it");
+			node.kind = Node::Kind::Call;
+			node.value = TreeGenomeValue(function);
+		}
+		// The arguments are compiled before the node is added, which keeps the nodes in evaluation order.
+		unsigned argumentIds[8];
+		std::vector<unsigned> largeArgumentIds;
+		unsigned *ids = argumentIds;
+		if (node.argumentCount > 8) {
+			largeArgumentIds.resize(node.argumentCount);
+			ids = largeArgumentIds.data();
+		}
+		unsigned i = 0;
+		for (auto child : treeNode) {
+			ids[i++] = compileNode(grammar, delegate, child);
+		}
+		node.firstArgument = arguments.size();
+		arguments.insert(arguments.end(), ids, ids + node.argumentCount);
+		return intern(node);
+	}
+
+	template<typename NodeType>
+	void compileBody(const grammar::Grammar &grammar, TreeGenomeDAGDelegate &delegate, const NodeType &root) {
+		Body body;
+		body.firstNode = nodes.size();
+		body.nodeCount = 0;
+		bodies.push_back(body);
+		size_t tableSize = 16;
+		while (tableSize < root.subTreeSize() * 2) {
+			tableSize *= 2;
+		}
+		table.assign(tableSize, uint32_t(emptySlot));
+		tableMask = tableSize - 1;
+		compileNode(grammar, delegate, root);
+		// The values of the nodes, followed by the arguments and the frame of the largest call.
+		auto &compiled = bodies.back();
+		size_t callSize = 0;
+		for (size_t i = compiled.firstNode, e = compiled.firstNode + compiled.nodeCount; i < e; ++i) {
+			const auto &node = nodes[i];
+			size_t size = node.argumentCount;
+			if (node.kind == Node::Kind::Call) {
+				size += bodies[node.value].requiredValueCount;
+			}
+			callSize = std::max(callSize, size);
+		}
+		compiled.requiredValueCount = compiled.nodeCount + callSize;
+	}
+
+	template<typename TreeType>
+	void compileTree(const grammar::Grammar &grammar, const TreeType &tree, TreeGenomeDAGDelegate &delegate) {
+		nodes.clear();
+		arguments.clear();
+		bodies.clear();
+		auto root = tree.first();
+		unsigned functionCount = delegate.functionCountForRoot(grammar.definitionIdForTreeGenomeValue(root.value));
+		if (!functionCount) {
+			compileBody(grammar, delegate, root);
+			return;
+		}
+		assert(functionCount + 1 == root.size() && "The main body must be the last argument of a function set root");
+		for (auto body : root) {
+			compileBody(grammar, delegate, body);
+		}
+	}
+public:
+	TreeGenomeDAG() { }
+
+	TreeGenomeDAG(const grammar::Grammar &grammar, const TreeGenome &tree, TreeGenomeDAGDelegate &delegate) {
+		compile(grammar, tree, delegate);
+	}
+
+	// Hash-cons the given tree into this graph. The storage of the previous graph is reused.
+	void compile(const grammar::Grammar &grammar, const TreeGenome &tree, TreeGenomeDAGDelegate &delegate) {
+		compileTree(grammar, tree, delegate);
+	}
+
+	void compile(const grammar::Grammar &grammar, const CompactTreeGenome &tree, TreeGenomeDAGDelegate &delegate) {
+		compileTree(grammar, tree, delegate);
+	}
+
+	// The number of distinct nodes in all of the bodies.
+	size_t size() const {
+		return nodes.size();
+	}
+
+	size_t functionCount() const {
+		return bodies.size() - 1;
+	}
+};
+
+/// Evaluates hash-consed GP trees. Every node of a body is evaluated once per call of the body, and every call
+/// runs the pre-compiled body of its function. The derived evaluator implements the terminals and the functions
+/// with the same methods as for TreeGenomeProgramEvaluator, which are dispatched statically:
+///
+///   T evaluateTerminal(unsigned definitionId, TreeGenomeValue value);
+///   T evaluateUnaryFunction(unsigned definitionId, T x);
+///   T evaluateBinaryFunction(unsigned definitionId, T x, T y);
+///   T evaluateFunction(unsigned definitionId, const T *arguments, unsigned argumentCount);
+template<typename T, typename Derived>
+struct TreeGenomeDAGEvaluator {
+private:
+	// The frames of the bodies that are being evaluated. A frame holds the values of the nodes of its body,
+	// followed by the arguments of a function or a call and the frame of the call.
+	std::vector<T> values;
+
+	T evaluateBody(const TreeGenomeDAG &dag, size_t bodyIndex, const T *parameters, unsigned parameterCount, size_t offset) {
+		auto &self = static_cast<Derived &>(*this);
+		const auto &body = dag.bodies[bodyIndex];
+		T *frame = values.data() + offset;
+		T *scratch = frame + body.nodeCount;
+		for (size_t i = 0; i < body.nodeCount; ++i) {
+			const auto &node = dag.nodes[body.firstNode + i];
+			const unsigned *arguments = dag.arguments.data() + node.firstArgument;
+			typedef TreeGenomeDAG::Node::Kind Kind;
+			switch (node.kind) {
+				case Kind::Terminal:
+					frame[i] = self.evaluateTerminal(node.definitionId, node.value);
+					break;
+				case Kind::Parameter:
+					assert(node.value < parameterCount);
+					frame[i] = parameters[node.value];
+					break;
+				case Kind::Function:
+					if (node.argumentCount == 1) {
+						frame[i] = self.evaluateUnaryFunction(node.definitionId, frame[arguments[0]]);
+					} else if (node.argumentCount == 2) {
+						frame[i] = self.evaluateBinaryFunction(node.definitionId, frame[arguments[0]], frame[arguments[1]]);
+					} else {
+						for (unsigned j = 0; j < node.argumentCount; ++j) {
+							scratch[j] = frame[arguments[j]];
+						}
+						frame[i] = self.evaluateFunction(node.definitionId, scratch, node.argumentCount);
+					}
+					break;
+				case Kind::Call:
+					for (unsigned j = 0; j < node.argumentCount; ++j) {
+						scratch[j] = frame[arguments[j]];
+					}
+					frame[i] = evaluateBody(dag, node.value, scratch, node.argumentCount, offset + body.nodeCount + node.argumentCount);
+					break;
+			}
+		}
+		return frame[body.nodeCount - 1];
+	}
+public:
+
+	// Evaluate the main body of the graph with the given parameters.
+	T operator()(const TreeGenomeDAG &dag, const T *parameters = nullptr, unsigned parameterCount = 0) {
+		GENETIC_PROFILE_SCOPE("TreeGenomeDAGEvaluator::evaluate");
+		const auto &main = dag.bodies.back();
+		if (values.size() < main.requiredValueCount) {
+			values.resize(main.requiredValueCount);
+		}
+		return evaluateBody(dag, dag.bodies.size() - 1, parameters, parameterCount, 0);
+	}
+
+	T evaluateUnaryFunction(unsigned definitionId, T x) {
+		return x;
+	}
+	T evaluateBinaryFunction(unsigned definitionId, T x, T y) {
+		return T();
+	}
+	T evaluateFunction(unsigned definitionId, const T *arguments, unsigned argumentCount) {
+		return T();
+	}
+};
+
+} // end namespace genetic
@@ -0,0 +1,462 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <cassert>
+#include <climits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace genetic {
+
+/// A read-only view of the values of one variable for all of the fitness cases, which doesn't own the values.
+/// The views of a MappedDataset point into the mapping, and a view can also be made from a vector.
+template<typename T>
+class ColumnView {
+	const T *values = nullptr;
+	size_t count = 0;
+public:
+	ColumnView() { }
+	ColumnView(const T *values, size_t count) : values(values), count(count) { }
+	ColumnView(const std::vector<T> &values) : values(values.data()), count(values.size()) { }
+
+	const T *data() const {
+		return values;
+	}
+
+	size_t size() const {
+		return count;
+	}
+
+	bool empty() const {
+		return count == 0;
+	}
+
+	const T &operator[](size_t i) const {
+		assert(i < count);
+		return values[i];
+	}
+
+	const T *begin() const {
+		return values;
+	}
+
+	const T *end() const {
+		return values + count;
+	}
+};
+
+/// A binary file of fitness cases that's stored column by column. The file starts with a header, followed by
+/// the table of the columns, their names, and the values of every column in one contiguous array that's aligned
+/// to 64 bytes, so the evaluators can run vectorized loops straight over the mapping.
+/// The values are stored in the byte order of the machine, which is checked when the dataset is mapped.
+namespace dataset {
+
+static const char magic[8] = { 'G', 'P', 'D', 'A', 'T', 'A', 0, 0 };
+static const uint32_t currentVersion = 1;
+static const uint32_t byteOrderMark = 0x01020304;
+static const uint64_t columnAlignment = 64;
+
+enum class ColumnType : uint32_t {
+	Int32,
+	Float32,
+	Float64
+};
+
+template<typename T> struct ColumnTypeOf;
+template<> struct ColumnTypeOf<int32_t> { static const ColumnType value = ColumnType::Int32; };
+template<> struct ColumnTypeOf<float> { static const ColumnType value = ColumnType::Float32; };
+template<> struct ColumnTypeOf<double> { static const ColumnType value = ColumnType::Float64; };
+
+inline size_t sizeOfType(ColumnType type) {
+	return type == ColumnType::Float64 ? 8 : 4;
+}
+
+struct Header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrderMark;
+	uint64_t columnCount;
+	uint64_t rowCount;
+	uint64_t columnsOffset, namesOffset;
+	uint64_t fileSize;
+};
+
+struct Column {
+	ColumnType type;
+	uint32_t nameSize;
+	uint64_t nameOffset;
+	uint64_t valuesOffset;
+};
+
+inline uint64_t alignOffset(uint64_t offset, uint64_t alignment = 8) {
+	return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+struct CsvConversionOptions {
+	char delimiter = ',';
+	/// Whether the first row holds the names of the columns. The columns are named x0, x1, ... otherwise.
+	bool hasHeader = true;
+	/// The columns whose values are all 32-bit integers are stored as integers.
+	bool inferIntegers = true;
+	/// The type of the other columns.
+	ColumnType floatType = ColumnType::Float32;
+};
+
+/// Reads the rows of a CSV file one at a time, splitting them in place. Quoted fields aren't supported,
+/// except for the names of the header.
+class CsvReader {
+	FILE *file;
+	char *line = nullptr;
+	size_t capacity = 0;
+	char delimiter;
+public:
+	std::vector<char *> fields;
+
+	CsvReader(FILE *file, char delimiter) : file(file), delimiter(delimiter) { }
+	CsvReader(const CsvReader &) = delete;
+	CsvReader &operator = (const CsvReader &) = delete;
+
+	~CsvReader() {
+		std::free(line);
+	}
+
+	// Read the next row that isn't empty into fields. Return false at the end of the file.
+	bool nextRow() {
+		ssize_t length;
+		while ((length = getline(&line, &capacity, file)) >= 0) {
+			while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+				line[--length] = 0;
+			}
+			if (length == 0) {
+				continue;
+			}
+			fields.clear();
+			fields.push_back(line);
+			for (char *c = line; *c; ++c) {
+				if (*c == delimiter) {
+					*c = 0;
+					fields.push_back(c + 1);
+				}
+			}
+			return true;
+		}
+		return false;
+	}
+};
+
+inline bool isBlank(char c) {
+	return c == ' ' || c == '\t';
+}
+
+inline bool parseInteger(const char *field, int32_t &value) {
+	char *end;
+	errno = 0;
+	long long parsed = std::strtoll(field, &end, 10);
+	while (isBlank(*end)) {
+		++end;
+	}
+	if (end == field || *end || errno || parsed < INT32_MIN || parsed > INT32_MAX) {
+		return false;
+	}
+	value = int32_t(parsed);
+	return true;
+}
+
+inline bool parseReal(const char *field, double &value) {
+	char *end;
+	value = std::strtod(field, &end);
+	while (isBlank(*end)) {
+		++end;
+	}
+	return end != field && !*end;
+}
+
+inline std::string trimmedName(const char *field) {
+	std::string name(field);
+	size_t begin = 0, end = name.size();
+	while (begin < end && isBlank(name[begin])) {
+		++begin;
+	}
+	while (end > begin && isBlank(name[end - 1])) {
+		--end;
+	}
+	if (end - begin >= 2 && name[begin] == '"' && name[end - 1] == '"') {
+		++begin;
+		--end;
+	}
+	return name.substr(begin, end - begin);
+}
+
+// Write the values of one row into the columns of a mapped dataset.
+inline bool writeRow(uint8_t *data, const std::vector<Column> &columns, const std::vector<char *> &fields, uint64_t row) {
+	if (fields.size() != columns.size()) {
+		return false;
+	}
+	for (size_t i = 0; i < columns.size(); ++i) {
+		uint8_t *values = data + columns[i].valuesOffset;
+		double real;
+		switch (columns[i].type) {
+			case ColumnType::Int32:
+				if (!parseInteger(fields[i], reinterpret_cast<int32_t *>(values)[row])) {
+					return false;
+				}
+				break;
+			case ColumnType::Float32:
+				if (!parseReal(fields[i], real)) {
+					return false;
+				}
+				reinterpret_cast<float *>(values)[row] = float(real);
+				break;
+			case ColumnType::Float64:
+				if (!parseReal(fields[i], reinterpret_cast<double *>(values)[row])) {
+					return false;
+				}
+				break;
+		}
+	}
+	return true;
+}
+
+// Convert the CSV file at the given path into a columnar dataset at the other path. The CSV file is read twice:
+// once to count the rows and to find the types of the columns, and once to write the values into the mapped
+// output file, so the conversion doesn't hold the dataset in memory. The dataset is written to a temporary file
+// first, which then replaces the output file. Return false if the CSV file can't be read, if a row has a different
+// number of fields, or if a value isn't a number.
+inline bool convertCsv(const std::string &csvPath, const std::string &path, const CsvConversionOptions &options = CsvConversionOptions()) {
+	FILE *csv = std::fopen(csvPath.c_str(), "rb");
+	if (!csv) {
+		return false;
+	}
+	std::vector<std::string> names;
+	std::vector<bool> isInteger;
+	uint64_t rowCount = 0;
+	bool isValid = true;
+	{
+		CsvReader reader(csv, options.delimiter);
+		if (options.hasHeader && reader.nextRow()) {
+			for (auto field : reader.fields) {
+				names.push_back(trimmedName(field));
+			}
+		}
+		while (isValid && reader.nextRow()) {
+			if (names.empty()) {
+				for (size_t i = 0; i < reader.fields.size(); ++i) {
+					names.push_back("x" + std::to_string(i));
+				}
+			}
+			isInteger.resize(names.size(), options.inferIntegers);
+			isValid = reader.fields.size() == names.size();
+			for (size_t i = 0; i < names.size() && isValid; ++i) {
+				int32_t integer;
+				double real;
+				if (isInteger[i] && !parseInteger(reader.fields[i], integer)) {
+					isInteger[i] = false;
+				}
+				isValid = isInteger[i] || parseReal(reader.fields[i], real);
+			}
+			++rowCount;
+		}
+	}
+	if (!isValid || names.empty()) {
+		std::fclose(csv);
+		return false;
+	}
+	isInteger.resize(names.size(), options.inferIntegers);
+
+	Header header;
+	std::memcpy(header.magic, magic, sizeof(magic));
+	header.version = currentVersion;
+	header.byteOrderMark = byteOrderMark;
+	header.columnCount = names.size();
+	header.rowCount = rowCount;
+	header.columnsOffset = alignOffset(sizeof(Header));
+	header.namesOffset = header.columnsOffset + names.size() * sizeof(Column);
+	std::vector<Column> columns(names.size());
+	uint64_t offset = header.namesOffset;
+	for (size_t i = 0; i < names.size(); ++i) {
+		columns[i].nameSize = uint32_t(names[i].size());
+		columns[i].nameOffset = offset;
+		offset += names[i].size();
+	}
+	for (size_t i = 0; i < names.size(); ++i) {
+		columns[i].type = isInteger[i] ? ColumnType::Int32 : options.floatType;
+		columns[i].valuesOffset = alignOffset(offset, columnAlignment);
+		offset = columns[i].valuesOffset + rowCount * sizeOfType(columns[i].type);
+	}
+	header.fileSize = offset;
+
+	auto temporaryPath = path + ".tmp";
+	int fd = open(temporaryPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		std::fclose(csv);
+		return false;
+	}
+	void *mapping = MAP_FAILED;
+	if (ftruncate(fd, off_t(header.fileSize)) == 0) {
+		mapping = mmap(nullptr, size_t(header.fileSize), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	isValid = mapping != MAP_FAILED && std::fseek(csv, 0, SEEK_SET) == 0;
+	if (isValid) {
+		auto data = static_cast<uint8_t *>(mapping);
+		std::memcpy(data, &header, sizeof(header));
+		std::memcpy(data + header.columnsOffset, columns.data(), columns.size() * sizeof(Column));
+		for (size_t i = 0; i < names.size(); ++i) {
+			std::memcpy(data + columns[i].nameOffset, names[i].data(), names[i].size());
+		}
+		CsvReader reader(csv, options.delimiter);
+		if (options.hasHeader) {
+			reader.nextRow();
+		}
+		uint64_t row = 0;
+		for (; isValid && row < rowCount && reader.nextRow(); ++row) {
+			isValid = writeRow(data, columns, reader.fields, row);
+		}
+		isValid = isValid && row == rowCount;
+		isValid = msync(mapping, size_t(header.fileSize), MS_SYNC) == 0 && isValid;
+	}
+	if (mapping != MAP_FAILED) {
+		munmap(mapping, size_t(header.fileSize));
+	}
+	std::fclose(csv);
+	isValid = close(fd) == 0 && isValid;
+	if (!isValid || std::rename(temporaryPath.c_str(), path.c_str()) != 0) {
+		std::remove(temporaryPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+} // end namespace dataset
+
+/// A columnar dataset file that's mapped into memory. The columns are views of the mapping, so the fitness cases
+/// are paged in by the operating system when the evaluators read them, and they're shared with the page cache
+/// instead of being copied into the memory of the process.
+class MappedDataset {
+	const uint8_t *data = nullptr;
+	size_t size = 0;
+	dataset::Header header;
+	bool isValid = false;
+
+	bool validate() {
+		using namespace dataset;
+		if (size < sizeof(Header)) {
+			return false;
+		}
+		std::memcpy(&header, data, sizeof(header));
+		if (std::memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != currentVersion || header.byteOrderMark != byteOrderMark || header.fileSize != size) {
+			return false;
+		}
+		if (header.columnsOffset % 8 || header.columnsOffset > size || header.columnCount > (size - header.columnsOffset) / sizeof(Column)) {
+			return false;
+		}
+		for (size_t i = 0; i < header.columnCount; ++i) {
+			const auto &column = columns()[i];
+			if (column.type != ColumnType::Int32 && column.type != ColumnType::Float32 && column.type != ColumnType::Float64) {
+				return false;
+			}
+			if (column.nameOffset + column.nameSize > size || column.valuesOffset % columnAlignment || column.valuesOffset > size ||
+			    header.rowCount > (size - column.valuesOffset) / sizeOfType(column.type)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	const dataset::Column *columns() const {
+		return reinterpret_cast<const dataset::Column *>(data + header.columnsOffset);
+	}
+public:
+	// Map the dataset at the given path. Check isLoaded to see whether it's a valid dataset.
+	explicit MappedDataset(const std::string &path) {
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return;
+		}
+		struct stat status;
+		if (fstat(fd, &status) == 0 && status.st_size > 0) {
+			void *mapping = mmap(nullptr, size_t(status.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapping != MAP_FAILED) {
+				data = static_cast<const uint8_t *>(mapping);
+				size = size_t(status.st_size);
+			}
+		}
+		close(fd);
+		isValid = data && validate();
+	}
+
+	MappedDataset(const MappedDataset &) = delete;
+	MappedDataset &operator = (const MappedDataset &) = delete;
+
+	~MappedDataset() {
+		if (data) {
+			munmap(const_cast<uint8_t *>(data), size);
+		}
+	}
+
+	bool isLoaded() const {
+		return isValid;
+	}
+
+	size_t rowCount() const {
+		assert(isValid);
+		return size_t(header.rowCount);
+	}
+
+	size_t columnCount() const {
+		assert(isValid);
+		return size_t(header.columnCount);
+	}
+
+	std::string columnName(size_t column) const {
+		assert(column < columnCount());
+		const auto &entry = columns()[column];
+		return std::string(reinterpret_cast<const char *>(data + entry.nameOffset), entry.nameSize);
+	}
+
+	dataset::ColumnType columnType(size_t column) const {
+		assert(column < columnCount());
+		return columns()[column].type;
+	}
+
+	// Return the index of the column with the given name, or -1 if there's no such column.
+	int columnIndex(const std::string &name) const {
+		for (size_t i = 0; i < columnCount(); ++i) {
+			const auto &entry = columns()[i];
+			if (entry.nameSize == name.size() && std::memcmp(data + entry.nameOffset, name.data(), name.size()) == 0) {
+				return int(i);
+			}
+		}
+		return -1;
+	}
+
+	// The values of the given column, which must be stored as T.
+	template<typename T>
+	ColumnView<T> column(size_t column) const {
+		assert(columnType(column) == dataset::ColumnTypeOf<T>::value && "The column is stored as a different type");
+		return ColumnView<T>(reinterpret_cast<const T *>(data + columns()[column].valuesOffset), rowCount());
+	}
+
+	template<typename T>
+	ColumnView<T> column(const std::string &name) const {
+		int index = columnIndex(name);
+		assert(index >= 0 && "There's no column with the given name");
+		return column<T>(size_t(index));
+	}
+
+	// Tell the operating system that the whole dataset will be read soon, so that it's paged in ahead of the
+	// first generation instead of while the first individuals are evaluated.
+	void prefetch() const {
+		assert(isValid);
+		madvise(const_cast<uint8_t *>(data), size, MADV_WILLNEED);
+	}
+};
+
+} // end namespace genetic
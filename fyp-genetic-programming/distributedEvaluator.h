@@ -0,0 +1,597 @@
+#pragma once
+
+#include "genome.h"
+#include "grammar.h"
+#include "geneticProgramming.h"
+#include "genomeCodec.h"
+#include "threadPool.h"
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <cerrno>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace genetic {
+namespace distributed {
+
+/// The kinds of messages that are exchanged by the master and the workers.
+enum class MessageType : uint32_t {
+	/// Master to worker: the grammar fingerprint, the batch id and the genomes of a batch.
+	Evaluate = 1,
+	/// Worker to master: the batch id and the fitness of every genome of the batch.
+	Results = 2,
+	/// Worker to master: the worker couldn't understand a batch.
+	Error = 3,
+	/// Master to worker: there are no more batches.
+	Shutdown = 4
+};
+
+/// Builds a message. The message starts with a header that stores the message type and the size of the payload,
+/// followed by the payload. All of the values are stored in little endian.
+class MessageWriter {
+	std::vector<uint8_t> buffer;
+public:
+	void begin(MessageType type) {
+		buffer.clear();
+		writeU32(uint32_t(type));
+		writeU32(0);
+	}
+
+	void writeU8(uint8_t value) {
+		buffer.push_back(value);
+	}
+
+	void writeU32(uint32_t value) {
+		for (unsigned i = 0; i < 4; ++i) {
+			buffer.push_back(uint8_t(value >> (i * 8)));
+		}
+	}
+
+	void writeU64(uint64_t value) {
+		writeU32(uint32_t(value));
+		writeU32(uint32_t(value >> 32));
+	}
+
+	void writeFloat(float value) {
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		writeU32(bits);
+	}
+
+	// Store the given genome with the compact encoding of the codec.
+	void writeGenome(const TreeGenome &genome) {
+		codec::encode(genome, buffer);
+	}
+
+	// Finish the message and return its bytes.
+	const std::vector<uint8_t> &end() {
+		uint32_t size = uint32_t(buffer.size() - 8);
+		for (unsigned i = 0; i < 4; ++i) {
+			buffer[4 + i] = uint8_t(size >> (i * 8));
+		}
+		return buffer;
+	}
+};
+
+/// Reads the payload of a message. Reading past the end of the payload marks the reader as invalid.
+class MessageReader {
+	const std::vector<uint8_t> &payload;
+	size_t position = 0;
+	bool isValid = true;
+
+	bool has(size_t size) {
+		if (payload.size() - position < size) {
+			isValid = false;
+		}
+		return isValid;
+	}
+public:
+	explicit MessageReader(const std::vector<uint8_t> &payload) : payload(payload) { }
+
+	bool valid() const {
+		return isValid;
+	}
+
+	bool isAtEnd() const {
+		return position == payload.size();
+	}
+
+	// The number of bytes of the payload that weren't read yet.
+	size_t remainingSize() const {
+		return payload.size() - position;
+	}
+
+	uint8_t readU8() {
+		return has(1) ? payload[position++] : 0;
+	}
+
+	uint32_t readU32() {
+		if (!has(4)) {
+			return 0;
+		}
+		uint32_t value = 0;
+		for (unsigned i = 0; i < 4; ++i) {
+			value |= uint32_t(payload[position++]) << (i * 8);
+		}
+		return value;
+	}
+
+	uint64_t readU64() {
+		uint64_t low = readU32();
+		return low | (uint64_t(readU32()) << 32);
+	}
+
+	float readFloat() {
+		uint32_t bits = readU32();
+		float value;
+		std::memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+
+	// Read a genome that was stored by MessageWriter::writeGenome into the given genome.
+	// Return false if the stored nodes don't form exactly one tree that's valid for the grammar of the decoder.
+	bool readGenome(codec::Decoder<> &decoder, TreeGenome &genome) {
+		const uint8_t *begin = payload.data() + position, *end = payload.data() + payload.size(), *current = begin;
+		if (!isValid || !decoder.decode(current, end, genome)) {
+			isValid = false;
+			return false;
+		}
+		position += size_t(current - begin);
+		return true;
+	}
+
+	bool readGenome(const grammar::Grammar &grammar, TreeGenome &genome) {
+		codec::Decoder<> decoder(grammar);
+		return readGenome(decoder, genome);
+	}
+};
+
+// Write all of the given bytes to the given socket. Return false if the connection failed.
+inline bool sendMessage(int fd, const std::vector<uint8_t> &message) {
+	size_t offset = 0;
+	while (offset < message.size()) {
+		auto written = send(fd, message.data() + offset, message.size() - offset, MSG_NOSIGNAL);
+		if (written < 0 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			return false;
+		}
+		offset += size_t(written);
+	}
+	return true;
+}
+
+inline bool receiveBytes(int fd, uint8_t *bytes, size_t size) {
+	size_t offset = 0;
+	while (offset < size) {
+		auto received = recv(fd, bytes + offset, size - offset, 0);
+		if (received < 0 && errno == EINTR) {
+			continue;
+		}
+		if (received <= 0) {
+			return false;
+		}
+		offset += size_t(received);
+	}
+	return true;
+}
+
+// Read the next message from the given socket. Return false if the connection was closed or failed.
+inline bool receiveMessage(int fd, MessageType &type, std::vector<uint8_t> &payload) {
+	// Larger messages are rejected as corrupt.
+	static const uint32_t maxPayloadSize = 1u << 30;
+	uint8_t header[8];
+	if (!receiveBytes(fd, header, sizeof(header))) {
+		return false;
+	}
+	uint32_t rawType = 0, size = 0;
+	for (unsigned i = 0; i < 4; ++i) {
+		rawType |= uint32_t(header[i]) << (i * 8);
+		size |= uint32_t(header[4 + i]) << (i * 8);
+	}
+	if (size > maxPayloadSize) {
+		return false;
+	}
+	type = MessageType(rawType);
+	payload.resize(size);
+	return receiveBytes(fd, payload.data(), size);
+}
+
+// Connect to the worker that listens on the given host and port. Return the socket, or -1 on failure.
+inline int connectToWorker(const std::string &host, unsigned short port) {
+	addrinfo hints, *addresses = nullptr;
+	std::memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0) {
+		return -1;
+	}
+	int fd = -1;
+	for (auto address = addresses; address && fd < 0; address = address->ai_next) {
+		fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+		if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(addresses);
+	return fd;
+}
+
+// Wait for the master to connect to the given port. Return the socket, or -1 on failure.
+inline int acceptMaster(unsigned short port) {
+	int listener = socket(AF_INET6, SOCK_STREAM, 0);
+	if (listener < 0) {
+		return -1;
+	}
+	int enable = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+	sockaddr_in6 address;
+	std::memset(&address, 0, sizeof(address));
+	address.sin6_family = AF_INET6;
+	address.sin6_addr = in6addr_any;
+	address.sin6_port = htons(port);
+	int fd = -1;
+	if (bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0 && listen(listener, 1) == 0) {
+		fd = accept(listener, nullptr, nullptr);
+	}
+	close(listener);
+	return fd;
+}
+
+/// Evaluates the batches of genomes that are sent by the master.
+class Worker {
+	const grammar::Grammar &grammar;
+	std::function<float (const TreeGenome &)> fitnessFunction;
+	core::ThreadPool pool;
+	uint64_t grammarFingerprint;
+	std::vector<TreeGenome> genomes;
+	std::vector<float> fitnesses;
+	std::vector<uint8_t> payload;
+	MessageWriter writer;
+	codec::Decoder<> decoder;
+public:
+	// The fitness function is called concurrently by the given number of threads, so it must be reentrant
+	// when there's more than one thread.
+	Worker(const grammar::Grammar &grammar, std::function<float (const TreeGenome &)> fitnessFunction, unsigned threadCount = 1) : grammar(grammar), fitnessFunction(std::move(fitnessFunction)), pool(threadCount), grammarFingerprint(grammar.fingerprint()), decoder(grammar) {
+	}
+
+	// Evaluate the batches that arrive on the given socket until the master shuts the worker down.
+	// Return false if the connection failed or the master sent a batch that the worker couldn't understand.
+	// The socket must be closed afterwards, as the master waits for the workers to close the connections.
+	bool serve(int fd) {
+		MessageType type;
+		while (receiveMessage(fd, type, payload)) {
+			if (type == MessageType::Shutdown) {
+				return true;
+			}
+			MessageReader reader(payload);
+			bool isValid = type == MessageType::Evaluate && reader.readU64() == grammarFingerprint;
+			uint32_t batchId = reader.readU32();
+			uint32_t count = reader.readU32();
+			// Every genome takes at least one byte, which bounds the count before the genomes are allocated.
+			if (count > reader.remainingSize()) {
+				isValid = false;
+			}
+			if (isValid && reader.valid()) {
+				genomes.resize(std::max<size_t>(genomes.size(), count));
+				for (uint32_t i = 0; i < count && isValid; ++i) {
+					isValid = reader.readGenome(decoder, genomes[i]);
+				}
+			}
+			if (!isValid || !reader.valid() || !reader.isAtEnd()) {
+				writer.begin(MessageType::Error);
+				writer.writeU32(batchId);
+				sendMessage(fd, writer.end());
+				return false;
+			}
+			fitnesses.resize(count);
+			pool.parallelFor(count, 0, [&] (size_t begin, size_t end) {
+				for (size_t i = begin; i < end; ++i) {
+					fitnesses[i] = fitnessFunction(genomes[i]);
+				}
+			});
+			writer.begin(MessageType::Results);
+			writer.writeU32(batchId);
+			writer.writeU32(count);
+			for (uint32_t i = 0; i < count; ++i) {
+				writer.writeFloat(fitnesses[i]);
+			}
+			if (!sendMessage(fd, writer.end())) {
+				return false;
+			}
+		}
+		return false;
+	}
+};
+
+/// Farms the fitness computation of a generation out to a set of connected workers.
+/// The generation is split into batches. Every worker has up to the pipeline depth of batches in flight, so
+/// that the next batch is already queued on the worker while the results of the previous one are sent back.
+/// Once there are no unassigned batches left, the idle workers receive copies of the batches that are still
+/// being evaluated by the slower workers, and the first result that comes back wins. The batches of a worker
+/// that disconnects or fails are assigned to the other workers, and when no workers are left the remaining
+/// individuals are evaluated locally by the fallback function.
+class Master {
+	struct Connection {
+		int fd;
+		bool isAlive;
+		// The ids of the batches that were sent to this worker and didn't come back yet.
+		std::vector<uint32_t> outstandingBatches;
+	};
+	struct Batch {
+		size_t begin, count;
+		unsigned issueCount;
+		bool isComplete;
+	};
+	std::vector<Connection> workers;
+	uint64_t grammarFingerprint;
+	size_t batchSize;
+	unsigned pipelineDepth;
+	std::function<float (const TreeGenome &)> fallback;
+
+	// The batches of the current generation, whose ids start at firstBatchId.
+	std::vector<Batch> batches;
+	std::deque<size_t> pendingBatches;
+	uint32_t firstBatchId = 0, nextBatchId = 0;
+	size_t reissuedBatchCount = 0;
+	MessageWriter writer;
+	std::vector<uint8_t> payload;
+	std::vector<pollfd> pollDescriptors;
+	std::vector<size_t> pollWorkers;
+
+	bool isCurrentBatch(uint32_t id) const {
+		return uint32_t(id - firstBatchId) < batches.size();
+	}
+
+	void disconnect(Connection &worker) {
+		close(worker.fd);
+		worker.isAlive = false;
+		for (auto id : worker.outstandingBatches) {
+			if (isCurrentBatch(id) && !batches[id - firstBatchId].isComplete) {
+				pendingBatches.push_front(id - firstBatchId);
+			}
+		}
+		worker.outstandingBatches.clear();
+	}
+
+	// Return the index of the next batch for the given worker, or batches.size() if there's nothing to send.
+	size_t nextBatchFor(const Connection &worker) {
+		while (!pendingBatches.empty()) {
+			auto index = pendingBatches.front();
+			pendingBatches.pop_front();
+			if (!batches[index].isComplete) {
+				return index;
+			}
+		}
+		// Re-issue the incomplete batch with the fewest copies in flight that isn't already on this worker.
+		size_t best = batches.size();
+		for (size_t i = 0; i < batches.size(); ++i) {
+			if (batches[i].isComplete || (best != batches.size() && batches[i].issueCount >= batches[best].issueCount)) {
+				continue;
+			}
+			auto id = uint32_t(firstBatchId + i);
+			if (std::find(worker.outstandingBatches.begin(), worker.outstandingBatches.end(), id) == worker.outstandingBatches.end()) {
+				best = i;
+			}
+		}
+		return best;
+	}
+
+	bool send(Connection &worker, size_t index, const std::vector<TreeGenome> &individuals) {
+		auto &batch = batches[index];
+		writer.begin(MessageType::Evaluate);
+		writer.writeU64(grammarFingerprint);
+		writer.writeU32(uint32_t(firstBatchId + index));
+		writer.writeU32(uint32_t(batch.count));
+		for (size_t i = batch.begin; i < batch.begin + batch.count; ++i) {
+			writer.writeGenome(individuals[i]);
+		}
+		if (!sendMessage(worker.fd, writer.end())) {
+			return false;
+		}
+		if (batch.issueCount) {
+			++reissuedBatchCount;
+		}
+		++batch.issueCount;
+		worker.outstandingBatches.push_back(uint32_t(firstBatchId + index));
+		return true;
+	}
+
+	// Receive a message from the given worker and store the results. Return the number of the batches that were completed.
+	size_t receive(Connection &worker, std::vector<float> &fitnesses) {
+		MessageType type;
+		if (!receiveMessage(worker.fd, type, payload) || type != MessageType::Results) {
+			disconnect(worker);
+			return 0;
+		}
+		MessageReader reader(payload);
+		uint32_t id = reader.readU32();
+		uint32_t count = reader.readU32();
+		auto outstanding = std::find(worker.outstandingBatches.begin(), worker.outstandingBatches.end(), id);
+		if (!reader.valid() || outstanding == worker.outstandingBatches.end()) {
+			disconnect(worker);
+			return 0;
+		}
+		worker.outstandingBatches.erase(outstanding);
+		if (!isCurrentBatch(id)) {
+			// A late copy of a batch from a previous generation.
+			return 0;
+		}
+		auto &batch = batches[id - firstBatchId];
+		if (batch.isComplete) {
+			return 0;
+		}
+		if (count != batch.count || payload.size() != 8 + size_t(count) * 4) {
+			disconnect(worker);
+			return 0;
+		}
+		for (uint32_t i = 0; i < count; ++i) {
+			fitnesses[batch.begin + i] = reader.readFloat();
+		}
+		batch.isComplete = true;
+		return 1;
+	}
+public:
+	// The master takes the ownership of the given connected sockets. The fallback evaluates the individuals
+	// locally when there are no workers left.
+	Master(const grammar::Grammar &grammar, const std::vector<int> &workerSockets, std::function<float (const TreeGenome &)> fallback, size_t batchSize = 64, unsigned pipelineDepth = 2) : grammarFingerprint(grammar.fingerprint()), batchSize(batchSize), pipelineDepth(pipelineDepth), fallback(std::move(fallback)) {
+		assert(batchSize != 0 && pipelineDepth != 0);
+		for (auto fd : workerSockets) {
+			Connection worker;
+			worker.fd = fd;
+			worker.isAlive = true;
+			workers.push_back(worker);
+		}
+	}
+
+	Master(const Master &) = delete;
+	Master &operator = (const Master &) = delete;
+
+	// Shut the workers down and close the sockets. The late results of the copies of the batches
+	// that are still in flight are drained first, so that the workers can finish cleanly.
+	~Master() {
+		MessageWriter shutdown;
+		shutdown.begin(MessageType::Shutdown);
+		for (auto &worker : workers) {
+			if (worker.isAlive) {
+				sendMessage(worker.fd, shutdown.end());
+			}
+		}
+		MessageType type;
+		for (auto &worker : workers) {
+			if (worker.isAlive) {
+				while (receiveMessage(worker.fd, type, payload)) { }
+				close(worker.fd);
+			}
+		}
+	}
+
+	size_t liveWorkerCount() const {
+		size_t count = 0;
+		for (const auto &worker : workers) {
+			count += worker.isAlive;
+		}
+		return count;
+	}
+
+	// The number of the copies of the batches that were sent to a second worker.
+	size_t getReissuedBatchCount() const {
+		return reissuedBatchCount;
+	}
+
+	void computeFitness(const std::vector<TreeGenome> &individuals, std::vector<float> &fitnesses) {
+		assert(fitnesses.size() >= individuals.size());
+		batches.clear();
+		pendingBatches.clear();
+		firstBatchId = nextBatchId;
+		for (size_t begin = 0; begin < individuals.size(); begin += batchSize) {
+			Batch batch;
+			batch.begin = begin;
+			batch.count = std::min(batchSize, individuals.size() - begin);
+			batch.issueCount = 0;
+			batch.isComplete = false;
+			pendingBatches.push_back(batches.size());
+			batches.push_back(batch);
+		}
+		nextBatchId += uint32_t(batches.size());
+		size_t remaining = batches.size();
+		while (remaining) {
+			// Fill the pipelines of the workers.
+			for (auto &worker : workers) {
+				while (worker.isAlive && worker.outstandingBatches.size() < pipelineDepth) {
+					auto index = nextBatchFor(worker);
+					if (index == batches.size()) {
+						break;
+					}
+					if (!send(worker, index, individuals)) {
+						pendingBatches.push_front(index);
+						disconnect(worker);
+					}
+				}
+			}
+			pollDescriptors.clear();
+			pollWorkers.clear();
+			for (size_t i = 0; i < workers.size(); ++i) {
+				if (workers[i].isAlive && !workers[i].outstandingBatches.empty()) {
+					pollfd descriptor;
+					descriptor.fd = workers[i].fd;
+					descriptor.events = POLLIN;
+					descriptor.revents = 0;
+					pollDescriptors.push_back(descriptor);
+					pollWorkers.push_back(i);
+				}
+			}
+			if (pollDescriptors.empty()) {
+				// All of the workers are gone.
+				assert(fallback && "No workers are left to compute the fitness");
+				for (auto &batch : batches) {
+					for (size_t i = batch.begin; !batch.isComplete && i < batch.begin + batch.count; ++i) {
+						fitnesses[i] = fallback(individuals[i]);
+					}
+					batch.isComplete = true;
+				}
+				break;
+			}
+			if (poll(pollDescriptors.data(), pollDescriptors.size(), -1) < 0) {
+				// The workers can't be waited for any more, so their batches are computed by the fallback.
+				if (errno != EINTR) {
+					for (auto i : pollWorkers) {
+						disconnect(workers[i]);
+					}
+				}
+				continue;
+			}
+			for (size_t i = 0; i < pollDescriptors.size(); ++i) {
+				if (pollDescriptors[i].revents) {
+					remaining -= receive(workers[pollWorkers[i]], fitnesses);
+				}
+			}
+		}
+	}
+};
+
+} // end namespace distributed
+
+/// A population delegate that computes the fitness on remote workers once they're connected. The individuals
+/// are evaluated locally with computeFitnessForIndividual before the workers are connected, or after all of them failed.
+class DistributedEvolvingPopulationDelegate : public EvolvingPopulationDelegate {
+	std::unique_ptr<distributed::Master> master;
+public:
+	// Return the fitness of the given individual. The workers must compute the same fitness.
+	virtual float computeFitnessForIndividual(const TreeGenome &individual) = 0;
+
+	// Send the batches to the workers that are connected to the given sockets, which are owned by the delegate.
+	void connectWorkers(const std::vector<int> &workerSockets, size_t batchSize = 64, unsigned pipelineDepth = 2) {
+		master.reset(new distributed::Master(genomeGrammar(), workerSockets, [this] (const TreeGenome &individual) {
+			return computeFitnessForIndividual(individual);
+		}, batchSize, pipelineDepth));
+	}
+
+	distributed::Master *distributedMaster() {
+		return master.get();
+	}
+
+	void computeFitness(const std::vector<TreeGenome> &individuals, std::vector<float> &fitnesses) override {
+		if (master) {
+			master->computeFitness(individuals, fitnesses);
+			return;
+		}
+		for (size_t i = 0; i < individuals.size(); ++i) {
+			fitnesses[i] = computeFitnessForIndividual(individuals[i]);
+		}
+	}
+};
+
+} // end namespace genetic
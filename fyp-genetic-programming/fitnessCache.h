@@ -0,0 +1,111 @@
+#pragma once
+
+#include "genome.h"
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <cassert>
+
+namespace genetic {
+
+/// Maps the structural hashes of the genomes to their fitness, which allows the population to skip the evaluation
+/// of the genomes that were already evaluated, like the elites or the individuals that weren't mutated.
+/// The fitness function must be deterministic. Once the cache is full, the entries are evicted with the CLOCK algorithm.
+class FitnessCache {
+	struct Entry {
+		uint64_t hash;
+		float fitness;
+		// Set when the entry is used, cleared when the clock hand passes the entry.
+		bool isReferenced;
+	};
+	std::vector<Entry> entries;
+	std::unordered_map<uint64_t, size_t> entryIndices;
+	size_t capacity;
+	size_t clockHand = 0;
+	size_t hitCount = 0, missCount = 0;
+public:
+	explicit FitnessCache(size_t capacity) : capacity(capacity) {
+		assert(capacity != 0);
+		entries.reserve(capacity);
+		entryIndices.reserve(capacity);
+	}
+
+	// Return true and set the fitness if the genome with the given hash is in the cache.
+	bool lookup(uint64_t hash, float &fitness) {
+		auto it = entryIndices.find(hash);
+		if (it == entryIndices.end()) {
+			++missCount;
+			return false;
+		}
+		++hitCount;
+		auto &entry = entries[it->second];
+		entry.isReferenced = true;
+		fitness = entry.fitness;
+		return true;
+	}
+
+	bool lookup(const TreeGenome &genome, float &fitness) {
+		return lookup(genome.structuralHash(), fitness);
+	}
+
+	// Store the fitness of the genome with the given hash, evicting an entry that wasn't used recently if the cache is full.
+	void insert(uint64_t hash, float fitness) {
+		auto it = entryIndices.find(hash);
+		if (it != entryIndices.end()) {
+			entries[it->second].fitness = fitness;
+			return;
+		}
+		size_t index;
+		if (entries.size() < capacity) {
+			index = entries.size();
+			entries.push_back(Entry());
+		} else {
+			while (entries[clockHand].isReferenced) {
+				entries[clockHand].isReferenced = false;
+				clockHand = (clockHand + 1) % capacity;
+			}
+			index = clockHand;
+			clockHand = (clockHand + 1) % capacity;
+			entryIndices.erase(entries[index].hash);
+		}
+		entries[index].hash = hash;
+		entries[index].fitness = fitness;
+		entries[index].isReferenced = false;
+		entryIndices[hash] = index;
+	}
+
+	void insert(const TreeGenome &genome, float fitness) {
+		insert(genome.structuralHash(), fitness);
+	}
+
+	void clear() {
+		entries.clear();
+		entryIndices.clear();
+		clockHand = 0;
+		hitCount = missCount = 0;
+	}
+
+	// The number of cached entries.
+	size_t size() const {
+		return entries.size();
+	}
+
+	size_t getCapacity() const {
+		return capacity;
+	}
+
+	size_t getHitCount() const {
+		return hitCount;
+	}
+
+	size_t getMissCount() const {
+		return missCount;
+	}
+
+	float getHitRate() const {
+		auto lookups = hitCount + missCount;
+		return lookups ? float(hitCount) / float(lookups) : 0.0f;
+	}
+};
+
+} // end namespace genetic
@@ -4,12 +4,35 @@
 #include "initializer.h"
 #include "grammar.h"
 #include "treePrinter.h"
+#include "threadPool.h"
+#include "fitnessCache.h"
+#include "lexicaseSelection.h"
+#include "random.h"
+#include "statistics.h"
+#include "profiler.h"
 #include <random>
 #include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <limits>
+#include <cmath>
 #include <iostream>
 
 namespace genetic {
 	
+/// The ways of selecting the parents of the next generation.
+enum class SelectionMethod {
+	/// A 3 tournament using the fitness.
+	Tournament,
+	/// Lexicase selection using the errors of the individuals for the fitness cases.
+	Lexicase,
+	/// Lexicase selection that treats the errors within the median absolute deviation of a case as equal.
+	EpsilonLexicase
+};
+
 template<class RNGType>
 struct GenericEvolutionParameters {
 	typedef RNGType RNG;
@@ -19,6 +42,23 @@ struct GenericEvolutionParameters {
 	float mutationRate = 0.0f;
 	/// The crossover rate.
 	float crossoverRate = 0.0f;
+	/// The largest depth of a tree that mutation and crossover may produce, or 0 for no limit.
+	size_t maxDepth = 0;
+	/// The largest number of nodes of a tree that mutation and crossover may produce, or 0 for no limit.
+	size_t maxNodeCount = 0;
+	/// Break the ties of the tournament selection in favour of the individual with fewer nodes, which is
+	/// known as lexicographic parsimony pressure.
+	bool useLexicographicParsimony = false;
+	/// The lexicase selections require a delegate that computes the errors of the fitness cases.
+	SelectionMethod selection = SelectionMethod::Tournament;
+	/// The fraction of the fitness cases that is drawn for every generation by the lexicase selections, which
+	/// is known as down-sampled lexicase selection. Only the drawn cases are evaluated.
+	float caseSampleRate = 1.0f;
+	/// Draw the random numbers of the variation from counter-based streams that are keyed by the stream seed, the
+	/// generation and the individual, instead of from rng. The serial and the parallel variation then produce the
+	/// same generations. The delegate must be a ConcurrentTreeGeneratorDelegate.
+	bool useRandomStreams = false;
+	uint64_t streamSeed = 0;
 };
 
 /// The parameters that control the evolutionary process.
@@ -34,25 +74,207 @@ size_t selectRandomNode(const TreeGenome &genome, GenericEvolutionParameters<T>
 
 }
 
+/// The random trees of a population delegate that can be generated concurrently, which the parallel variation, the
+/// random streams and the steady state evolution of the population require. A delegate that supports them derives
+/// from this class as well as from EvolvingPopulationDelegate.
+class ConcurrentTreeGeneratorDelegate {
+public:
+	virtual ~ConcurrentTreeGeneratorDelegate() {}
+
+	// Return a random tree of the given type that's generated with the given random number generator.
+	// This is called concurrently by the parallel variation of the population, so it must be reentrant.
+	virtual TreeGenome generateRandomTreeOfTypeConcurrently(TreeGenomeType type, core::Philox4x32 &rng) = 0;
+
+	// The reentrant version of EvolvingPopulationDelegate::generateRandomTreeOfTypeInto, which is used by the
+	// parallel variation. Return 0 to use generateRandomTreeOfTypeConcurrently instead.
+	virtual size_t generateRandomTreeOfTypeConcurrentlyInto(TreeGenomeType type, core::Philox4x32 &rng, std::vector<TreeGenome::NodeStorageType> &nodes) {
+		return 0;
+	}
+};
+
 ///
 class EvolvingPopulationDelegate {
 public:
 	std::unique_ptr<TreeGenomePrinterDelegate> printerDelegate;
 
+	virtual ~EvolvingPopulationDelegate() {}
+
 	virtual void computeFitness(const std::vector<TreeGenome> &individuals, std::vector<float> &fitnesses) = 0;
 
 	virtual TreeGenome generateRandomTreeOfType(TreeGenomeType type) = 0;
 
+	// Replace the contents of the given reusable buffer by the nodes of a random tree of the given type in preorder,
+	// like the trees of IterativeTreeGenerator, and return the depth of the tree. This lets the mutation avoid
+	// creating a genome for every sub-tree. Return 0 to use generateRandomTreeOfType instead.
+	virtual size_t generateRandomTreeOfTypeInto(TreeGenomeType type, std::vector<TreeGenome::NodeStorageType> &nodes) {
+		return 0;
+	}
+
 	virtual const grammar::Grammar &genomeGrammar() = 0;
+
+	// Return the fitness of the given individual. This is called concurrently by the steady state evolution of the
+	// population, so it must be reentrant.
+	virtual float computeFitnessConcurrently(const TreeGenome &individual) {
+		assert(false && "The delegate doesn't support steady state evolution");
+		return 0;
+	}
+
+	// Return true if the fitness of the given individual of the last call of computeFitness is only an estimate,
+	// like the fitness of an individual whose evaluation was stopped early. An estimate isn't stored in the
+	// fitness cache of the population.
+	virtual bool isFitnessEstimated(size_t individual) {
+		return false;
+	}
+
+	// The serial variation reports how it produces every individual of the next generation, which lets a delegate
+	// keep state for every individual across the generations, like IncrementalEvolvingPopulationDelegate. A slot is
+	// an individual of the next generation, and a source is an individual of the current generation.
+	// The given slot was copied from the given source, whose genome is given.
+	virtual void didSelectIndividual(size_t slot, size_t source, const TreeGenome &genome) {
+	}
+
+	// The sub-tree at the given node of the genome in the given slot replaced a sub-tree with the given size.
+	virtual void didReplaceSubTree(size_t slot, const TreeGenome &genome, size_t nodeId, size_t replacedSize) {
+	}
+
+	// The sub-trees at the given nodes of the genomes in the given slots were exchanged.
+	virtual void didSwapSubTrees(size_t slot, const TreeGenome &genome, size_t nodeId, size_t otherSlot, const TreeGenome &other, size_t otherNodeId) {
+	}
+
+	// The next generation replaced the current one, so the slots are now the individuals of the current generation.
+	virtual void didAdvanceGeneration() {
+	}
+
+	// Called by the population with the fitness of every individual of a generation once it was evaluated,
+	// including the individuals whose fitness was found in the fitness cache.
+	virtual void didEvaluateGeneration(const std::vector<float> &fitnesses) {
+	}
+
+	// The number of fitness cases, which is needed by the lexicase selections.
+	virtual size_t fitnessCaseCount() {
+		return 0;
+	}
+
+	// Write the errors of every individual for the given fitness cases into the rows of the matrix, which has
+	// one column per given case. Return false when the delegate only computes the fitness.
+	virtual bool computeCaseErrors(const std::vector<TreeGenome> &individuals, const std::vector<size_t> &cases, CaseErrorMatrix &errors) {
+		return false;
+	}
+
+	// Return the fitness of an individual from its errors for the evaluated cases, which is used to find the elite
+	// when the population selects by the case errors.
+	virtual float fitnessForCaseErrors(const TreeGenome &individual, const float *errors, size_t caseCount) {
+		float sum = 0;
+		for (size_t c = 0; c < caseCount; ++c) {
+			sum += errors[c];
+		}
+		return -sum / float(caseCount);
+	}
+};
+
+/// A population delegate that computes the fitness of every individual independently, spreading
+/// the individuals across the threads of a thread pool.
+class ParallelEvolvingPopulationDelegate : public EvolvingPopulationDelegate {
+	core::ThreadPool pool;
+	size_t chunkSize;
+public:
+	// A chunk size of 0 lets the thread pool pick the number of individuals evaluated by one task.
+	ParallelEvolvingPopulationDelegate(unsigned threadCount = core::ThreadPool::defaultThreadCount(), size_t chunkSize = 0) : pool(threadCount), chunkSize(chunkSize) {
+	}
+
+	// Return the fitness of the given individual.
+	// This method must be reentrant, as it's called concurrently from several threads.
+	virtual float computeFitnessForIndividual(const TreeGenome &individual) = 0;
+
+	float computeFitnessConcurrently(const TreeGenome &individual) override {
+		return computeFitnessForIndividual(individual);
+	}
+
+	void computeFitness(const std::vector<TreeGenome> &individuals, std::vector<float> &fitnesses) override {
+		assert(fitnesses.size() >= individuals.size());
+		pool.parallelFor(individuals.size(), chunkSize, [&] (size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				fitnesses[i] = computeFitnessForIndividual(individuals[i]);
+			}
+		});
+	}
+
+	// Write the errors of the given individual for the given fitness cases, or return false when the delegate
+	// only computes the fitness. This method must be reentrant, as it's called concurrently from several threads.
+	virtual bool computeCaseErrorsForIndividual(const TreeGenome &individual, const size_t *cases, size_t caseCount, float *errors) {
+		return false;
+	}
+
+	bool computeCaseErrors(const std::vector<TreeGenome> &individuals, const std::vector<size_t> &cases, CaseErrorMatrix &errors) override {
+		assert(errors.getIndividualCount() >= individuals.size() && errors.getCaseCount() == cases.size());
+		std::atomic<bool> isComputed(true);
+		pool.parallelFor(individuals.size(), chunkSize, [&] (size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				if (!computeCaseErrorsForIndividual(individuals[i], cases.data(), cases.size(), errors.row(i))) {
+					isComputed.store(false, std::memory_order_relaxed);
+				}
+			}
+		});
+		return isComputed.load(std::memory_order_relaxed);
+	}
+
+	core::ThreadPool &threadPool() {
+		return pool;
+	}
+};
+
+/// The ids of the nodes of a genome grouped by their type, which allows a node with a given type to be
+/// sampled without scanning the genome. The ids of every type are stored in preorder.
+class TreeGenomeTypeIndex {
+	// The nodes of the type t are nodes[offsets[t]] to nodes[offsets[t + 1]].
+	std::vector<uint32_t> offsets;
+	std::vector<uint32_t> nodes;
+public:
+	// Index the nodes of the given genome. The storage of the previous index is reused.
+	void build(const TreeGenome &genome, const grammar::Grammar &grammar) {
+		offsets.assign(grammar.typeCount() + 1, 0);
+		for (size_t i = 0, e = genome.getNodeCount(); i < e; ++i) {
+			++offsets[grammar[genome[i]].getType() + 1];
+		}
+		for (size_t t = 1; t < offsets.size(); ++t) {
+			offsets[t] += offsets[t - 1];
+		}
+		nodes.resize(genome.getNodeCount());
+		for (size_t i = 0, e = genome.getNodeCount(); i < e; ++i) {
+			nodes[offsets[grammar[genome[i]].getType()]++] = uint32_t(i);
+		}
+		// The offsets were advanced to the end of their buckets.
+		for (size_t t = offsets.size() - 1; t > 0; --t) {
+			offsets[t] = offsets[t - 1];
+		}
+		offsets[0] = 0;
+	}
+
+	// The number of nodes with the given type.
+	size_t count(TreeGenomeType type) const {
+		assert(type + 1 < offsets.size());
+		return offsets[type + 1] - offsets[type];
+	}
+
+	// The id of the i-th node with the given type.
+	size_t node(TreeGenomeType type, size_t i) const {
+		assert(i < count(type));
+		return nodes[offsets[type] + i];
+	}
 };
 
 // This class represents a population of individuals that have a tree-genome of a given type.
 class Population {
 private:
     std::vector<TreeGenome> individuals;
+    // The storage for the next generation. The two generations are swapped by nextGeneration, which
+    // overwrites the genomes of the previous generation in place instead of allocating new ones.
+    std::vector<TreeGenome> nextIndividuals;
     std::vector<float> fitnesses;
 	EvolutionParameters &params;
     EvolvingPopulationDelegate &traits;
+    // The delegate as a concurrent tree generator, or null if it can't generate the trees concurrently.
+    ConcurrentTreeGeneratorDelegate *concurrentTraits;
 	
 	template<typename U>
 	U random(U max) {
@@ -63,49 +285,574 @@ private:
 		return utils::selectRandomNode(genome, params);
 	}
 
-	void mutate(TreeGenome &genome) {
-		auto nodeId = selectRandomNode(genome);
+	// Return a uniform index in [0, count). The random streams use the faster sampling, which draws other numbers.
+	template<typename RNG>
+	size_t randomIndex(RNG &rng, size_t count) {
+		if (params.useRandomStreams) {
+			return core::uniformIndex(rng, count);
+		}
+		return std::uniform_int_distribution<size_t>(0, count - 1)(rng);
+	}
+
+	template<typename RNG>
+	float randomProbability(RNG &rng) {
+		if (params.useRandomStreams) {
+			return core::uniformProbability(rng);
+		}
+		return std::uniform_real_distribution<float>(0, 1)(rng);
+	}
+
+	template<typename RNG>
+	size_t selectRandomNode(const TreeGenome &genome, RNG &rng) {
+		return randomIndex(rng, genome.getNodeCount());
+	}
+
+	// The number of times that mutation and crossover draw another point when the varied tree would exceed
+	// the size limits.
+	static constexpr unsigned variationAttemptCount = 3;
+
+	bool hasSizeLimits() const {
+		return params.maxDepth != 0 || params.maxNodeCount != 0;
+	}
+
+	// Return true if replacing the sub-tree at the given node by a sub-tree with the given size and depth keeps
+	// the genome within the size limits. A genome that already exceeds a limit may still shrink.
+	bool fitsSizeLimits(const TreeGenome &genome, size_t nodeId, size_t insertedSize, size_t insertedDepth) const {
+		const size_t removedSize = genome[nodeId].subTreeSize();
+		if (params.maxNodeCount && insertedSize > removedSize && genome.getNodeCount() - removedSize + insertedSize > params.maxNodeCount) {
+			return false;
+		}
+		if (params.maxDepth && genome.getLevel(nodeId) + insertedDepth - 1 > params.maxDepth && insertedDepth > genome.getSubTreeDepth(nodeId)) {
+			return false;
+		}
+		return true;
+	}
+
+	bool fitsSizeLimits(const TreeGenome &genome, size_t nodeId, const TreeGenome &other, size_t otherNodeId) const {
+		return fitsSizeLimits(genome, nodeId, other[otherNodeId].subTreeSize(), params.maxDepth ? other.getSubTreeDepth(otherNodeId) : 0);
+	}
+
+	// Replace a random node by a random tree of the same type, which is generated into the given buffer or made by
+	// the given function when the delegate doesn't generate into buffers. Another node is drawn when the result
+	// would exceed the size limits, and the genome is left unchanged when no attempt fits.
+	// Return the id of the replaced node and the size of the replaced sub-tree, which is 0 if the genome is unchanged.
+	template<typename RNG, typename GenerateInto, typename Generate>
+	std::pair<size_t, size_t> mutate(TreeGenome &genome, RNG &rng, std::vector<TreeGenome::NodeStorageType> &nodes, GenerateInto generateInto, Generate generate) {
+		GENETIC_PROFILE_SCOPE("Population::mutate");
 		const auto &grammar = traits.genomeGrammar();
-		// Replace the node only with the node of the same type.
-		genome.replace(nodeId, traits.generateRandomTreeOfType(grammar[genome[nodeId]].getType()));
+		const unsigned attemptCount = hasSizeLimits() ? variationAttemptCount : 1;
+		for (unsigned attempt = 0; attempt < attemptCount; ++attempt) {
+			auto nodeId = selectRandomNode(genome, rng);
+			// Replace the node only with the node of the same type.
+			const auto type = grammar[genome[nodeId]].getType();
+			if (auto depth = generateInto(type, nodes)) {
+				if (!hasSizeLimits() || fitsSizeLimits(genome, nodeId, nodes.size(), depth)) {
+					const size_t replacedSize = genome[nodeId].subTreeSize();
+					genome.replace(nodeId, nodes.data(), nodes.size());
+					return std::make_pair(nodeId, replacedSize);
+				}
+				continue;
+			}
+			auto subTree = generate(type);
+			if (!hasSizeLimits() || fitsSizeLimits(genome, nodeId, subTree, 0)) {
+				const size_t replacedSize = genome[nodeId].subTreeSize();
+				genome.replace(nodeId, subTree);
+				return std::make_pair(nodeId, replacedSize);
+			}
+		}
+		return std::make_pair(size_t(0), size_t(0));
+	}
+
+	// The reusable buffer for the sub-trees of the serial mutation.
+	std::vector<TreeGenome::NodeStorageType> mutationNodes;
+
+	std::pair<size_t, size_t> mutate(TreeGenome &genome) {
+		return mutate(genome, params.rng, mutationNodes, [this] (TreeGenomeType type, std::vector<TreeGenome::NodeStorageType> &nodes) {
+			return traits.generateRandomTreeOfTypeInto(type, nodes);
+		}, [this] (TreeGenomeType type) {
+			return traits.generateRandomTreeOfType(type);
+		});
+	}
+
+	void mutateConcurrently(TreeGenome &genome, core::Philox4x32 &rng, std::vector<TreeGenome::NodeStorageType> &nodes) {
+		mutate(genome, rng, nodes, [&] (TreeGenomeType type, std::vector<TreeGenome::NodeStorageType> &nodes) {
+			return concurrentTraits->generateRandomTreeOfTypeConcurrentlyInto(type, rng, nodes);
+		}, [&] (TreeGenomeType type) {
+			return concurrentTraits->generateRandomTreeOfTypeConcurrently(type, rng);
+		});
 	}
 	
-	std::pair<size_t, bool> selectRandomNodeWithType(const TreeGenome &genome, TreeGenomeType type) {
+	// Select a random node with the given type using the type index of the genome, or by counting the nodes
+	// of the genome when there's no index. Both ways pick the same node for the same random number.
+	template<typename RNG>
+	std::pair<size_t, bool> selectRandomNodeWithType(const TreeGenome &genome, TreeGenomeType type, RNG &rng, const TreeGenomeTypeIndex *typeIndex) {
+		if (typeIndex) {
+			size_t count = typeIndex->count(type);
+			if (!count) {
+				return std::make_pair(0, false);
+			}
+			auto index = randomIndex(rng, count);
+			return std::make_pair(typeIndex->node(type, index), true);
+		}
 		const auto &grammar = traits.genomeGrammar();
-		std::vector<size_t> nodes;
+		size_t count = 0;
 		for (size_t i = 0, e = genome.getNodeCount(); i < e; ++i) {
-			const auto &def = grammar[genome[i]];
-			if (def.getType() == type) {
-				nodes.push_back(i);
-			}
+			count += grammar[genome[i]].getType() == type;
 		}
-		if (nodes.empty()) {
+		if (!count) {
 			return std::make_pair(0, false);
 		}
-		auto index = std::uniform_int_distribution<size_t>(0, nodes.size() - 1)(params.rng);
-		return std::make_pair(nodes[index], true);
+		auto index = randomIndex(rng, count);
+		for (size_t i = 0;; ++i) {
+			if (grammar[genome[i]].getType() == type && index-- == 0) {
+				return std::make_pair(i, true);
+			}
+		}
 	}
 	
 	// Return true if crossover was successful. False is returned when the other genome
-	// doesn't have any nodes that have the same type.
-	bool crossover(TreeGenome &genome, size_t i, TreeGenomeType type, TreeGenome &other) {
-		auto selection = selectRandomNodeWithType(other, type);
-		if (!selection.second) {
-			return false;
+	// doesn't have any nodes that have the same type. The type index of the other genome is optional.
+	// Another crossover point is drawn when either of the genomes would exceed the size limits, and the genomes
+	// are left unchanged when no attempt fits. The node of the other genome that was exchanged is stored into the
+	// optional swapped node id when the sub-trees were exchanged.
+	template<typename RNG>
+	bool crossover(TreeGenome &genome, size_t i, TreeGenomeType type, TreeGenome &other, RNG &rng, TreeGenome::SwapBuffer &buffer, const TreeGenomeTypeIndex *otherTypeIndex, size_t *swappedNodeId = nullptr) {
+		GENETIC_PROFILE_SCOPE("Population::crossover");
+		const unsigned attemptCount = hasSizeLimits() ? variationAttemptCount : 1;
+		for (unsigned attempt = 0; attempt < attemptCount; ++attempt) {
+			auto selection = selectRandomNodeWithType(other, type, rng, otherTypeIndex);
+			if (!selection.second) {
+				return false;
+			}
+			if (!hasSizeLimits() || (fitsSizeLimits(genome, i, other, selection.first) && fitsSizeLimits(other, selection.first, genome, i))) {
+				genome.swapSubTrees(i, other, selection.first, buffer);
+				if (swappedNodeId) {
+					*swappedNodeId = selection.first;
+				}
+				break;
+			}
 		}
-		auto j = selection.first;
-		auto x = genome.getSubTree(i), y = other.getSubTree(j);
-		genome.replace(i, y);
-		other.replace(j, x);
 		return true;
 	}
+
+	// The individuals of the next generation that are still unmodified copies of an individual of the
+	// current generation share the type index of that individual.
+	static constexpr size_t modifiedSlot = std::numeric_limits<size_t>::max();
+	std::vector<size_t> nextSources;
+	std::vector<TreeGenomeTypeIndex> typeIndices;
+	// The generation for which the type index of every individual was built, or -1, and the locks that let the
+	// tasks of the parallel variation build the indices that they use.
+	std::unique_ptr<std::atomic<int>[]> typeIndexGenerations;
+	std::unique_ptr<std::mutex[]> typeIndexMutexes;
+	size_t typeIndexCount = 0;
+
+	void resizeTypeIndices(size_t size) {
+		if (typeIndexCount == size) {
+			return;
+		}
+		typeIndices.resize(size);
+		typeIndexGenerations.reset(new std::atomic<int>[size]);
+		typeIndexMutexes.reset(new std::mutex[size]);
+		typeIndexCount = size;
+		invalidateTypeIndices();
+	}
+
+	// Forget the type indices, like when the individuals are replaced within a generation.
+	void invalidateTypeIndices() {
+		for (size_t i = 0; i < typeIndexCount; ++i) {
+			typeIndexGenerations[i].store(-1, std::memory_order_relaxed);
+		}
+	}
+
+	// Return the type index of the individual of the current generation that the given slot of the next generation
+	// was copied from, or null if the slot was modified. The index is built when it's first used in a generation.
+	const TreeGenomeTypeIndex *typeIndexForSlot(size_t slot) {
+		auto source = nextSources[slot];
+		if (source == modifiedSlot) {
+			return nullptr;
+		}
+		buildTypeIndex(source);
+		return &typeIndices[source];
+	}
+
+	void buildTypeIndex(size_t individual) {
+		if (typeIndexGenerations[individual].load(std::memory_order_relaxed) != generation) {
+			typeIndices[individual].build(individuals[individual], traits.genomeGrammar());
+			typeIndexGenerations[individual].store(generation, std::memory_order_relaxed);
+		}
+	}
+
+	// Return the type index of the given individual of the current generation, which is built by the first task
+	// that uses it in a generation, so the individuals that are never a crossover partner aren't scanned.
+	const TreeGenomeTypeIndex *typeIndexConcurrently(size_t individual) {
+		auto &builtGeneration = typeIndexGenerations[individual];
+		if (builtGeneration.load(std::memory_order_acquire) != generation) {
+			std::lock_guard<std::mutex> lock(typeIndexMutexes[individual]);
+			if (builtGeneration.load(std::memory_order_relaxed) != generation) {
+				typeIndices[individual].build(individuals[individual], traits.genomeGrammar());
+				builtGeneration.store(generation, std::memory_order_release);
+			}
+		}
+		return &typeIndices[individual];
+	}
+	
+	TreeGenome::SwapBuffer crossoverBuffer;
+	
+	bool usesCaseErrors() const {
+		return params.selection != SelectionMethod::Tournament;
+	}
+
+	// The errors of the current generation for the cases that were drawn for it, which are used by the lexicase selections.
+	CaseErrorMatrix caseErrors;
+	std::vector<size_t> allCases, sampledCases;
+	LexicaseSelectionBuffer selectionBuffer;
+
+	// Evaluate the errors of the individuals of the current generation for a sample of the cases, and
+	// derive their fitness from them.
+	void computeCaseErrors() {
+		const size_t caseCount = traits.fitnessCaseCount();
+		assert(caseCount != 0 && "The delegate doesn't have any fitness cases");
+		assert(params.caseSampleRate > 0 && params.caseSampleRate <= 1);
+		const size_t sampleSize = std::max(size_t(1), std::min(caseCount, size_t(std::lround(double(caseCount) * params.caseSampleRate))));
+		sampledCases.clear();
+		if (sampleSize == caseCount) {
+			for (size_t c = 0; c < caseCount; ++c) {
+				sampledCases.push_back(c);
+			}
+		} else {
+			// A partial Fisher-Yates shuffle, whose result is sorted to keep the accesses of the delegate in order.
+			allCases.resize(caseCount);
+			for (size_t c = 0; c < caseCount; ++c) {
+				allCases[c] = c;
+			}
+			for (size_t c = 0; c < sampleSize; ++c) {
+				std::swap(allCases[c], allCases[std::uniform_int_distribution<size_t>(c, caseCount - 1)(params.rng)]);
+			}
+			sampledCases.assign(allCases.begin(), allCases.begin() + sampleSize);
+			std::sort(sampledCases.begin(), sampledCases.end());
+		}
+		const size_t size = individuals.size();
+		caseErrors.resize(size, sampleSize);
+		auto isComputed = traits.computeCaseErrors(individuals, sampledCases, caseErrors);
+		assert(isComputed && "The delegate doesn't compute the case errors");
+		(void)isComputed;
+		caseErrors.replaceNonFiniteErrors();
+		for (size_t i = 0; i < size; ++i) {
+			fitnesses[i] = traits.fitnessForCaseErrors(individuals[i], caseErrors.row(i), sampleSize);
+		}
+		if (params.selection == SelectionMethod::EpsilonLexicase) {
+			caseErrors.computeEpsilons();
+		}
+	}
+
+	// Evaluate the individuals of the current generation. The fitness cache isn't used by the lexicase selections,
+	// as every generation is evaluated for other cases.
+	void computeFitness() {
+		cacheHitCount = 0;
+		if (usesCaseErrors()) {
+			computeCaseErrors();
+		} else if (!fitnessCache) {
+			traits.computeFitness(individuals, fitnesses);
+		} else {
+			computeUncachedFitness();
+		}
+		traits.didEvaluateGeneration(fitnesses);
+	}
+
+	// Evaluate the individuals of the current generation whose fitness isn't in the fitness cache. The estimated
+	// fitnesses aren't cached, as a later generation would take them as the exact fitness of its clones.
+	void computeUncachedFitness() {
+		// Only evaluate the genomes that aren't in the cache. The genomes are moved to a separate
+		// generation for the delegate, and the individuals that are duplicates are evaluated once.
+		const size_t size = individuals.size();
+		static const size_t isCached = std::numeric_limits<size_t>::max();
+		uncachedSlots.resize(size);
+		pendingGenomes.clear();
+		uncachedHashes.clear();
+		uncachedOwners.clear();
+		for (size_t i = 0; i < size; ++i) {
+			auto hash = individuals[i].structuralHash();
+			if (fitnessCache->lookup(hash, fitnesses[i])) {
+				uncachedSlots[i] = isCached;
+				++cacheHitCount;
+				continue;
+			}
+			auto inserted = pendingGenomes.insert(std::make_pair(hash, uncachedOwners.size()));
+			uncachedSlots[i] = inserted.first->second;
+			if (!inserted.second) {
+				continue;
+			}
+			size_t slot = uncachedOwners.size();
+			if (uncachedGenomes.size() <= slot) {
+				uncachedGenomes.resize(slot + 1);
+			}
+			std::swap(uncachedGenomes[slot], individuals[i]);
+			uncachedHashes.push_back(hash);
+			uncachedOwners.push_back(i);
+		}
+		const size_t uncachedCount = uncachedOwners.size();
+		if (uncachedCount) {
+			uncachedGenomes.resize(uncachedCount);
+			uncachedFitnesses.resize(uncachedCount);
+			traits.computeFitness(uncachedGenomes, uncachedFitnesses);
+		}
+		for (size_t slot = 0; slot < uncachedCount; ++slot) {
+			std::swap(uncachedGenomes[slot], individuals[uncachedOwners[slot]]);
+			if (!traits.isFitnessEstimated(slot)) {
+				fitnessCache->insert(uncachedHashes[slot], uncachedFitnesses[slot]);
+			}
+		}
+		for (size_t i = 0; i < size; ++i) {
+			if (uncachedSlots[i] != isCached) {
+				fitnesses[i] = uncachedFitnesses[uncachedSlots[i]];
+			}
+		}
+	}
+	
+	FitnessCache *fitnessCache = nullptr;
+	// The number of individuals of the last evaluated generation whose fitness was found in the cache.
+	size_t cacheHitCount = 0;
+	// Reusable storage for the evaluation of the genomes that aren't in the fitness cache.
+	std::vector<size_t> uncachedSlots, uncachedOwners;
+	std::vector<uint64_t> uncachedHashes;
+	std::vector<TreeGenome> uncachedGenomes;
+	std::vector<float> uncachedFitnesses;
+	std::unordered_map<uint64_t, size_t> pendingGenomes;
 	
+	// Sort the first count ids of the individuals using the given ordering.
+	template<typename Compare>
+	void rankIndividuals(size_t count, Compare compare) {
+		rankedIndividuals.resize(individuals.size());
+		for (size_t i = 0; i < rankedIndividuals.size(); ++i) {
+			rankedIndividuals[i] = i;
+		}
+		std::partial_sort(rankedIndividuals.begin(), rankedIndividuals.begin() + count, rankedIndividuals.end(), compare);
+	}
+
+	// Run the given loop on the variation thread pool, or on this thread when there's no pool.
+	void forEachVariationTask(size_t count, const std::function<void (size_t begin, size_t end)> &fn) {
+		if (variationPool) {
+			variationPool->parallelFor(count, 0, fn);
+		} else if (count) {
+			fn(0, count);
+		}
+	}
+
+	// Produce the next generation on the thread pool. The varied individuals are split into pairs, and every pair
+	// is selected, mutated and crossed over by an independent task. The tasks use counter-based random number
+	// generators keyed by a seed that's drawn from params.rng once per generation, or by the random streams of
+	// the pair, so the next generation doesn't depend on the number of threads.
+	void varyConcurrently(size_t bestIndividual) {
+		const size_t size = individuals.size();
+		const size_t variedCount = size - 1;
+		const size_t taskCount = (variedCount + 1) / 2;
+		const uint64_t seed = params.useRandomStreams ? 0 : (uint64_t(params.rng()) << 32) | uint64_t(params.rng());
+		const core::RandomStreams streams(params.streamSeed);
+		variationBuffers.resize(taskCount);
+		variationPartners.resize(taskCount);
+		variationNodes.resize(taskCount);
+		variationSelectionBuffers.resize(taskCount);
+		variationFailureCounts.assign(taskCount, 0);
+		forEachVariationTask(taskCount, [&] (size_t begin, size_t end) {
+			for (size_t task = begin; task < end; ++task) {
+				size_t first = task * 2, last = std::min(first + 2, variedCount);
+				auto rng = params.useRandomStreams ? streams.stream(generation, first, variationStream) : core::Philox4x32(seed, task);
+				// The first two individuals are the elites.
+				for (size_t i = first; i < last; ++i) {
+					nextSources[i] = i < 2 ? bestIndividual : selectIndividual(rng, variationSelectionBuffers[task]);
+					nextIndividuals[i].assign(individuals[nextSources[i]]);
+				}
+				for (size_t i = first; i < last; ++i) {
+					auto p = randomProbability(rng);
+					if (p <= params.mutationRate) {
+						mutateConcurrently(nextIndividuals[i], rng, variationNodes[task]);
+						nextSources[i] = modifiedSlot;
+						continue;
+					}
+					if (p > params.mutationRate + params.crossoverRate) {
+						continue;
+					}
+					// Cross the individual over with the other individual of the pair, or with a selected
+					// individual when the pair is incomplete.
+					TreeGenome *other = &variationPartners[task];
+					size_t otherSource;
+					if (last - first == 2) {
+						size_t otherSlot = i == first ? last - 1 : first;
+						other = &nextIndividuals[otherSlot];
+						otherSource = nextSources[otherSlot];
+						nextSources[otherSlot] = modifiedSlot;
+					} else {
+						otherSource = selectIndividual(rng, variationSelectionBuffers[task]);
+						other->assign(individuals[otherSource]);
+					}
+					nextSources[i] = modifiedSlot;
+					auto genomeIndex = selectRandomNode(nextIndividuals[i], rng);
+					const auto type = traits.genomeGrammar()[nextIndividuals[i][genomeIndex]].getType();
+					auto otherTypeIndex = otherSource != modifiedSlot ? typeIndexConcurrently(otherSource) : nullptr;
+					// The failures are reported through crossoverFailureCount, as the tasks can't print in order.
+					if (!crossover(nextIndividuals[i], genomeIndex, type, *other, rng, variationBuffers[task], otherTypeIndex)) {
+						++variationFailureCounts[task];
+					}
+					// The crossover of the first individual also varied the second one.
+					if (i == first) {
+						break;
+					}
+				}
+			}
+		});
+		nextIndividuals[size - 1].assign(individuals[bestIndividual]);
+		for (auto count : variationFailureCounts) {
+			crossoverFailureCount += count;
+		}
+	}
+
+	core::ThreadPool *variationPool = nullptr;
+	// The operation of the random streams that vary a pair of individuals.
+	static constexpr uint32_t variationStream = 0;
+	// The reusable storage of every variation task.
+	std::vector<TreeGenome::SwapBuffer> variationBuffers;
+	std::vector<TreeGenome> variationPartners;
+	std::vector<std::vector<TreeGenome::NodeStorageType>> variationNodes;
+	std::vector<LexicaseSelectionBuffer> variationSelectionBuffers;
+	std::vector<size_t> variationFailureCounts;
+
+	// An individual of the steady state evolution, which is replaced concurrently. The slot is locked while its
+	// genome is copied or replaced, and the tournaments read its fitness and node count without the lock.
+	struct SteadyStateSlot {
+		std::mutex mutex;
+		std::atomic<float> fitness;
+		std::atomic<size_t> nodeCount;
+	};
+	// The reusable storage of every worker of the steady state evolution.
+	struct SteadyStateWorker {
+		TreeGenome offspring, partner;
+		TreeGenome::SwapBuffer buffer;
+		std::vector<TreeGenome::NodeStorageType> nodes;
+		size_t replacementCount = 0, failureCount = 0;
+	};
+	std::unique_ptr<SteadyStateSlot[]> steadyStateSlots;
+	std::vector<SteadyStateWorker> steadyStateWorkers;
+	// The number of offspring that were produced by the steady state evolution, which numbers the random streams.
+	size_t steadyStateOffspringCount = 0;
+	// The operation of the random streams that produce an offspring.
+	static constexpr uint32_t steadyStateStream = 1;
+
+	// Return true if the individual in the slot a is fitter than the one in the slot b, comparing the node counts of
+	// equally fit individuals when the parsimony pressure is used.
+	bool isFitterSlot(size_t a, size_t b) const {
+		const float fitnessA = steadyStateSlots[a].fitness.load(std::memory_order_relaxed), fitnessB = steadyStateSlots[b].fitness.load(std::memory_order_relaxed);
+		if (fitnessA != fitnessB || !params.useLexicographicParsimony) {
+			return fitnessA > fitnessB;
+		}
+		return steadyStateSlots[a].nodeCount.load(std::memory_order_relaxed) < steadyStateSlots[b].nodeCount.load(std::memory_order_relaxed);
+	}
+
+	// Return the winner of a 3 tournament among the slots, or its loser for the replacement.
+	template<typename RNG>
+	size_t selectSlotConcurrently(RNG &rng, bool selectsLoser) {
+		const size_t size = individuals.size();
+		size_t selected = randomIndex(rng, size);
+		for (unsigned j = 1; j < 3; ++j) {
+			const size_t candidate = randomIndex(rng, size);
+			if (selectsLoser ? isFitterSlot(selected, candidate) : isFitterSlot(candidate, selected)) {
+				selected = candidate;
+			}
+		}
+		return selected;
+	}
+
+	void copySlotConcurrently(size_t slot, TreeGenome &genome) {
+		std::lock_guard<std::mutex> lock(steadyStateSlots[slot].mutex);
+		genome.assign(individuals[slot]);
+	}
+
+	// Swap the given genome into the slot if it's at least as fit as the individual in the slot, which may have
+	// been replaced since the slot lost its tournament. The fittest individual is therefore never lost. An offspring
+	// whose fitness is NaN never replaces an individual, while an individual whose fitness is NaN is always replaced.
+	bool replaceSlotConcurrently(size_t slot, TreeGenome &genome, float fitness) {
+		auto &state = steadyStateSlots[slot];
+		std::lock_guard<std::mutex> lock(state.mutex);
+		if (std::isnan(fitness) || fitness < state.fitness.load(std::memory_order_relaxed)) {
+			return false;
+		}
+		std::swap(individuals[slot], genome);
+		state.fitness.store(fitness, std::memory_order_relaxed);
+		state.nodeCount.store(individuals[slot].getNodeCount(), std::memory_order_relaxed);
+		return true;
+	}
+
+	// Select a parent and vary it into the offspring of the worker, like a task of the parallel variation.
+	void produceOffspringConcurrently(SteadyStateWorker &worker, core::Philox4x32 &rng) {
+		copySlotConcurrently(selectSlotConcurrently(rng, false), worker.offspring);
+		auto p = randomProbability(rng);
+		if (p <= params.mutationRate) {
+			mutateConcurrently(worker.offspring, rng, worker.nodes);
+		} else if (p <= params.mutationRate + params.crossoverRate) {
+			copySlotConcurrently(selectSlotConcurrently(rng, false), worker.partner);
+			auto genomeIndex = selectRandomNode(worker.offspring, rng);
+			const auto type = traits.genomeGrammar()[worker.offspring[genomeIndex]].getType();
+			if (!crossover(worker.offspring, genomeIndex, type, worker.partner, rng, worker.buffer, nullptr)) {
+				++worker.failureCount;
+			}
+		}
+	}
+
+	StatisticsRecorder *statisticsRecorder = nullptr;
+	size_t crossoverFailureCount = 0;
+
+	typedef std::chrono::steady_clock Clock;
+
+	static uint64_t elapsedNanoseconds(Clock::time_point begin, Clock::time_point end) {
+		return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+	}
+
+	// Record the statistics of the evaluated generation and the times it took to produce the next one.
+	void recordStatistics(uint64_t evaluationTime, uint64_t selectionTime, uint64_t variationTime) {
+		GenerationRecord record;
+		const size_t size = fitnesses.size();
+		record.generation = generation;
+		record.individualCount = size;
+		record.minFitness = record.maxFitness = fitnesses[0];
+		record.minNodeCount = record.maxNodeCount = individuals[0].getNodeCount();
+		record.minDepth = record.maxDepth = individuals[0].getDepth();
+		double fitnessSum = 0, nodeCountSum = 0, depthSum = 0;
+		for (size_t i = 0; i < size; ++i) {
+			const float fitness = fitnesses[i];
+			const uint64_t nodeCount = individuals[i].getNodeCount(), depth = individuals[i].getDepth();
+			record.minFitness = std::min(record.minFitness, fitness);
+			record.maxFitness = std::max(record.maxFitness, fitness);
+			record.minNodeCount = std::min(record.minNodeCount, nodeCount);
+			record.maxNodeCount = std::max(record.maxNodeCount, nodeCount);
+			record.minDepth = std::min(record.minDepth, depth);
+			record.maxDepth = std::max(record.maxDepth, depth);
+			fitnessSum += fitness;
+			nodeCountSum += double(nodeCount);
+			depthSum += double(depth);
+		}
+		const double average = fitnessSum / double(size);
+		double squaredDeviationSum = 0;
+		for (size_t i = 0; i < size; ++i) {
+			squaredDeviationSum += (fitnesses[i] - average) * (fitnesses[i] - average);
+		}
+		record.averageFitness = float(average);
+		record.fitnessStandardDeviation = float(std::sqrt(squaredDeviationSum / double(size)));
+		record.averageNodeCount = float(nodeCountSum / double(size));
+		record.averageDepth = float(depthSum / double(size));
+		record.evaluationTime = evaluationTime;
+		record.selectionTime = selectionTime;
+		record.variationTime = variationTime;
+		record.crossoverFailureCount = crossoverFailureCount;
+		record.cacheHitRate = fitnessCache ? float(cacheHitCount) / float(size) : 0.0f;
+		statisticsRecorder->record(record);
+	}
+
+	std::vector<size_t> rankedIndividuals;
 	size_t currentBestIndividualId = 0;
 	int evaluatedGeneration = -1;
 public:
     int generation = 0;
 	
-	Population(size_t size, EvolutionParameters &params, EvolvingPopulationDelegate &delegate) : params(params), traits(delegate) {
+	Population(size_t size, EvolutionParameters &params, EvolvingPopulationDelegate &delegate) : params(params), traits(delegate), concurrentTraits(dynamic_cast<ConcurrentTreeGeneratorDelegate *>(&delegate)) {
         assert(size != 0);
         fitnesses.resize(size);
     }
@@ -114,6 +861,53 @@ public:
 		return individuals[i];
 	}
 
+	// The number of individuals in a generation.
+	size_t size() const {
+		return fitnesses.size();
+	}
+
+	// The fitness of the given individual, which is only valid once the generation was evaluated.
+	float getFitness(size_t i) const {
+		return fitnesses[i];
+	}
+
+	// Replace the current generation by the given individuals, which were already evaluated, like the
+	// individuals that are loaded from a checkpoint.
+	void restore(int restoredGeneration, std::vector<TreeGenome> restoredIndividuals, const std::vector<float> &restoredFitnesses) {
+		assert(restoredIndividuals.size() == fitnesses.size() && restoredFitnesses.size() == fitnesses.size());
+		individuals = std::move(restoredIndividuals);
+		fitnesses = restoredFitnesses;
+		generation = restoredGeneration;
+		invalidateTypeIndices();
+		currentBestIndividualId = size_t(std::max_element(fitnesses.begin(), fitnesses.end()) - fitnesses.begin());
+		// The case errors aren't restored, so the lexicase selections evaluate the generation again.
+		evaluatedGeneration = usesCaseErrors() ? -1 : generation;
+	}
+	
+	// Use the given cache to avoid evaluating the genomes that were already evaluated. Pass null to
+	// evaluate every individual.
+	void setFitnessCache(FitnessCache *cache) {
+		fitnessCache = cache;
+	}
+
+	// Produce the next generations concurrently on the given thread pool. The delegate must be a
+	// ConcurrentTreeGeneratorDelegate, or false is returned and the generations are still produced serially.
+	// Pass null to produce the next generations serially, which produces the same generations as the pool when
+	// the random streams are used.
+	bool setParallelVariation(core::ThreadPool *pool) {
+		if (pool && !concurrentTraits) {
+			return false;
+		}
+		variationPool = pool;
+		return true;
+	}
+
+	// Record the statistics of every generation that's produced by nextGeneration into the given recorder,
+	// which is a cheaper alternative to dumping the generations. Pass null to stop recording.
+	void setStatisticsRecorder(StatisticsRecorder *recorder) {
+		statisticsRecorder = recorder;
+	}
+
     void initialize(int maxDepth, Initializer &init) {
 		InitializationOptions opts;
 		opts.maxTreeGenomeDepth = maxDepth;
@@ -123,21 +917,45 @@ public:
 		});
     }
     
+    // Return the id of the individual that's selected by a 3 tournament, or by the lexicase selection.
+    size_t selectIndividual() {
+        return selectIndividual(params.rng);
+    }
+
+    template<typename RNG>
+    size_t selectIndividual(RNG &rng) {
+        return selectIndividual(rng, selectionBuffer);
+    }
+
+    // The lexicase selections use the given buffer, so the threads that select concurrently need their own buffers.
+    template<typename RNG>
+    size_t selectIndividual(RNG &rng, LexicaseSelectionBuffer &buffer) {
+        GENETIC_PROFILE_SCOPE("Population::select");
+        if (usesCaseErrors()) {
+            assert(caseErrors.getIndividualCount() == individuals.size() && "The case errors are only known once the generation was evaluated");
+            return selectByLexicase(caseErrors, rng, buffer);
+        }
+        const size_t size = individuals.size();
+        size_t s[3];
+        for (auto &selected : s) {
+            selected = randomIndex(rng, size);
+        }
+        auto maxFitness = fitnesses[s[0]];
+        auto selectedIndividual = s[0];
+        for (unsigned j = 1; j < 3; ++j) {
+            if (fitnesses[s[j]] > maxFitness || (params.useLexicographicParsimony && fitnesses[s[j]] == maxFitness &&
+                                                 individuals[s[j]].getNodeCount() < individuals[selectedIndividual].getNodeCount())) {
+                maxFitness = fitnesses[s[j]];
+                selectedIndividual = s[j];
+            }
+        }
+        return selectedIndividual;
+    }
+    
     void select(std::vector<TreeGenome> &newGeneration, size_t count) {
         assert(count != 0 && count <= individuals.size());
         for (size_t i = 0; i < count; ++i) {
-            std::uniform_int_distribution<size_t> sampler(0, individuals.size() - 1);
-			// 3 Tournament selection.
-            size_t s[3] = { sampler(params.rng), sampler(params.rng), sampler(params.rng) };
-            auto maxFitness = fitnesses[s[0]];
-            auto selectedIndividual = s[0];
-            for (unsigned j = 1; j < 3; ++j) {
-                if (fitnesses[s[j]] > maxFitness) {
-                    maxFitness = fitnesses[s[j]];
-                    selectedIndividual = s[j];
-                }
-            }
-            newGeneration.push_back(individuals[selectedIndividual].copy());
+            newGeneration.push_back(individuals[selectIndividual()].copy());
         }
     }
 
@@ -174,6 +992,7 @@ public:
         std::cout << "Average fitness:\t" << stats.averageFitness << "\n";
         std::cout << "Best fitness:\t" << stats.bestFitness << "\n";
         std::cout << "Best individual:\t";
+		// One printer renders every individual into its buffer.
 		TreeGenomePrinter printer(traits.genomeGrammar());
 		printer.print(individuals[stats.bestIndividual], std::cout, traits.printerDelegate.get());
         std::cout << "\n";
@@ -181,7 +1000,6 @@ public:
 			size_t idx = 0;
             for (const auto &i : individuals) {
                 std::cout << "\t#" << idx << ":\t";
-				TreeGenomePrinter printer(traits.genomeGrammar());
 				printer.print(i, std::cout, traits.printerDelegate.get());
                 std::cout << "\n";
 				idx++;
@@ -194,8 +1012,9 @@ public:
 		if (evaluatedGeneration == generation) {
 			return currentBestIndividualId;
 		}
+		GENETIC_PROFILE_SCOPE("Population::evaluateGeneration");
         // Evaluate the individuals.
-		traits.computeFitness(individuals, fitnesses);
+		computeFitness();
 		assert(fitnesses.size() == individuals.size());
 		size_t bestIndividual = 0;
 		float bestFitness = fitnesses[0];
@@ -210,46 +1029,222 @@ public:
 		evaluatedGeneration = generation;
         return bestIndividual;
     }
-    
+
+    // Copy the given number of the fittest individuals of the current generation and their fitness,
+    // from the fittest one. The ties are broken by the index of the individual.
+    void getFittestIndividuals(size_t count, std::vector<TreeGenome> &genomes, std::vector<float> &genomeFitnesses) {
+        assert(count <= individuals.size());
+        evaluateGeneration();
+        rankIndividuals(count, [this] (size_t a, size_t b) {
+            return fitnesses[a] > fitnesses[b] || (fitnesses[a] == fitnesses[b] && a < b);
+        });
+        genomes.resize(count);
+        genomeFitnesses.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            genomes[i].assign(individuals[rankedIndividuals[i]]);
+            genomeFitnesses[i] = fitnesses[rankedIndividuals[i]];
+        }
+    }
+
+    // Replace the least fit individuals of the current generation with the given individuals, which
+    // were already evaluated. The ties are broken by the index of the individual.
+    void replaceLeastFitIndividuals(std::vector<TreeGenome> &genomes, const std::vector<float> &genomeFitnesses) {
+        assert(genomes.size() == genomeFitnesses.size() && genomes.size() <= individuals.size());
+        evaluateGeneration();
+        rankIndividuals(genomes.size(), [this] (size_t a, size_t b) {
+            return fitnesses[a] < fitnesses[b] || (fitnesses[a] == fitnesses[b] && a < b);
+        });
+        for (size_t i = 0; i < genomes.size(); ++i) {
+            auto id = rankedIndividuals[i];
+            std::swap(individuals[id], genomes[i]);
+            fitnesses[id] = genomeFitnesses[i];
+            if (id < typeIndexCount) {
+                typeIndexGenerations[id].store(-1, std::memory_order_relaxed);
+            }
+            if (fitnesses[id] > fitnesses[currentBestIndividualId]) {
+                currentBestIndividualId = id;
+            }
+        }
+        // The case errors of the given individuals aren't known, so the lexicase selections evaluate the generation again.
+        if (usesCaseErrors()) {
+            evaluatedGeneration = -1;
+        }
+    }
+
+    // Evolve the population without generations until the given number of offspring was produced. The threads of the
+    // pool repeatedly select a parent by a tournament, vary it into an offspring, evaluate the offspring with the
+    // computeFitnessConcurrently of the delegate and replace the loser of another tournament by it, unless the loser
+    // is fitter. No thread waits for the others, so an expensive evaluation only delays the thread that runs it.
+    // The delegate must be a ConcurrentTreeGeneratorDelegate. The threads interleave differently in every
+    // run, so the result is only reproducible with a single thread. Only the tournament selection is supported, and
+    // the fitness cache isn't used.
+    // The generation advances once per population size of produced offspring. Return the number of offspring that
+    // replaced an individual.
+    size_t evolveSteadyState(core::ThreadPool &pool, size_t offspringCount) {
+        GENETIC_PROFILE_SCOPE("Population::evolveSteadyState");
+        if (!concurrentTraits) {
+            assert(false && "The delegate can't generate the trees concurrently");
+            return 0;
+        }
+        assert(!usesCaseErrors() && "The steady state evolution only supports the tournament selection");
+        assert(params.mutationRate + params.crossoverRate <= 1.0);
+        Clock::time_point start;
+        if (statisticsRecorder) {
+            start = Clock::now();
+            crossoverFailureCount = 0;
+        }
+        evaluateGeneration();
+        const size_t size = individuals.size();
+        steadyStateSlots.reset(new SteadyStateSlot[size]);
+        for (size_t i = 0; i < size; ++i) {
+            steadyStateSlots[i].fitness.store(fitnesses[i], std::memory_order_relaxed);
+            steadyStateSlots[i].nodeCount.store(individuals[i].getNodeCount(), std::memory_order_relaxed);
+        }
+        const uint64_t seed = params.useRandomStreams ? 0 : (uint64_t(params.rng()) << 32) | uint64_t(params.rng());
+        const core::RandomStreams streams(params.streamSeed);
+        const size_t firstOffspring = steadyStateOffspringCount;
+        std::atomic<size_t> nextOffspring(0);
+        steadyStateWorkers.resize(pool.size());
+        // Every worker is a single task that claims offspring until there are none left.
+        pool.parallelFor(steadyStateWorkers.size(), 1, [&] (size_t begin, size_t end) {
+            for (size_t w = begin; w < end; ++w) {
+                auto &worker = steadyStateWorkers[w];
+                worker.replacementCount = worker.failureCount = 0;
+                for (;;) {
+                    const size_t offspring = nextOffspring.fetch_add(1, std::memory_order_relaxed);
+                    if (offspring >= offspringCount) {
+                        break;
+                    }
+                    const uint64_t number = uint64_t(firstOffspring + offspring);
+                    auto rng = params.useRandomStreams ? streams.stream(0, number, steadyStateStream) : core::Philox4x32(seed, number);
+                    produceOffspringConcurrently(worker, rng);
+                    const float fitness = traits.computeFitnessConcurrently(worker.offspring);
+                    if (replaceSlotConcurrently(selectSlotConcurrently(rng, true), worker.offspring, fitness)) {
+                        ++worker.replacementCount;
+                    }
+                }
+            }
+        });
+        size_t replacementCount = 0;
+        for (const auto &worker : steadyStateWorkers) {
+            replacementCount += worker.replacementCount;
+            crossoverFailureCount += worker.failureCount;
+        }
+        size_t bestIndividual = 0;
+        for (size_t i = 0; i < size; ++i) {
+            fitnesses[i] = steadyStateSlots[i].fitness.load(std::memory_order_relaxed);
+            if (fitnesses[i] > fitnesses[bestIndividual]) {
+                bestIndividual = i;
+            }
+        }
+        steadyStateSlots.reset();
+        invalidateTypeIndices();
+        steadyStateOffspringCount += offspringCount;
+        generation += int(steadyStateOffspringCount / size - firstOffspring / size);
+        currentBestIndividualId = bestIndividual;
+        evaluatedGeneration = generation;
+        if (statisticsRecorder) {
+            recordStatistics(0, 0, elapsedNanoseconds(start, Clock::now()));
+        }
+        return replacementCount;
+    }
+
     void nextGeneration(bool doDump = true) {
+        GENETIC_PROFILE_SCOPE("Population::nextGeneration");
+        Clock::time_point evaluationStart;
+        if (statisticsRecorder) {
+            evaluationStart = Clock::now();
+            crossoverFailureCount = 0;
+        }
         auto bestIndividual = evaluateGeneration();
+        Clock::time_point selectionStart;
+        if (statisticsRecorder) {
+            selectionStart = Clock::now();
+        }
 		
 		if (doDump)
 			dump(false);
         
         // Selection.
-        std::vector<TreeGenome> newGeneration; newGeneration.reserve(individuals.size());
+        const size_t size = individuals.size();
+        assert(size >= 3);
+        nextIndividuals.resize(size);
+        nextSources.resize(size);
+        resizeTypeIndices(size);
+        assert(params.mutationRate + params.crossoverRate <= 1.0);
+        // The random streams need the concurrent tree generator even without a pool.
+        assert(!params.useRandomStreams || concurrentTraits);
+        if ((variationPool || params.useRandomStreams) && concurrentTraits) {
+            varyConcurrently(bestIndividual);
+            if (statisticsRecorder) {
+                recordStatistics(elapsedNanoseconds(evaluationStart, selectionStart), 0, elapsedNanoseconds(selectionStart, Clock::now()));
+            }
+            std::swap(individuals, nextIndividuals);
+            traits.didAdvanceGeneration();
+            ++generation;
+            return;
+        }
+        auto &newGeneration = nextIndividuals;
         // Add two elites for mutation / crossover.
-        newGeneration.push_back(individuals[bestIndividual].copy());
-        newGeneration.push_back(individuals[bestIndividual].copy());
+        newGeneration[0].assign(individuals[bestIndividual]);
+        newGeneration[1].assign(individuals[bestIndividual]);
+        nextSources[0] = nextSources[1] = bestIndividual;
         assert(params.mutationRate + params.crossoverRate <= 1.0);
         // Performs tournament selection for the rest.
-        select(newGeneration, individuals.size() - 3);
-        // Do mutation / crossover.
-        for (size_t i = 0; i < newGeneration.size(); ++i) {
+        for (size_t i = 2; i < size - 1; ++i) {
+            nextSources[i] = selectIndividual();
+            newGeneration[i].assign(individuals[nextSources[i]]);
+        }
+        for (size_t i = 0; i < size - 1; ++i) {
+            traits.didSelectIndividual(i, nextSources[i], individuals[nextSources[i]]);
+        }
+        Clock::time_point variationStart;
+        if (statisticsRecorder) {
+            variationStart = Clock::now();
+        }
+        // Do mutation / crossover on every individual but the last elite.
+        const size_t variedCount = size - 1;
+        for (size_t i = 0; i < variedCount; ++i) {
             std::uniform_real_distribution<float> sampler(0, 1);
             auto p = sampler(params.rng);
             if (p <= params.mutationRate) {
-				mutate(newGeneration[i]);
+				auto replaced = mutate(newGeneration[i]);
+				if (replaced.second) {
+					traits.didReplaceSubTree(i, newGeneration[i], replaced.first, replaced.second);
+				}
+				nextSources[i] = modifiedSlot;
             }
             else if (p <= params.mutationRate + params.crossoverRate) {
-                auto next = (i + 1) != newGeneration.size() ? i + 1 : random(newGeneration.size() - 1);
+                auto next = (i + 1) != variedCount ? i + 1 : random(variedCount - 1);
                 if (next == i) {
                     next = i - 1;
                 }
 				auto genomeIndex = selectRandomNode(newGeneration[i]);
 				const auto type = traits.genomeGrammar()[newGeneration[i][genomeIndex]].getType();
 				// TODO: Try 3 times.
-				if (!crossover(newGeneration[i], genomeIndex, type, newGeneration[next])) {
+				const size_t notSwapped = std::numeric_limits<size_t>::max();
+				size_t swappedNodeId = notSwapped;
+				if (!crossover(newGeneration[i], genomeIndex, type, newGeneration[next], params.rng, crossoverBuffer, typeIndexForSlot(next), &swappedNodeId)) {
 					std::cout << "Error: failed to crossover because types couldn't be matched";
+					++crossoverFailureCount;
 				}
+				if (swappedNodeId != notSwapped) {
+					traits.didSwapSubTrees(i, newGeneration[i], genomeIndex, next, newGeneration[next], swappedNodeId);
+				}
+				nextSources[i] = nextSources[next] = modifiedSlot;
                 ++i;
             }
         }
         // Add the elite without mutation / crossover.
-        newGeneration.push_back(individuals[bestIndividual].copy());
+        newGeneration[size - 1].assign(individuals[bestIndividual]);
+        traits.didSelectIndividual(size - 1, bestIndividual, individuals[bestIndividual]);
+        if (statisticsRecorder) {
+            auto variationEnd = Clock::now();
+            recordStatistics(elapsedNanoseconds(evaluationStart, selectionStart), elapsedNanoseconds(selectionStart, variationStart), elapsedNanoseconds(variationStart, variationEnd));
+        }
         
-        individuals = std::move(newGeneration);
+        std::swap(individuals, nextIndividuals);
+        traits.didAdvanceGeneration();
         ++generation;
     }
 };
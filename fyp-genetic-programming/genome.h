@@ -10,6 +10,8 @@ typedef unsigned TreeGenomeValue;
 typedef unsigned TreeGenomeType;
 // A GP Tree.
 typedef core::Tree<TreeGenomeValue> TreeGenome;
+// A GP Tree that uses half of the memory of TreeGenome, for grammars whose node limit fits into 16 bits.
+typedef core::Tree<TreeGenomeValue, core::PackedTreeNodeStorage<TreeGenomeValue>> CompactTreeGenome;
 
 } // end namespace genetic
 
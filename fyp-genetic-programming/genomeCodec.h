@@ -0,0 +1,167 @@
+#pragma once
+
+#include "genome.h"
+#include "grammar.h"
+#include "geneticProgramming.h"
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+namespace genetic {
+
+/// A compact binary encoding of genomes: the raw values of the nodes in preorder, each stored as an unsigned LEB128
+/// varint. The child counts and the sub-tree sizes aren't stored, as they follow from the arity of the definitions of
+/// the grammar, so a genome whose raw values are below 128 takes one byte per node. A genome ends with the node that
+/// completes its tree, and a sequence of genomes starts with the varint of their count.
+/// The encoding doesn't depend on the byte order of the machine, but it can only be decoded with the same grammar.
+namespace codec {
+
+inline void writeVarint(std::vector<uint8_t> &bytes, uint32_t value) {
+	while (value >= 0x80) {
+		bytes.push_back(uint8_t(value | 0x80));
+		value >>= 7;
+	}
+	bytes.push_back(uint8_t(value));
+}
+
+// Read a varint and advance the given position past it. Return false if the bytes end within the varint or the
+// value doesn't fit into 32 bits.
+inline bool readVarint(const uint8_t *&position, const uint8_t *end, uint32_t &value) {
+	uint32_t result = 0;
+	for (unsigned shift = 0; shift < 35; shift += 7) {
+		if (position == end) {
+			return false;
+		}
+		const uint8_t byte = *position++;
+		if (shift == 28 && byte > 0x0f) {
+			return false;
+		}
+		result |= uint32_t(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			value = result;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Append the encoding of the given genome to the given bytes.
+template<typename NodeStorage>
+void encode(const core::Tree<TreeGenomeValue, NodeStorage> &genome, std::vector<uint8_t> &bytes) {
+	const auto *nodes = genome.nodeData();
+	for (size_t i = 0, e = genome.getNodeCount(); i < e; ++i) {
+		writeVarint(bytes, nodes[i].value);
+	}
+}
+
+// Append the count and the encodings of the given genomes to the given bytes.
+template<typename NodeStorage>
+void encode(const core::Tree<TreeGenomeValue, NodeStorage> *genomes, size_t count, std::vector<uint8_t> &bytes) {
+	writeVarint(bytes, uint32_t(count));
+	for (size_t i = 0; i < count; ++i) {
+		encode(genomes[i], bytes);
+	}
+}
+
+template<typename NodeStorage>
+void encode(const std::vector<core::Tree<TreeGenomeValue, NodeStorage>> &genomes, std::vector<uint8_t> &bytes) {
+	encode(genomes.data(), genomes.size(), bytes);
+}
+
+// Append the count and the encodings of the individuals of the given population to the given bytes.
+inline void encode(Population &population, std::vector<uint8_t> &bytes) {
+	writeVarint(bytes, uint32_t(population.size()));
+	for (size_t i = 0; i < population.size(); ++i) {
+		encode(population[i], bytes);
+	}
+}
+
+/// Decodes the genomes of a grammar. The decoder keeps the nodes of the genome that's being decoded, so a genome
+/// is decoded without allocating but for its own storage once the buffers are large enough.
+template<typename NodeStorage = TreeGenome::NodeStorageType>
+class Decoder {
+	const grammar::Grammar &grammar;
+	std::vector<NodeStorage> nodes;
+	// The stack of the sub-trees whose parents weren't reached yet while the sub-tree sizes are computed.
+	std::vector<size_t> visitedCounts;
+public:
+	typedef core::Tree<TreeGenomeValue, NodeStorage> Genome;
+
+	explicit Decoder(const grammar::Grammar &grammar) : grammar(grammar) { }
+
+	// Decode a genome that starts at the given position into the given genome, which reuses its storage, and advance
+	// the position past it. Return false if the bytes end before the tree is complete, or if a raw value isn't
+	// valid for the grammar. The genome and the position are unspecified when false is returned.
+	bool decode(const uint8_t *&position, const uint8_t *end, Genome &genome) {
+		// The nodes are written through a pointer into a buffer that only grows, which is several times faster than
+		// a push_back for every node.
+		NodeStorage *output = nodes.data();
+		size_t count = 0;
+		const TreeGenomeValue nodeLimit = grammar.getNodeLimit();
+		// The number of nodes that are still missing from the tree, which only reaches 0 once the tree is complete.
+		size_t missingNodeCount = 1;
+		do {
+			uint32_t value;
+			if (!readVarint(position, end, value) || value >= nodeLimit || count == NodeStorage::maxSubTreeSize) {
+				return false;
+			}
+			if (count == nodes.size()) {
+				nodes.resize(std::max<size_t>(16, count * 2), NodeStorage(0));
+				output = nodes.data();
+			}
+			auto &node = output[count++];
+			node = NodeStorage(value);
+			// The packed node storage may not hold every raw value of the grammar.
+			if (TreeGenomeValue(node.value) != value) {
+				return false;
+			}
+			const unsigned argumentCount = grammar[grammar.definitionIdForTreeGenomeValue(value)].getNumArguments();
+			node.childCount = decltype(node.childCount)(argumentCount);
+			missingNodeCount += size_t(argumentCount) - 1;
+		} while (missingNodeCount != 0);
+		// The sub-trees are completed in reverse preorder, where the children of a node are the last sub-trees that
+		// were completed before it. The stack holds the number of nodes that were visited before every completed
+		// sub-tree, so a node spans the nodes that were visited since its first child, without branching on its arity.
+		if (visitedCounts.size() <= count) {
+			visitedCounts.resize(count + 1);
+		}
+		size_t *visitedBefore = visitedCounts.data();
+		visitedBefore[0] = 0;
+		size_t height = 0;
+		for (size_t i = count, visited = 0; i-- > 0; ++visited) {
+			auto &node = output[i];
+			const size_t childCount = size_t(node.childCount);
+			node.subTreeSize = decltype(node.subTreeSize)(visited - visitedBefore[height - childCount] + 1);
+			height = height - childCount + 1;
+			visitedBefore[height] = visited + 1;
+		}
+		genome.assignNodes(output, count);
+		return true;
+	}
+
+	// Replace the given genomes by the genomes that were encoded with their count, reusing the storage of the genomes.
+	// Return false if the bytes aren't exactly such a sequence of genomes.
+	bool decode(const uint8_t *data, size_t size, std::vector<Genome> &genomes) {
+		const uint8_t *position = data, *end = data + size;
+		uint32_t count;
+		// Every genome takes at least one byte, which bounds the count before the genomes are allocated.
+		if (!readVarint(position, end, count) || count > size_t(end - position)) {
+			return false;
+		}
+		genomes.resize(count);
+		for (auto &genome : genomes) {
+			if (!decode(position, end, genome)) {
+				return false;
+			}
+		}
+		return position == end;
+	}
+
+	bool decode(const std::vector<uint8_t> &bytes, std::vector<Genome> &genomes) {
+		return decode(bytes.data(), bytes.size(), genomes);
+	}
+};
+
+} // end namespace codec
+} // end namespace genetic
@@ -0,0 +1,491 @@
+#pragma once
+
+#include "genome.h"
+#include "grammar.h"
+#include "geneticProgramming.h"
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#ifdef GENETIC_ENABLE_OPENCL
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+#endif
+
+namespace genetic {
+
+/// The evaluation of whole generations of real valued genomes on a compute device.
+/// The genomes of a generation are flattened into one buffer of opcodes, which is executed for every fitness case
+/// of a dataset that stays on the device, and the device returns the fitness of every individual.
+namespace gpu {
+
+/// The operations that a device can execute.
+enum class Operation : uint32_t {
+	/// Pushes the value of a variable of the current fitness case.
+	Variable,
+	/// Pushes a constant.
+	Constant,
+	Add,
+	Subtract,
+	Multiply,
+	/// Protected division, which returns 1 when the divisor is 0.
+	Divide,
+	Negate,
+	Sin,
+	Cos,
+	/// Protected exponentiation, which is clamped to the largest float.
+	Exp,
+	/// Protected natural logarithm of the absolute value, which returns 0 for 0.
+	Log,
+	Min,
+	Max
+};
+
+// Return the number of arguments of the given operation.
+inline unsigned argumentCount(Operation operation) {
+	switch (operation) {
+		case Operation::Variable:
+		case Operation::Constant:
+			return 0;
+		case Operation::Negate:
+		case Operation::Sin:
+		case Operation::Cos:
+		case Operation::Exp:
+		case Operation::Log:
+			return 1;
+		default:
+			return 2;
+	}
+}
+
+/// The operation that's executed for a definition of the grammar.
+struct OperationDescriptor {
+	Operation operation;
+	/// The index of the variable, or the constant.
+	uint32_t variable = 0;
+	float constant = 0.0f;
+
+	OperationDescriptor(Operation operation) : operation(operation) { }
+
+	static OperationDescriptor makeVariable(uint32_t variable) {
+		OperationDescriptor result(Operation::Variable);
+		result.variable = variable;
+		return result;
+	}
+
+	static OperationDescriptor makeConstant(float constant) {
+		OperationDescriptor result(Operation::Constant);
+		result.constant = constant;
+		return result;
+	}
+};
+
+/// The fitness cases. The fitness of an individual is the negated sum of the absolute errors of its outputs.
+struct Dataset {
+	size_t caseCount = 0;
+	size_t variableCount = 0;
+	/// The values of the variable v for all of the cases are variables[v * caseCount] to variables[(v + 1) * caseCount].
+	std::vector<float> variables;
+	/// The expected output of every case.
+	std::vector<float> targets;
+};
+
+/// Maps the definitions of a grammar to the operations of the device. The opcode of a node is its definition id.
+struct OpcodeTable {
+	/// The operation of every opcode, and its argument, which is the variable index or the bits of the constant.
+	std::vector<uint32_t> operations;
+	std::vector<uint32_t> arguments;
+
+	template<typename F>
+	OpcodeTable(const grammar::Grammar &grammar, F operationForDefinition) {
+		for (const auto &definition : grammar.definitions()) {
+			OperationDescriptor descriptor = operationForDefinition(definition);
+			assert(argumentCount(descriptor.operation) == definition.getNumArguments() && "The operation doesn't match the definition");
+			uint32_t argument = descriptor.variable;
+			if (descriptor.operation == Operation::Constant) {
+				std::memcpy(&argument, &descriptor.constant, sizeof(argument));
+			}
+			operations.push_back(uint32_t(descriptor.operation));
+			arguments.push_back(argument);
+		}
+	}
+};
+
+/// The genomes of a generation, lowered into one flat buffer of opcodes.
+/// The opcodes of every individual are stored in reverse preorder like in TreeGenomeProgram, so the first argument
+/// of an operation is on the top of the stack, and the opcodes of the individual i are opcodes[offsets[i]] to opcodes[offsets[i + 1]].
+struct PopulationProgram {
+	std::vector<uint32_t> opcodes;
+	std::vector<uint32_t> offsets;
+	// The number of stack slots that are needed to execute any of the individuals.
+	unsigned maxStackDepth = 0;
+
+	// Lower the given genomes into this program, reusing its storage.
+	void compile(const grammar::Grammar &grammar, const std::vector<TreeGenome> &genomes) {
+		offsets.resize(genomes.size() + 1);
+		offsets[0] = 0;
+		size_t nodeCount = 0;
+		for (size_t i = 0; i < genomes.size(); ++i) {
+			nodeCount += genomes[i].getNodeCount();
+			offsets[i + 1] = uint32_t(nodeCount);
+		}
+		opcodes.resize(nodeCount);
+		maxStackDepth = 0;
+		for (size_t i = 0; i < genomes.size(); ++i) {
+			const auto &genome = genomes[i];
+			uint32_t *output = opcodes.data() + offsets[i];
+			unsigned depth = 0;
+			for (size_t j = 0, e = genome.getNodeCount(); j < e; ++j) {
+				const auto &definition = grammar[genome[e - 1 - j]];
+				output[j] = definition.getDefinitionId();
+				assert(depth >= definition.getNumArguments());
+				depth = depth - definition.getNumArguments() + 1;
+				maxStackDepth = std::max(maxStackDepth, depth);
+			}
+			assert(depth == 1);
+		}
+	}
+
+	size_t size() const {
+		return offsets.empty() ? 0 : offsets.size() - 1;
+	}
+};
+
+/// A compute device that evaluates the population programs.
+class Device {
+public:
+	virtual ~Device() { }
+
+	// Store the opcode table and the dataset on the device. Return false if the device couldn't store them.
+	virtual bool upload(const OpcodeTable &table, const Dataset &dataset) = 0;
+
+	// Compute the fitness of every individual of the given program. Return false if the device failed.
+	virtual bool evaluate(const PopulationProgram &program, std::vector<float> &fitnesses) = 0;
+};
+
+// Clamp a fitness that isn't finite to the lowest fitness.
+inline float finiteFitness(float error) {
+	return std::isfinite(error) ? -error : std::numeric_limits<float>::lowest();
+}
+
+/// Executes the population programs on the host with the same semantics as the device kernels.
+/// It's the fallback when there's no device, and the reference that the devices are tested against.
+class ReferenceDevice : public Device {
+	std::vector<uint32_t> operations, arguments;
+	const Dataset *dataset = nullptr;
+	std::vector<float> stack;
+
+	static float apply(Operation operation, float x, float y) {
+		switch (operation) {
+			case Operation::Add: return x + y;
+			case Operation::Subtract: return x - y;
+			case Operation::Multiply: return x * y;
+			case Operation::Divide: return y == 0.0f ? 1.0f : x / y;
+			case Operation::Negate: return -x;
+			case Operation::Sin: return std::sin(x);
+			case Operation::Cos: return std::cos(x);
+			case Operation::Exp: return std::min(std::exp(x), std::numeric_limits<float>::max());
+			case Operation::Log: return x == 0.0f ? 0.0f : std::log(std::fabs(x));
+			case Operation::Min: return std::min(x, y);
+			case Operation::Max: return std::max(x, y);
+			default:
+				assert(false && "Not a function");
+				return 0.0f;
+		}
+	}
+public:
+	bool upload(const OpcodeTable &table, const Dataset &dataset) override {
+		operations = table.operations;
+		arguments = table.arguments;
+		this->dataset = &dataset;
+		return true;
+	}
+
+	bool evaluate(const PopulationProgram &program, std::vector<float> &fitnesses) override {
+		assert(dataset && "The dataset wasn't uploaded");
+		const size_t caseCount = dataset->caseCount;
+		stack.resize(program.maxStackDepth);
+		for (size_t individual = 0; individual < program.size(); ++individual) {
+			float error = 0;
+			for (size_t c = 0; c < caseCount; ++c) {
+				// Points one past the top of the stack.
+				float *top = stack.data();
+				for (uint32_t i = program.offsets[individual]; i < program.offsets[individual + 1]; ++i) {
+					auto opcode = program.opcodes[i];
+					auto argument = arguments[opcode];
+					auto operation = Operation(operations[opcode]);
+					switch (argumentCount(operation)) {
+						case 0:
+							if (operation == Operation::Variable) {
+								*top = dataset->variables[argument * caseCount + c];
+							} else {
+								std::memcpy(top, &argument, sizeof(float));
+							}
+							++top;
+							break;
+						case 1:
+							top[-1] = apply(operation, top[-1], 0.0f);
+							break;
+						default:
+							top[-2] = apply(operation, top[-1], top[-2]);
+							--top;
+							break;
+					}
+				}
+				assert(top == stack.data() + 1);
+				error += std::fabs(stack[0] - dataset->targets[c]);
+			}
+			fitnesses[individual] = finiteFitness(error);
+		}
+		return true;
+	}
+};
+
+#ifdef GENETIC_ENABLE_OPENCL
+
+/// Evaluates the population programs with OpenCL. A work group evaluates one individual, its work items evaluate
+/// a strided subset of the cases, and the errors are reduced in local memory, so a generation is evaluated by one
+/// kernel launch. The dataset and the opcode table stay on the device, only the opcodes are uploaded per generation.
+class OpenCLDevice : public Device {
+	static constexpr size_t workGroupSize = 64;
+	// The kernel's stack size. Programs that need a deeper stack aren't evaluated by the device.
+	static constexpr unsigned maxStackDepth = 64;
+
+	cl_context context = nullptr;
+	cl_device_id device = nullptr;
+	cl_command_queue queue = nullptr;
+	cl_program program = nullptr;
+	cl_kernel kernel = nullptr;
+	cl_mem operations = nullptr, arguments = nullptr, variables = nullptr, targets = nullptr;
+	cl_mem opcodes = nullptr, offsets = nullptr, fitnessBuffer = nullptr;
+	size_t opcodeCapacity = 0, individualCapacity = 0;
+	cl_uint caseCount = 0;
+
+	static const char *kernelSource() {
+		return
+		"#define STACK_SIZE 64\n"
+		"__kernel void evaluate(__global const uint *opcodes, __global const uint *offsets,\n"
+		"                       __global const uint *operations, __global const uint *arguments,\n"
+		"                       __global const float *variables, __global const float *targets, uint caseCount,\n"
+		"                       __global float *fitnesses, __local float *partial) {\n"
+		"	uint individual = get_group_id(0), lane = get_local_id(0), laneCount = get_local_size(0);\n"
+		"	uint begin = offsets[individual], end = offsets[individual + 1];\n"
+		"	float stack[STACK_SIZE];\n"
+		"	float error = 0.0f;\n"
+		"	for (uint c = lane; c < caseCount; c += laneCount) {\n"
+		"		int top = 0;\n"
+		"		for (uint i = begin; i < end; ++i) {\n"
+		"			uint opcode = opcodes[i], argument = arguments[opcode];\n"
+		"			float x = top > 0 ? stack[top - 1] : 0.0f, y = top > 1 ? stack[top - 2] : 0.0f;\n"
+		"			switch (operations[opcode]) {\n"
+		"				case 0: stack[top++] = variables[argument * caseCount + c]; break;\n"
+		"				case 1: stack[top++] = as_float(argument); break;\n"
+		"				case 2: stack[--top - 1] = x + y; break;\n"
+		"				case 3: stack[--top - 1] = x - y; break;\n"
+		"				case 4: stack[--top - 1] = x * y; break;\n"
+		"				case 5: stack[--top - 1] = y == 0.0f ? 1.0f : x / y; break;\n"
+		"				case 6: stack[top - 1] = -x; break;\n"
+		"				case 7: stack[top - 1] = sin(x); break;\n"
+		"				case 8: stack[top - 1] = cos(x); break;\n"
+		"				case 9: stack[top - 1] = fmin(exp(x), MAXFLOAT); break;\n"
+		"				case 10: stack[top - 1] = x == 0.0f ? 0.0f : log(fabs(x)); break;\n"
+		"				case 11: stack[--top - 1] = fmin(x, y); break;\n"
+		"				case 12: stack[--top - 1] = fmax(x, y); break;\n"
+		"			}\n"
+		"		}\n"
+		"		error += fabs(stack[0] - targets[c]);\n"
+		"	}\n"
+		"	partial[lane] = error;\n"
+		"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+		"	for (uint stride = laneCount / 2; stride > 0; stride /= 2) {\n"
+		"		if (lane < stride)\n"
+		"			partial[lane] += partial[lane + stride];\n"
+		"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+		"	}\n"
+		"	if (lane == 0)\n"
+		"		fitnesses[individual] = isfinite(partial[0]) ? -partial[0] : -MAXFLOAT;\n"
+		"}\n";
+	}
+
+	static void release(cl_mem &buffer) {
+		if (buffer) {
+			clReleaseMemObject(buffer);
+			buffer = nullptr;
+		}
+	}
+
+	cl_mem createBuffer(cl_mem_flags flags, size_t size, const void *data) {
+		cl_int status;
+		cl_mem buffer = clCreateBuffer(context, flags | (data ? CL_MEM_COPY_HOST_PTR : 0), std::max<size_t>(size, 1), const_cast<void *>(data), &status);
+		return status == CL_SUCCESS ? buffer : nullptr;
+	}
+public:
+	OpenCLDevice() = default;
+	OpenCLDevice(const OpenCLDevice &) = delete;
+	OpenCLDevice &operator = (const OpenCLDevice &) = delete;
+
+	~OpenCLDevice() {
+		release(operations);
+		release(arguments);
+		release(variables);
+		release(targets);
+		release(opcodes);
+		release(offsets);
+		release(fitnessBuffer);
+		if (kernel) clReleaseKernel(kernel);
+		if (program) clReleaseProgram(program);
+		if (queue) clReleaseCommandQueue(queue);
+		if (context) clReleaseContext(context);
+	}
+
+	// Set up the first GPU, or the first device of any kind if there's no GPU. Return false if there's no usable device.
+	bool initialize() {
+		cl_platform_id platform;
+		cl_uint platformCount = 0;
+		if (clGetPlatformIDs(1, &platform, &platformCount) != CL_SUCCESS || platformCount == 0) {
+			return false;
+		}
+		if (clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, nullptr) != CL_SUCCESS &&
+		    clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &device, nullptr) != CL_SUCCESS) {
+			return false;
+		}
+		cl_int status;
+		context = clCreateContext(nullptr, 1, &device, nullptr, nullptr, &status);
+		if (status != CL_SUCCESS) {
+			return false;
+		}
+		queue = clCreateCommandQueue(context, device, 0, &status);
+		if (status != CL_SUCCESS) {
+			return false;
+		}
+		const char *source = kernelSource();
+		program = clCreateProgramWithSource(context, 1, &source, nullptr, &status);
+		if (status != CL_SUCCESS || clBuildProgram(program, 1, &device, "", nullptr, nullptr) != CL_SUCCESS) {
+			return false;
+		}
+		kernel = clCreateKernel(program, "evaluate", &status);
+		return status == CL_SUCCESS;
+	}
+
+	bool upload(const OpcodeTable &table, const Dataset &dataset) override {
+		release(operations);
+		release(arguments);
+		release(variables);
+		release(targets);
+		operations = createBuffer(CL_MEM_READ_ONLY, table.operations.size() * sizeof(uint32_t), table.operations.data());
+		arguments = createBuffer(CL_MEM_READ_ONLY, table.arguments.size() * sizeof(uint32_t), table.arguments.data());
+		variables = createBuffer(CL_MEM_READ_ONLY, dataset.variables.size() * sizeof(float), dataset.variables.empty() ? nullptr : dataset.variables.data());
+		targets = createBuffer(CL_MEM_READ_ONLY, dataset.targets.size() * sizeof(float), dataset.targets.data());
+		caseCount = cl_uint(dataset.caseCount);
+		return operations && arguments && variables && targets;
+	}
+
+	bool evaluate(const PopulationProgram &populationProgram, std::vector<float> &fitnesses) override {
+		if (!kernel || populationProgram.maxStackDepth > maxStackDepth) {
+			return false;
+		}
+		const size_t individualCount = populationProgram.size();
+		if (individualCount == 0) {
+			return true;
+		}
+		if (populationProgram.opcodes.size() > opcodeCapacity) {
+			release(opcodes);
+			opcodeCapacity = populationProgram.opcodes.size() * 2;
+			opcodes = createBuffer(CL_MEM_READ_ONLY, opcodeCapacity * sizeof(uint32_t), nullptr);
+		}
+		if (individualCount > individualCapacity) {
+			release(offsets);
+			release(fitnessBuffer);
+			individualCapacity = individualCount;
+			offsets = createBuffer(CL_MEM_READ_ONLY, (individualCapacity + 1) * sizeof(uint32_t), nullptr);
+			fitnessBuffer = createBuffer(CL_MEM_WRITE_ONLY, individualCapacity * sizeof(float), nullptr);
+		}
+		if (!opcodes || !offsets || !fitnessBuffer) {
+			opcodeCapacity = individualCapacity = 0;
+			return false;
+		}
+		bool isSuccessful =
+			clEnqueueWriteBuffer(queue, opcodes, CL_FALSE, 0, populationProgram.opcodes.size() * sizeof(uint32_t), populationProgram.opcodes.data(), 0, nullptr, nullptr) == CL_SUCCESS &&
+			clEnqueueWriteBuffer(queue, offsets, CL_FALSE, 0, populationProgram.offsets.size() * sizeof(uint32_t), populationProgram.offsets.data(), 0, nullptr, nullptr) == CL_SUCCESS;
+		cl_mem kernelBuffers[] = { opcodes, offsets, operations, arguments, variables, targets };
+		for (cl_uint i = 0; i < 6 && isSuccessful; ++i) {
+			isSuccessful = clSetKernelArg(kernel, i, sizeof(cl_mem), &kernelBuffers[i]) == CL_SUCCESS;
+		}
+		isSuccessful = isSuccessful &&
+			clSetKernelArg(kernel, 6, sizeof(cl_uint), &caseCount) == CL_SUCCESS &&
+			clSetKernelArg(kernel, 7, sizeof(cl_mem), &fitnessBuffer) == CL_SUCCESS &&
+			clSetKernelArg(kernel, 8, workGroupSize * sizeof(float), nullptr) == CL_SUCCESS;
+		size_t globalSize = individualCount * workGroupSize, localSize = workGroupSize;
+		isSuccessful = isSuccessful &&
+			clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &globalSize, &localSize, 0, nullptr, nullptr) == CL_SUCCESS &&
+			clEnqueueReadBuffer(queue, fitnessBuffer, CL_TRUE, 0, individualCount * sizeof(float), fitnesses.data(), 0, nullptr, nullptr) == CL_SUCCESS;
+		return isSuccessful;
+	}
+};
+
+#endif // GENETIC_ENABLE_OPENCL
+
+// Return the OpenCL device when it's enabled and available, or the reference device otherwise.
+inline std::unique_ptr<Device> makeDefaultDevice() {
+#ifdef GENETIC_ENABLE_OPENCL
+	std::unique_ptr<OpenCLDevice> device(new OpenCLDevice());
+	if (device->initialize()) {
+		return std::move(device);
+	}
+#endif
+	return std::unique_ptr<Device>(new ReferenceDevice());
+}
+
+} // end namespace gpu
+
+/// A population delegate that computes the fitness of the whole generation on a compute device.
+/// The derived delegate maps the definitions of its grammar to the operations of the device, and provides the dataset.
+/// When the device fails to evaluate a generation, the generation is evaluated by the reference device on the host.
+class GPUEvolvingPopulationDelegate : public EvolvingPopulationDelegate {
+	std::unique_ptr<gpu::Device> device;
+	std::unique_ptr<gpu::ReferenceDevice> fallbackDevice;
+	std::unique_ptr<gpu::OpcodeTable> opcodeTable;
+	gpu::PopulationProgram program;
+	bool isUploaded = false;
+public:
+	// Use the given device, or the default device when it's null.
+	explicit GPUEvolvingPopulationDelegate(std::unique_ptr<gpu::Device> device = nullptr) : device(device ? std::move(device) : gpu::makeDefaultDevice()) {
+	}
+
+	// Return the operation that implements the given definition, which must take the same number of arguments.
+	virtual gpu::OperationDescriptor operationForDefinition(const grammar::Definition &definition) = 0;
+
+	// The dataset, which must stay alive and unchanged while the delegate is used.
+	virtual const gpu::Dataset &dataset() = 0;
+
+	void computeFitness(const std::vector<TreeGenome> &individuals, std::vector<float> &fitnesses) override {
+		if (!isUploaded) {
+			opcodeTable.reset(new gpu::OpcodeTable(genomeGrammar(), [this] (const grammar::Definition &definition) {
+				return operationForDefinition(definition);
+			}));
+			isUploaded = device->upload(*opcodeTable, dataset());
+			if (!isUploaded) {
+				device.reset(new gpu::ReferenceDevice());
+				isUploaded = device->upload(*opcodeTable, dataset());
+			}
+		}
+		program.compile(genomeGrammar(), individuals);
+		if (device->evaluate(program, fitnesses)) {
+			return;
+		}
+		if (!fallbackDevice) {
+			fallbackDevice.reset(new gpu::ReferenceDevice());
+			fallbackDevice->upload(*opcodeTable, dataset());
+		}
+		fallbackDevice->evaluate(program, fitnesses);
+	}
+};
+
+} // end namespace genetic
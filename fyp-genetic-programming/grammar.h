@@ -6,6 +6,9 @@
 #include <vector>
 #include <initializer_list>
 #include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
 
 namespace genetic {
 namespace grammar {
@@ -198,7 +201,15 @@ private:
 	unsigned terminalCount, terminalAndFunctionCount;
 	TreeGenomeValue terminalLimit, functionLimit, nodeLimit;
 	TreeGenomeValue validNodeLimit;
+	
+	// Maps the raw node values to the definition ids. It's only built when the node limit is small enough
+	// for the table to stay in the cache.
+	std::vector<uint16_t> definitionIdTable;
+	// The first raw value of every definition, sorted in ascending order.
+	std::vector<TreeGenomeValue> definitionRawValues;
 public:
+	/// The largest node limit for which the grammar uses a direct raw value lookup table.
+	static constexpr TreeGenomeValue directLookupTableLimit = 1 << 14;
 
 	Grammar(std::initializer_list<Type> types, std::initializer_list<Definition> nodes) : nodes(), globalDefinitionSet(0,0,0,0), typeMappings() {
 		// Set up the types.
@@ -278,6 +289,18 @@ public:
 			val += x.weight;
 		}
 		
+		// Build the raw value lookup structures.
+		for (auto &x : this->nodes) {
+			definitionRawValues.push_back(x.rawValue);
+		}
+		if (nodeLimit <= directLookupTableLimit && this->nodes.size() <= std::numeric_limits<uint16_t>::max()) {
+			definitionIdTable.reserve(nodeLimit);
+			for (auto &x : this->nodes) {
+				definitionIdTable.insert(definitionIdTable.end(), x.weight, uint16_t(x.nodeId));
+			}
+			assert(definitionIdTable.size() == nodeLimit);
+		}
+		
 		// Create the type partions
 		typePartions.resize(types.size());
 		std::vector<std::pair<bool, bool>> typePartionsInitialized(types.size(), std::make_pair(false, false));
@@ -379,6 +402,40 @@ public:
 		return nodeLimit;
 	}
 
+	// Return a hash of the types and the definitions of this grammar, which identifies the meaning of the raw
+	// node values. Grammars with the same fingerprint interpret the genomes in the same way.
+	uint64_t fingerprint() const {
+		// FNV-1a.
+		uint64_t hash = 0xcbf29ce484222325ull;
+		auto combine = [&] (uint64_t value) {
+			for (unsigned i = 0; i < 8; ++i) {
+				hash ^= (value >> (i * 8)) & 0xff;
+				hash *= 0x100000001b3ull;
+			}
+		};
+		auto combineString = [&] (const char *string) {
+			for (; *string; ++string) {
+				hash ^= uint64_t((unsigned char)*string);
+				hash *= 0x100000001b3ull;
+			}
+			combine(0);
+		};
+		for (const auto &type : types) {
+			combineString(type.getName());
+		}
+		for (const auto &node : nodes) {
+			combineString(node.getName());
+			combine(uint64_t(node.kind));
+			combine(node.typeId);
+			combine(node.weight);
+			combine(node.numArguments);
+			for (auto typeId : node.argumentTypeIds) {
+				combine(typeId);
+			}
+		}
+		return hash;
+	}
+
 	const Definition &operator [](const TreeGenome::Node &node) const {
 		return nodes[definitionIdForTreeGenomeValue(node.value)];
 	}
@@ -399,24 +456,14 @@ public:
 	}
 
 	unsigned definitionIdForTreeGenomeValue(TreeGenomeValue rawValue) const {
-		assert(rawValue < validNodeLimit);
-		if (rawValue < terminalLimit) {
-			// Must be a terminal.
-			for (unsigned i = 0; i < terminalCount; ++i) {
-				if (rawValue >= nodes[i].rawValue && rawValue < (nodes[i].rawValue + nodes[i].weight)) {
-					return i;
-				}
-			}
-		} else if (rawValue < nodeLimit) {
-			// Must be a function.
-			for (unsigned i = terminalCount; i < terminalAndFunctionCount; ++i) {
-				if (rawValue >= nodes[i].rawValue && rawValue < (nodes[i].rawValue + nodes[i].weight)) {
-					return i;
-				}
-			}
+		assert(rawValue < validNodeLimit && "Invalid node value");
+		if (!definitionIdTable.empty()) {
+			return definitionIdTable[rawValue];
 		}
-		assert(false && "Invalid node value");
-		return 0;
+		// The definition is the last one whose raw value range starts before the given value.
+		auto it = std::upper_bound(definitionRawValues.begin(), definitionRawValues.end(), rawValue);
+		assert(it != definitionRawValues.begin());
+		return unsigned(it - definitionRawValues.begin()) - 1;
 	}
 };
 	
@@ -0,0 +1,318 @@
+#pragma once
+
+#include "genome.h"
+#include "grammar.h"
+#include "treeBatchEvaluator.h"
+#include "geneticProgramming.h"
+#include "profiler.h"
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <cstdint>
+
+namespace genetic {
+
+/// Evaluates a GP tree for a batch of fitness cases and keeps the output of every node, so that once a sub-tree
+/// is replaced only the new sub-tree and its ancestors are evaluated again, reusing the outputs of the other nodes.
+/// This takes O(depth * cases) instead of O(nodes * cases) per mutation, at the cost of storing one column
+/// of values per node.
+///
+/// The derived evaluator implements the same evaluate methods as TreeGenomeProgramBatchEvaluator, which are
+/// always called for all of the cases at once. The genome must only be modified through the replace and
+/// swapSubTrees methods of this evaluator, or be followed by didReplaceSubTree or didSwapSubTrees, or reset must
+/// be called after the genome was modified.
+template<typename T, typename Derived>
+struct IncrementalTreeGenomeEvaluator {
+private:
+	const grammar::Grammar &grammar;
+	size_t caseCount;
+	// The pool of node output columns, caseCount values per column.
+	std::vector<T> columns;
+	std::vector<unsigned> freeColumns;
+	// The column and the dirty flag of every node in preorder.
+	std::vector<unsigned> nodeColumns;
+	std::vector<char> isDirty;
+	std::vector<const T *> arguments;
+	// The columns of a sub-tree that moves to another genome.
+	std::vector<T> movedValues;
+	std::vector<char> movedIsDirty;
+	size_t evaluatedNodeCount = 0;
+
+	unsigned allocateColumn() {
+		if (freeColumns.empty()) {
+			unsigned column = unsigned(columns.size() / std::max<size_t>(caseCount, 1));
+			columns.resize(columns.size() + caseCount);
+			return column;
+		}
+		unsigned column = freeColumns.back();
+		freeColumns.pop_back();
+		return column;
+	}
+
+	T *column(unsigned id) {
+		return columns.data() + size_t(id) * caseCount;
+	}
+
+	void evaluateNode(const TreeGenome &tree, size_t nodeId) {
+		if (!isDirty[nodeId]) {
+			return;
+		}
+		auto node = tree[nodeId];
+		const auto &definition = grammar[node];
+		assert(node.size() == definition.getNumArguments());
+		size_t firstArgument = arguments.size();
+		for (auto child : node) {
+			evaluateNode(tree, child.nodeId);
+			arguments.push_back(column(nodeColumns[child.nodeId]));
+		}
+		auto &self = static_cast<Derived &>(*this);
+		T *result = column(nodeColumns[nodeId]);
+		auto dID = definition.getDefinitionId();
+		switch (definition.getNumArguments()) {
+			case 0:
+				self.evaluateTerminal(dID, node.value, 0, caseCount, result);
+				break;
+			case 1:
+				self.evaluateUnaryFunction(dID, arguments[firstArgument], result, caseCount);
+				break;
+			case 2:
+				self.evaluateBinaryFunction(dID, arguments[firstArgument], arguments[firstArgument + 1], result, caseCount);
+				break;
+			default:
+				self.evaluateFunction(dID, arguments.data() + firstArgument, definition.getNumArguments(), result, caseCount);
+				break;
+		}
+		arguments.resize(firstArgument);
+		isDirty[nodeId] = false;
+		++evaluatedNodeCount;
+	}
+
+	// Replace the columns of the sub-tree with the given node id, which had the given size, by the columns
+	// for the sub-tree that's now stored in the genome. The values of the new columns are copied from the
+	// given source, or the new columns are marked as dirty if there's no source. The ancestors are marked as dirty.
+	void spliceColumns(const TreeGenome &tree, size_t nodeId, size_t oldSubTreeSize, const T *sourceValues, const char *sourceIsDirty) {
+		size_t newSubTreeSize = tree[nodeId].subTreeSize();
+		for (size_t i = nodeId; i < nodeId + oldSubTreeSize; ++i) {
+			freeColumns.push_back(nodeColumns[i]);
+		}
+		nodeColumns.erase(nodeColumns.begin() + nodeId, nodeColumns.begin() + nodeId + oldSubTreeSize);
+		isDirty.erase(isDirty.begin() + nodeId, isDirty.begin() + nodeId + oldSubTreeSize);
+		nodeColumns.insert(nodeColumns.begin() + nodeId, newSubTreeSize, 0);
+		isDirty.insert(isDirty.begin() + nodeId, newSubTreeSize, true);
+		for (size_t i = 0; i < newSubTreeSize; ++i) {
+			nodeColumns[nodeId + i] = allocateColumn();
+		}
+		if (sourceValues) {
+			for (size_t i = 0; i < newSubTreeSize; ++i) {
+				std::copy(sourceValues + i * caseCount, sourceValues + (i + 1) * caseCount, column(nodeColumns[nodeId + i]));
+				isDirty[nodeId + i] = sourceIsDirty[i];
+			}
+		}
+		tree.forEachAncestor(nodeId, [&] (size_t i) {
+			isDirty[i] = true;
+		});
+	}
+
+	// Copy the columns of the sub-tree with the given node id into the moved sub-tree storage.
+	void saveSubTree(size_t nodeId, size_t subTreeSize) {
+		movedValues.resize(subTreeSize * caseCount);
+		movedIsDirty.assign(isDirty.begin() + nodeId, isDirty.begin() + nodeId + subTreeSize);
+		for (size_t i = 0; i < subTreeSize; ++i) {
+			const T *values = column(nodeColumns[nodeId + i]);
+			std::copy(values, values + caseCount, movedValues.begin() + i * caseCount);
+		}
+	}
+public:
+	IncrementalTreeGenomeEvaluator(const grammar::Grammar &grammar, size_t caseCount) : grammar(grammar), caseCount(caseCount) {
+		assert(caseCount != 0);
+	}
+
+	size_t getCaseCount() const {
+		return caseCount;
+	}
+
+	// The number of nodes that were computed by the last evaluation.
+	size_t getEvaluatedNodeCount() const {
+		return evaluatedNodeCount;
+	}
+
+	// Forget the cached outputs and start tracking the given genome.
+	void reset(const TreeGenome &tree) {
+		freeColumns.clear();
+		nodeColumns.resize(tree.getNodeCount());
+		isDirty.assign(tree.getNodeCount(), true);
+		columns.resize(tree.getNodeCount() * caseCount);
+		for (size_t i = 0; i < nodeColumns.size(); ++i) {
+			nodeColumns[i] = unsigned(i);
+		}
+	}
+
+	// Evaluate the dirty nodes of the given genome and return the outputs of the root, one value per case.
+	// The returned column is valid until the genome is modified.
+	const T *operator()(const TreeGenome &tree) {
+		GENETIC_PROFILE_SCOPE("IncrementalTreeGenomeEvaluator::evaluate");
+		assert(nodeColumns.size() == tree.getNodeCount() && "The genome was modified without the evaluator");
+		evaluatedNodeCount = 0;
+		evaluateNode(tree, 0);
+		return column(nodeColumns[0]);
+	}
+
+	// Take over the cached outputs of the other evaluator, which tracks a copy of the genome.
+	void assign(const IncrementalTreeGenomeEvaluator &other) {
+		assert(other.caseCount == caseCount);
+		columns = other.columns;
+		freeColumns = other.freeColumns;
+		nodeColumns = other.nodeColumns;
+		isDirty = other.isDirty;
+	}
+
+	// Replace the sub-tree with the given node id in the given genome by the given sub-tree.
+	void replace(TreeGenome &tree, size_t nodeId, const TreeGenome &subTree) {
+		size_t oldSubTreeSize = tree[nodeId].subTreeSize();
+		tree.replace(nodeId, subTree);
+		didReplaceSubTree(tree, nodeId, oldSubTreeSize);
+	}
+
+	// Track the replacement of the sub-tree with the given node id and the given size in the given genome,
+	// which was already modified.
+	void didReplaceSubTree(const TreeGenome &tree, size_t nodeId, size_t replacedSize) {
+		spliceColumns(tree, nodeId, replacedSize, nullptr, nullptr);
+	}
+
+	// Exchange the sub-tree with the given node id in the given genome with the sub-tree in the other genome, which
+	// is tracked by the other evaluator. The cached outputs of the exchanged sub-trees move with them.
+	void swapSubTrees(TreeGenome &tree, size_t nodeId, TreeGenome &other, size_t otherNodeId, IncrementalTreeGenomeEvaluator &otherEvaluator, TreeGenome::SwapBuffer &buffer) {
+		tree.swapSubTrees(nodeId, other, otherNodeId, buffer);
+		didSwapSubTrees(tree, nodeId, other, otherNodeId, otherEvaluator);
+	}
+
+	// Track the exchange of the sub-trees with the given node ids, which was already done in the genomes.
+	void didSwapSubTrees(const TreeGenome &tree, size_t nodeId, const TreeGenome &other, size_t otherNodeId, IncrementalTreeGenomeEvaluator &otherEvaluator) {
+		assert(&otherEvaluator != this && otherEvaluator.caseCount == caseCount);
+		// Each genome now holds the sub-tree of the other one.
+		size_t size = other[otherNodeId].subTreeSize(), otherSize = tree[nodeId].subTreeSize();
+		saveSubTree(nodeId, size);
+		otherEvaluator.saveSubTree(otherNodeId, otherSize);
+		spliceColumns(tree, nodeId, size, otherEvaluator.movedValues.data(), otherEvaluator.movedIsDirty.data());
+		otherEvaluator.spliceColumns(other, otherNodeId, otherSize, movedValues.data(), movedIsDirty.data());
+	}
+
+	void evaluateUnaryFunction(unsigned definitionId, const T *x, T *result, size_t count) {
+		batch::copy(x, result, count);
+	}
+	void evaluateBinaryFunction(unsigned definitionId, const T *x, const T *y, T *result, size_t count) {
+		batch::fill(T(), result, count);
+	}
+	void evaluateFunction(unsigned definitionId, const T *const *arguments, unsigned argumentCount, T *result, size_t count) {
+		batch::fill(T(), result, count);
+	}
+};
+
+/// A population delegate that keeps an incremental evaluator for every individual, so the serial variation of the
+/// population only evaluates the sub-trees that it replaced and their ancestors. The evaluators are copied along
+/// with the selected individuals, and follow the mutations and the crossovers that the population reports.
+/// An individual whose evaluator doesn't track its genome, like after the parallel variation, a restore or when
+/// the fitness cache evaluates a subset of the generation, is evaluated in full. The delegate evaluates the
+/// individuals on the calling thread, and stores one column per node of every individual.
+template<typename T, typename Evaluator>
+class IncrementalEvolvingPopulationDelegate : public EvolvingPopulationDelegate {
+	// The evaluator of an individual, and the structural hash of the genome that it tracks.
+	struct Slot {
+		std::unique_ptr<Evaluator> evaluator;
+		uint64_t hash = 0;
+		bool isTracked = false;
+	};
+	// The slots of the current generation, and the slots of the next generation that the variation produces.
+	std::vector<Slot> slots, nextSlots;
+	size_t evaluatedNodeCount = 0;
+
+	Evaluator &evaluatorOf(Slot &slot) {
+		if (!slot.evaluator) {
+			slot.evaluator = makeEvaluator();
+		}
+		return *slot.evaluator;
+	}
+
+	Slot &nextSlot(size_t slot) {
+		if (nextSlots.size() <= slot) {
+			nextSlots.resize(slot + 1);
+		}
+		return nextSlots[slot];
+	}
+public:
+	// Return a new evaluator for the fitness cases.
+	virtual std::unique_ptr<Evaluator> makeEvaluator() = 0;
+
+	// Return the fitness of the given individual from the outputs of its root, one value per fitness case.
+	virtual float fitnessForOutputs(const TreeGenome &individual, const T *outputs) = 0;
+
+	// The number of nodes that were computed by the last call of computeFitness.
+	size_t getEvaluatedNodeCount() const {
+		return evaluatedNodeCount;
+	}
+
+	void computeFitness(const std::vector<TreeGenome> &individuals, std::vector<float> &fitnesses) override {
+		assert(fitnesses.size() >= individuals.size());
+		evaluatedNodeCount = 0;
+		if (slots.size() < individuals.size()) {
+			slots.resize(individuals.size());
+		}
+		for (size_t i = 0; i < individuals.size(); ++i) {
+			auto &slot = slots[i];
+			auto &evaluator = evaluatorOf(slot);
+			const uint64_t hash = individuals[i].structuralHash();
+			if (!slot.isTracked || slot.hash != hash) {
+				evaluator.reset(individuals[i]);
+			}
+			const T *outputs = evaluator(individuals[i]);
+			evaluatedNodeCount += evaluator.getEvaluatedNodeCount();
+			fitnesses[i] = fitnessForOutputs(individuals[i], outputs);
+			slot.hash = hash;
+			slot.isTracked = true;
+		}
+	}
+
+	void didSelectIndividual(size_t slot, size_t source, const TreeGenome &genome) override {
+		auto &next = nextSlot(slot);
+		next.isTracked = source < slots.size() && slots[source].isTracked && slots[source].hash == genome.structuralHash();
+		if (next.isTracked) {
+			evaluatorOf(next).assign(*slots[source].evaluator);
+			next.hash = slots[source].hash;
+		}
+	}
+
+	void didReplaceSubTree(size_t slot, const TreeGenome &genome, size_t nodeId, size_t replacedSize) override {
+		auto &next = nextSlot(slot);
+		if (next.isTracked) {
+			next.evaluator->didReplaceSubTree(genome, nodeId, replacedSize);
+			next.hash = genome.structuralHash();
+		}
+	}
+
+	void didSwapSubTrees(size_t slot, const TreeGenome &genome, size_t nodeId, size_t otherSlot, const TreeGenome &other, size_t otherNodeId) override {
+		nextSlot(std::max(slot, otherSlot));
+		auto &next = nextSlots[slot], &otherNext = nextSlots[otherSlot];
+		if (next.isTracked && otherNext.isTracked) {
+			next.evaluator->didSwapSubTrees(genome, nodeId, other, otherNodeId, *otherNext.evaluator);
+		} else if (next.isTracked) {
+			next.evaluator->didReplaceSubTree(genome, nodeId, other[otherNodeId].subTreeSize());
+		} else if (otherNext.isTracked) {
+			otherNext.evaluator->didReplaceSubTree(other, otherNodeId, genome[nodeId].subTreeSize());
+		}
+		if (next.isTracked) {
+			next.hash = genome.structuralHash();
+		}
+		if (otherNext.isTracked) {
+			otherNext.hash = other.structuralHash();
+		}
+	}
+
+	void didAdvanceGeneration() override {
+		std::swap(slots, nextSlots);
+		for (auto &slot : nextSlots) {
+			slot.isTracked = false;
+		}
+	}
+};
+
+} // end namespace genetic
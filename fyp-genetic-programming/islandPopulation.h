@@ -0,0 +1,210 @@
+#pragma once
+
+#include "geneticProgramming.h"
+#include "rampedHalfAndHalfInitializer.h"
+#include "concurrentQueue.h"
+#include "threadPool.h"
+#include <vector>
+#include <memory>
+#include <random>
+#include <functional>
+#include <algorithm>
+
+namespace genetic {
+
+/// The islands that receive the migrants of an island.
+enum class MigrationTopology {
+	/// Every island sends its migrants to the next island.
+	Ring,
+	/// The islands are connected into a ring with a random order that changes with every migration.
+	Random
+};
+
+/// The parameters of an island model.
+struct IslandModelParameters {
+	size_t islandCount = 4;
+	size_t islandSize = 100;
+	/// The seed that the random number generators of the islands are derived from.
+	unsigned masterSeed = 0;
+	/// The number of generations between two migrations.
+	size_t migrationInterval = 10;
+	/// The number of the fittest individuals that are sent to the next island by a migration.
+	size_t migrantCount = 2;
+	MigrationTopology topology = MigrationTopology::Ring;
+	/// The number of threads that evolve the islands. 0 uses one thread per island, up to the number of hardware threads.
+	unsigned threadCount = 0;
+	float mutationRate = 0.0f;
+	float crossoverRate = 0.0f;
+};
+
+/// Evolves several populations, the islands, independently on separate threads and periodically migrates
+/// the fittest individuals of each island to another island, replacing the least fit individuals there.
+/// Every island has its own delegate and random number generator, which is seeded from the master seed and the
+/// index of the island. The islands only interact at the migrations, so the results only depend on the master seed.
+class IslandPopulation {
+public:
+	// Create the delegate of the island with the given index, which uses the given parameters.
+	typedef std::function<std::unique_ptr<EvolvingPopulationDelegate> (size_t islandIndex, EvolutionParameters &params)> DelegateFactory;
+private:
+	struct Migrant {
+		TreeGenome genome;
+		float fitness;
+	};
+	struct Island {
+		EvolutionParameters params;
+		std::unique_ptr<EvolvingPopulationDelegate> delegate;
+		std::unique_ptr<Population> population;
+		// The migrants that leave this island. The island is the only producer and the island
+		// that receives the migrants is the only consumer.
+		core::SingleProducerSingleConsumerQueue<Migrant> emigrants;
+		// Reusable storage for the migrants.
+		std::vector<TreeGenome> genomes;
+		std::vector<float> fitnesses;
+
+		explicit Island(size_t migrantCount) : emigrants(std::max<size_t>(migrantCount, 1)) { }
+	};
+	IslandModelParameters parameters;
+	std::vector<std::unique_ptr<Island>> islands;
+	// The island that sends its migrants to each island.
+	std::vector<size_t> sources;
+	std::mt19937 migrationRng;
+	core::ThreadPool pool;
+
+	static unsigned threadCountFor(const IslandModelParameters &parameters) {
+		if (parameters.threadCount) {
+			return parameters.threadCount;
+		}
+		return unsigned(std::min<size_t>(parameters.islandCount, core::ThreadPool::defaultThreadCount()));
+	}
+
+	// Call the given function for every island on the threads of the pool.
+	void forEachIsland(const std::function<void (Island &island, size_t index)> &fn) {
+		pool.parallelFor(islands.size(), 1, [&] (size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				fn(*islands[i], i);
+			}
+		});
+	}
+
+	void updateSources() {
+		const size_t count = islands.size();
+		sources.resize(count);
+		if (parameters.topology == MigrationTopology::Ring) {
+			for (size_t i = 0; i < count; ++i) {
+				sources[i] = (i + count - 1) % count;
+			}
+			return;
+		}
+		std::vector<size_t> order(count);
+		for (size_t i = 0; i < count; ++i) {
+			order[i] = i;
+		}
+		std::shuffle(order.begin(), order.end(), migrationRng);
+		for (size_t i = 0; i < count; ++i) {
+			sources[order[(i + 1) % count]] = order[i];
+		}
+	}
+
+	void migrate() {
+		// The emigrants are queued by every island before any island receives its immigrants.
+		forEachIsland([this] (Island &island, size_t) {
+			island.population->getFittestIndividuals(parameters.migrantCount, island.genomes, island.fitnesses);
+			for (size_t i = 0; i < island.genomes.size(); ++i) {
+				Migrant migrant;
+				std::swap(migrant.genome, island.genomes[i]);
+				migrant.fitness = island.fitnesses[i];
+				bool isQueued = island.emigrants.push(std::move(migrant));
+				assert(isQueued);
+				(void)isQueued;
+			}
+		});
+		updateSources();
+		forEachIsland([this] (Island &island, size_t i) {
+			auto &source = islands[sources[i]]->emigrants;
+			island.genomes.clear();
+			island.fitnesses.clear();
+			Migrant migrant;
+			while (source.pop(migrant)) {
+				island.genomes.push_back(std::move(migrant.genome));
+				island.fitnesses.push_back(migrant.fitness);
+			}
+			island.population->replaceLeastFitIndividuals(island.genomes, island.fitnesses);
+		});
+	}
+public:
+	int generation = 0;
+
+	IslandPopulation(const IslandModelParameters &parameters, const DelegateFactory &delegateFactory) : parameters(parameters), migrationRng(parameters.masterSeed), pool(threadCountFor(parameters)) {
+		assert(parameters.islandCount != 0);
+		assert(parameters.migrationInterval != 0);
+		assert(parameters.migrantCount < parameters.islandSize);
+		for (size_t i = 0; i < parameters.islandCount; ++i) {
+			std::unique_ptr<Island> island(new Island(parameters.migrantCount));
+			std::seed_seq seed{ parameters.masterSeed, unsigned(i) };
+			island->params.rng.seed(seed);
+			island->params.mutationRate = parameters.mutationRate;
+			island->params.crossoverRate = parameters.crossoverRate;
+			island->delegate = delegateFactory(i, island->params);
+			island->population.reset(new Population(parameters.islandSize, island->params, *island->delegate));
+			islands.push_back(std::move(island));
+		}
+	}
+
+	size_t size() const {
+		return islands.size();
+	}
+
+	Population &operator [](size_t i) {
+		return *islands[i]->population;
+	}
+
+	EvolvingPopulationDelegate &delegate(size_t i) {
+		return *islands[i]->delegate;
+	}
+
+	// Initialize every island with the ramped half and half initializer.
+	void initialize(int maxDepth, RampedHalfAndHalfInitializerDelegate *initializerDelegate = nullptr) {
+		forEachIsland([=] (Island &island, size_t) {
+			RampedHalfAndHalfInitializer<EvolutionParameters::RNG> init(island.delegate->genomeGrammar(), island.params.rng, initializerDelegate);
+			island.population->initialize(maxDepth, init);
+		});
+	}
+
+	// Evolve the islands for the given number of generations, migrating the individuals after every migration interval.
+	void evolve(size_t generationCount) {
+		while (generationCount) {
+			size_t interval = parameters.migrationInterval;
+			size_t steps = std::min(generationCount, interval - size_t(generation) % interval);
+			forEachIsland([=] (Island &island, size_t) {
+				for (size_t i = 0; i < steps; ++i) {
+					island.population->nextGeneration(false);
+				}
+			});
+			generation += int(steps);
+			generationCount -= steps;
+			if (size_t(generation) % interval == 0 && parameters.migrantCount) {
+				migrate();
+			}
+		}
+	}
+
+	// Evaluate the current generation of every island. Return the index of the island and the id of the
+	// fittest individual across all of the islands.
+	std::pair<size_t, size_t> evaluateGeneration() {
+		std::vector<size_t> bestIndividuals(islands.size());
+		std::vector<float> bestFitnesses(islands.size());
+		forEachIsland([&] (Island &island, size_t i) {
+			bestIndividuals[i] = island.population->evaluateGeneration();
+			bestFitnesses[i] = island.population->getStats().bestFitness;
+		});
+		size_t bestIsland = 0;
+		for (size_t i = 1; i < islands.size(); ++i) {
+			if (bestFitnesses[i] > bestFitnesses[bestIsland]) {
+				bestIsland = i;
+			}
+		}
+		return std::make_pair(bestIsland, bestIndividuals[bestIsland]);
+	}
+};
+
+} // end namespace genetic
@@ -0,0 +1,279 @@
+#pragma once
+
+#include "genome.h"
+#include "grammar.h"
+#include "initializer.h"
+#include "random.h"
+#include "profiler.h"
+#include <vector>
+#include <cstdint>
+#include <cmath>
+
+namespace genetic {
+
+/// Samples an index with a probability that's proportional to its weight in constant time, using Vose's alias method.
+/// A single random number draws both the index and a uniform offset below its weight, which is how the raw node
+/// values of a definition are drawn.
+class AliasTable {
+	// The probability of keeping the drawn column, scaled to 32 bits, and the index that's used otherwise.
+	std::vector<uint32_t> thresholds;
+	std::vector<uint32_t> aliases;
+	std::vector<TreeGenomeValue> weights;
+public:
+	AliasTable() { }
+
+	explicit AliasTable(const std::vector<TreeGenomeValue> &weights) {
+		build(weights);
+	}
+
+	void build(const std::vector<TreeGenomeValue> &weights) {
+		const size_t count = weights.size();
+		this->weights = weights;
+		thresholds.assign(count, 0);
+		aliases.assign(count, 0);
+		if (!count) {
+			return;
+		}
+		double total = 0;
+		for (auto weight : weights) {
+			total += double(weight);
+		}
+		assert(total > 0);
+		// The probabilities scaled by the number of columns, split into the columns that are under- and overfull.
+		std::vector<double> scaled(count);
+		std::vector<uint32_t> small, large;
+		for (size_t i = 0; i < count; ++i) {
+			scaled[i] = double(weights[i]) * double(count) / total;
+			(scaled[i] < 1.0 ? small : large).push_back(uint32_t(i));
+		}
+		while (!small.empty() && !large.empty()) {
+			auto less = small.back(), more = large.back();
+			small.pop_back();
+			thresholds[less] = uint32_t(std::min(scaled[less] * 4294967296.0, 4294967295.0));
+			aliases[less] = more;
+			scaled[more] -= 1.0 - scaled[less];
+			if (scaled[more] < 1.0) {
+				large.pop_back();
+				small.push_back(more);
+			}
+		}
+		// The remaining columns are full, up to the rounding errors.
+		for (auto i : small) {
+			thresholds[i] = 0xffffffffu;
+			aliases[i] = i;
+		}
+		for (auto i : large) {
+			thresholds[i] = 0xffffffffu;
+			aliases[i] = i;
+		}
+	}
+
+	bool isEmpty() const {
+		return thresholds.empty();
+	}
+
+	size_t size() const {
+		return thresholds.size();
+	}
+
+	// Draw an index, and a uniform offset in [0, weight) of the drawn index.
+	template<typename RNG>
+	size_t sample(RNG &rng, TreeGenomeValue &offset) const {
+		assert(!isEmpty());
+		// The high half of the product is the column, and the low half is uniform within the column. It decides
+		// between the column and its alias, and the part that's left over is scaled to the offset.
+		auto product = uint64_t(core::random32(rng)) * uint64_t(thresholds.size());
+		auto column = size_t(product >> 32);
+		auto fraction = uint32_t(product), threshold = thresholds[column];
+		size_t index;
+		uint64_t numerator, denominator;
+		if (fraction < threshold) {
+			index = column;
+			numerator = fraction;
+			denominator = threshold;
+		} else {
+			index = aliases[column];
+			numerator = fraction - threshold;
+			denominator = (uint64_t(1) << 32) - threshold;
+		}
+		auto weight = weights[index];
+		offset = weight > 1 ? TreeGenomeValue((numerator * weight) / denominator) : 0;
+		return index;
+	}
+
+	template<typename RNG>
+	size_t sample(RNG &rng) const {
+		TreeGenomeValue offset;
+		return sample(rng, offset);
+	}
+};
+
+/// Generates random GP trees like TreeGenerator, without recursion and without allocating once its buffers are
+/// large enough. The definitions are drawn from alias tables that are built per type when the generator is created,
+/// so the grammar isn't queried while a tree is generated. The trees have the same distribution as the trees of
+/// TreeGenerator, but they're made from different random numbers.
+/// The trees are written in preorder into a node buffer that's provided by the caller.
+template<class RNG>
+class IterativeTreeGenerator {
+public:
+	typedef TreeGenome::NodeStorageType NodeStorage;
+	typedef std::vector<NodeStorage> NodeBuffer;
+	enum class Strategy {
+		Full,
+		Grow
+	};
+private:
+	// A candidate definition of a type.
+	struct Entry {
+		TreeGenomeValue rawValue;
+		unsigned argumentCount;
+		// The index of the first argument type in argumentTypes.
+		size_t firstArgument;
+	};
+	// The candidate definitions of one type, and the tables that draw them.
+	struct TypeTables {
+		std::vector<Entry> terminals, functions, nodes;
+		AliasTable terminalTable, functionTable, nodeTable;
+	};
+	// A function node whose arguments are still being generated.
+	struct Frame {
+		size_t nodeIndex;
+		size_t nextArgument, endArgument;
+		int depth;
+	};
+
+	RNG &rng;
+	std::vector<TreeGenomeType> argumentTypes;
+	// The tables of every type, followed by the tables of the definitions that aren't constrained by a type.
+	std::vector<TypeTables> typeTables;
+	std::vector<Frame> stack;
+
+	const TypeTables &tablesForType(TreeGenomeType type) const {
+		return type == grammar::Type::invalidTypeId ? typeTables.back() : typeTables[type];
+	}
+
+	// Draw a definition for a node with the given remaining depth, and add it to the buffer.
+	void addNode(NodeBuffer &nodes, TreeGenomeType type, int depth, Strategy strategy) {
+		const auto &tables = tablesForType(type);
+		const Entry *entry;
+		TreeGenomeValue offset;
+		if (depth <= 1 && !tables.terminals.empty()) {
+			entry = &tables.terminals[tables.terminalTable.sample(rng, offset)];
+		} else if (strategy == Strategy::Full) {
+			entry = &tables.functions[tables.functionTable.sample(rng, offset)];
+		} else {
+			entry = &tables.nodes[tables.nodeTable.sample(rng, offset)];
+		}
+		NodeStorage node(entry->rawValue + offset);
+		node.childCount = entry->argumentCount;
+		nodes.push_back(node);
+		if (entry->argumentCount) {
+			Frame frame;
+			frame.nodeIndex = nodes.size() - 1;
+			frame.nextArgument = entry->firstArgument;
+			frame.endArgument = entry->firstArgument + entry->argumentCount;
+			frame.depth = depth;
+			stack.push_back(frame);
+		}
+	}
+public:
+	IterativeTreeGenerator(const grammar::Grammar &grammar, RNG &rng) : rng(rng) {
+		typeTables.resize(grammar.typeCount() + 1);
+		std::vector<std::vector<TreeGenomeValue>> terminalWeights(typeTables.size()), functionWeights(typeTables.size());
+		for (const auto &definition : grammar.definitions()) {
+			Entry entry;
+			entry.rawValue = definition.getNodeValue();
+			entry.argumentCount = definition.getNumArguments();
+			entry.firstArgument = argumentTypes.size();
+			for (unsigned i = 0; i < entry.argumentCount; ++i) {
+				argumentTypes.push_back(definition.getTypeForArgument(i));
+			}
+			for (size_t tablesIndex : { size_t(definition.getType()), typeTables.size() - 1 }) {
+				auto &tables = typeTables[tablesIndex];
+				(definition.isTerminal() ? tables.terminals : tables.functions).push_back(entry);
+				(definition.isTerminal() ? terminalWeights : functionWeights)[tablesIndex].push_back(definition.getWeight());
+			}
+		}
+		for (size_t i = 0; i < typeTables.size(); ++i) {
+			auto &tables = typeTables[i];
+			tables.nodes = tables.terminals;
+			tables.nodes.insert(tables.nodes.end(), tables.functions.begin(), tables.functions.end());
+			auto nodeWeights = terminalWeights[i];
+			nodeWeights.insert(nodeWeights.end(), functionWeights[i].begin(), functionWeights[i].end());
+			tables.terminalTable.build(terminalWeights[i]);
+			tables.functionTable.build(functionWeights[i]);
+			tables.nodeTable.build(nodeWeights);
+		}
+	}
+
+	// Replace the contents of the given buffer by a random tree of the given type, and return the depth of the tree.
+	size_t generate(NodeBuffer &nodes, int maxDepth, Strategy strategy, TreeGenomeType type = grammar::Type::invalidTypeId) {
+		GENETIC_PROFILE_SCOPE("IterativeTreeGenerator::generate");
+		nodes.clear();
+		stack.clear();
+		addNode(nodes, type, maxDepth, strategy);
+		size_t depth = 1;
+		while (!stack.empty()) {
+			auto &frame = stack.back();
+			if (frame.nextArgument == frame.endArgument) {
+				auto &node = nodes[frame.nodeIndex];
+				node.subTreeSize = decltype(node.subTreeSize)(nodes.size() - frame.nodeIndex);
+				stack.pop_back();
+				continue;
+			}
+			auto argumentType = argumentTypes[frame.nextArgument++];
+			int childDepth = frame.depth - 1;
+			depth = std::max(depth, stack.size() + 1);
+			// The frame can't be used after the child is added, as the stack may grow.
+			addNode(nodes, argumentType, childDepth, strategy);
+		}
+		return depth;
+	}
+
+	size_t generateFull(NodeBuffer &nodes, int maxDepth, TreeGenomeType type = grammar::Type::invalidTypeId) {
+		return generate(nodes, maxDepth, Strategy::Full, type);
+	}
+
+	size_t generateGrow(NodeBuffer &nodes, int maxDepth, TreeGenomeType type = grammar::Type::invalidTypeId) {
+		return generate(nodes, maxDepth, Strategy::Grow, type);
+	}
+
+	// Replace the given genome by a random tree, which reuses the storage of the genome.
+	// The given buffer holds the nodes while they're generated.
+	size_t generate(TreeGenome &genome, NodeBuffer &nodes, int maxDepth, Strategy strategy, TreeGenomeType type = grammar::Type::invalidTypeId) {
+		auto depth = generate(nodes, maxDepth, strategy, type);
+		genome.assignNodes(nodes.data(), nodes.size());
+		return depth;
+	}
+};
+
+/// Implements ramped half and half initialization like RampedHalfAndHalfInitializer, using the iterative generator.
+/// Only the storage of the generated genomes is allocated.
+template<class RNG>
+class IterativeRampedHalfAndHalfInitializer : public Initializer {
+	IterativeTreeGenerator<RNG> generator;
+	typename IterativeTreeGenerator<RNG>::NodeBuffer nodes;
+public:
+	IterativeRampedHalfAndHalfInitializer(const grammar::Grammar &grammar, RNG &rng) : generator(grammar, rng) { }
+
+	void initialize(const InitializationOptions &options, std::function<void (TreeGenome)> consumer) override {
+		typedef typename IterativeTreeGenerator<RNG>::Strategy Strategy;
+		// The same depth ramp as RampedHalfAndHalfInitializer.
+		size_t size = options.populationSize, i = 0;
+		float depth = 1;
+		float depthDelta = float(options.maxTreeGenomeDepth) / (float(size)/2);
+		for (; i < size/2; ++i, depth += depthDelta) {
+			TreeGenome genome;
+			generator.generate(genome, nodes, int(floor(depth)), Strategy::Full);
+			consumer(std::move(genome));
+		}
+		depth = 1;
+		for (; i < size; ++i, depth += depthDelta) {
+			TreeGenome genome;
+			generator.generate(genome, nodes, int(floor(depth)), Strategy::Grow);
+			consumer(std::move(genome));
+		}
+	}
+};
+
+} // end namespace genetic
@@ -0,0 +1,146 @@
+#pragma once
+
+#include "random.h"
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <cstddef>
+#include <cassert>
+
+namespace genetic {
+
+/// The errors of every individual of a generation for every evaluated fitness case, where a lower error is better.
+/// The errors of an individual are contiguous, so a delegate writes every row independently.
+class CaseErrorMatrix {
+	size_t individualCount = 0, caseCount = 0;
+	std::vector<float> errors;
+	// The epsilon of every case, or none for exact lexicase selection.
+	std::vector<float> epsilons;
+	std::vector<float> column;
+public:
+	// Resize the matrix for the given number of individuals and cases. The errors are left unspecified.
+	void resize(size_t individuals, size_t cases) {
+		individualCount = individuals;
+		caseCount = cases;
+		errors.resize(individuals * cases);
+		epsilons.clear();
+	}
+
+	size_t getIndividualCount() const {
+		return individualCount;
+	}
+
+	size_t getCaseCount() const {
+		return caseCount;
+	}
+
+	float *row(size_t individual) {
+		assert(individual < individualCount);
+		return errors.data() + individual * caseCount;
+	}
+
+	const float *row(size_t individual) const {
+		assert(individual < individualCount);
+		return errors.data() + individual * caseCount;
+	}
+
+	float operator()(size_t individual, size_t c) const {
+		assert(individual < individualCount && c < caseCount);
+		return errors[individual * caseCount + c];
+	}
+
+	// Replace the errors that aren't finite, like the NaN of a division by zero, by infinity, so that the
+	// individuals that don't have a valid error for a case are the worst ones for the case.
+	void replaceNonFiniteErrors() {
+		for (auto &error : errors) {
+			if (!std::isfinite(error)) {
+				error = std::numeric_limits<float>::infinity();
+			}
+		}
+	}
+
+	// Set the epsilon of every case to the median absolute deviation of its errors, which is used by
+	// epsilon-lexicase selection.
+	void computeEpsilons() {
+		epsilons.resize(caseCount);
+		column.resize(individualCount);
+		const size_t middle = individualCount / 2;
+		for (size_t c = 0; c < caseCount; ++c) {
+			for (size_t i = 0; i < individualCount; ++i) {
+				column[i] = errors[i * caseCount + c];
+			}
+			std::nth_element(column.begin(), column.begin() + middle, column.end());
+			const float median = column[middle];
+			// The infinite errors deviate from an infinite median by 0 rather than NaN.
+			for (auto &error : column) {
+				error = error == median ? 0.0f : std::abs(error - median);
+			}
+			std::nth_element(column.begin(), column.begin() + middle, column.end());
+			epsilons[c] = column[middle];
+		}
+	}
+
+	// Use exact lexicase selection.
+	void clearEpsilons() {
+		epsilons.clear();
+	}
+
+	float epsilon(size_t c) const {
+		return epsilons.empty() ? 0.0f : epsilons[c];
+	}
+};
+
+/// The reusable storage of a lexicase selection. Every thread that selects needs its own buffer.
+struct LexicaseSelectionBuffer {
+	std::vector<size_t> candidates, remainingCandidates;
+	std::vector<size_t> cases;
+};
+
+/// Select an individual with lexicase selection: the cases are visited in a random order, and every case keeps only
+/// the candidates whose error is within the epsilon of the best error of the candidates for that case. The selected
+/// individual is a random one of the candidates that remain when there's one left or when the cases run out.
+template<typename RNG>
+size_t selectByLexicase(const CaseErrorMatrix &errors, RNG &rng, LexicaseSelectionBuffer &buffer) {
+	const size_t individualCount = errors.getIndividualCount(), caseCount = errors.getCaseCount();
+	assert(individualCount != 0);
+	auto &candidates = buffer.candidates;
+	candidates.resize(individualCount);
+	for (size_t i = 0; i < individualCount; ++i) {
+		candidates[i] = i;
+	}
+	auto &cases = buffer.cases;
+	cases.resize(caseCount);
+	for (size_t c = 0; c < caseCount; ++c) {
+		cases[c] = c;
+	}
+	// The order of the cases is shuffled lazily, as the selection usually ends after a few cases.
+	for (size_t step = 0; step < caseCount && candidates.size() > 1; ++step) {
+		std::swap(cases[step], cases[step + core::uniformIndex(rng, caseCount - step)]);
+		const size_t c = cases[step];
+		// The NaN errors are skipped, as std::min keeps the best error when it's compared to a NaN.
+		float best = std::numeric_limits<float>::infinity();
+		for (auto candidate : candidates) {
+			best = std::min(best, errors(candidate, c));
+		}
+		const float limit = best + errors.epsilon(c);
+		auto &remaining = buffer.remainingCandidates;
+		remaining.clear();
+		for (auto candidate : candidates) {
+			if (errors(candidate, c) <= limit) {
+				remaining.push_back(candidate);
+			}
+		}
+		// The case doesn't decide anything when none of the candidates has an error that can be compared.
+		if (remaining.empty()) {
+			continue;
+		}
+		std::swap(candidates, remaining);
+	}
+	if (candidates.size() == 1) {
+		return candidates[0];
+	}
+	return candidates[core::uniformIndex(rng, candidates.size())];
+}
+
+} // end namespace genetic
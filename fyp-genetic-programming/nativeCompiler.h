@@ -0,0 +1,144 @@
+#pragma once
+
+#include "genome.h"
+#include "grammar.h"
+#include "treeCompiler.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cstdio>
+#include <dlfcn.h>
+#include <unistd.h>
+
+namespace genetic {
+
+/// An abstract class that describes how the genomes are turned into C functions by the native compiler.
+/// The inherited printing methods define how the bodies of the functions are printed by the tree compiler.
+class TreeGenomeNativeCompilerDelegate : public TreeGenomeCompilerDelegate {
+public:
+	// Return the C declaration of a function with the given name that evaluates a genome, like `int name(int x, int y)`.
+	// It must match the function type that the native compiler is instantiated with.
+	virtual std::string functionDeclaration(const std::string &name) = 0;
+
+	// Return the C code that's emitted before the functions, like the functions of the grammar that aren't operators.
+	virtual std::string modulePrelude() {
+		return "";
+	}
+};
+
+/// A shared library that contains the native code of a batch of genomes.
+template<typename FunctionType>
+class TreeGenomeNativeModule {
+	void *handle;
+	std::vector<FunctionType *> functions;
+public:
+	TreeGenomeNativeModule(void *handle, std::vector<FunctionType *> functions) : handle(handle), functions(std::move(functions)) { }
+	TreeGenomeNativeModule(const TreeGenomeNativeModule &) = delete;
+	TreeGenomeNativeModule &operator = (const TreeGenomeNativeModule &) = delete;
+
+	~TreeGenomeNativeModule() {
+		dlclose(handle);
+	}
+
+	size_t size() const {
+		return functions.size();
+	}
+
+	// Return the function with the native code of the genome with the given index.
+	FunctionType *operator [](size_t i) const {
+		assert(i < functions.size());
+		return functions[i];
+	}
+};
+
+/// Compiles genomes into native code by printing them as C functions with the tree compiler and building them
+/// with the system C compiler into a shared library, which is then loaded into the process.
+/// A batch of genomes, like a whole generation, is compiled into one library to amortize the cost of the compiler.
+template<typename FunctionType>
+class TreeGenomeNativeCompiler {
+	const grammar::Grammar &grammar;
+	TreeGenomeNativeCompilerDelegate &delegate;
+	std::string compilerCommand;
+
+	static std::string temporaryDirectory() {
+		const char *directory = getenv("TMPDIR");
+		std::string path = directory && *directory ? directory : "/tmp";
+		if (path.back() != '/') {
+			path += "/";
+		}
+		path += "genetic-native-XXXXXX";
+		if (!mkdtemp(&path[0])) {
+			return "";
+		}
+		return path;
+	}
+
+	// Quote the given string as a single word for the shell, as the temporary directory may contain any character.
+	static std::string shellQuote(const std::string &word) {
+		std::string quoted = "'";
+		for (char c : word) {
+			if (c == '\'') {
+				quoted += "'\\''";
+			} else {
+				quoted += c;
+			}
+		}
+		return quoted + "'";
+	}
+public:
+	// The compiler command is invoked with the source file and the output library appended to it.
+	TreeGenomeNativeCompiler(const grammar::Grammar &grammar, TreeGenomeNativeCompilerDelegate &delegate, std::string compilerCommand = "cc -O2 -shared -fPIC") : grammar(grammar), delegate(delegate), compilerCommand(std::move(compilerCommand)) {
+	}
+
+	// Return the C source code of the module with the given genomes.
+	std::string moduleSource(const std::vector<TreeGenome> &genomes) {
+		std::ostringstream os;
+		os << delegate.modulePrelude() << "\n";
+		TreeGenomeCompiler compiler(grammar, &delegate);
+		for (size_t i = 0; i < genomes.size(); ++i) {
+			os << delegate.functionDeclaration("genome" + std::to_string(i)) << " {\n\treturn ";
+			compiler.print(genomes[i], os);
+			os << ";\n}\n";
+		}
+		return os.str();
+	}
+
+	// Compile the given genomes into a module. Return null if the module couldn't be built or loaded.
+	std::unique_ptr<TreeGenomeNativeModule<FunctionType>> compile(const std::vector<TreeGenome> &genomes) {
+		auto directory = temporaryDirectory();
+		if (directory.empty()) {
+			return nullptr;
+		}
+		auto sourcePath = directory + "/module.c", libraryPath = directory + "/module.so";
+		{
+			std::ofstream source(sourcePath);
+			source << moduleSource(genomes);
+		}
+		auto command = compilerCommand + " " + shellQuote(sourcePath) + " -o " + shellQuote(libraryPath);
+		bool isBuilt = std::system(command.c_str()) == 0;
+		void *handle = isBuilt ? dlopen(libraryPath.c_str(), RTLD_NOW | RTLD_LOCAL) : nullptr;
+		// The loaded library stays mapped after its file is removed.
+		std::remove(sourcePath.c_str());
+		std::remove(libraryPath.c_str());
+		rmdir(directory.c_str());
+		if (!handle) {
+			return nullptr;
+		}
+		std::vector<FunctionType *> functions;
+		functions.reserve(genomes.size());
+		for (size_t i = 0; i < genomes.size(); ++i) {
+			auto symbol = dlsym(handle, ("genome" + std::to_string(i)).c_str());
+			if (!symbol) {
+				dlclose(handle);
+				return nullptr;
+			}
+			functions.push_back(reinterpret_cast<FunctionType *>(symbol));
+		}
+		return std::unique_ptr<TreeGenomeNativeModule<FunctionType>>(new TreeGenomeNativeModule<FunctionType>(handle, std::move(functions)));
+	}
+};
+
+} // end namespace genetic
@@ -0,0 +1,335 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+
+#define GENETIC_PROFILE_CONCATENATE_(a, b) a##b
+#define GENETIC_PROFILE_CONCATENATE(a, b) GENETIC_PROFILE_CONCATENATE_(a, b)
+
+// The instrumentation of the library, which is compiled in when GENETIC_ENABLE_PROFILING is defined, and expands
+// to nothing otherwise. The names must be string literals, as the measurements keep pointers to them.
+#ifdef GENETIC_ENABLE_PROFILING
+// Time the rest of the enclosing scope.
+#define GENETIC_PROFILE_SCOPE(name) ::genetic::profiling::ScopedTimer GENETIC_PROFILE_CONCATENATE(profileScope, __LINE__)(name)
+// Add the given amount to a counter.
+#define GENETIC_PROFILE_COUNT(name, amount) ::genetic::profiling::count(name, uint64_t(amount))
+// Count the allocations of the given vector in the rest of the enclosing scope.
+#define GENETIC_PROFILE_ALLOCATIONS(name, vector) ::genetic::profiling::AllocationCounter<decltype(vector)> GENETIC_PROFILE_CONCATENATE(profileAllocations, __LINE__)(name, vector)
+#else
+#define GENETIC_PROFILE_SCOPE(name)
+#define GENETIC_PROFILE_COUNT(name, amount)
+#define GENETIC_PROFILE_ALLOCATIONS(name, vector)
+#endif
+
+namespace genetic {
+
+/// Scoped timers and counters that are aggregated per thread, and exported in the trace event format of Chrome
+/// or as totals. Every thread records into its own profile, which is only locked by the thread itself until the
+/// profiles are collected, so the threads don't contend while they're measured.
+namespace profiling {
+
+#ifdef GENETIC_ENABLE_PROFILING
+static const bool isEnabled = true;
+#else
+static const bool isEnabled = false;
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+/// A timed scope. The times are given in nanoseconds since the profiler was first used.
+struct Event {
+	const char *name;
+	uint64_t begin, duration;
+};
+
+struct TimerTotal {
+	const char *name = nullptr;
+	uint64_t count = 0, totalTime = 0, maxTime = 0;
+};
+
+struct CounterTotal {
+	const char *name = nullptr;
+	uint64_t value = 0;
+};
+
+/// The measurements of one thread.
+struct ThreadProfile {
+	unsigned threadId = 0;
+	// The timed scopes, up to the event capacity, in the order in which they ended.
+	std::vector<Event> events;
+	uint64_t droppedEventCount = 0;
+	std::vector<TimerTotal> timers;
+	std::vector<CounterTotal> counters;
+};
+
+/// The profiles of all of the threads that were measured.
+struct Report {
+	std::vector<ThreadProfile> threads;
+
+	// The totals of the timer with the given name across the threads.
+	TimerTotal timer(const char *name) const {
+		TimerTotal total;
+		total.name = name;
+		for (const auto &thread : threads) {
+			for (const auto &timer : thread.timers) {
+				if (std::strcmp(timer.name, name) == 0) {
+					total.count += timer.count;
+					total.totalTime += timer.totalTime;
+					total.maxTime = std::max(total.maxTime, timer.maxTime);
+				}
+			}
+		}
+		return total;
+	}
+
+	// The sum of the counter with the given name across the threads.
+	uint64_t counter(const char *name) const {
+		uint64_t value = 0;
+		for (const auto &thread : threads) {
+			for (const auto &counter : thread.counters) {
+				if (std::strcmp(counter.name, name) == 0) {
+					value += counter.value;
+				}
+			}
+		}
+		return value;
+	}
+
+	// The totals of every timer and counter across the threads, in the order in which they were first seen.
+	std::vector<TimerTotal> timers() const {
+		std::vector<TimerTotal> result;
+		for (const auto &thread : threads) {
+			for (const auto &timer : thread.timers) {
+				if (std::none_of(result.begin(), result.end(), [&] (const TimerTotal &t) { return std::strcmp(t.name, timer.name) == 0; })) {
+					result.push_back(this->timer(timer.name));
+				}
+			}
+		}
+		return result;
+	}
+
+	std::vector<CounterTotal> counters() const {
+		std::vector<CounterTotal> result;
+		for (const auto &thread : threads) {
+			for (const auto &counter : thread.counters) {
+				if (std::none_of(result.begin(), result.end(), [&] (const CounterTotal &c) { return std::strcmp(c.name, counter.name) == 0; })) {
+					CounterTotal total;
+					total.name = counter.name;
+					total.value = this->counter(counter.name);
+					result.push_back(total);
+				}
+			}
+		}
+		return result;
+	}
+};
+
+/// Owns the profiles of the threads. The profile of a thread outlives the thread until it's collected.
+class Registry {
+	struct Recorder {
+		std::mutex mutex;
+		ThreadProfile profile;
+	};
+	std::mutex mutex;
+	std::vector<std::shared_ptr<Recorder>> recorders;
+	unsigned nextThreadId = 0;
+	std::atomic<size_t> eventCapacity;
+	const Clock::time_point epoch = Clock::now();
+
+	std::shared_ptr<Recorder> addRecorder() {
+		std::shared_ptr<Recorder> recorder(new Recorder());
+		std::lock_guard<std::mutex> lock(mutex);
+		recorder->profile.threadId = nextThreadId++;
+		recorders.push_back(recorder);
+		return recorder;
+	}
+
+	Registry() : eventCapacity(size_t(1) << 20) { }
+
+	Recorder &recorderForThisThread() {
+		thread_local std::shared_ptr<Recorder> recorder = addRecorder();
+		return *recorder;
+	}
+
+	template<typename Total>
+	static Total &totalWithName(std::vector<Total> &totals, const char *name) {
+		for (auto &total : totals) {
+			if (total.name == name) {
+				return total;
+			}
+		}
+		totals.push_back(Total());
+		totals.back().name = name;
+		return totals.back();
+	}
+public:
+	static Registry &shared() {
+		static Registry registry;
+		return registry;
+	}
+
+	uint64_t now() const {
+		return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - epoch).count());
+	}
+
+	// Set the number of events that every thread keeps until the profiles are collected. The timers and the
+	// counters are still updated when the events are dropped.
+	void setEventCapacity(size_t capacity) {
+		eventCapacity.store(capacity, std::memory_order_relaxed);
+	}
+
+	void recordScope(const char *name, uint64_t begin, uint64_t end) {
+		auto &recorder = recorderForThisThread();
+		std::lock_guard<std::mutex> lock(recorder.mutex);
+		auto &profile = recorder.profile;
+		auto &timer = totalWithName(profile.timers, name);
+		uint64_t duration = end - begin;
+		++timer.count;
+		timer.totalTime += duration;
+		timer.maxTime = std::max(timer.maxTime, duration);
+		if (profile.events.size() < eventCapacity.load(std::memory_order_relaxed)) {
+			Event event;
+			event.name = name;
+			event.begin = begin;
+			event.duration = duration;
+			profile.events.push_back(event);
+		} else {
+			++profile.droppedEventCount;
+		}
+	}
+
+	void count(const char *name, uint64_t amount) {
+		auto &recorder = recorderForThisThread();
+		std::lock_guard<std::mutex> lock(recorder.mutex);
+		totalWithName(recorder.profile.counters, name).value += amount;
+	}
+
+	// Return the profiles of the threads that recorded anything. When reset is true, the profiles start over,
+	// and the profiles of the threads that exited are released.
+	Report collect(bool reset = true) {
+		Report report;
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto &recorder : recorders) {
+			std::lock_guard<std::mutex> recorderLock(recorder->mutex);
+			auto &profile = recorder->profile;
+			if (!profile.events.empty() || !profile.timers.empty() || !profile.counters.empty()) {
+				report.threads.push_back(profile);
+			}
+			if (reset) {
+				profile.events.clear();
+				profile.droppedEventCount = 0;
+				profile.timers.clear();
+				profile.counters.clear();
+			}
+		}
+		if (reset) {
+			recorders.erase(std::remove_if(recorders.begin(), recorders.end(), [] (const std::shared_ptr<Recorder> &recorder) {
+				return recorder.use_count() == 1;
+			}), recorders.end());
+		}
+		return report;
+	}
+};
+
+/// Records the time from its construction to its destruction, see GENETIC_PROFILE_SCOPE.
+class ScopedTimer {
+	const char *name;
+	uint64_t begin;
+public:
+	explicit ScopedTimer(const char *name) : name(name), begin(Registry::shared().now()) { }
+	ScopedTimer(const ScopedTimer &) = delete;
+	ScopedTimer &operator = (const ScopedTimer &) = delete;
+
+	~ScopedTimer() {
+		auto &registry = Registry::shared();
+		registry.recordScope(name, begin, registry.now());
+	}
+};
+
+inline void count(const char *name, uint64_t amount = 1) {
+	Registry::shared().count(name, amount);
+}
+
+/// Counts one allocation when the capacity of a vector changed between its construction and its destruction,
+/// see GENETIC_PROFILE_ALLOCATIONS.
+template<typename Vector>
+class AllocationCounter {
+	const char *name;
+	const Vector &vector;
+	size_t initialCapacity;
+public:
+	AllocationCounter(const char *name, const Vector &vector) : name(name), vector(vector), initialCapacity(vector.capacity()) { }
+	AllocationCounter(const AllocationCounter &) = delete;
+	AllocationCounter &operator = (const AllocationCounter &) = delete;
+
+	~AllocationCounter() {
+		if (vector.capacity() != initialCapacity) {
+			count(name);
+		}
+	}
+};
+
+inline Report collect(bool reset = true) {
+	return Registry::shared().collect(reset);
+}
+
+inline void writeJSONString(std::ostream &stream, const char *string) {
+	stream << '"';
+	for (const char *c = string; *c; ++c) {
+		if (*c == '"' || *c == '\\') {
+			stream << '\\';
+		}
+		stream << *c;
+	}
+	stream << '"';
+}
+
+// Write the events and the counters of the given report as the elements of a JSON array in the trace event
+// format of Chrome, one element per line, each followed by a comma. The times are in microseconds.
+inline void writeTraceEvents(const Report &report, std::ostream &stream) {
+	for (const auto &thread : report.threads) {
+		uint64_t end = 0;
+		for (const auto &event : thread.events) {
+			stream << "{\"name\":";
+			writeJSONString(stream, event.name);
+			stream << ",\"cat\":\"genetic\",\"ph\":\"X\",\"pid\":0,\"tid\":" << thread.threadId
+			       << ",\"ts\":" << double(event.begin) / 1000.0 << ",\"dur\":" << double(event.duration) / 1000.0 << "},\n";
+			end = std::max(end, event.begin + event.duration);
+		}
+		for (const auto &counter : thread.counters) {
+			stream << "{\"name\":";
+			writeJSONString(stream, counter.name);
+			stream << ",\"cat\":\"genetic\",\"ph\":\"C\",\"pid\":0,\"tid\":" << thread.threadId
+			       << ",\"ts\":" << double(end) / 1000.0 << ",\"args\":{\"value\":" << counter.value << "}},\n";
+		}
+	}
+}
+
+// Write the given report as a complete trace file that can be opened by chrome://tracing or Perfetto.
+inline void writeChromeTrace(const Report &report, std::ostream &stream) {
+	stream << "[\n";
+	writeTraceEvents(report, stream);
+	stream << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"genetic\"}}\n]\n";
+}
+
+// Write the totals of the timers and the counters of the given report as comma separated values.
+inline void writeTotals(const Report &report, std::ostream &stream) {
+	stream << "name,count,total_ns,max_ns\n";
+	for (const auto &timer : report.timers()) {
+		stream << timer.name << ',' << timer.count << ',' << timer.totalTime << ',' << timer.maxTime << '\n';
+	}
+	for (const auto &counter : report.counters()) {
+		stream << counter.name << ',' << counter.value << ",,\n";
+	}
+}
+
+} // end namespace profiling
+} // end namespace genetic
@@ -0,0 +1,211 @@
+#pragma once
+
+#include "genome.h"
+#include "geneticProgramming.h"
+#include "threadPool.h"
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <limits>
+#include <cstdint>
+
+namespace genetic {
+
+/// The ways in which RacingEvolvingPopulationDelegate stops evaluating the individuals that can't compete.
+enum class RacingMode {
+	/// Evaluate every individual for all of the fitness cases.
+	None,
+	/// Stop evaluating an individual once its fitness can't reach the threshold, which is the fitness that
+	/// was reached by the given fraction of the previous generation.
+	Threshold,
+	/// Evaluate all of the individuals for a batch of cases, and keep evaluating the given fraction of them
+	/// that did best so far, with batches that double in size, until the remaining ones were evaluated for all cases.
+	SuccessiveHalving
+};
+
+struct RacingOptions {
+	RacingMode mode = RacingMode::Threshold;
+	/// The number of fitness cases that are evaluated before an individual is compared against the others.
+	size_t batchSize = 64;
+	/// The fraction of the previous generation that reached the threshold of the threshold mode, or the fraction
+	/// of the individuals that's kept by every round of successive halving.
+	float survivalFraction = 0.5f;
+};
+
+/// A population delegate that computes the fitness from separate fitness cases, and stops evaluating the individuals
+/// that are hopeless after a part of the cases. The fitness of such an individual is estimated from the cases
+/// that were evaluated, assuming the rest of the cases score the same on average, which keeps it below the fitness
+/// of the individuals that were evaluated for all cases in the threshold mode. The individuals are evaluated
+/// concurrently on the thread pool like the individuals of ParallelEvolvingPopulationDelegate.
+/// The estimated fitness is reported by isFitnessEstimated, so the population doesn't store it in its fitness cache.
+class RacingEvolvingPopulationDelegate : public ParallelEvolvingPopulationDelegate {
+	// The threshold for the next generation, which is derived from the last evaluated generation.
+	float threshold = -std::numeric_limits<float>::infinity();
+	std::vector<float> caseFitnessSums, sortedFitnesses;
+	std::vector<size_t> activeIndividuals;
+	// Whether the fitness of every individual of the last call of computeFitness is an estimate.
+	std::vector<uint8_t> isEstimated;
+	std::atomic<size_t> evaluatedCaseCount, prunedCount;
+
+	float estimatedFitness(const TreeGenome &individual, float caseFitnessSum, size_t evaluatedCases, size_t caseCount) {
+		return fitnessForCaseFitness(individual, caseFitnessSum / float(evaluatedCases) * float(caseCount));
+	}
+
+	void computeFitnessWithThreshold(const std::vector<TreeGenome> &individuals, std::vector<float> &fitnesses) {
+		const size_t caseCount = fitnessCaseCount();
+		threadPool().parallelFor(individuals.size(), 0, [&] (size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				float sum = 0;
+				size_t firstCase = 0;
+				while (firstCase < caseCount) {
+					size_t count = std::min(options.batchSize, caseCount - firstCase);
+					sum += computeCaseBatchFitness(individuals[i], firstCase, count);
+					firstCase += count;
+					if (firstCase < caseCount && fitnessForCaseFitness(individuals[i], sum + float(caseCount - firstCase) * maxCaseFitness()) < threshold) {
+						break;
+					}
+				}
+				evaluatedCaseCount.fetch_add(firstCase, std::memory_order_relaxed);
+				if (firstCase < caseCount) {
+					prunedCount.fetch_add(1, std::memory_order_relaxed);
+					isEstimated[i] = true;
+					fitnesses[i] = estimatedFitness(individuals[i], sum, firstCase, caseCount);
+				} else {
+					fitnesses[i] = fitnessForCaseFitness(individuals[i], sum);
+				}
+			}
+		});
+		updateThreshold(fitnesses.data(), individuals.size());
+	}
+
+	// The pruned individuals are estimated below the threshold, which lowers the next one when many were pruned.
+	void updateThreshold(const float *fitnesses, size_t size) {
+		sortedFitnesses.assign(fitnesses, fitnesses + size);
+		size_t rank = std::min(size - 1, size_t(float(size) * options.survivalFraction));
+		std::nth_element(sortedFitnesses.begin(), sortedFitnesses.begin() + rank, sortedFitnesses.end(), std::greater<float>());
+		threshold = sortedFitnesses[rank];
+	}
+
+	void computeFitnessWithSuccessiveHalving(const std::vector<TreeGenome> &individuals, std::vector<float> &fitnesses) {
+		const size_t caseCount = fitnessCaseCount();
+		const size_t size = individuals.size();
+		caseFitnessSums.assign(size, 0.0f);
+		activeIndividuals.resize(size);
+		for (size_t i = 0; i < size; ++i) {
+			activeIndividuals[i] = i;
+		}
+		size_t firstCase = 0, batchSize = options.batchSize;
+		while (true) {
+			const size_t count = std::min(batchSize, caseCount - firstCase);
+			threadPool().parallelFor(activeIndividuals.size(), 0, [&] (size_t begin, size_t end) {
+				for (size_t j = begin; j < end; ++j) {
+					auto i = activeIndividuals[j];
+					caseFitnessSums[i] += computeCaseBatchFitness(individuals[i], firstCase, count);
+				}
+			});
+			firstCase += count;
+			evaluatedCaseCount.fetch_add(count * activeIndividuals.size(), std::memory_order_relaxed);
+			if (firstCase == caseCount) {
+				break;
+			}
+			// Keep the individuals with the best sums, breaking the ties by their index.
+			size_t keptCount = std::max(size_t(1), size_t(float(activeIndividuals.size()) * options.survivalFraction));
+			if (keptCount < activeIndividuals.size()) {
+				std::nth_element(activeIndividuals.begin(), activeIndividuals.begin() + keptCount, activeIndividuals.end(), [this] (size_t a, size_t b) {
+					return caseFitnessSums[a] > caseFitnessSums[b] || (caseFitnessSums[a] == caseFitnessSums[b] && a < b);
+				});
+				for (size_t j = keptCount; j < activeIndividuals.size(); ++j) {
+					auto i = activeIndividuals[j];
+					isEstimated[i] = true;
+					fitnesses[i] = estimatedFitness(individuals[i], caseFitnessSums[i], firstCase, caseCount);
+				}
+				prunedCount.fetch_add(activeIndividuals.size() - keptCount, std::memory_order_relaxed);
+				activeIndividuals.resize(keptCount);
+				std::sort(activeIndividuals.begin(), activeIndividuals.end());
+			}
+			batchSize *= 2;
+		}
+		for (auto i : activeIndividuals) {
+			fitnesses[i] = fitnessForCaseFitness(individuals[i], caseFitnessSums[i]);
+		}
+	}
+public:
+	RacingOptions options;
+
+	RacingEvolvingPopulationDelegate(RacingOptions options = RacingOptions(), unsigned threadCount = core::ThreadPool::defaultThreadCount()) : ParallelEvolvingPopulationDelegate(threadCount), evaluatedCaseCount(0), prunedCount(0), options(options) {
+		assert(options.batchSize != 0);
+		assert(options.survivalFraction > 0 && options.survivalFraction <= 1);
+	}
+
+	// The number of fitness cases.
+	size_t fitnessCaseCount() override = 0;
+
+	// Return the sum of the scores of the given individual for the fitness cases [firstCase, firstCase + caseCount).
+	// This method must be reentrant, as it's called concurrently from several threads.
+	virtual float computeCaseBatchFitness(const TreeGenome &individual, size_t firstCase, size_t caseCount) = 0;
+
+	// The largest score of a single fitness case, which bounds the fitness that the remaining cases can add.
+	virtual float maxCaseFitness() = 0;
+
+	// Return the fitness of the individual whose scores for all of the cases sum up to the given value, like
+	// the average score with a penalty for the size of the tree. This must not decrease when the sum grows.
+	virtual float fitnessForCaseFitness(const TreeGenome &individual, float caseFitnessSum) {
+		return caseFitnessSum;
+	}
+
+	float computeFitnessForIndividual(const TreeGenome &individual) override {
+		return fitnessForCaseFitness(individual, computeCaseBatchFitness(individual, 0, fitnessCaseCount()));
+	}
+
+	void computeFitness(const std::vector<TreeGenome> &individuals, std::vector<float> &fitnesses) override {
+		assert(fitnesses.size() >= individuals.size());
+		evaluatedCaseCount.store(0, std::memory_order_relaxed);
+		prunedCount.store(0, std::memory_order_relaxed);
+		isEstimated.assign(individuals.size(), false);
+		if (individuals.empty()) {
+			return;
+		}
+		switch (options.mode) {
+			case RacingMode::None:
+				ParallelEvolvingPopulationDelegate::computeFitness(individuals, fitnesses);
+				evaluatedCaseCount.store(individuals.size() * fitnessCaseCount(), std::memory_order_relaxed);
+				break;
+			case RacingMode::Threshold:
+				computeFitnessWithThreshold(individuals, fitnesses);
+				break;
+			case RacingMode::SuccessiveHalving:
+				computeFitnessWithSuccessiveHalving(individuals, fitnesses);
+				break;
+		}
+	}
+
+	bool isFitnessEstimated(size_t individual) override {
+		return individual < isEstimated.size() && isEstimated[individual];
+	}
+
+	// Derive the threshold from the whole generation, including the individuals whose fitness was found in the
+	// fitness cache, which weren't passed to computeFitness.
+	void didEvaluateGeneration(const std::vector<float> &fitnesses) override {
+		if (options.mode == RacingMode::Threshold && !fitnesses.empty()) {
+			updateThreshold(fitnesses.data(), fitnesses.size());
+		}
+	}
+
+	// Forget the threshold that was derived from the previous generations, like when the fitness cases change.
+	void resetThreshold() {
+		threshold = -std::numeric_limits<float>::infinity();
+	}
+
+	// The number of fitness cases that were evaluated for the last generation, for all of the individuals.
+	size_t getEvaluatedCaseCount() const {
+		return evaluatedCaseCount.load(std::memory_order_relaxed);
+	}
+
+	// The number of individuals of the last generation whose fitness was estimated.
+	size_t getPrunedCount() const {
+		return prunedCount.load(std::memory_order_relaxed);
+	}
+};
+
+} // end namespace genetic
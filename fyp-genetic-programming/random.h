@@ -0,0 +1,150 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
+
+namespace genetic {
+namespace core {
+
+/// The Philox4x32-10 counter-based random number generator.
+/// Every output block is a pure function of a 128 bit counter and a 64 bit key, so a generator is cheap to create
+/// and many independent streams can be derived from one key, like one stream per task of a parallel loop,
+/// without any shared state. It satisfies the requirements of a uniform random bit generator.
+class Philox4x32 {
+	uint32_t counter[4];
+	uint32_t key[2];
+	uint32_t block[4];
+	unsigned index = 4;
+
+	static void multiply(uint32_t a, uint32_t b, uint32_t &high, uint32_t &low) {
+		uint64_t product = uint64_t(a) * uint64_t(b);
+		high = uint32_t(product >> 32);
+		low = uint32_t(product);
+	}
+
+	void increment() {
+		for (unsigned i = 0; i < 4 && ++counter[i] == 0; ++i) { }
+	}
+public:
+	typedef uint32_t result_type;
+
+	// Create the generator for the given stream of the given key.
+	explicit Philox4x32(uint64_t seed = 0, uint64_t stream = 0) {
+		key[0] = uint32_t(seed);
+		key[1] = uint32_t(seed >> 32);
+		counter[0] = counter[1] = 0;
+		counter[2] = uint32_t(stream);
+		counter[3] = uint32_t(stream >> 32);
+	}
+
+	static constexpr result_type min() {
+		return 0;
+	}
+
+	static constexpr result_type max() {
+		return 0xffffffffu;
+	}
+
+	// Compute the output block for the given counter and key.
+	static void generateBlock(const uint32_t counter[4], const uint32_t key[2], uint32_t result[4]) {
+		uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+		uint32_t k0 = key[0], k1 = key[1];
+		for (unsigned round = 0; round < 10; ++round) {
+			uint32_t high0, low0, high1, low1;
+			multiply(0xD2511F53u, c0, high0, low0);
+			multiply(0xCD9E8D57u, c2, high1, low1);
+			c0 = high1 ^ c1 ^ k0;
+			c1 = low1;
+			c2 = high0 ^ c3 ^ k1;
+			c3 = low0;
+			k0 += 0x9E3779B9u;
+			k1 += 0xBB67AE85u;
+		}
+		result[0] = c0;
+		result[1] = c1;
+		result[2] = c2;
+		result[3] = c3;
+	}
+
+	result_type operator()() {
+		if (index == 4) {
+			generateBlock(counter, key, block);
+			increment();
+			index = 0;
+		}
+		return block[index++];
+	}
+
+	void discard(unsigned long long count) {
+		for (; count; --count) {
+			(*this)();
+		}
+	}
+};
+
+/// Derives an independent Philox stream for every operation on every individual of every generation from one seed,
+/// so the random numbers that an operation uses don't depend on the order, or the thread, in which it runs.
+class RandomStreams {
+	uint64_t seed;
+
+	// The finalizer of SplitMix64.
+	static uint64_t mix(uint64_t value) {
+		value += 0x9E3779B97F4A7C15ull;
+		value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+		value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+		return value ^ (value >> 31);
+	}
+public:
+	explicit RandomStreams(uint64_t seed = 0) : seed(seed) { }
+
+	uint64_t getSeed() const {
+		return seed;
+	}
+
+	// Return the stream of the given operation. The individual must fit into 56 bits, and the operation into 8 bits.
+	Philox4x32 stream(uint64_t generation, uint64_t individual, uint32_t operation = 0) const {
+		assert(individual < (uint64_t(1) << 56) && operation < 256);
+		return Philox4x32(mix(seed ^ mix(generation)), (individual << 8) | operation);
+	}
+};
+
+// Return 32 random bits from a generator that produces at least 32 bits.
+template<typename RNG>
+inline uint32_t random32(RNG &rng) {
+	static_assert(RNG::min() == 0 && RNG::max() >= 0xffffffffu, "The generator must produce at least 32 random bits");
+	return uint32_t(rng());
+}
+
+// Return a uniform integer in [0, bound) without a distribution object, using Lemire's nearly divisionless
+// method. It usually takes one random number and one multiplication.
+template<typename RNG>
+inline uint32_t uniformBelow(RNG &rng, uint32_t bound) {
+	assert(bound != 0);
+	uint64_t product = uint64_t(random32(rng)) * bound;
+	uint32_t low = uint32_t(product);
+	if (low < bound) {
+		const uint32_t threshold = uint32_t(-bound) % bound;
+		while (low < threshold) {
+			product = uint64_t(random32(rng)) * bound;
+			low = uint32_t(product);
+		}
+	}
+	return uint32_t(product >> 32);
+}
+
+// Return a uniform index in [0, count), where the count fits into 32 bits.
+template<typename RNG>
+inline size_t uniformIndex(RNG &rng, size_t count) {
+	assert(count != 0 && uint64_t(count) <= 0xffffffffull);
+	return uniformBelow(rng, uint32_t(count));
+}
+
+// Return a uniform float in [0, 1) that's made from the top 24 bits of a random number.
+template<typename RNG>
+inline float uniformProbability(RNG &rng) {
+	return float(random32(rng) >> 8) * (1.0f / 16777216.0f);
+}
+
+} // end namespace core
+} // end namespace genetic
@@ -0,0 +1,419 @@
+#pragma once
+
+#include "genome.h"
+#include "grammar.h"
+#include "treeProgram.h"
+#include "treeBatchEvaluator.h"
+#include "profiler.h"
+#include <vector>
+#include <initializer_list>
+#include <type_traits>
+#include <cstdint>
+#include <cstring>
+
+namespace genetic {
+namespace grammar {
+
+/// The base of a definition of a static grammar, which declares its weight, the index of its type and
+/// the indices of the types of its arguments. The indices refer to the types that make the runtime grammar.
+/// A derived definition declares its name and its operation, which the static evaluators call directly:
+///
+///   static const char *name();
+///   // A terminal, where offset is the raw node value minus the first raw value of the definition.
+///   template<typename T> static T evaluate(Context &context, TreeGenomeValue offset, size_t fitnessCase);
+///   // A function, where x is the first argument.
+///   template<typename T> static T evaluate(T x, T y);
+template<TreeGenomeValue Weight, unsigned TypeIndex, unsigned... ArgumentTypeIndices>
+struct StaticDefinition {
+	static_assert(Weight != 0, "A definition must have a weight");
+	static constexpr TreeGenomeValue weight = Weight;
+	static constexpr unsigned typeIndex = TypeIndex;
+	static constexpr unsigned argumentCount = sizeof...(ArgumentTypeIndices);
+
+	static Definition makeDefinition(const char *name, const std::vector<Type> &types) {
+		return Definition(argumentCount ? Definition::Kind::Function : Definition::Kind::Terminal, name, types[TypeIndex], { types[ArgumentTypeIndices]... }, Weight, argumentCount);
+	}
+};
+
+template<TreeGenomeValue Weight, unsigned TypeIndex = 0>
+struct StaticTerminal : StaticDefinition<Weight, TypeIndex> { };
+
+template<TreeGenomeValue Weight, unsigned TypeIndex = 0, unsigned X = TypeIndex>
+struct StaticUnaryFunction : StaticDefinition<Weight, TypeIndex, X> { };
+
+template<TreeGenomeValue Weight, unsigned TypeIndex = 0, unsigned X = TypeIndex, unsigned Y = TypeIndex>
+struct StaticBinaryFunction : StaticDefinition<Weight, TypeIndex, X, Y> { };
+
+template<TreeGenomeValue Weight, unsigned TypeIndex = 0, unsigned X = TypeIndex, unsigned Y = TypeIndex, unsigned Z = TypeIndex>
+struct StaticTernaryFunction : StaticDefinition<Weight, TypeIndex, X, Y, Z> { };
+
+namespace staticGrammar {
+
+template<unsigned... I>
+struct IndexSequence { };
+
+template<unsigned N, unsigned... I>
+struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, I...> { };
+
+template<unsigned... I>
+struct MakeIndexSequence<0, I...> {
+	typedef IndexSequence<I...> type;
+};
+
+template<unsigned I, typename D, typename... Ds>
+struct DefinitionAt {
+	typedef typename DefinitionAt<I - 1, Ds...>::type type;
+};
+
+template<typename D, typename... Ds>
+struct DefinitionAt<0, D, Ds...> {
+	typedef D type;
+};
+
+template<typename D, typename... Ds>
+struct IndexOf;
+
+template<typename D>
+struct IndexOf<D> {
+	static constexpr unsigned value = 0;
+};
+
+template<typename D, typename First, typename... Rest>
+struct IndexOf<D, First, Rest...> {
+	static constexpr unsigned value = std::is_same<D, First>::value ? 0 : 1 + IndexOf<D, Rest...>::value;
+};
+
+// The sum of the first count weights.
+constexpr TreeGenomeValue weightSum(unsigned count) {
+	return 0;
+}
+
+template<typename... Rest>
+constexpr TreeGenomeValue weightSum(unsigned count, TreeGenomeValue weight, Rest... rest) {
+	return count == 0 ? 0 : weight + weightSum(count - 1, rest...);
+}
+
+// The order of the definitions in a grammar: the terminals come first, and either kind is ordered by type.
+constexpr uint64_t rank(unsigned argumentCount, unsigned typeIndex) {
+	return (uint64_t(argumentCount != 0) << 32) | typeIndex;
+}
+
+constexpr bool isSorted(uint64_t previous) {
+	return true;
+}
+
+template<typename... Rest>
+constexpr bool isSorted(uint64_t previous, uint64_t next, Rest... rest) {
+	return previous <= next && isSorted(next, rest...);
+}
+
+// Finds the definition whose raw value range contains a raw value by comparing it against the compile time
+// bounds of the ranges, which the compiler turns into a tree of branches.
+template<typename Grammar, unsigned Begin, unsigned Count>
+struct DefinitionLookup {
+	static constexpr unsigned middle = Begin + Count / 2;
+
+	static unsigned find(TreeGenomeValue value) {
+		return value < Grammar::template rawValue<middle>() ? DefinitionLookup<Grammar, Begin, Count / 2>::find(value) : DefinitionLookup<Grammar, middle, Count - Count / 2>::find(value);
+	}
+};
+
+template<typename Grammar, unsigned Begin>
+struct DefinitionLookup<Grammar, Begin, 1> {
+	static unsigned find(TreeGenomeValue value) {
+		return Begin;
+	}
+};
+
+} // end namespace staticGrammar
+
+/// A grammar that's declared as a list of definition types, whose raw value ranges and type partitions are known
+/// at compile time. It makes the runtime grammar that the population and the generators use, which has the same
+/// definition ids and raw values, and the static evaluators below call the operations of the definitions without
+/// querying the grammar. The definitions must be listed in the order of the runtime grammar: the terminals before
+/// the functions, and the definitions of either kind ordered by type.
+template<typename... Definitions>
+struct StaticGrammar {
+	static constexpr unsigned definitionCount = sizeof...(Definitions);
+	static_assert(definitionCount != 0, "A grammar needs definitions");
+	static_assert(staticGrammar::isSorted(0, staticGrammar::rank(Definitions::argumentCount, Definitions::typeIndex)...), "The terminals must come before the functions, and either kind must be ordered by type");
+
+	template<unsigned I>
+	using DefinitionAt = typename staticGrammar::DefinitionAt<I, Definitions...>::type;
+
+	static_assert(DefinitionAt<0>::argumentCount == 0, "A grammar needs a terminal");
+
+	// The first raw value of the definition with the given id.
+	template<unsigned I>
+	static constexpr TreeGenomeValue rawValue() {
+		return staticGrammar::weightSum(I, Definitions::weight...);
+	}
+
+	static constexpr TreeGenomeValue nodeLimit = staticGrammar::weightSum(definitionCount, Definitions::weight...);
+
+	// The definition id of the given definition type.
+	template<typename D>
+	static constexpr unsigned definitionId() {
+		return staticGrammar::IndexOf<D, Definitions...>::value;
+	}
+
+	static unsigned definitionIdForRawValue(TreeGenomeValue value) {
+		assert(value < nodeLimit && "Invalid node value");
+		return staticGrammar::DefinitionLookup<StaticGrammar, 0, definitionCount>::find(value);
+	}
+
+	static unsigned argumentCount(unsigned definitionId) {
+		static const unsigned argumentCounts[] = { Definitions::argumentCount... };
+		assert(definitionId < definitionCount);
+		return argumentCounts[definitionId];
+	}
+
+	// Make the runtime grammar with the given types, which the type indices of the definitions refer to.
+	static Grammar makeGrammar(std::initializer_list<Type> types) {
+		const std::vector<Type> typeList(types);
+		Grammar grammar(types, { Definitions::makeDefinition(Definitions::name(), typeList)... });
+#ifndef NDEBUG
+		const char *names[] = { Definitions::name()... };
+		const TreeGenomeValue weights[] = { Definitions::weight... };
+		TreeGenomeValue rawValue = 0;
+		for (unsigned i = 0; i < definitionCount; ++i) {
+			assert(std::strcmp(grammar[i].getName(), names[i]) == 0 && grammar[i].getNodeValue() == rawValue && "The runtime grammar doesn't match the static grammar");
+			rawValue += weights[i];
+		}
+#endif
+		return grammar;
+	}
+
+	// Lower the given tree into the given program like TreeGenomeProgram::compile, without the runtime grammar.
+	static void compile(const TreeGenome &tree, TreeGenomeProgram &program) {
+		compileTree(tree, program);
+	}
+
+	static void compile(const CompactTreeGenome &tree, TreeGenomeProgram &program) {
+		compileTree(tree, program);
+	}
+private:
+	template<typename TreeType>
+	static void compileTree(const TreeType &tree, TreeGenomeProgram &program) {
+		const size_t count = tree.getNodeCount();
+		const auto *nodes = tree.nodeData();
+		program.instructions.resize(count);
+		unsigned depth = 0;
+		program.maxStackDepth = 0;
+		for (size_t i = 0; i < count; ++i) {
+			const auto &node = nodes[count - 1 - i];
+			auto &instruction = program.instructions[i];
+			instruction.value = TreeGenomeValue(node.value);
+			instruction.definitionId = definitionIdForRawValue(instruction.value);
+			instruction.argumentCount = argumentCount(instruction.definitionId);
+			assert(node.childCount == instruction.argumentCount);
+			assert(depth >= instruction.argumentCount);
+			depth = depth - instruction.argumentCount + 1;
+			program.maxStackDepth = std::max(program.maxStackDepth, depth);
+		}
+		assert(depth == 1);
+	}
+};
+
+} // end namespace grammar
+
+/// Executes compiled GP trees of a static grammar. The definition id of every instruction selects the handler of
+/// its definition from a sequence of compile time cases, which the compiler lowers into a jump table or a tree of
+/// branches with the operations inlined, so the grammar isn't queried while a program runs. A table of function
+/// pointers would be slower for large programs, whose single indirect call is mispredicted at almost every node.
+/// The context is passed to the terminals, like the values of the parameters of the fitness cases.
+template<typename T, typename StaticGrammarType, typename Context>
+struct StaticTreeGenomeProgramEvaluator {
+private:
+	std::vector<T> stack;
+
+	// The first argument of a function is on the top of the stack.
+	template<typename D>
+	static T *apply(std::integral_constant<unsigned, 0>, T *top, TreeGenomeValue offset, Context &context, size_t fitnessCase) {
+		*top = D::template evaluate<T>(context, offset, fitnessCase);
+		return top + 1;
+	}
+
+	template<typename D>
+	static T *apply(std::integral_constant<unsigned, 1>, T *top, TreeGenomeValue offset, Context &context, size_t fitnessCase) {
+		top[-1] = D::template evaluate<T>(top[-1]);
+		return top;
+	}
+
+	template<typename D>
+	static T *apply(std::integral_constant<unsigned, 2>, T *top, TreeGenomeValue offset, Context &context, size_t fitnessCase) {
+		top[-2] = D::template evaluate<T>(top[-1], top[-2]);
+		return top - 1;
+	}
+
+	template<typename D>
+	static T *apply(std::integral_constant<unsigned, 3>, T *top, TreeGenomeValue offset, Context &context, size_t fitnessCase) {
+		top[-3] = D::template evaluate<T>(top[-1], top[-2], top[-3]);
+		return top - 2;
+	}
+
+	template<unsigned I>
+	static T *handler(T *top, TreeGenomeValue value, Context &context, size_t fitnessCase) {
+		typedef typename StaticGrammarType::template DefinitionAt<I> D;
+		static_assert(D::argumentCount <= 3, "The static evaluators support up to 3 arguments");
+		return apply<D>(std::integral_constant<unsigned, D::argumentCount>(), top, value - StaticGrammarType::template rawValue<I>(), context, fitnessCase);
+	}
+
+	// Run the handler of the given definition id, which is at least I.
+	template<unsigned I>
+	static T *dispatch(std::true_type isLast, unsigned definitionId, T *top, TreeGenomeValue value, Context &context, size_t fitnessCase) {
+		return handler<I>(top, value, context, fitnessCase);
+	}
+
+	template<unsigned I>
+	static T *dispatch(std::false_type isLast, unsigned definitionId, T *top, TreeGenomeValue value, Context &context, size_t fitnessCase) {
+		if (definitionId == I) {
+			return handler<I>(top, value, context, fitnessCase);
+		}
+		return dispatch<I + 1>(std::integral_constant<bool, I + 2 == StaticGrammarType::definitionCount>(), definitionId, top, value, context, fitnessCase);
+	}
+
+	template<bool hasConstants>
+	T run(const TreeGenomeProgram &program, const T *constants, Context &context, size_t fitnessCase) {
+		if (stack.size() < program.maxStackDepth) {
+			stack.resize(program.maxStackDepth);
+		}
+		T *top = stack.data();
+		for (const auto &instruction : program.instructions) {
+			if (hasConstants && instruction.definitionId == TreeGenomeProgram::constantDefinitionId) {
+				*top++ = constants[instruction.value];
+				continue;
+			}
+			assert(instruction.definitionId < StaticGrammarType::definitionCount);
+			top = dispatch<0>(std::integral_constant<bool, StaticGrammarType::definitionCount == 1>(), instruction.definitionId, top, instruction.value, context, fitnessCase);
+		}
+		assert(top == stack.data() + 1);
+		return stack[0];
+	}
+public:
+	// Evaluate the program for the given fitness case.
+	T operator()(const TreeGenomeProgram &program, Context &context, size_t fitnessCase = 0) {
+		GENETIC_PROFILE_SCOPE("StaticTreeGenomeProgramEvaluator::evaluate");
+		return run<false>(program, nullptr, context, fitnessCase);
+	}
+
+	T operator()(const SimplifiedTreeGenomeProgram<T> &program, Context &context, size_t fitnessCase = 0) {
+		GENETIC_PROFILE_SCOPE("StaticTreeGenomeProgramEvaluator::evaluate");
+		return run<true>(program, program.constants.data(), context, fitnessCase);
+	}
+};
+
+/// Executes compiled GP trees of a static grammar for a batch of fitness cases at once, like
+/// TreeGenomeProgramBatchEvaluator. Every instruction jumps through a table that holds one handler per definition,
+/// which is a loop over a block of cases that calls the inlined operation of the definition, so the compiler can
+/// vectorize it. The indirect call is paid once per block.
+template<typename T, typename StaticGrammarType, typename Context>
+struct StaticTreeGenomeProgramBatchEvaluator {
+private:
+	typedef void (*Handler)(T *const *top, T *__restrict result, TreeGenomeValue value, Context &context, size_t firstCase, size_t count);
+	size_t blockSize;
+	const Handler *handlers;
+	batch::ColumnStorage<T> storage;
+	std::vector<T *> freeColumns;
+	std::vector<T *> stack;
+
+	void reserveColumns(size_t columnCount) {
+		storage.reserve(columnCount, blockSize, freeColumns);
+	}
+
+	// The column of the first argument of a function is on the top of the stack.
+	template<typename D>
+	static void apply(std::integral_constant<unsigned, 0>, T *const *top, T *__restrict result, TreeGenomeValue offset, Context &context, size_t firstCase, size_t count) {
+		for (size_t i = 0; i < count; ++i) {
+			result[i] = D::template evaluate<T>(context, offset, firstCase + i);
+		}
+	}
+
+	template<typename D>
+	static void apply(std::integral_constant<unsigned, 1>, T *const *top, T *__restrict result, TreeGenomeValue offset, Context &context, size_t firstCase, size_t count) {
+		const T *__restrict x = top[-1];
+		for (size_t i = 0; i < count; ++i) {
+			result[i] = D::template evaluate<T>(x[i]);
+		}
+	}
+
+	template<typename D>
+	static void apply(std::integral_constant<unsigned, 2>, T *const *top, T *__restrict result, TreeGenomeValue offset, Context &context, size_t firstCase, size_t count) {
+		const T *__restrict x = top[-1], *__restrict y = top[-2];
+		for (size_t i = 0; i < count; ++i) {
+			result[i] = D::template evaluate<T>(x[i], y[i]);
+		}
+	}
+
+	template<typename D>
+	static void apply(std::integral_constant<unsigned, 3>, T *const *top, T *__restrict result, TreeGenomeValue offset, Context &context, size_t firstCase, size_t count) {
+		const T *__restrict x = top[-1], *__restrict y = top[-2], *__restrict z = top[-3];
+		for (size_t i = 0; i < count; ++i) {
+			result[i] = D::template evaluate<T>(x[i], y[i], z[i]);
+		}
+	}
+
+	template<unsigned I>
+	static void handler(T *const *top, T *__restrict result, TreeGenomeValue value, Context &context, size_t firstCase, size_t count) {
+		typedef typename StaticGrammarType::template DefinitionAt<I> D;
+		static_assert(D::argumentCount <= 3, "The static evaluators support up to 3 arguments");
+		apply<D>(std::integral_constant<unsigned, D::argumentCount>(), top, result, value - StaticGrammarType::template rawValue<I>(), context, firstCase, count);
+	}
+
+	template<unsigned... I>
+	static const Handler *makeHandlers(grammar::staticGrammar::IndexSequence<I...>) {
+		static const Handler handlers[] = { &handler<I>... };
+		return handlers;
+	}
+
+	template<bool hasConstants>
+	void evaluateBlock(const TreeGenomeProgram &program, const T *constants, Context &context, size_t firstCase, size_t count) {
+		for (const auto &instruction : program.instructions) {
+			T *result = freeColumns.back();
+			freeColumns.pop_back();
+			if (hasConstants && instruction.definitionId == TreeGenomeProgram::constantDefinitionId) {
+				batch::fill(constants[instruction.value], result, count);
+			} else {
+				assert(instruction.definitionId < StaticGrammarType::definitionCount);
+				handlers[instruction.definitionId](stack.data() + stack.size(), result, instruction.value, context, firstCase, count);
+			}
+			for (unsigned i = 0; i < instruction.argumentCount; ++i) {
+				freeColumns.push_back(stack.back());
+				stack.pop_back();
+			}
+			stack.push_back(result);
+		}
+		assert(stack.size() == 1);
+	}
+
+	template<bool hasConstants>
+	void run(const TreeGenomeProgram &program, const T *constants, Context &context, size_t caseCount, T *results) {
+		// One more column than the stack depth, as a result is written before its arguments are released.
+		reserveColumns(program.maxStackDepth + 1);
+		for (size_t firstCase = 0; firstCase < caseCount; firstCase += blockSize) {
+			size_t count = std::min(blockSize, caseCount - firstCase);
+			stack.clear();
+			evaluateBlock<hasConstants>(program, constants, context, firstCase, count);
+			batch::copy(stack.back(), results + firstCase, count);
+			freeColumns.push_back(stack.back());
+		}
+	}
+public:
+	// The block size is the number of fitness cases that are evaluated by one pass over the program.
+	explicit StaticTreeGenomeProgramBatchEvaluator(size_t blockSize = 256) : blockSize(blockSize), handlers(makeHandlers(typename grammar::staticGrammar::MakeIndexSequence<StaticGrammarType::definitionCount>::type())) {
+		assert(blockSize != 0);
+	}
+
+	// Evaluate the program for the fitness cases [0, caseCount), writing one result per case.
+	void operator()(const TreeGenomeProgram &program, Context &context, size_t caseCount, T *results) {
+		GENETIC_PROFILE_SCOPE("StaticTreeGenomeProgramBatchEvaluator::evaluate");
+		run<false>(program, nullptr, context, caseCount, results);
+	}
+
+	void operator()(const SimplifiedTreeGenomeProgram<T> &program, Context &context, size_t caseCount, T *results) {
+		GENETIC_PROFILE_SCOPE("StaticTreeGenomeProgramBatchEvaluator::evaluate");
+		run<true>(program, program.constants.data(), context, caseCount, results);
+	}
+};
+
+} // end namespace genetic
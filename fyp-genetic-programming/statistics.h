@@ -0,0 +1,329 @@
+#pragma once
+
+#include "concurrentQueue.h"
+#include "profiler.h"
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+#include <ostream>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstring>
+#include <cassert>
+
+namespace genetic {
+
+/// The statistics of one generation of a population. The phase times are given in nanoseconds: the evaluation
+/// of the generation, the selection of the individuals of the next generation and their mutation and crossover.
+/// When the next generation is produced concurrently, the selection happens in the variation tasks, so it's
+/// included in the variation time.
+struct GenerationRecord {
+	int64_t generation = 0;
+	uint64_t individualCount = 0;
+	float minFitness = 0, averageFitness = 0, maxFitness = 0, fitnessStandardDeviation = 0;
+	uint64_t minNodeCount = 0, maxNodeCount = 0;
+	float averageNodeCount = 0;
+	uint64_t minDepth = 0, maxDepth = 0;
+	float averageDepth = 0;
+	uint64_t evaluationTime = 0, selectionTime = 0, variationTime = 0;
+	uint64_t crossoverFailureCount = 0;
+	// The share of the individuals whose fitness was found in the fitness cache, or 0 without a cache.
+	float cacheHitRate = 0;
+};
+
+/// The destination of the generation records.
+class StatisticsSink {
+public:
+	virtual ~StatisticsSink() { }
+	virtual void write(const GenerationRecord &record) = 0;
+	// Write the measurements of the instrumentation, see profiling::collect. They're ignored by default.
+	virtual void writeProfile(const profiling::Report &report) { }
+	// Called when the recorder ran out of records to write, like when its queue was drained.
+	virtual void flush() { }
+};
+
+/// Writes the records as comma separated values, with a header line before the first record.
+class CSVStatisticsSink : public StatisticsSink {
+	std::ostream &stream;
+	bool isHeaderWritten = false;
+public:
+	explicit CSVStatisticsSink(std::ostream &stream) : stream(stream) { }
+
+	void write(const GenerationRecord &r) override {
+		if (!isHeaderWritten) {
+			stream << "generation,individuals,min_fitness,avg_fitness,max_fitness,stddev_fitness,"
+			          "min_nodes,avg_nodes,max_nodes,min_depth,avg_depth,max_depth,"
+			          "evaluate_ns,select_ns,vary_ns,crossover_failures,cache_hit_rate\n";
+			isHeaderWritten = true;
+		}
+		stream << r.generation << ',' << r.individualCount << ','
+		       << r.minFitness << ',' << r.averageFitness << ',' << r.maxFitness << ',' << r.fitnessStandardDeviation << ','
+		       << r.minNodeCount << ',' << r.averageNodeCount << ',' << r.maxNodeCount << ','
+		       << r.minDepth << ',' << r.averageDepth << ',' << r.maxDepth << ','
+		       << r.evaluationTime << ',' << r.selectionTime << ',' << r.variationTime << ','
+		       << r.crossoverFailureCount << ',' << r.cacheHitRate << '\n';
+	}
+
+	void flush() override {
+		stream.flush();
+	}
+};
+
+/// Writes the records as fixed size little endian records, with the fields in the order of GenerationRecord.
+/// The integers take 8 bytes and the floats are stored as their 4 byte IEEE 754 representation, so the files
+/// don't depend on the machine that wrote them.
+class BinaryStatisticsSink : public StatisticsSink {
+	std::ostream &stream;
+	std::vector<uint8_t> bytes;
+
+	void writeU32(uint32_t value) {
+		for (unsigned i = 0; i < 4; ++i) {
+			bytes.push_back(uint8_t(value >> (i * 8)));
+		}
+	}
+
+	void writeU64(uint64_t value) {
+		writeU32(uint32_t(value));
+		writeU32(uint32_t(value >> 32));
+	}
+
+	void writeFloat(float value) {
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		writeU32(bits);
+	}
+
+	static uint64_t readU64(const uint8_t *&position) {
+		uint64_t value = 0;
+		for (unsigned i = 0; i < 8; ++i) {
+			value |= uint64_t(*position++) << (i * 8);
+		}
+		return value;
+	}
+
+	static float readFloat(const uint8_t *&position) {
+		uint32_t bits = 0;
+		for (unsigned i = 0; i < 4; ++i) {
+			bits |= uint32_t(*position++) << (i * 8);
+		}
+		float value;
+		std::memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+public:
+	// The number of bytes of every record.
+	static constexpr size_t recordSize = 10 * 8 + 7 * 4;
+
+	explicit BinaryStatisticsSink(std::ostream &stream) : stream(stream) { }
+
+	void write(const GenerationRecord &r) override {
+		bytes.clear();
+		writeU64(uint64_t(r.generation));
+		writeU64(r.individualCount);
+		writeFloat(r.minFitness);
+		writeFloat(r.averageFitness);
+		writeFloat(r.maxFitness);
+		writeFloat(r.fitnessStandardDeviation);
+		writeU64(r.minNodeCount);
+		writeU64(r.maxNodeCount);
+		writeFloat(r.averageNodeCount);
+		writeU64(r.minDepth);
+		writeU64(r.maxDepth);
+		writeFloat(r.averageDepth);
+		writeU64(r.evaluationTime);
+		writeU64(r.selectionTime);
+		writeU64(r.variationTime);
+		writeU64(r.crossoverFailureCount);
+		writeFloat(r.cacheHitRate);
+		assert(bytes.size() == recordSize);
+		stream.write(reinterpret_cast<const char *>(bytes.data()), std::streamsize(bytes.size()));
+	}
+
+	// Decode the record that starts at the given bytes, which hold at least recordSize bytes.
+	static GenerationRecord read(const uint8_t *data) {
+		const uint8_t *position = data;
+		GenerationRecord r;
+		r.generation = int64_t(readU64(position));
+		r.individualCount = readU64(position);
+		r.minFitness = readFloat(position);
+		r.averageFitness = readFloat(position);
+		r.maxFitness = readFloat(position);
+		r.fitnessStandardDeviation = readFloat(position);
+		r.minNodeCount = readU64(position);
+		r.maxNodeCount = readU64(position);
+		r.averageNodeCount = readFloat(position);
+		r.minDepth = readU64(position);
+		r.maxDepth = readU64(position);
+		r.averageDepth = readFloat(position);
+		r.evaluationTime = readU64(position);
+		r.selectionTime = readU64(position);
+		r.variationTime = readU64(position);
+		r.crossoverFailureCount = readU64(position);
+		r.cacheHitRate = readFloat(position);
+		assert(size_t(position - data) == recordSize);
+		return r;
+	}
+
+	void flush() override {
+		stream.flush();
+	}
+};
+
+/// Writes the profiles in the trace event format of Chrome, as a JSON array that's left open, so the trace can
+/// be loaded while it's still being written. The counters of every profile are recorded when its last scope ended,
+/// and the generation records are written as counters of the fitness.
+class ChromeTraceStatisticsSink : public StatisticsSink {
+	std::ostream &stream;
+	bool isHeaderWritten = false;
+	// The end of the last scope that was written, in nanoseconds.
+	uint64_t lastEventTime = 0;
+
+	void writeHeader() {
+		if (!isHeaderWritten) {
+			stream << "[\n";
+			isHeaderWritten = true;
+		}
+	}
+public:
+	explicit ChromeTraceStatisticsSink(std::ostream &stream) : stream(stream) { }
+
+	void write(const GenerationRecord &r) override {
+		writeHeader();
+		stream << "{\"name\":\"fitness\",\"cat\":\"genetic\",\"ph\":\"C\",\"pid\":0,\"ts\":" << double(lastEventTime) / 1000.0
+		       << ",\"args\":{\"min\":" << r.minFitness << ",\"average\":" << r.averageFitness << ",\"max\":" << r.maxFitness << "}},\n";
+	}
+
+	void writeProfile(const profiling::Report &report) override {
+		writeHeader();
+		profiling::writeTraceEvents(report, stream);
+		for (const auto &thread : report.threads) {
+			for (const auto &event : thread.events) {
+				lastEventTime = std::max(lastEventTime, event.begin + event.duration);
+			}
+		}
+	}
+
+	void flush() override {
+		stream.flush();
+	}
+};
+
+/// Passes the records to a function.
+class CallbackStatisticsSink : public StatisticsSink {
+	std::function<void (const GenerationRecord &)> callback;
+public:
+	explicit CallbackStatisticsSink(std::function<void (const GenerationRecord &)> callback) : callback(std::move(callback)) { }
+
+	void write(const GenerationRecord &record) override {
+		callback(record);
+	}
+};
+
+/// Collects the generation records of a population and writes them to a sink on a background thread.
+/// The records are passed through a lock-free queue, so recording a generation never waits for the sink, and only
+/// takes the lock of the background thread to wake it up. When the queue is full the record is dropped and counted instead.
+class StatisticsRecorder {
+	StatisticsSink &sink;
+	core::SingleProducerSingleConsumerQueue<GenerationRecord> queue;
+	std::atomic<size_t> droppedCount;
+	// The profiles that weren't written yet, which aren't passed through the queue as they're much larger.
+	std::vector<profiling::Report> profiles;
+	std::mutex profileMutex;
+	// Guards the flags that wake the background thread.
+	std::mutex mutex;
+	std::condition_variable wakeCondition;
+	bool hasPendingRecords = false, isStopping = false;
+	std::thread thread;
+
+	void drain() {
+		GenerationRecord record;
+		bool hasWritten = false;
+		while (queue.pop(record)) {
+			sink.write(record);
+			hasWritten = true;
+		}
+		std::vector<profiling::Report> pendingProfiles;
+		{
+			std::lock_guard<std::mutex> lock(profileMutex);
+			pendingProfiles.swap(profiles);
+		}
+		for (const auto &report : pendingProfiles) {
+			sink.writeProfile(report);
+			hasWritten = true;
+		}
+		if (hasWritten) {
+			sink.flush();
+		}
+	}
+
+	void writerMain() {
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			wakeCondition.wait(lock, [this] { return hasPendingRecords || isStopping; });
+			const bool isLastDrain = isStopping;
+			hasPendingRecords = false;
+			// The sink is written without the lock, so the producers never wait for it.
+			lock.unlock();
+			drain();
+			if (isLastDrain) {
+				return;
+			}
+			lock.lock();
+		}
+	}
+
+	void wakeWriter() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			hasPendingRecords = true;
+		}
+		wakeCondition.notify_one();
+	}
+public:
+	explicit StatisticsRecorder(StatisticsSink &sink, size_t capacity = 1024) : sink(sink), queue(capacity), droppedCount(0) {
+		thread = std::thread([this] { writerMain(); });
+	}
+
+	StatisticsRecorder(const StatisticsRecorder &) = delete;
+	StatisticsRecorder &operator = (const StatisticsRecorder &) = delete;
+
+	// Write the remaining records and stop the background thread.
+	~StatisticsRecorder() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			isStopping = true;
+		}
+		wakeCondition.notify_one();
+		thread.join();
+	}
+
+	// Queue the given record. This must only be called by one thread at a time, like the thread that runs the evolution.
+	void record(const GenerationRecord &record) {
+		if (!queue.push(record)) {
+			droppedCount.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		wakeWriter();
+	}
+
+	// Queue the given profile, like the profile that's collected after every generation. This only waits
+	// for the other threads that queue a profile.
+	void recordProfile(profiling::Report report) {
+		{
+			std::lock_guard<std::mutex> lock(profileMutex);
+			profiles.push_back(std::move(report));
+		}
+		wakeWriter();
+	}
+
+	// The number of records that were dropped, because the sink didn't keep up.
+	size_t getDroppedCount() const {
+		return droppedCount.load(std::memory_order_relaxed);
+	}
+};
+
+} // end namespace genetic
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <cassert>
+
+namespace genetic {
+namespace core {
+
+/// A fixed set of worker threads that execute data-parallel loops.
+/// The thread that calls parallelFor participates in the loop, so a pool of size 1 has no worker threads at all.
+class ThreadPool {
+	std::vector<std::thread> workers;
+	// Serializes the loops that are submitted by different threads.
+	std::mutex submitMutex;
+	std::mutex mutex;
+	std::condition_variable wakeCondition, doneCondition;
+
+	// The state of the loop that's currently being executed.
+	const std::function<void (size_t, size_t)> *job = nullptr;
+	size_t jobSize = 0, jobChunkSize = 1;
+	std::atomic<size_t> nextIndex;
+	unsigned activeWorkers = 0;
+	unsigned long long jobCounter = 0;
+	bool isStopping = false;
+
+	// The pool whose loop the current thread is executing, or null. A worker always belongs to its pool.
+	static ThreadPool *&currentPool() {
+		thread_local ThreadPool *pool = nullptr;
+		return pool;
+	}
+
+	// Marks the calling thread as executing a loop of the pool while it participates in the loop.
+	struct CurrentPoolScope {
+		ThreadPool *previous;
+
+		explicit CurrentPoolScope(ThreadPool *pool) : previous(currentPool()) {
+			currentPool() = pool;
+		}
+		~CurrentPoolScope() {
+			currentPool() = previous;
+		}
+	};
+
+	// Claim chunks of the current loop until there are none left.
+	void runChunks() {
+		for (;;) {
+			size_t begin = nextIndex.fetch_add(jobChunkSize);
+			if (begin >= jobSize) {
+				return;
+			}
+			size_t end = std::min(begin + jobChunkSize, jobSize);
+			(*job)(begin, end);
+		}
+	}
+
+	void workerMain() {
+		currentPool() = this;
+		unsigned long long seenJob = 0;
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wakeCondition.wait(lock, [&] { return isStopping || jobCounter != seenJob; });
+				if (isStopping) {
+					return;
+				}
+				seenJob = jobCounter;
+			}
+			runChunks();
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--activeWorkers == 0) {
+				doneCondition.notify_one();
+			}
+		}
+	}
+public:
+	// Return the number of hardware threads, or 1 if it can't be determined.
+	static unsigned defaultThreadCount() {
+		auto count = std::thread::hardware_concurrency();
+		return count ? count : 1;
+	}
+
+	// Create a pool that runs the loops on the given number of threads, including the calling thread.
+	explicit ThreadPool(unsigned threadCount = defaultThreadCount()) : nextIndex(0) {
+		assert(threadCount != 0);
+		for (unsigned i = 1; i < threadCount; ++i) {
+			workers.push_back(std::thread([this] { workerMain(); }));
+		}
+	}
+
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool &operator = (const ThreadPool &) = delete;
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			isStopping = true;
+		}
+		wakeCondition.notify_all();
+		for (auto &worker : workers) {
+			worker.join();
+		}
+	}
+
+	// The number of threads that execute a loop, including the calling thread.
+	unsigned size() const {
+		return unsigned(workers.size()) + 1;
+	}
+
+	// Split the range [0, count) into chunks of the given size and call the given function for each chunk.
+	// The chunks are executed concurrently, so the function must be reentrant. A chunk size of 0 picks the
+	// chunk size automatically. This method returns once all of the chunks have been executed.
+	// A loop that's started from within a loop of the same pool runs on the calling thread, as the other threads
+	// may be waiting for the outer loop to finish.
+	void parallelFor(size_t count, size_t chunkSize, const std::function<void (size_t begin, size_t end)> &fn) {
+		if (count == 0) {
+			return;
+		}
+		if (chunkSize == 0) {
+			// A few chunks per thread balance the load when the cost of an iteration varies.
+			chunkSize = std::max<size_t>(1, count / (size_t(size()) * 4));
+		}
+		if (workers.empty() || count <= chunkSize || currentPool() == this) {
+			fn(0, count);
+			return;
+		}
+		std::lock_guard<std::mutex> submitLock(submitMutex);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = &fn;
+			jobSize = count;
+			jobChunkSize = chunkSize;
+			nextIndex.store(0);
+			activeWorkers = unsigned(workers.size());
+			++jobCounter;
+		}
+		wakeCondition.notify_all();
+		{
+			CurrentPoolScope scope(this);
+			runChunks();
+		}
+		std::unique_lock<std::mutex> lock(mutex);
+		doneCondition.wait(lock, [&] { return activeWorkers == 0; });
+		job = nullptr;
+	}
+};
+
+} // end namespace core
+} // end namespace genetic
@@ -1,86 +1,221 @@
 #pragma once
 
 #include <vector>
+#include <cstddef>
+#include <algorithm>
+#include <limits>
+#include <cstdint>
 #include <cassert>
+#include "profiler.h"
 
 namespace genetic {
 namespace core {
 
-/// Tree ADT.
+/// The default storage for a tree node.
 template <typename T>
+struct TreeNodeStorage {
+    T value;
+    // The number of children that this tree node has.
+    unsigned childCount;
+    // The number of nodes contained in this sub-tree, including the current node.
+    unsigned subTreeSize;
+    
+    static constexpr size_t maxChildCount = std::numeric_limits<unsigned>::max();
+    static constexpr size_t maxSubTreeSize = std::numeric_limits<unsigned>::max();
+    
+    TreeNodeStorage(T value) : value(value), childCount(0), subTreeSize(1) {
+    }
+};
+
+/// A tree node storage that stores the fields of a node in smaller integer types.
+/// The defaults use 6 bytes per node instead of 12, which limits the node values to 16 bits,
+/// the number of children to 255 and the size of a tree to 65535 nodes.
+template <typename T, typename ValueType = uint16_t, typename ChildCountType = uint8_t, typename SubTreeSizeType = uint16_t>
+struct PackedTreeNodeStorage {
+    ValueType value;
+    ChildCountType childCount;
+    SubTreeSizeType subTreeSize;
+    
+    static constexpr size_t maxChildCount = std::numeric_limits<ChildCountType>::max();
+    static constexpr size_t maxSubTreeSize = std::numeric_limits<SubTreeSizeType>::max();
+    
+    PackedTreeNodeStorage(T value) : value(ValueType(value)), childCount(0), subTreeSize(1) {
+        assert(T(this->value) == value && "Node value doesn't fit into the packed node storage");
+    }
+};
+
+/// Tree ADT.
+/// The node storage defines how the nodes are stored, which must have the fields and the limits of TreeNodeStorage.
+template <typename T, typename NodeStorage = TreeNodeStorage<T>>
 class Tree {
-    struct NodeStorage {
-        T value;
-        // The number of children that this tree node has.
-        unsigned childCount;
-        // The number of nodes contained in this sub-tree, including the current node.
-        unsigned subTreeSize;
-        
-        NodeStorage(T value) : value(value), childCount(0), subTreeSize(1) {
-        }
-    };
+    template <typename, typename> friend class Tree;
     std::vector<NodeStorage> nodes;
     
     Tree(std::vector<NodeStorage> nodes) : nodes(std::move(nodes)) { }
     
     size_t addNode(T value) {
+        assert(nodes.size() < NodeStorage::maxSubTreeSize && "Too many nodes for the node storage");
+        GENETIC_PROFILE_ALLOCATIONS("Tree::nodeAllocations", nodes);
         nodes.push_back(NodeStorage(value));
         return nodes.size() - 1;
     }
 
-	// This helper struct is used to walk the tree.
-	struct Enumerator {
-		const Tree<T> &tree;
-		size_t nodeId;
-	public:
-		Enumerator(const Tree<T> &tree) : tree(tree), nodeId(0) {}
-		Enumerator(Enumerator &&other) : tree(other.tree), nodeId(other.nodeId) { other.nodeId = tree.nodes.size(); }
-		
-		struct Node {
-			T value;
-			unsigned childCount;
-		};
-		
-		size_t currentNodeId() const { return nodeId; }
-		
-		Node advance() {
-			Node n;
-			n.value = tree.nodes[nodeId].value;
-			n.childCount = tree.nodes[nodeId].childCount;
-			++nodeId;
-			return n;
-		}
-	};
-	
-	// Return an enumerator that starts with the root node.
-	Enumerator root() const {
-		return Enumerator(*this);
-	}
+    // Add the given delta to the sub-tree sizes of all the ancestors of the given node.
+    void adjustAncestorSubTreeSizes(size_t nodeId, long delta) {
+        forEachAncestor(nodeId, [&] (size_t i) {
+            nodes[i].subTreeSize = decltype(nodes[i].subTreeSize)(long(nodes[i].subTreeSize) + delta);
+        });
+    }
+    
+    // Replace the sub-tree with the given node id by the given nodes in place.
+    // This doesn't allocate unless the tree grows beyond its capacity.
+    void splice(size_t nodeId, const NodeStorage *subTree, size_t subTreeSize) {
+        assert(nodeId < nodes.size());
+        assert(nodes.size() - nodes[nodeId].subTreeSize + subTreeSize <= NodeStorage::maxSubTreeSize && "Too many nodes for the node storage");
+        GENETIC_PROFILE_ALLOCATIONS("Tree::nodeAllocations", nodes);
+        size_t oldSize = nodes[nodeId].subTreeSize;
+        adjustAncestorSubTreeSizes(nodeId, long(subTreeSize) - long(oldSize));
+        auto position = nodes.begin() + nodeId;
+        if (subTreeSize > oldSize) {
+            const NodeStorage placeholder = *position;
+            nodes.insert(position + oldSize, subTreeSize - oldSize, placeholder);
+        } else if (subTreeSize < oldSize) {
+            nodes.erase(position + subTreeSize, position + oldSize);
+        }
+        std::copy(subTree, subTree + subTreeSize, nodes.begin() + nodeId);
+        assert(nodes[0].subTreeSize == nodes.size());
+    }
+
 public:
     Tree() {
+        GENETIC_PROFILE_COUNT("Tree::nodeAllocations", 1);
         nodes.reserve(100);
     }
 	
-    Tree(Tree<T> &&other) : nodes(std::move(other.nodes)) {
+    Tree(Tree &&other) : nodes(std::move(other.nodes)) {
+    }
+    
+    Tree &operator = (Tree &&other) {
+        nodes = std::move(other.nodes);
+        return *this;
     }
 	
-    Tree<T> copy() const {
-        return Tree<T>(std::vector<NodeStorage>(nodes.begin(), nodes.end()));
+    Tree copy() const {
+        GENETIC_PROFILE_COUNT("Tree::nodeAllocations", 1);
+        return Tree(std::vector<NodeStorage>(nodes.begin(), nodes.end()));
+    }
+    
+    // Replace the contents of this tree by a copy of the given tree.
+    // Unlike copy, this reuses the storage of this tree, so it doesn't allocate once the tree is large enough.
+    void assign(const Tree &other) {
+        GENETIC_PROFILE_ALLOCATIONS("Tree::nodeAllocations", nodes);
+        nodes.assign(other.nodes.begin(), other.nodes.end());
+    }
+    
+    // Replace the contents of this tree by a copy of the given tree that uses a different node storage.
+    template <typename OtherNodeStorage>
+    void assign(const Tree<T, OtherNodeStorage> &other) {
+        assert(other.nodes.size() <= NodeStorage::maxSubTreeSize && "Too many nodes for the node storage");
+        GENETIC_PROFILE_ALLOCATIONS("Tree::nodeAllocations", nodes);
+        nodes.clear();
+        nodes.reserve(other.nodes.size());
+        for (const auto &node : other.nodes) {
+            NodeStorage storage(T(node.value));
+            assert(node.childCount <= NodeStorage::maxChildCount);
+            storage.childCount = decltype(storage.childCount)(node.childCount);
+            storage.subTreeSize = decltype(storage.subTreeSize)(node.subTreeSize);
+            nodes.push_back(storage);
+        }
     }
     
     // Return the number of nodes in a tree.
     size_t getNodeCount() const { return nodes.size(); }
+    
+    typedef NodeStorage NodeStorageType;
+    
+    // Return the nodes of this tree in preorder, which allows a tree to be stored in a binary format.
+    const NodeStorage *nodeData() const { return nodes.data(); }
+    
+    // Replace the contents of this tree by the given nodes in preorder, which must form a tree.
+    void assignNodes(const NodeStorage *first, size_t count) {
+        assert(isValidNodeArray(first, count) && "The nodes don't form a tree");
+        GENETIC_PROFILE_ALLOCATIONS("Tree::nodeAllocations", nodes);
+        nodes.assign(first, first + count);
+    }
+    
+    // Return true if the given nodes in preorder form exactly one tree with consistent sub-tree sizes.
+    static bool isValidNodeArray(const NodeStorage *nodes, size_t count) {
+        if (count == 0 || nodes[0].subTreeSize != count) {
+            return false;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            size_t end = i + nodes[i].subTreeSize;
+            if (nodes[i].subTreeSize == 0 || end > count) {
+                return false;
+            }
+            size_t child = i + 1;
+            for (size_t j = 0; j < nodes[i].childCount; ++j) {
+                if (child >= end) {
+                    return false;
+                }
+                child += nodes[child].subTreeSize;
+            }
+            if (child != end) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    // Return a hash of the structure of this tree, which combines the values and the child counts of the nodes in preorder.
+    // Trees that are equal have the same hash.
+    uint64_t structuralHash() const {
+        uint64_t hash = nodes.size();
+        for (const auto &node : nodes) {
+            uint64_t x = (uint64_t(node.value) << 16) ^ uint64_t(node.childCount);
+            hash ^= x + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+        }
+        // Finalize the hash with the splitmix64 mixer, so that all of the bits depend on all of the nodes.
+        hash ^= hash >> 30; hash *= 0xbf58476d1ce4e5b9ull;
+        hash ^= hash >> 27; hash *= 0x94d049bb133111ebull;
+        hash ^= hash >> 31;
+        return hash;
+    }
+
+    // Return the number of nodes on the longest path from the root to a leaf; a single node has a depth of 1.
+    size_t getDepth() const {
+        return nodes.empty() ? 0 : getSubTreeDepth(0);
+    }
+
+    // Return the depth of the sub-tree with the given root node id.
+    size_t getSubTreeDepth(size_t subRootNodeId) const {
+        assert(subRootNodeId < nodes.size());
+        size_t depth = 0;
+        for (size_t child = subRootNodeId + 1, end = subRootNodeId + nodes[subRootNodeId].subTreeSize; child < end; child += nodes[child].subTreeSize) {
+            depth = std::max(depth, getSubTreeDepth(child));
+        }
+        return depth + 1;
+    }
+
+    // Return the number of nodes on the path from the root to the given node; the root has a level of 1.
+    size_t getLevel(size_t nodeId) const {
+        size_t level = 1;
+        forEachAncestor(nodeId, [&] (size_t) {
+            ++level;
+        });
+        return level;
+    }
 	
 	struct Iterator;
 	
 	// A reference to a node in a tree.
 	struct Node {
-		const Tree<T> &tree;
+		const Tree &tree;
 		size_t nodeId;
 	public:
 		T value;
 		
-		Node(const Tree<T> &tree, size_t nodeId) : tree(tree), nodeId(nodeId), value(tree.nodes[nodeId].value) {
+		Node(const Tree &tree, size_t nodeId) : tree(tree), nodeId(nodeId), value(tree.nodes[nodeId].value) {
 		}
 		
 		// Return the iterator with the first child.
@@ -97,6 +232,11 @@ public:
 			return tree.nodes[nodeId].childCount;
 		}
 		
+		// Return the number of nodes in this sub-tree, including this node.
+		size_t subTreeSize() const {
+			return tree.nodes[nodeId].subTreeSize;
+		}
+		
 		bool isEmpty() const {
 			return size() == 0;
 		}
@@ -116,10 +256,10 @@ public:
 	};
 	
 	struct Iterator {
-		const Tree<T> &tree;
+		const Tree &tree;
 		size_t nodeId;
 	public:
-		Iterator(const Tree<T> &tree, size_t nodeId) : tree(tree), nodeId(nodeId) { }
+		Iterator(const Tree &tree, size_t nodeId) : tree(tree), nodeId(nodeId) { }
 
 		Node operator *() const {
 			assert(nodeId < tree.nodes.size());
@@ -158,38 +298,85 @@ public:
 		return Node(*this, nodeId);
 	}
 	
+    // Call the given function with the node id of every ancestor of the given node, starting with the root.
+    // The function may modify the sub-tree size of the ancestor that it's given.
+    template <typename Function>
+    void forEachAncestor(size_t nodeId, Function fn) const {
+        assert(nodeId < nodes.size());
+        size_t i = 0;
+        while (i != nodeId) {
+            fn(i);
+            // Descend into the child that contains the node.
+            size_t child = i + 1;
+            while (child + nodes[child].subTreeSize <= nodeId) {
+                child += nodes[child].subTreeSize;
+            }
+            i = child;
+        }
+    }
+    
     // Return the sub-tree that uses the node with the given node id as root.
-    Tree<T> getSubTree(size_t subRootNodeId) {
+    Tree getSubTree(size_t subRootNodeId) {
         assert(subRootNodeId < nodes.size());
-        return Tree<T>(std::vector<NodeStorage>(nodes.begin() + subRootNodeId, nodes.begin() + subRootNodeId + nodes[subRootNodeId].subTreeSize));
+        GENETIC_PROFILE_COUNT("Tree::nodeAllocations", 1);
+        return Tree(std::vector<NodeStorage>(nodes.begin() + subRootNodeId, nodes.begin() + subRootNodeId + nodes[subRootNodeId].subTreeSize));
     }
     
     // Replace a sub-tree with the given node id by the given sub-tree.
-    void replace(size_t nodeId, const Tree<T> &subTree) {
-        assert(nodeId < nodes.size());
-        nodes.erase(nodes.begin() + nodeId, nodes.begin() + nodeId + nodes[nodeId].subTreeSize);
-        nodes.insert(nodes.begin() + nodeId, subTree.nodes.begin(), subTree.nodes.end());
-        auto i = root();
-        recomputeSubTreeSizes(i, nodeId, subTree.nodes.size());
-        assert(nodes[0].subTreeSize == nodes.size());
+    void replace(size_t nodeId, const Tree &subTree) {
+        assert(&subTree != this);
+        GENETIC_PROFILE_SCOPE("Tree::replace");
+        splice(nodeId, subTree.nodes.data(), subTree.nodes.size());
+    }
+
+    // Replace a sub-tree with the given node id by the given nodes in preorder, which must form a tree.
+    void replace(size_t nodeId, const NodeStorage *subTree, size_t subTreeSize) {
+        assert(isValidNodeArray(subTree, subTreeSize) && "The nodes don't form a tree");
+        GENETIC_PROFILE_SCOPE("Tree::replace");
+        splice(nodeId, subTree, subTreeSize);
+    }
+    
+    /// Reusable storage for the nodes that are exchanged by swapSubTrees.
+    class SwapBuffer {
+        std::vector<NodeStorage> nodes;
+        friend class Tree;
+    };
+    
+    // Exchange the sub-tree with the given node id with the sub-tree with the given node id in the other tree.
+    // The subtree sizes are only updated along the paths from the roots to the exchanged sub-trees, and
+    // no memory is allocated once the trees and the buffer have grown to a sufficient capacity.
+    void swapSubTrees(size_t nodeId, Tree &other, size_t otherNodeId, SwapBuffer &buffer) {
+        assert(&other != this);
+        assert(nodeId < nodes.size() && otherNodeId < other.nodes.size());
+        size_t size = nodes[nodeId].subTreeSize, otherSize = other.nodes[otherNodeId].subTreeSize;
+        if (size == otherSize) {
+            std::swap_ranges(nodes.begin() + nodeId, nodes.begin() + nodeId + size, other.nodes.begin() + otherNodeId);
+            return;
+        }
+        buffer.nodes.assign(nodes.begin() + nodeId, nodes.begin() + nodeId + size);
+        splice(nodeId, other.nodes.data() + otherNodeId, otherSize);
+        other.splice(otherNodeId, buffer.nodes.data(), size);
     }
     
     /// Helper class that constructs trees.
     class Builder {
-        Tree<T> &tree;
+        Tree &tree;
         std::vector<size_t> stack;
     public:
-        Builder(Tree<T> &tree) : tree(tree) { }
+        Builder(Tree &tree) : tree(tree) { }
         
         void push(T value) {
-            if (!stack.empty())
+            if (!stack.empty()) {
+                assert(tree.nodes[stack.back()].childCount < NodeStorage::maxChildCount);
                 tree.nodes[stack.back()].childCount++;
+            }
             stack.push_back(tree.addNode(value));
         }
         
         void add(T value) {
             tree.addNode(value);
             if (!stack.empty()) {
+                assert(tree.nodes[stack.back()].childCount < NodeStorage::maxChildCount);
                 tree.nodes[stack.back()].childCount++;
                 tree.nodes[stack.back()].subTreeSize++;
             }
@@ -204,19 +391,6 @@ public:
                 tree.nodes[stack.back()].subTreeSize += size;
         }
     };
-
-private:
-    unsigned recomputeSubTreeSizes(Enumerator &tree, size_t nodeId, unsigned newSubTreeSize) {
-        auto parentNodeId = tree.currentNodeId();
-        auto node = tree.advance();
-        if (!node.childCount) { return 1; }
-        unsigned subTreeSize = 1;
-        for (unsigned i = 0; i < node.childCount; ++i) {
-            subTreeSize += recomputeSubTreeSizes(tree, nodeId, newSubTreeSize);
-        }
-        nodes[parentNodeId].subTreeSize = subTreeSize;
-        return subTreeSize;
-    }
 };
 	
 } // end namespace core
@@ -0,0 +1,181 @@
+#pragma once
+
+#include "treeProgram.h"
+#include "profiler.h"
+#include <vector>
+#include <cstdint>
+
+namespace genetic {
+
+/// Loops over columns of fitness case values that are used to implement the batched evaluators.
+/// The columns never alias, so the compiler can vectorize these loops.
+namespace batch {
+
+template<typename T>
+inline void fill(T value, T *__restrict result, size_t count) {
+	for (size_t i = 0; i < count; ++i) {
+		result[i] = value;
+	}
+}
+
+template<typename T>
+inline void copy(const T *__restrict x, T *__restrict result, size_t count) {
+	for (size_t i = 0; i < count; ++i) {
+		result[i] = x[i];
+	}
+}
+
+template<typename T>
+inline void negate(const T *__restrict x, T *__restrict result, size_t count) {
+	for (size_t i = 0; i < count; ++i) {
+		result[i] = -x[i];
+	}
+}
+
+template<typename T>
+inline void add(const T *__restrict x, const T *__restrict y, T *__restrict result, size_t count) {
+	for (size_t i = 0; i < count; ++i) {
+		result[i] = x[i] + y[i];
+	}
+}
+
+template<typename T>
+inline void subtract(const T *__restrict x, const T *__restrict y, T *__restrict result, size_t count) {
+	for (size_t i = 0; i < count; ++i) {
+		result[i] = x[i] - y[i];
+	}
+}
+
+template<typename T>
+inline void multiply(const T *__restrict x, const T *__restrict y, T *__restrict result, size_t count) {
+	for (size_t i = 0; i < count; ++i) {
+		result[i] = x[i] * y[i];
+	}
+}
+
+/// The memory of the columns of a batched evaluator, which is reused by every program.
+template<typename T>
+class ColumnStorage {
+	std::vector<unsigned char> bytes;
+public:
+	// Columns are aligned to the cache line size, which is enough for any vector unit.
+	static constexpr size_t columnAlignment = 64;
+
+	// Replace the given columns by the given number of columns of blockSize values each.
+	void reserve(size_t columnCount, size_t blockSize, std::vector<T *> &columns) {
+		// Every column starts at an aligned address, whatever the block size.
+		size_t columnBytes = (blockSize * sizeof(T) + columnAlignment - 1) & ~(columnAlignment - 1);
+		size_t size = columnCount * columnBytes + columnAlignment;
+		if (bytes.size() < size) {
+			bytes.resize(size);
+		}
+		auto base = reinterpret_cast<std::uintptr_t>(bytes.data());
+		base = (base + columnAlignment - 1) & ~std::uintptr_t(columnAlignment - 1);
+		columns.clear();
+		for (size_t i = 0; i < columnCount; ++i) {
+			columns.push_back(reinterpret_cast<T *>(base + i * columnBytes));
+		}
+	}
+};
+
+} // end namespace batch
+
+/// Executes a compiled GP tree for a batch of fitness cases at once.
+/// Every stack slot holds a column of values, one value per fitness case, so the program is interpreted once per
+/// block of cases and every instruction turns into a loop over the block. The derived evaluator implements these methods:
+///
+///   void evaluateTerminal(unsigned definitionId, TreeGenomeValue value, size_t firstCase, size_t count, T *result);
+///   void evaluateUnaryFunction(unsigned definitionId, const T *x, T *result, size_t count);
+///   void evaluateBinaryFunction(unsigned definitionId, const T *x, const T *y, T *result, size_t count);
+///   void evaluateFunction(unsigned definitionId, const T *const *arguments, unsigned argumentCount, T *result, size_t count);
+///
+/// The result column never aliases the argument columns. T must be a trivially copyable value type.
+template<typename T, typename Derived>
+struct TreeGenomeProgramBatchEvaluator {
+private:
+	size_t blockSize;
+	batch::ColumnStorage<T> storage;
+	std::vector<T *> freeColumns;
+	std::vector<T *> stack;
+	std::vector<const T *> arguments;
+
+	void reserveColumns(size_t columnCount) {
+		storage.reserve(columnCount, blockSize, freeColumns);
+	}
+
+	template<bool hasConstants>
+	void evaluateBlock(const TreeGenomeProgram &program, const T *constants, size_t firstCase, size_t count) {
+		auto &self = static_cast<Derived &>(*this);
+		for (const auto &instruction : program.instructions) {
+			T *result = freeColumns.back();
+			freeColumns.pop_back();
+			switch (instruction.argumentCount) {
+				case 0:
+					if (hasConstants && instruction.definitionId == TreeGenomeProgram::constantDefinitionId) {
+						batch::fill(constants[instruction.value], result, count);
+					} else {
+						self.evaluateTerminal(instruction.definitionId, instruction.value, firstCase, count, result);
+					}
+					break;
+				case 1:
+					self.evaluateUnaryFunction(instruction.definitionId, stack.back(), result, count);
+					break;
+				case 2:
+					self.evaluateBinaryFunction(instruction.definitionId, stack.end()[-1], stack.end()[-2], result, count);
+					break;
+				default:
+					// The first argument is on the top of the stack.
+					arguments.assign(stack.rbegin(), stack.rbegin() + instruction.argumentCount);
+					self.evaluateFunction(instruction.definitionId, arguments.data(), instruction.argumentCount, result, count);
+					break;
+			}
+			for (unsigned i = 0; i < instruction.argumentCount; ++i) {
+				freeColumns.push_back(stack.back());
+				stack.pop_back();
+			}
+			stack.push_back(result);
+		}
+		assert(stack.size() == 1);
+	}
+
+	template<bool hasConstants>
+	void run(const TreeGenomeProgram &program, const T *constants, size_t caseCount, T *results) {
+		// One more column than the stack depth, as a result is written before its arguments are released.
+		reserveColumns(program.maxStackDepth + 1);
+		for (size_t firstCase = 0; firstCase < caseCount; firstCase += blockSize) {
+			size_t count = std::min(blockSize, caseCount - firstCase);
+			stack.clear();
+			evaluateBlock<hasConstants>(program, constants, firstCase, count);
+			batch::copy(stack.back(), results + firstCase, count);
+			freeColumns.push_back(stack.back());
+		}
+	}
+public:
+	// The block size is the number of fitness cases that are evaluated by one pass over the program.
+	explicit TreeGenomeProgramBatchEvaluator(size_t blockSize = 256) : blockSize(blockSize) {
+		assert(blockSize != 0);
+	}
+
+	// Evaluate the program for the fitness cases [0, caseCount), writing one result per case.
+	void operator()(const TreeGenomeProgram &program, size_t caseCount, T *results) {
+		GENETIC_PROFILE_SCOPE("TreeGenomeProgramBatchEvaluator::evaluate");
+		run<false>(program, nullptr, caseCount, results);
+	}
+
+	void operator()(const SimplifiedTreeGenomeProgram<T> &program, size_t caseCount, T *results) {
+		GENETIC_PROFILE_SCOPE("TreeGenomeProgramBatchEvaluator::evaluate");
+		run<true>(program, program.constants.data(), caseCount, results);
+	}
+
+	void evaluateUnaryFunction(unsigned definitionId, const T *x, T *result, size_t count) {
+		batch::copy(x, result, count);
+	}
+	void evaluateBinaryFunction(unsigned definitionId, const T *x, const T *y, T *result, size_t count) {
+		batch::fill(T(), result, count);
+	}
+	void evaluateFunction(unsigned definitionId, const T *const *arguments, unsigned argumentCount, T *result, size_t count) {
+		batch::fill(T(), result, count);
+	}
+};
+
+} // end namespace genetic
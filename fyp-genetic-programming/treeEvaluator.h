@@ -2,6 +2,7 @@
 
 #include "genome.h"
 #include "grammar.h"
+#include "profiler.h"
 #include <vector>
 
 namespace genetic {
@@ -38,6 +39,7 @@ public:
 	}
 
 	T operator()(const TreeGenome &tree){
+		GENETIC_PROFILE_SCOPE("TreeGenomeEvaluator::evaluate");
 		return (*this)(tree.first());
 	}
 
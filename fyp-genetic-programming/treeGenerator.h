@@ -2,6 +2,7 @@
 
 #include "genome.h"
 #include "grammar.h"
+#include "profiler.h"
 #include <random>
 
 namespace genetic {
@@ -83,11 +84,13 @@ public:
 
 	/// Generate a tree that grows fully until it reaches the specified depth.
 	void generateFull(TreeGenome::Builder &builder, int maxDepth, TreeGenomeType type = grammar::Type::invalidTypeId) {
+		GENETIC_PROFILE_SCOPE("TreeGenerator::generate");
 		generate(builder, maxDepth, Strategy::Full, type);
 	}
 
 	/// Generate a tree that can grow until max depth, but doesn't have to.
 	void generateGrow(TreeGenome::Builder &builder, int maxDepth, TreeGenomeType type = grammar::Type::invalidTypeId) {
+		GENETIC_PROFILE_SCOPE("TreeGenerator::generate");
 		generate(builder, maxDepth, Strategy::Grow, type);
 	}
 };
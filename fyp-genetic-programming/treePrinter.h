@@ -3,6 +3,9 @@
 #include "genome.h"
 #include "grammar.h"
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
 
 namespace genetic {
 
@@ -12,38 +15,72 @@ public:
 	virtual ~TreeGenomePrinterDelegate() {}
 	// The tree printer calls this method before printing the given terminal node. If this method returns true, the tree printer won't print the given terminal node using the default behaviour.
 	virtual bool printTerminal(const grammar::Definition &definition, const TreeGenome::Node &node, std::ostream &os) = 0;
+
+	// The tree printer calls this method before appending the given terminal node to a buffer. The default
+	// implementation appends what the stream version prints, so overriding it avoids the stream.
+	virtual bool appendTerminal(const grammar::Definition &definition, const TreeGenome::Node &node, std::string &buffer) {
+		std::ostringstream os;
+		bool isPrinted = printTerminal(definition, node, os);
+		buffer += os.str();
+		return isPrinted;
+	}
 };
 
-// Prints out the GP tree.
+// Prints out the GP tree. The trees are rendered without recursion into a buffer that's reused by every tree, which
+// is written to the stream at once.
 struct TreeGenomePrinter {
 	const grammar::Grammar &defs;
+private:
+	std::string buffer;
+	// The number of arguments that are still missing for every function that's being printed.
+	std::vector<unsigned> missingArguments;
+
+	// Append the sub-tree of the given tree whose nodes are in the given range to the given buffer.
+	void append(const TreeGenome &tree, size_t firstNode, size_t endNode, std::string &buffer, TreeGenomePrinterDelegate *delegate) {
+		missingArguments.clear();
+		for (size_t i = firstNode; i < endNode; ++i) {
+			if (!missingArguments.empty()) {
+				buffer += ' ';
+				--missingArguments.back();
+			}
+			const auto node = tree[i];
+			const auto &definition = defs[node];
+			if (!definition.isTerminal()) {
+				assert(node.size() == definition.getNumArguments());
+				buffer += '(';
+				buffer += definition.getName();
+				missingArguments.push_back(definition.getNumArguments());
+				continue;
+			}
+			assert(node.isEmpty());
+			if (!delegate || !delegate->appendTerminal(definition, node, buffer)) {
+				buffer += definition.getName();
+			}
+			while (!missingArguments.empty() && missingArguments.back() == 0) {
+				buffer += ')';
+				missingArguments.pop_back();
+			}
+		}
+	}
 public:
 
 	TreeGenomePrinter(const grammar::Grammar &definitions) : defs(definitions) { }
 
 	void print(const TreeGenome::Node &node, std::ostream &os, TreeGenomePrinterDelegate *delegate = nullptr) {
-		const auto &definition = defs[node];
-		if (definition.isTerminal()) {
-			assert(node.isEmpty());
-			if (delegate && delegate->printTerminal(definition, node, os)) {
-				return;
-			}
-			os << definition.getName();
-			return;
-		}
-		assert(node.size() == definition.getNumArguments());
-		os << "(" << definition.getName();
-		for (auto child : node) {
-			os << " ";
-			print(child, os, delegate);
-		}
-		os << ")";
+		buffer.clear();
+		append(node.tree, node.nodeId, node.nodeId + node.subTreeSize(), buffer, delegate);
+		os.write(buffer.data(), std::streamsize(buffer.size()));
+	}
+
+	// Append the given tree to the given buffer, as it's printed to a stream.
+	void print(const TreeGenome &tree, std::string &buffer, TreeGenomePrinterDelegate *delegate = nullptr) {
+		append(tree, 0, tree.getNodeCount(), buffer, delegate);
 	}
 
 	void print(const TreeGenome &tree, std::ostream &os, TreeGenomePrinterDelegate *delegate = nullptr) {
-		for (auto node : tree) {
-			print(node, os, delegate);
-		}
+		buffer.clear();
+		print(tree, buffer, delegate);
+		os.write(buffer.data(), std::streamsize(buffer.size()));
 	}
 };
 
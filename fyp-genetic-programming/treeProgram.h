@@ -0,0 +1,159 @@
+#pragma once
+
+#include "genome.h"
+#include "grammar.h"
+#include "profiler.h"
+#include <vector>
+#include <algorithm>
+
+namespace genetic {
+
+/// A GP tree that's lowered into a flat sequence of instructions.
+/// The instructions are stored in reverse preorder, so every instruction is executed after the
+/// instructions that compute its arguments, and a program can be executed with a simple value stack.
+struct TreeGenomeProgram {
+	struct Instruction {
+		unsigned definitionId;
+		unsigned argumentCount;
+		// The raw node value, which allows terminals to encode additional information in their weight range.
+		TreeGenomeValue value;
+	};
+	// The definition id of the instructions that push a constant of a simplified program.
+	static constexpr unsigned constantDefinitionId = ~0u;
+	std::vector<Instruction> instructions;
+	// The number of stack slots that are needed to execute this program.
+	unsigned maxStackDepth = 0;
+private:
+	template<typename NodeType>
+	void compileSubTree(const grammar::Grammar &grammar, const NodeType &node) {
+		instructions.resize(node.subTreeSize());
+		const auto &tree = node.tree;
+		size_t nodeId = node.nodeId;
+		unsigned depth = 0;
+		maxStackDepth = 0;
+		for (size_t i = 0, e = instructions.size(); i < e; ++i) {
+			auto child = tree[nodeId + e - 1 - i];
+			const auto &definition = grammar[grammar.definitionIdForTreeGenomeValue(child.value)];
+			assert(child.size() == definition.getNumArguments());
+			Instruction &instruction = instructions[i];
+			instruction.definitionId = definition.getDefinitionId();
+			instruction.argumentCount = definition.getNumArguments();
+			instruction.value = child.value;
+			assert(depth >= instruction.argumentCount);
+			depth = depth - instruction.argumentCount + 1;
+			maxStackDepth = std::max(maxStackDepth, depth);
+		}
+		assert(depth == 1);
+	}
+public:
+
+	TreeGenomeProgram() { }
+
+	TreeGenomeProgram(const grammar::Grammar &grammar, const TreeGenome &tree) {
+		compile(grammar, tree);
+	}
+
+	TreeGenomeProgram(const grammar::Grammar &grammar, const TreeGenome::Node &node) {
+		compile(grammar, node);
+	}
+
+	// Lower the sub-tree that starts at the given node into this program.
+	// The storage of the previous program is reused.
+	void compile(const grammar::Grammar &grammar, const TreeGenome::Node &node) {
+		compileSubTree(grammar, node);
+	}
+
+	void compile(const grammar::Grammar &grammar, const TreeGenome &tree) {
+		compileSubTree(grammar, tree.first());
+	}
+
+	void compile(const grammar::Grammar &grammar, const CompactTreeGenome::Node &node) {
+		compileSubTree(grammar, node);
+	}
+
+	void compile(const grammar::Grammar &grammar, const CompactTreeGenome &tree) {
+		compileSubTree(grammar, tree.first());
+	}
+
+	size_t size() const {
+		return instructions.size();
+	}
+};
+
+/// A program that's produced by TreeGenomeSimplifier. Besides the instructions of the grammar it has
+/// instructions that push the constants that were folded from the tree. Their definition id is
+/// TreeGenomeProgram::constantDefinitionId and their value is the index of the constant.
+template<typename T>
+struct SimplifiedTreeGenomeProgram : TreeGenomeProgram {
+	std::vector<T> constants;
+};
+
+/// Executes compiled GP trees.
+/// The derived evaluator implements the terminals and the functions by declaring the evaluate methods below,
+/// which are dispatched statically by the interpreter loop. The value stack is reused between the runs.
+template<typename T, typename Derived>
+struct TreeGenomeProgramEvaluator {
+private:
+	std::vector<T> stack;
+
+	template<bool hasConstants>
+	T run(const TreeGenomeProgram &program, const T *constants) {
+		if (stack.size() < program.maxStackDepth) {
+			stack.resize(program.maxStackDepth);
+		}
+		auto &self = static_cast<Derived &>(*this);
+		// Points one past the top of the stack. The first argument of a function is on the top of the stack.
+		T *top = stack.data();
+		for (const auto &instruction : program.instructions) {
+			switch (instruction.argumentCount) {
+				case 0:
+					if (hasConstants && instruction.definitionId == TreeGenomeProgram::constantDefinitionId) {
+						*top = constants[instruction.value];
+					} else {
+						*top = self.evaluateTerminal(instruction.definitionId, instruction.value);
+					}
+					++top;
+					break;
+				case 1:
+					top[-1] = self.evaluateUnaryFunction(instruction.definitionId, top[-1]);
+					break;
+				case 2:
+					top[-2] = self.evaluateBinaryFunction(instruction.definitionId, top[-1], top[-2]);
+					--top;
+					break;
+				default: {
+					T *arguments = top - instruction.argumentCount;
+					std::reverse(arguments, top);
+					*arguments = self.evaluateFunction(instruction.definitionId, arguments, instruction.argumentCount);
+					top = arguments + 1;
+					break;
+				}
+			}
+		}
+		assert(top == stack.data() + 1);
+		return stack[0];
+	}
+public:
+
+	T operator()(const TreeGenomeProgram &program) {
+		GENETIC_PROFILE_SCOPE("TreeGenomeProgramEvaluator::evaluate");
+		return run<false>(program, nullptr);
+	}
+
+	T operator()(const SimplifiedTreeGenomeProgram<T> &program) {
+		GENETIC_PROFILE_SCOPE("TreeGenomeProgramEvaluator::evaluate");
+		return run<true>(program, program.constants.data());
+	}
+
+	T evaluateUnaryFunction(unsigned definitionId, T x) {
+		return x;
+	}
+	T evaluateBinaryFunction(unsigned definitionId, T x, T y) {
+		return T();
+	}
+	T evaluateFunction(unsigned definitionId, const T *arguments, unsigned argumentCount) {
+		return T();
+	}
+};
+
+} // end namespace genetic
@@ -0,0 +1,255 @@
+#pragma once
+
+#include "genome.h"
+#include "grammar.h"
+#include "treeProgram.h"
+#include <vector>
+#include <algorithm>
+
+namespace genetic {
+
+/// The algebraic properties of a function definition, which allow TreeGenomeSimplifier to rewrite its nodes.
+/// The identity, annihilator and cancellation properties apply to binary functions only.
+template<typename T>
+struct AlgebraicProperties {
+	// f(x, y) = f(y, x). The identity applies to both of the arguments of a commutative function.
+	bool isCommutative = false;
+	// f can be computed when all of its arguments are constants, so it doesn't depend on a fitness case.
+	bool isConstantFoldable = false;
+	// f(x, identity) = x, like x - 0 and x * 1.
+	bool hasIdentity = false;
+	T identity = T();
+	// f(x, annihilator) = f(annihilator, x) = annihilator, like x * 0.
+	bool hasAnnihilator = false;
+	T annihilator = T();
+	// f(x, x) = cancellation, like x - x = 0.
+	bool isCancelling = false;
+	T cancellation = T();
+};
+
+/// Tells the simplifier what the definitions of a grammar mean. Nothing is assumed about a definition by default.
+/// The delegate must only declare the properties that hold for all of the values that the evaluator
+/// can produce, e.g. x * 0 isn't 0 for floats that can be infinite.
+template<typename T>
+class TreeGenomeSimplifierDelegate {
+public:
+	virtual ~TreeGenomeSimplifierDelegate() { }
+
+	virtual AlgebraicProperties<T> propertiesForFunction(unsigned definitionId) {
+		return AlgebraicProperties<T>();
+	}
+
+	// Return true and set the result when the given terminal is a constant.
+	virtual bool valueForConstantTerminal(unsigned definitionId, TreeGenomeValue value, T &result) {
+		return false;
+	}
+
+	// Return the same raw value for the terminals that evaluate to the same value, like the terminals
+	// that use the weight range to encode a parameter index. This allows equal sub-trees to be found.
+	virtual TreeGenomeValue canonicalValueForTerminal(unsigned definitionId, TreeGenomeValue value) {
+		return value;
+	}
+
+	// Compute a constant foldable function. The first argument is arguments[0].
+	virtual T evaluateFunction(unsigned definitionId, const T *arguments, unsigned argumentCount) {
+		assert(false && "The delegate must evaluate the constant foldable functions");
+		return T();
+	}
+};
+
+/// Rewrites a GP tree into a smaller program that computes the same value, by folding the constant sub-trees
+/// and by applying the algebraic properties that are declared by the delegate. The genome isn't changed,
+/// so the simplification doesn't affect the evolution, only the cost of evaluating an individual.
+/// The result is run by the evaluators like any other program, see SimplifiedTreeGenomeProgram.
+template<typename T>
+class TreeGenomeSimplifier {
+	typedef TreeGenomeProgram::Instruction Instruction;
+
+	const grammar::Grammar &grammar;
+	TreeGenomeSimplifierDelegate<T> &delegate;
+	// The properties of every definition.
+	std::vector<AlgebraicProperties<T>> properties;
+	// The node ids of the children of the nodes that are being simplified, and the bounds of their instructions.
+	std::vector<size_t> childNodeIds;
+	std::vector<size_t> argumentBounds;
+	// The arguments of a function that's folded.
+	std::vector<T> arguments;
+
+	SimplifiedTreeGenomeProgram<T> *program = nullptr;
+
+	bool isConstant(size_t instructionIndex, T &value) {
+		const auto &instruction = program->instructions[instructionIndex];
+		if (instruction.definitionId == TreeGenomeProgram::constantDefinitionId) {
+			value = program->constants[instruction.value];
+			return true;
+		}
+		return instruction.argumentCount == 0 && delegate.valueForConstantTerminal(instruction.definitionId, instruction.value, value);
+	}
+
+	// Replace the instructions after the given index by a constant.
+	void emitConstant(size_t begin, T value) {
+		auto &instructions = program->instructions;
+		instructions.resize(begin);
+		Instruction instruction;
+		instruction.definitionId = TreeGenomeProgram::constantDefinitionId;
+		instruction.argumentCount = 0;
+		instruction.value = TreeGenomeValue(program->constants.size());
+		instructions.push_back(instruction);
+		program->constants.push_back(value);
+	}
+
+	// Replace the instructions after the given index by the given range of them.
+	void emitRange(size_t begin, size_t rangeBegin, size_t rangeEnd) {
+		auto &instructions = program->instructions;
+		std::copy(instructions.begin() + rangeBegin, instructions.begin() + rangeEnd, instructions.begin() + begin);
+		instructions.resize(begin + (rangeEnd - rangeBegin));
+	}
+
+	bool isEqual(size_t begin, size_t end, size_t otherBegin, size_t otherEnd) {
+		if (end - begin != otherEnd - otherBegin) {
+			return false;
+		}
+		const auto &instructions = program->instructions;
+		for (size_t i = begin, j = otherBegin; i < end; ++i, ++j) {
+			if (instructions[i].definitionId != instructions[j].definitionId || instructions[i].argumentCount != instructions[j].argumentCount) {
+				return false;
+			}
+			if (instructions[i].argumentCount != 0) {
+				continue;
+			}
+			if (instructions[i].definitionId == TreeGenomeProgram::constantDefinitionId) {
+				if (!(program->constants[instructions[i].value] == program->constants[instructions[j].value])) {
+					return false;
+				}
+			} else if (instructions[i].value != instructions[j].value) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Append the given function, whose simplified arguments start at the given instruction index,
+	// or replace it and its arguments by a simpler equivalent.
+	void rewriteFunction(const Instruction &instruction, size_t begin, size_t boundsBegin) {
+		const size_t argumentCount = instruction.argumentCount;
+		auto argumentBegin = [&] (size_t i) { return argumentBounds[boundsBegin + argumentCount - 1 - i]; };
+		auto argumentEnd = [&] (size_t i) { return argumentBounds[boundsBegin + argumentCount - i]; };
+		const auto &props = properties[instruction.definitionId];
+		if (props.isConstantFoldable) {
+			arguments.resize(argumentCount);
+			bool isFoldable = true;
+			for (size_t i = 0; i < argumentCount && isFoldable; ++i) {
+				isFoldable = argumentEnd(i) - argumentBegin(i) == 1 && isConstant(argumentBegin(i), arguments[i]);
+			}
+			if (isFoldable) {
+				emitConstant(begin, delegate.evaluateFunction(instruction.definitionId, arguments.data(), instruction.argumentCount));
+				return;
+			}
+		}
+		if (argumentCount == 2) {
+			T x, y;
+			bool isXConstant = argumentEnd(0) - argumentBegin(0) == 1 && isConstant(argumentBegin(0), x);
+			bool isYConstant = argumentEnd(1) - argumentBegin(1) == 1 && isConstant(argumentBegin(1), y);
+			if (props.hasAnnihilator && ((isXConstant && x == props.annihilator) || (isYConstant && y == props.annihilator))) {
+				emitConstant(begin, props.annihilator);
+				return;
+			}
+			if (props.hasIdentity) {
+				if (isYConstant && y == props.identity) {
+					emitRange(begin, argumentBegin(0), argumentEnd(0));
+					return;
+				}
+				if (props.isCommutative && isXConstant && x == props.identity) {
+					emitRange(begin, argumentBegin(1), argumentEnd(1));
+					return;
+				}
+			}
+			if (props.isCancelling && isEqual(argumentBegin(0), argumentEnd(0), argumentBegin(1), argumentEnd(1))) {
+				emitConstant(begin, props.cancellation);
+				return;
+			}
+		}
+		program->instructions.push_back(instruction);
+	}
+
+	// Append the simplified instructions of the given sub-tree, which are in the order of TreeGenomeProgram,
+	// so the instructions of the sub-tree end with its root.
+	template<typename TreeType>
+	void simplifyNode(const TreeType &tree, size_t nodeId) {
+		auto node = tree[nodeId];
+		const auto &definition = grammar[grammar.definitionIdForTreeGenomeValue(node.value)];
+		assert(node.size() == definition.getNumArguments());
+		auto &instructions = program->instructions;
+		Instruction instruction;
+		instruction.definitionId = definition.getDefinitionId();
+		instruction.argumentCount = definition.getNumArguments();
+		if (definition.isTerminal()) {
+			instruction.value = delegate.canonicalValueForTerminal(instruction.definitionId, node.value);
+			instructions.push_back(instruction);
+			return;
+		}
+		// The function values don't carry any information, so equal functions have equal values.
+		instruction.value = definition.getNodeValue();
+
+		// The last argument is computed first, so the first argument ends up on the top of the stack.
+		size_t childrenBegin = childNodeIds.size();
+		for (auto child : node) {
+			childNodeIds.push_back(child.nodeId);
+		}
+		const size_t argumentCount = instruction.argumentCount;
+		// The instructions of the arguments start at these bounds, from the last argument to the first one.
+		const size_t begin = instructions.size();
+		size_t boundsBegin = argumentBounds.size();
+		for (size_t i = 0; i < argumentCount; ++i) {
+			argumentBounds.push_back(instructions.size());
+			simplifyNode(tree, childNodeIds[childrenBegin + argumentCount - 1 - i]);
+		}
+		argumentBounds.push_back(instructions.size());
+		childNodeIds.resize(childrenBegin);
+		// The sub-trees of the arguments have popped their bounds, so these are the bounds of this node.
+		assert(argumentBounds.size() == boundsBegin + argumentCount + 1);
+
+		rewriteFunction(instruction, begin, boundsBegin);
+		argumentBounds.resize(boundsBegin);
+	}
+
+	template<typename TreeType>
+	void simplifyTree(const TreeType &tree, SimplifiedTreeGenomeProgram<T> &result) {
+		program = &result;
+		result.instructions.clear();
+		result.constants.clear();
+		simplifyNode(tree, 0);
+		program = nullptr;
+		unsigned depth = 0;
+		result.maxStackDepth = 0;
+		for (const auto &instruction : result.instructions) {
+			assert(depth >= instruction.argumentCount);
+			depth = depth - instruction.argumentCount + 1;
+			result.maxStackDepth = std::max(result.maxStackDepth, depth);
+		}
+		assert(depth == 1);
+	}
+public:
+	TreeGenomeSimplifier(const grammar::Grammar &grammar, TreeGenomeSimplifierDelegate<T> &delegate) : grammar(grammar), delegate(delegate) {
+		for (const auto &definition : grammar.definitions()) {
+			properties.push_back(definition.isFunction() ? delegate.propertiesForFunction(definition.getDefinitionId()) : AlgebraicProperties<T>());
+		}
+	}
+
+	// Simplify the given tree into the given program. The storage of the previous program is reused.
+	void simplify(const TreeGenome &tree, SimplifiedTreeGenomeProgram<T> &result) {
+		simplifyTree(tree, result);
+	}
+
+	void simplify(const CompactTreeGenome &tree, SimplifiedTreeGenomeProgram<T> &result) {
+		simplifyTree(tree, result);
+	}
+
+	SimplifiedTreeGenomeProgram<T> operator()(const TreeGenome &tree) {
+		SimplifiedTreeGenomeProgram<T> result;
+		simplify(tree, result);
+		return result;
+	}
+};
+
+} // end namespace genetic
@@ -1,7 +1,10 @@
 #include "geneticProgramming.h"
 #include "grammar.h"
 #include "treePrinter.h"
-#include "treeEvaluator.h"
+#include "treeBatchEvaluator.h"
+#include "treeSimplifier.h"
+#include "dataset.h"
+#include "staticGrammar.h"
 #include "rampedHalfAndHalfInitializer.h"
 #include <iostream>
 #include <sstream>
@@ -18,21 +21,55 @@ int f(int x, int y) { return x * y + (y - x * x); }
 	
 static const Type fnType = type("int");
 
-static const Grammar fnGrammar = Grammar({
-	fnType
-}, {
-	terminal("parameter", fnType, 50),
-	terminal("1", fnType, 50),
-	binaryFunction("+", fnType, { fnType, fnType }, 50),
-	binaryFunction("-", fnType, { fnType, fnType }, 50),
-	binaryFunction("*", fnType, { fnType, fnType }, 50)
-});
-
 static const unsigned parameterCount = 2;
 
-static int parameterId(const Definition &definition, const TreeGenome::Node &node) {
+// The fitness cases, one column per parameter.
+struct FnCases {
+	const ColumnView<int> *parameters;
+};
+
+// The definitions of the grammar, which are evaluated without looking up the definitions.
+struct FnParameter : StaticTerminal<50> {
+	static const char *name() { return "parameter"; }
+	template<typename T>
+	static T evaluate(const FnCases &cases, TreeGenomeValue offset, size_t fitnessCase) {
+		return cases.parameters[offset / (weight / parameterCount)][fitnessCase];
+	}
+};
+
+struct FnOne : StaticTerminal<50> {
+	static const char *name() { return "1"; }
+	template<typename T>
+	static T evaluate(const FnCases &cases, TreeGenomeValue offset, size_t fitnessCase) {
+		return 1;
+	}
+};
+
+struct FnAdd : StaticBinaryFunction<50> {
+	static const char *name() { return "+"; }
+	template<typename T>
+	static T evaluate(T x, T y) { return x + y; }
+};
+
+struct FnSubtract : StaticBinaryFunction<50> {
+	static const char *name() { return "-"; }
+	template<typename T>
+	static T evaluate(T x, T y) { return x - y; }
+};
+
+struct FnMultiply : StaticBinaryFunction<50> {
+	static const char *name() { return "*"; }
+	template<typename T>
+	static T evaluate(T x, T y) { return x * y; }
+};
+
+typedef StaticGrammar<FnParameter, FnOne, FnAdd, FnSubtract, FnMultiply> FnStaticGrammar;
+
+static const Grammar fnGrammar = FnStaticGrammar::makeGrammar({ fnType });
+
+static int parameterId(const Definition &definition, TreeGenomeValue nodeValue) {
 	assert(definition.getName() == std::string("parameter"));
-	auto value = node.value - definition.getNodeValue();
+	auto value = nodeValue - definition.getNodeValue();
 	assert(value < definition.getWeight());
 	auto rangeOfParameter = (definition.getWeight() / parameterCount);
 	assert(rangeOfParameter * parameterCount == definition.getWeight());
@@ -44,18 +81,30 @@ class PrinterDelegate: public TreeGenomePrinterDelegate {
 public:
 	bool printTerminal(const Definition &definition, const TreeGenome::Node &node, std::ostream &os) override {
 		if (definition.getName() == std::string("parameter")) {
-			os << "$" << parameterId(definition, node);
+			os << "$" << parameterId(definition, node.value);
+			return true;
+		}
+		return false;
+	}
+
+	bool appendTerminal(const Definition &definition, const TreeGenome::Node &node, std::string &buffer) override {
+		if (definition.getName() == std::string("parameter")) {
+			buffer += "$";
+			buffer += std::to_string(parameterId(definition, node.value));
 			return true;
 		}
 		return false;
 	}
 };
 
-struct FnEvaluator : TreeGenomeEvaluator<int> {
-	const std::vector<int> &parameters;
+// Evaluates a tree for all of the fitness cases at once.
+typedef StaticTreeGenomeProgramBatchEvaluator<int, FnStaticGrammar, const FnCases> FnEvaluator;
+
+// The algebra of the grammar, which removes the dead and the constant sub-trees before a tree is evaluated.
+struct FnSimplifierDelegate : TreeGenomeSimplifierDelegate<int> {
 	unsigned parameter, one, add, sub, mul;
 public:
-	FnEvaluator(const std::vector<int> &parameters) : TreeGenomeEvaluator<int>(fnGrammar), parameters(parameters) {
+	FnSimplifierDelegate() {
 		auto definitionDictionary = GrammarDefinitionAccessor(fnGrammar);
 		parameter = definitionDictionary["parameter"].getDefinitionId();
 		one = definitionDictionary["1"].getDefinitionId();
@@ -64,26 +113,47 @@ public:
 		mul = definitionDictionary["*"].getDefinitionId();
 	}
 
-	int evaluteTerminal(unsigned definitionId, const TreeGenome::Node &node) override {
-		if (definitionId == parameter) {
-			return parameters[parameterId(fnGrammar[definitionId], node)];
+	AlgebraicProperties<int> propertiesForFunction(unsigned definitionId) override {
+		AlgebraicProperties<int> properties;
+		properties.isConstantFoldable = true;
+		properties.hasIdentity = true;
+		if (definitionId == add) {
+			properties.isCommutative = true;
+		} else if (definitionId == sub) {
+			properties.isCancelling = true;
+		} else {
+			assert(definitionId == mul);
+			properties.isCommutative = true;
+			properties.identity = 1;
+			properties.hasAnnihilator = true;
 		}
-		assert(definitionId == one);
-		return 1;
+		return properties;
 	}
 
-	int evaluateBinaryFunction(unsigned definitionId, const TreeGenome::Node &node, int x, int y) override {
+	bool valueForConstantTerminal(unsigned definitionId, TreeGenomeValue value, int &result) override {
+		result = 1;
+		return definitionId == one;
+	}
+
+	TreeGenomeValue canonicalValueForTerminal(unsigned definitionId, TreeGenomeValue value) override {
+		if (definitionId != parameter) {
+			return value;
+		}
+		const auto &definition = fnGrammar[definitionId];
+		return definition.getNodeValue() + parameterId(definition, value) * (definition.getWeight() / parameterCount);
+	}
+
+	int evaluateFunction(unsigned definitionId, const int *arguments, unsigned argumentCount) override {
 		if (definitionId == add) {
-			return x + y;
+			return arguments[0] + arguments[1];
 		} else if (definitionId == sub) {
-			return x - y;
+			return arguments[0] - arguments[1];
 		}
-		assert(definitionId == mul);
-		return x * y;
+		return arguments[0] * arguments[1];
 	}
 };
 
-class FnEvolver: public EvolvingPopulationDelegate {
+class FnEvolver: public ParallelEvolvingPopulationDelegate {
 public:
 	EvolutionParameters &params;
 	
@@ -98,31 +168,36 @@ public:
 		return genome;
 	}
 
-	int evaluate(const TreeGenome &tree, const std::vector<int> &parameters) {
-		FnEvaluator eval(parameters);
-		return eval(tree);
-	}
-
-	float computeFitnessForIndividual(const TreeGenome &i) {
-		static const std::vector<std::vector<int>> parameters = { {1,2}, {4,5}, {6,7}, {8,9}, {10, 11}, {45, 11}, {450, 660}, {2017, 13} };
+	float computeFitnessForIndividual(const TreeGenome &i) override {
+		// The fitness cases, stored column by column.
+		static const std::vector<int> columns[parameterCount] = {
+			{ 1, 4, 6, 8, 10, 45, 450, 2017 },
+			{ 2, 5, 7, 9, 11, 11, 660, 13 }
+		};
+		const ColumnView<int> parameters[parameterCount] = { columns[0], columns[1] };
+		const size_t caseCount = parameters[0].size();
+		// Simplify the tree once and run it for all of the fitness cases. The delegate holds no state, so it's shared
+		// by the threads, while every thread reuses its own simplifier, program and evaluator.
+		static FnSimplifierDelegate simplifierDelegate;
+		thread_local TreeGenomeSimplifier<int> simplifier(fnGrammar, simplifierDelegate);
+		thread_local SimplifiedTreeGenomeProgram<int> program;
+		thread_local FnEvaluator eval;
+		simplifier.simplify(i, program);
+		const FnCases cases = { parameters };
+		int answers[8];
+		assert(caseCount <= sizeof(answers) / sizeof(answers[0]));
+		eval(program, cases, caseCount, answers);
 		float fitness = 0.0;
-		for (const auto &p : parameters) {
-			auto expectedAnswer = f(p[0], p[1]);
-			auto answer = evaluate(i, p);
-			fitness += 1.0f - (float(abs(answer - expectedAnswer)) / 1000.0f);
+		for (size_t c = 0; c < caseCount; ++c) {
+			auto expectedAnswer = f(parameters[0][c], parameters[1][c]);
+			fitness += 1.0f - (float(abs(answers[c] - expectedAnswer)) / 1000.0f);
 		}
-		fitness /= float(parameters.size());
+		fitness /= float(caseCount);
 		// Penalize large trees.
 		fitness -= log10f(ceil(float(i.getNodeCount()) / 30.0f));
 		return fitness;
 	}
 
-	void computeFitness(const std::vector<TreeGenome> &individuals, std::vector<float> &fitnesses) override {
-		for (size_t i = 0; i < individuals.size(); ++i) {
-			fitnesses[i] = computeFitnessForIndividual(individuals[i]);
-		}
-	}
-	
 	const grammar::Grammar &genomeGrammar() override {
 		return fnGrammar;
 	}
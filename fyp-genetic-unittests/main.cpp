@@ -2,10 +2,32 @@
 #include "grammar.h"
 #include "treePrinter.h"
 #include "rampedHalfAndHalfInitializer.h"
+#include "genomeCodec.h"
+#include "staticGrammar.h"
+#include "profiler.h"
+#include "dataset.h"
+#include "racingEvaluator.h"
+#include "dagEvaluator.h"
+#include "treeSimplifier.h"
+#include "iterativeTreeGenerator.h"
+#include "statistics.h"
+#include "checkpoint.h"
+#include "gpuEvaluator.h"
+#include "random.h"
+#include "distributedEvaluator.h"
+#include "islandPopulation.h"
+#include "nativeCompiler.h"
+#include "incrementalEvaluator.h"
+#include "fitnessCache.h"
+#include "treeBatchEvaluator.h"
+#include "treeEvaluator.h"
+#include "treeProgram.h"
+#include "threadPool.h"
 
 #include <iostream>
 #include <sstream>
 #include <cassert>
+#include <sys/resource.h>
 
 namespace treeGenomeTest {
 
@@ -291,6 +313,24 @@ void testTreeGenomePrinter() {
 	TreeGenomePrinter printer(grammar);
 	printer.print(tree, ss);
 	assert(ss.str() == "(+ (sin x) (* y (sin y)))");
+	// A sub-tree is printed on its own.
+	ss.str("");
+	printer.print(tree[3], ss);
+	assert(ss.str() == "(* y (sin y))");
+	// The terminals of the delegate are printed through the stream by default.
+	struct ValuePrinterDelegate : TreeGenomePrinterDelegate {
+		bool printTerminal(const Definition &definition, const TreeGenome::Node &node, std::ostream &os) override {
+			if (definition.getName() == std::string("y")) {
+				os << "y" << node.value;
+				return true;
+			}
+			return false;
+		}
+	};
+	ValuePrinterDelegate delegate;
+	ss.str("");
+	printer.print(tree[3], ss, &delegate);
+	assert(ss.str() == "(* y" + std::to_string(y) + " (sin y" + std::to_string(y) + "))");
 }
 	
 void testRampedHalfAndHalfInitializer() {
@@ -453,6 +493,2686 @@ void testGenome() {
         assert(rootSubTree2.getNodeCount() == 7);
         assert(description(rootSubTree2) == "(+ (+ (+ 1 1) 1) 0)");
     }
+    {
+        TestTreeType genome;
+        TestTreeType::Builder builder(genome);
+        builder.push(Plus); builder.push(Plus); builder.add(One); builder.add(One); builder.pop(); builder.add(Zero); builder.pop();
+        TestTreeType other;
+        TestTreeType::Builder builder2(other);
+        builder2.add(Zero);
+        other.assign(genome);
+        assert(other.getNodeCount() == 5);
+        assert(description(other) == "(+ (+ 1 1) 0)");
+        genome.replace(1, other);
+        assert(description(genome) == "(+ (+ (+ 1 1) 0) 0)");
+        assert(description(other) == "(+ (+ 1 1) 0)");
+        other.assign(genome.getSubTree(2));
+        assert(other.getNodeCount() == 3);
+        assert(description(other) == "(+ 1 1)");
+    }
+}
+
+void testThreadPool() {
+	using namespace genetic::core;
+
+	for (unsigned threadCount = 1; threadCount <= 4; ++threadCount) {
+		ThreadPool pool(threadCount);
+		assert(pool.size() == threadCount);
+		for (size_t count : { size_t(0), size_t(1), size_t(7), size_t(1000) }) {
+			for (size_t chunkSize : { size_t(0), size_t(1), size_t(3), size_t(2000) }) {
+				std::vector<std::atomic<unsigned>> visits(count);
+				for (auto &visit : visits) {
+					visit.store(0);
+				}
+				pool.parallelFor(count, chunkSize, [&] (size_t begin, size_t end) {
+					assert(begin < end && end <= count);
+					for (size_t i = begin; i < end; ++i) {
+						visits[i]++;
+					}
+				});
+				for (const auto &visit : visits) {
+					assert(visit.load() == 1);
+				}
+			}
+		}
+		// A loop that's started from within a loop of the same pool runs on the thread of the outer chunk.
+		std::vector<std::atomic<unsigned>> visits(20 * 30);
+		for (auto &visit : visits) {
+			visit.store(0);
+		}
+		pool.parallelFor(20, 1, [&] (size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				const auto thread = std::this_thread::get_id();
+				pool.parallelFor(30, 1, [&] (size_t innerBegin, size_t innerEnd) {
+					assert(std::this_thread::get_id() == thread);
+					for (size_t j = innerBegin; j < innerEnd; ++j) {
+						visits[i * 30 + j]++;
+					}
+				});
+			}
+		});
+		for (const auto &visit : visits) {
+			assert(visit.load() == 1);
+		}
+	}
+}
+
+namespace {
+
+// Evaluates the same integer grammar both recursively and as a compiled program.
+struct IntOperations {
+	unsigned x, y, add, sub, neg, select;
+
+	IntOperations(const genetic::grammar::Grammar &grammar) {
+		auto definitionDictionary = genetic::grammar::GrammarDefinitionAccessor(grammar);
+		x = definitionDictionary["x"].getDefinitionId();
+		y = definitionDictionary["y"].getDefinitionId();
+		add = definitionDictionary["+"].getDefinitionId();
+		sub = definitionDictionary["-"].getDefinitionId();
+		neg = definitionDictionary["neg"].getDefinitionId();
+		select = definitionDictionary["select"].getDefinitionId();
+	}
+
+	int terminal(unsigned definitionId) const {
+		return definitionId == x ? 3 : 7;
+	}
+
+	int unary(unsigned definitionId, int value) const {
+		assert(definitionId == neg);
+		return -value;
+	}
+
+	int binary(unsigned definitionId, int a, int b) const {
+		return definitionId == add ? a + b : a - b;
+	}
+
+	int ternary(unsigned definitionId, const int *arguments) const {
+		assert(definitionId == select);
+		return arguments[0] > 0 ? arguments[1] : arguments[2];
+	}
+};
+
+struct IntTreeEvaluator : genetic::TreeGenomeEvaluator<int> {
+	IntOperations ops;
+
+	IntTreeEvaluator(const genetic::grammar::Grammar &grammar) : genetic::TreeGenomeEvaluator<int>(grammar), ops(grammar) { }
+
+	int evaluteTerminal(unsigned definitionId, const genetic::TreeGenome::Node &node) override {
+		return ops.terminal(definitionId);
+	}
+	int evaluateUnaryFunction(unsigned definitionId, const genetic::TreeGenome::Node &node, int x) override {
+		return ops.unary(definitionId, x);
+	}
+	int evaluateBinaryFunction(unsigned definitionId, const genetic::TreeGenome::Node &node, int x, int y) override {
+		return ops.binary(definitionId, x, y);
+	}
+	int evaluateFunction(unsigned definitionId, const genetic::TreeGenome::Node &node, const std::vector<int> &arguments) override {
+		return ops.ternary(definitionId, arguments.data());
+	}
+};
+
+struct IntProgramEvaluator : genetic::TreeGenomeProgramEvaluator<int, IntProgramEvaluator> {
+	IntOperations ops;
+
+	IntProgramEvaluator(const genetic::grammar::Grammar &grammar) : ops(grammar) { }
+
+	int evaluateTerminal(unsigned definitionId, genetic::TreeGenomeValue value) {
+		return ops.terminal(definitionId);
+	}
+	int evaluateUnaryFunction(unsigned definitionId, int x) {
+		return ops.unary(definitionId, x);
+	}
+	int evaluateBinaryFunction(unsigned definitionId, int x, int y) {
+		return ops.binary(definitionId, x, y);
+	}
+	int evaluateFunction(unsigned definitionId, const int *arguments, unsigned argumentCount) {
+		assert(argumentCount == 3);
+		return ops.ternary(definitionId, arguments);
+	}
+};
+
+genetic::grammar::Grammar makeIntGrammar() {
+	using namespace genetic::grammar;
+	const Type t = type("int");
+	return Grammar({ t }, {
+		terminal("x", t, 10),
+		terminal("y", t, 10),
+		binaryFunction("+", t, {t, t}, 5),
+		binaryFunction("-", t, {t, t}, 5),
+		unaryFunction("neg", t, t, 3),
+		ternaryFunction("select", t, {t, t, t}, 3)
+	});
+}
+
+} // end anonymous namespace
+
+void testTreeGenomeProgram() {
+	using namespace genetic;
+
+	auto grammar = makeIntGrammar();
+	auto rng = std::mt19937(7);
+	TreeGenerator<std::mt19937> generator(grammar, rng);
+	IntTreeEvaluator treeEvaluator(grammar);
+	IntProgramEvaluator programEvaluator(grammar);
+	TreeGenomeProgram program;
+	for (int i = 0; i < 200; ++i) {
+		TreeGenome genome;
+		{
+			TreeGenome::Builder builder(genome);
+			if (i % 2)
+				generator.generateFull(builder, 1 + i % 7);
+			else
+				generator.generateGrow(builder, 1 + i % 7);
+		}
+		program.compile(grammar, genome);
+		assert(program.size() == genome.getNodeCount());
+		assert(programEvaluator(program) == treeEvaluator(genome));
+		// Sub-trees can be compiled on their own too.
+		auto root = genome.first();
+		for (auto child : root) {
+			assert(programEvaluator(TreeGenomeProgram(grammar, child)) == treeEvaluator(child));
+		}
+	}
+}
+
+void testTreeGenomeProgramBatchEvaluator() {
+	using namespace genetic;
+
+	// Every fitness case has its own values for the terminals.
+	static const size_t caseCount = 1000;
+	std::vector<int> xs(caseCount), ys(caseCount);
+	for (size_t i = 0; i < caseCount; ++i) {
+		xs[i] = int(i) - 300;
+		ys[i] = int(i * 7 % 13);
+	}
+	struct CaseEvaluator : TreeGenomeProgramEvaluator<int, CaseEvaluator> {
+		IntOperations ops;
+		int x, y;
+
+		CaseEvaluator(const grammar::Grammar &grammar) : ops(grammar), x(0), y(0) { }
+
+		int evaluateTerminal(unsigned definitionId, TreeGenomeValue value) {
+			return definitionId == ops.x ? x : y;
+		}
+		int evaluateUnaryFunction(unsigned definitionId, int x) {
+			return ops.unary(definitionId, x);
+		}
+		int evaluateBinaryFunction(unsigned definitionId, int x, int y) {
+			return ops.binary(definitionId, x, y);
+		}
+		int evaluateFunction(unsigned definitionId, const int *arguments, unsigned argumentCount) {
+			return ops.ternary(definitionId, arguments);
+		}
+	};
+	struct BatchEvaluator : TreeGenomeProgramBatchEvaluator<int, BatchEvaluator> {
+		IntOperations ops;
+		const std::vector<int> &xs, &ys;
+
+		BatchEvaluator(const grammar::Grammar &grammar, const std::vector<int> &xs, const std::vector<int> &ys, size_t blockSize = 64) : TreeGenomeProgramBatchEvaluator<int, BatchEvaluator>(blockSize), ops(grammar), xs(xs), ys(ys) { }
+
+		void evaluateTerminal(unsigned definitionId, TreeGenomeValue value, size_t firstCase, size_t count, int *result) {
+			// The columns are aligned to the cache line size.
+			assert(reinterpret_cast<std::uintptr_t>(result) % 64 == 0);
+			batch::copy((definitionId == ops.x ? xs : ys).data() + firstCase, result, count);
+		}
+		void evaluateUnaryFunction(unsigned definitionId, const int *x, int *result, size_t count) {
+			assert(x != result);
+			batch::negate(x, result, count);
+		}
+		void evaluateBinaryFunction(unsigned definitionId, const int *x, const int *y, int *result, size_t count) {
+			assert(x != result && y != result);
+			if (definitionId == ops.add)
+				batch::add(x, y, result, count);
+			else
+				batch::subtract(x, y, result, count);
+		}
+		void evaluateFunction(unsigned definitionId, const int *const *arguments, unsigned argumentCount, int *result, size_t count) {
+			assert(argumentCount == 3);
+			for (size_t i = 0; i < count; ++i) {
+				result[i] = arguments[0][i] > 0 ? arguments[1][i] : arguments[2][i];
+			}
+		}
+	};
+
+	auto grammar = makeIntGrammar();
+	auto rng = std::mt19937(3);
+	TreeGenerator<std::mt19937> generator(grammar, rng);
+	CaseEvaluator caseEvaluator(grammar);
+	// A block size whose columns aren't a multiple of the alignment is evaluated like the others.
+	BatchEvaluator batchEvaluator(grammar, xs, ys), oddBatchEvaluator(grammar, xs, ys, 3);
+	std::vector<int> results(caseCount), oddResults(caseCount);
+	TreeGenomeProgram program;
+	for (int i = 0; i < 50; ++i) {
+		TreeGenome genome;
+		{
+			TreeGenome::Builder builder(genome);
+			generator.generateGrow(builder, 1 + i % 8);
+		}
+		program.compile(grammar, genome);
+		batchEvaluator(program, caseCount, results.data());
+		oddBatchEvaluator(program, caseCount, oddResults.data());
+		assert(oddResults == results);
+		for (size_t c = 0; c < caseCount; ++c) {
+			caseEvaluator.x = xs[c];
+			caseEvaluator.y = ys[c];
+			assert(results[c] == caseEvaluator(program));
+		}
+	}
+}
+
+void testGrammarRawValueLookup() {
+	using namespace genetic;
+	using namespace genetic::grammar;
+
+	// The small grammar uses a lookup table, the large one searches the raw value ranges.
+	const Type t = type("int");
+	for (TreeGenomeValue scale : { 1u, 1000u }) {
+		Grammar grammar = Grammar({ t }, {
+			terminal("x", t, 10 * scale),
+			terminal("y", t, 1),
+			binaryFunction("+", t, {t, t}, 5 * scale),
+			binaryFunction("*", t, {t, t}, 11),
+			unaryFunction("sin", t, t, 3 * scale)
+		});
+		assert(grammar.getNodeLimit() > Grammar::directLookupTableLimit || scale == 1);
+		for (const auto &definition : grammar.definitions()) {
+			for (TreeGenomeValue i = 0; i < definition.getWeight(); ++i) {
+				assert(grammar.definitionIdForTreeGenomeValue(definition.getNodeValue() + i) == definition.getDefinitionId());
+			}
+		}
+	}
+}
+
+namespace {
+
+std::string treeString(const genetic::core::Tree<int>::Node &node) {
+	std::string result = std::to_string(node.value);
+	if (node.isEmpty()) {
+		return result;
+	}
+	result = "(" + result;
+	for (auto child : node) {
+		result += " " + treeString(child);
+	}
+	return result + ")";
+}
+
+// Verify the stored sub-tree sizes by walking the tree.
+size_t checkSubTreeSizes(const genetic::core::Tree<int>::Node &node) {
+	size_t size = 1;
+	for (auto child : node) {
+		size += checkSubTreeSizes(child);
+	}
+	assert(size == node.subTreeSize());
+	return size;
+}
+
+void buildRandomTree(genetic::core::Tree<int>::Builder &builder, std::mt19937 &rng, int depth, int &counter) {
+	unsigned childCount = depth > 0 ? std::uniform_int_distribution<unsigned>(0, 3)(rng) : 0;
+	if (!childCount) {
+		builder.add(counter++);
+		return;
+	}
+	builder.push(counter++);
+	for (unsigned i = 0; i < childCount; ++i) {
+		buildRandomTree(builder, rng, depth - 1, counter);
+	}
+	builder.pop();
+}
+
+} // end anonymous namespace
+
+void testTreeSwapSubTrees() {
+	using namespace genetic::core;
+
+	auto rng = std::mt19937(5);
+	Tree<int>::SwapBuffer buffer;
+	for (int i = 0; i < 300; ++i) {
+		Tree<int> a, b;
+		int counter = 0;
+		{
+			Tree<int>::Builder builder(a);
+			buildRandomTree(builder, rng, i % 6, counter);
+		}
+		{
+			Tree<int>::Builder builder(b);
+			buildRandomTree(builder, rng, (i / 6) % 6, counter);
+		}
+		size_t x = std::uniform_int_distribution<size_t>(0, a.getNodeCount() - 1)(rng);
+		size_t y = std::uniform_int_distribution<size_t>(0, b.getNodeCount() - 1)(rng);
+
+		// The reference result that's computed by copying the sub-trees.
+		auto expectedA = a.copy(), expectedB = b.copy();
+		auto subTreeA = a.getSubTree(x), subTreeB = b.getSubTree(y);
+		expectedA.replace(x, subTreeB);
+		expectedB.replace(y, subTreeA);
+
+		a.swapSubTrees(x, b, y, buffer);
+		assert(a.getNodeCount() == expectedA.getNodeCount());
+		assert(b.getNodeCount() == expectedB.getNodeCount());
+		assert(treeString(a.first()) == treeString(expectedA.first()));
+		assert(treeString(b.first()) == treeString(expectedB.first()));
+		checkSubTreeSizes(a.first());
+		checkSubTreeSizes(b.first());
+		checkSubTreeSizes(expectedA.first());
+		checkSubTreeSizes(expectedB.first());
+	}
+}
+
+void testCompactTreeGenome() {
+	using namespace genetic;
+
+	assert(sizeof(core::PackedTreeNodeStorage<TreeGenomeValue>) * 2 == sizeof(core::TreeNodeStorage<TreeGenomeValue>));
+
+	auto grammar = makeIntGrammar();
+	auto rng = std::mt19937(9);
+	TreeGenerator<std::mt19937> generator(grammar, rng);
+	IntProgramEvaluator evaluator(grammar);
+	CompactTreeGenome::SwapBuffer buffer;
+	for (int i = 0; i < 100; ++i) {
+		TreeGenome genome, other;
+		{
+			TreeGenome::Builder builder(genome);
+			generator.generateFull(builder, 1 + i % 6);
+		}
+		{
+			TreeGenome::Builder builder(other);
+			generator.generateGrow(builder, 1 + i % 5);
+		}
+		CompactTreeGenome compact, compactOther;
+		compact.assign(genome);
+		compactOther.assign(other);
+		assert(compact.getNodeCount() == genome.getNodeCount());
+		for (size_t j = 0; j < genome.getNodeCount(); ++j) {
+			assert(compact[j].value == genome[j].value);
+			assert(compact[j].size() == genome[j].size());
+			assert(compact[j].subTreeSize() == genome[j].subTreeSize());
+		}
+		TreeGenomeProgram program;
+		program.compile(grammar, compact);
+		assert(evaluator(program) == evaluator(TreeGenomeProgram(grammar, genome)));
+
+		// The sub-tree operations give the same result as the ones on the default storage.
+		TreeGenome::SwapBuffer genomeBuffer;
+		size_t x = genome.getNodeCount() / 2, y = other.getNodeCount() / 3;
+		genome.swapSubTrees(x, other, y, genomeBuffer);
+		compact.swapSubTrees(x, compactOther, y, buffer);
+		TreeGenome roundTrip;
+		roundTrip.assign(compact);
+		program.compile(grammar, roundTrip);
+		assert(evaluator(program) == evaluator(TreeGenomeProgram(grammar, genome)));
+		program.compile(grammar, compactOther);
+		assert(evaluator(program) == evaluator(TreeGenomeProgram(grammar, other)));
+	}
+}
+
+namespace {
+
+// Evolves integer trees that evaluate to 42.
+class IntEvolver : public genetic::EvolvingPopulationDelegate, public genetic::ConcurrentTreeGeneratorDelegate {
+public:
+	genetic::EvolutionParameters &params;
+	genetic::grammar::Grammar grammar;
+	IntProgramEvaluator evaluator;
+	genetic::TreeGenomeProgram program;
+	size_t evaluationCount = 0;
+
+	IntEvolver(genetic::EvolutionParameters &params) : params(params), grammar(makeIntGrammar()), evaluator(grammar) { }
+
+	float computeFitnessForIndividual(const genetic::TreeGenome &individual) {
+		++evaluationCount;
+		program.compile(grammar, individual);
+		return -float(abs(evaluator(program) - 42)) - float(individual.getNodeCount()) * 0.01f;
+	}
+
+	void computeFitness(const std::vector<genetic::TreeGenome> &individuals, std::vector<float> &fitnesses) override {
+		for (size_t i = 0; i < individuals.size(); ++i) {
+			fitnesses[i] = computeFitnessForIndividual(individuals[i]);
+		}
+	}
+
+	genetic::TreeGenome generateRandomTreeOfType(genetic::TreeGenomeType type) override {
+		genetic::TreeGenome genome;
+		genetic::TreeGenerator<genetic::EvolutionParameters::RNG> generator(grammar, params.rng);
+		genetic::TreeGenome::Builder builder(genome);
+		generator.generateGrow(builder, 2, type);
+		return genome;
+	}
+
+	genetic::TreeGenome generateRandomTreeOfTypeConcurrently(genetic::TreeGenomeType type, genetic::core::Philox4x32 &rng) override {
+		genetic::TreeGenome genome;
+		genetic::TreeGenerator<genetic::core::Philox4x32> generator(grammar, rng);
+		genetic::TreeGenome::Builder builder(genome);
+		generator.generateGrow(builder, 2, type);
+		return genome;
+	}
+
+	const genetic::grammar::Grammar &genomeGrammar() override {
+		return grammar;
+	}
+};
+
+void initializeIntPopulation(genetic::Population &population, IntEvolver &evolver, int maxDepth = 5) {
+	genetic::RampedHalfAndHalfInitializer<genetic::EvolutionParameters::RNG> init(evolver.grammar, evolver.params.rng);
+	population.initialize(maxDepth, init);
+}
+
+} // end anonymous namespace
+
+void testFitnessCache() {
+	using namespace genetic;
+
+	{
+		// Eviction.
+		FitnessCache cache(2);
+		float fitness;
+		cache.insert(1, 1.0f);
+		cache.insert(2, 2.0f);
+		assert(cache.lookup(1, fitness) && fitness == 1.0f);
+		cache.insert(3, 3.0f);
+		assert(cache.size() == 2);
+		assert(!cache.lookup(2, fitness));
+		assert(cache.lookup(1, fitness) && fitness == 1.0f);
+		assert(cache.lookup(3, fitness) && fitness == 3.0f);
+		assert(cache.getHitCount() == 3 && cache.getMissCount() == 1);
+	}
+
+	// The cached evolution is identical to the uncached one, but evaluates fewer genomes.
+	EvolutionParameters params, cachedParams;
+	params.rng = cachedParams.rng = std::mt19937(1);
+	params.mutationRate = cachedParams.mutationRate = 0.1f;
+	params.crossoverRate = cachedParams.crossoverRate = 0.8f;
+	IntEvolver evolver(params), cachedEvolver(cachedParams);
+	Population population(50, params, evolver), cachedPopulation(50, cachedParams, cachedEvolver);
+	FitnessCache cache(1000);
+	cachedPopulation.setFitnessCache(&cache);
+	initializeIntPopulation(population, evolver);
+	initializeIntPopulation(cachedPopulation, cachedEvolver);
+	for (int i = 0; i < 20; ++i) {
+		population.nextGeneration(false);
+		cachedPopulation.nextGeneration(false);
+	}
+	population.evaluateGeneration();
+	cachedPopulation.evaluateGeneration();
+	auto stats = population.getStats(), cachedStats = cachedPopulation.getStats();
+	assert(stats.bestFitness == cachedStats.bestFitness);
+	assert(stats.averageFitness == cachedStats.averageFitness);
+	assert(population[stats.bestIndividual].structuralHash() == cachedPopulation[cachedStats.bestIndividual].structuralHash());
+	assert(evolver.evaluationCount == 21 * 50);
+	assert(cachedEvolver.evaluationCount < evolver.evaluationCount);
+	assert(cache.getHitCount() > 0);
+}
+
+namespace {
+
+struct IncrementalIntEvaluator : genetic::IncrementalTreeGenomeEvaluator<int, IncrementalIntEvaluator> {
+	IntOperations ops;
+
+	IncrementalIntEvaluator(const genetic::grammar::Grammar &grammar, size_t caseCount) : genetic::IncrementalTreeGenomeEvaluator<int, IncrementalIntEvaluator>(grammar, caseCount), ops(grammar) { }
+
+	void evaluateTerminal(unsigned definitionId, genetic::TreeGenomeValue value, size_t firstCase, size_t count, int *result) {
+		for (size_t i = 0; i < count; ++i) {
+			result[i] = definitionId == ops.x ? int(firstCase + i) + 3 : int(firstCase + i) * 7;
+		}
+	}
+	void evaluateUnaryFunction(unsigned definitionId, const int *x, int *result, size_t count) {
+		genetic::batch::negate(x, result, count);
+	}
+	void evaluateBinaryFunction(unsigned definitionId, const int *x, const int *y, int *result, size_t count) {
+		if (definitionId == ops.add)
+			genetic::batch::add(x, y, result, count);
+		else
+			genetic::batch::subtract(x, y, result, count);
+	}
+	void evaluateFunction(unsigned definitionId, const int *const *arguments, unsigned argumentCount, int *result, size_t count) {
+		for (size_t i = 0; i < count; ++i) {
+			result[i] = arguments[0][i] > 0 ? arguments[1][i] : arguments[2][i];
+		}
+	}
+};
+
+} // end anonymous namespace
+
+void testIncrementalTreeGenomeEvaluator() {
+	using namespace genetic;
+
+	const size_t caseCount = 16;
+	auto grammar = makeIntGrammar();
+	auto rng = std::mt19937(13);
+	TreeGenerator<std::mt19937> generator(grammar, rng);
+	auto randomTree = [&] (int depth) {
+		TreeGenome genome;
+		TreeGenome::Builder builder(genome);
+		generator.generateFull(builder, depth);
+		return genome;
+	};
+	// Compare the incremental outputs with a full evaluation.
+	auto check = [&] (const TreeGenome &genome, const int *outputs) {
+		IncrementalIntEvaluator fullEvaluator(grammar, caseCount);
+		fullEvaluator.reset(genome);
+		auto expected = fullEvaluator(genome);
+		assert(fullEvaluator.getEvaluatedNodeCount() == genome.getNodeCount());
+		assert(std::equal(expected, expected + caseCount, outputs));
+	};
+
+	TreeGenome::SwapBuffer buffer;
+	TreeGenome genome = randomTree(6), other = randomTree(5);
+	IncrementalIntEvaluator evaluator(grammar, caseCount), otherEvaluator(grammar, caseCount);
+	evaluator.reset(genome);
+	otherEvaluator.reset(other);
+	check(genome, evaluator(genome));
+	check(other, otherEvaluator(other));
+	// A clean genome isn't evaluated again.
+	evaluator(genome);
+	assert(evaluator.getEvaluatedNodeCount() == 0);
+	for (int i = 0; i < 100; ++i) {
+		if (i % 2) {
+			size_t nodeId = std::uniform_int_distribution<size_t>(0, genome.getNodeCount() - 1)(rng);
+			auto subTree = randomTree(1 + i % 3);
+			size_t depth = 0;
+			genome.forEachAncestor(nodeId, [&] (size_t) { ++depth; });
+			evaluator.replace(genome, nodeId, subTree);
+			check(genome, evaluator(genome));
+			// Only the new sub-tree and the path to the root are evaluated.
+			assert(evaluator.getEvaluatedNodeCount() == subTree.getNodeCount() + depth);
+		} else {
+			size_t nodeId = std::uniform_int_distribution<size_t>(0, genome.getNodeCount() - 1)(rng);
+			size_t otherNodeId = std::uniform_int_distribution<size_t>(0, other.getNodeCount() - 1)(rng);
+			evaluator.swapSubTrees(genome, nodeId, other, otherNodeId, otherEvaluator, buffer);
+			size_t depth = 0;
+			genome.forEachAncestor(nodeId, [&] (size_t) { ++depth; });
+			check(genome, evaluator(genome));
+			// The exchanged sub-tree was already evaluated by the other genome.
+			assert(evaluator.getEvaluatedNodeCount() == depth);
+			check(other, otherEvaluator(other));
+		}
+	}
+
+	// The population delegate only evaluates the sub-trees that were varied, and computes the same fitness as
+	// a full evaluation.
+	struct IncrementalIntEvolver : IncrementalEvolvingPopulationDelegate<int, IncrementalIntEvaluator> {
+		EvolutionParameters &params;
+		grammar::Grammar grammar;
+
+		IncrementalIntEvolver(EvolutionParameters &params) : params(params), grammar(makeIntGrammar()) { }
+
+		std::unique_ptr<IncrementalIntEvaluator> makeEvaluator() override {
+			return std::unique_ptr<IncrementalIntEvaluator>(new IncrementalIntEvaluator(grammar, caseCount));
+		}
+		float fitnessForOutputs(const TreeGenome &individual, const int *outputs) override {
+			float fitness = 0;
+			for (size_t c = 0; c < caseCount; ++c) {
+				fitness -= float(std::min(abs(outputs[c] - int(c) * 5), 1000));
+			}
+			return fitness - float(individual.getNodeCount()) * 0.01f;
+		}
+		TreeGenome generateRandomTreeOfType(TreeGenomeType type) override {
+			TreeGenome genome;
+			TreeGenerator<EvolutionParameters::RNG> generator(grammar, params.rng);
+			TreeGenome::Builder builder(genome);
+			generator.generateGrow(builder, 2, type);
+			return genome;
+		}
+		const grammar::Grammar &genomeGrammar() override {
+			return grammar;
+		}
+	};
+	EvolutionParameters params;
+	params.rng = std::mt19937(21);
+	params.mutationRate = 0.2f;
+	params.crossoverRate = 0.7f;
+	IncrementalIntEvolver evolver(params);
+	Population population(30, params, evolver);
+	RampedHalfAndHalfInitializer<EvolutionParameters::RNG> initializer(evolver.grammar, params.rng);
+	population.initialize(5, initializer);
+	for (int i = 0; i < 10; ++i) {
+		population.evaluateGeneration();
+		size_t nodeCount = 0;
+		for (size_t j = 0; j < population.size(); ++j) {
+			nodeCount += population[j].getNodeCount();
+			IncrementalIntEvaluator fullEvaluator(evolver.grammar, caseCount);
+			fullEvaluator.reset(population[j]);
+			assert(population.getFitness(j) == evolver.fitnessForOutputs(population[j], fullEvaluator(population[j])));
+		}
+		// Only the first generation is evaluated in full.
+		assert(i == 0 ? evolver.getEvaluatedNodeCount() == nodeCount : evolver.getEvaluatedNodeCount() < nodeCount);
+		population.nextGeneration(false);
+	}
+}
+
+void testTreeGenomeNativeCompiler() {
+	using namespace genetic;
+
+	class Delegate : public TreeGenomeNativeCompilerDelegate {
+	public:
+		bool printTerminal(const grammar::Definition &definition, const TreeGenome::Node &node, std::ostream &os) override {
+			return false;
+		}
+		bool printFunction(const grammar::Definition &definition, const TreeGenome::Node &node, std::ostream &os) override {
+			return false;
+		}
+		bool treeGenomeCompilerShouldPrintFunctionAsOperator(const grammar::Definition &definition) override {
+			return definition.getName() == std::string("+") || definition.getName() == std::string("-");
+		}
+		std::string functionDeclaration(const std::string &name) override {
+			return "int " + name + "(int x, int y)";
+		}
+		std::string modulePrelude() override {
+			return "static int neg(int x) { return -x; }\n"
+			       "static int select(int c, int a, int b) { return c > 0 ? a : b; }\n";
+		}
+	};
+
+	auto grammar = makeIntGrammar();
+	auto rng = std::mt19937(17);
+	TreeGenerator<std::mt19937> generator(grammar, rng);
+	std::vector<TreeGenome> genomes;
+	for (int i = 0; i < 20; ++i) {
+		TreeGenome genome;
+		{
+			TreeGenome::Builder builder(genome);
+			generator.generateGrow(builder, 1 + i % 6);
+		}
+		genomes.push_back(std::move(genome));
+	}
+	Delegate delegate;
+	TreeGenomeNativeCompiler<int (int, int)> compiler(grammar, delegate);
+	auto module = compiler.compile(genomes);
+	assert(module && module->size() == genomes.size());
+	// The program evaluator uses x = 3 and y = 7.
+	IntProgramEvaluator evaluator(grammar);
+	for (size_t i = 0; i < genomes.size(); ++i) {
+		assert((*module)[i](3, 7) == evaluator(TreeGenomeProgram(grammar, genomes[i])));
+	}
+	// The paths are quoted for the shell, even when the temporary directory contains a quote.
+	{
+		std::string directory = "/tmp/genetic-native-test-'quoted";
+		mkdir(directory.c_str(), 0700);
+		const char *previous = getenv("TMPDIR");
+		std::string previousDirectory = previous ? previous : "";
+		setenv("TMPDIR", directory.c_str(), 1);
+		auto quotedModule = compiler.compile(genomes);
+		if (previous) {
+			setenv("TMPDIR", previousDirectory.c_str(), 1);
+		} else {
+			unsetenv("TMPDIR");
+		}
+		rmdir(directory.c_str());
+		assert(quotedModule && (*quotedModule)[0](3, 7) == (*module)[0](3, 7));
+	}
+	// Invalid code fails to compile.
+	TreeGenomeNativeCompiler<int (int, int)> invalidCompiler(grammar, delegate, "false");
+	assert(!invalidCompiler.compile(genomes));
+}
+
+void testIslandPopulation() {
+	using namespace genetic;
+
+	{
+		core::SingleProducerSingleConsumerQueue<int> queue(2);
+		int value;
+		assert(queue.isEmpty() && !queue.pop(value));
+		assert(queue.push(1) && queue.push(2) && !queue.push(3));
+		assert(queue.pop(value) && value == 1);
+		assert(queue.push(3));
+		assert(queue.pop(value) && value == 2);
+		assert(queue.pop(value) && value == 3);
+		assert(queue.isEmpty());
+	}
+
+	auto factory = [] (size_t, EvolutionParameters &params) {
+		return std::unique_ptr<EvolvingPopulationDelegate>(new IntEvolver(params));
+	};
+	auto run = [&] (MigrationTopology topology, unsigned threadCount, std::vector<uint64_t> &bestHashes, std::vector<float> &bestFitnesses) {
+		IslandModelParameters parameters;
+		parameters.islandCount = 3;
+		parameters.islandSize = 20;
+		parameters.masterSeed = 5;
+		parameters.migrationInterval = 4;
+		parameters.migrantCount = 2;
+		parameters.topology = topology;
+		parameters.threadCount = threadCount;
+		parameters.mutationRate = 0.1f;
+		parameters.crossoverRate = 0.8f;
+		IslandPopulation islands(parameters, factory);
+		islands.initialize(5);
+		islands.evolve(3);
+		islands.evolve(9);
+		assert(islands.generation == 12);
+		islands.evaluateGeneration();
+		bestHashes.clear();
+		bestFitnesses.clear();
+		for (size_t i = 0; i < islands.size(); ++i) {
+			auto stats = islands[i].getStats();
+			assert(islands[i].generation == 12);
+			bestHashes.push_back(islands[i][stats.bestIndividual].structuralHash());
+			bestFitnesses.push_back(stats.bestFitness);
+		}
+	};
+	for (auto topology : { MigrationTopology::Ring, MigrationTopology::Random }) {
+		std::vector<uint64_t> hashes, otherHashes;
+		std::vector<float> fitnesses, otherFitnesses;
+		// The results don't depend on the number of threads.
+		run(topology, 1, hashes, fitnesses);
+		run(topology, 3, otherHashes, otherFitnesses);
+		assert(hashes == otherHashes && fitnesses == otherFitnesses);
+		// The fittest individual was copied to another island by the last migration.
+		auto bestFitness = *std::max_element(fitnesses.begin(), fitnesses.end());
+		assert(std::count(fitnesses.begin(), fitnesses.end(), bestFitness) >= 2);
+	}
+}
+
+void testDistributedEvaluation() {
+	using namespace genetic;
+	using namespace genetic::distributed;
+
+	auto grammar = makeIntGrammar();
+	auto otherGrammar = [] {
+		using namespace genetic::grammar;
+		const Type t = type("int");
+		return Grammar({ t }, {
+			terminal("x", t, 10),
+			terminal("y", t, 10),
+			binaryFunction("+", t, {t, t}, 5),
+			binaryFunction("-", t, {t, t}, 5),
+			unaryFunction("neg", t, t, 4),
+			ternaryFunction("select", t, {t, t, t}, 3)
+		});
+	}();
+	assert(grammar.fingerprint() == makeIntGrammar().fingerprint());
+	assert(grammar.fingerprint() != otherGrammar.fingerprint());
+
+	auto rng = std::mt19937(23);
+	TreeGenerator<std::mt19937> generator(grammar, rng);
+	std::vector<TreeGenome> genomes(100);
+	for (size_t i = 0; i < genomes.size(); ++i) {
+		TreeGenome::Builder builder(genomes[i]);
+		generator.generateGrow(builder, 1 + int(i % 6));
+	}
+
+	{
+		// The genomes survive the round trip through a message.
+		MessageWriter writer;
+		writer.begin(MessageType::Evaluate);
+		for (const auto &genome : genomes) {
+			writer.writeGenome(genome);
+		}
+		const auto &message = writer.end();
+		std::vector<uint8_t> payload(message.begin() + 8, message.end());
+		MessageReader reader(payload);
+		TreeGenome genome;
+		for (const auto &expected : genomes) {
+			assert(reader.readGenome(grammar, genome));
+			assert(genome.structuralHash() == expected.structuralHash());
+			assert(genome[0].subTreeSize() == genome.getNodeCount());
+		}
+		assert(reader.isAtEnd());
+		// A truncated genome is rejected.
+		payload.resize(payload.size() - 1);
+		MessageReader truncatedReader(payload);
+		for (size_t i = 0; i + 1 < genomes.size(); ++i) {
+			assert(truncatedReader.readGenome(grammar, genome));
+		}
+		assert(!truncatedReader.readGenome(grammar, genome) && !truncatedReader.valid());
+	}
+
+	EvolutionParameters params;
+	IntEvolver local(params);
+	std::vector<float> expected(genomes.size()), fitnesses(genomes.size());
+	local.computeFitness(genomes, expected);
+
+	// The first worker is fast, the second one is slow, and the third one has a different grammar.
+	std::vector<int> masterSockets;
+	std::vector<std::thread> threads;
+	int results[3] = { -1, -1, -1 };
+	for (int w = 0; w < 3; ++w) {
+		int sockets[2];
+		int status = socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+		assert(status == 0);
+		masterSockets.push_back(sockets[0]);
+		int workerSocket = sockets[1];
+		threads.push_back(std::thread([w, workerSocket, &otherGrammar, &results] {
+			EvolutionParameters params;
+			IntEvolver evolver(params);
+			Worker worker(w == 2 ? otherGrammar : evolver.grammar, [w, &evolver] (const TreeGenome &genome) {
+				if (w == 1) {
+					std::this_thread::sleep_for(std::chrono::milliseconds(2));
+				}
+				return evolver.computeFitnessForIndividual(genome);
+			});
+			results[w] = worker.serve(workerSocket);
+			close(workerSocket);
+		}));
+	}
+	{
+		Master master(local.grammar, masterSockets, [&local] (const TreeGenome &genome) {
+			return local.computeFitnessForIndividual(genome);
+		}, 10, 2);
+		for (int i = 0; i < 2; ++i) {
+			std::fill(fitnesses.begin(), fitnesses.end(), 0.0f);
+			master.computeFitness(genomes, fitnesses);
+			assert(fitnesses == expected);
+		}
+		assert(master.liveWorkerCount() == 2);
+		// The batches of the slow worker were re-issued to the fast one.
+		assert(master.getReissuedBatchCount() > 0);
+	}
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	assert(results[0] == 1 && results[1] == 1 && results[2] == 0);
+
+	{
+		// A batch that claims more genomes than its payload can hold is rejected before the genomes are allocated.
+		int sockets[2];
+		int status = socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+		assert(status == 0);
+		Worker worker(local.grammar, [] (const TreeGenome &) { return 0.0f; });
+		MessageWriter writer;
+		writer.begin(MessageType::Evaluate);
+		writer.writeU64(local.grammar.fingerprint());
+		writer.writeU32(7);
+		writer.writeU32(0xffffffffu);
+		writer.writeU8(0);
+		assert(sendMessage(sockets[0], writer.end()));
+		assert(!worker.serve(sockets[1]));
+		MessageType type;
+		std::vector<uint8_t> payload;
+		assert(receiveMessage(sockets[0], type, payload) && type == MessageType::Error);
+		close(sockets[0]);
+		close(sockets[1]);
+	}
+
+	{
+		// When the workers can't be polled, like when the descriptors exceed the limit of the process, their batches
+		// are computed by the fallback instead of polling again forever.
+		int sockets[2];
+		int status = socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+		assert(status == 0);
+		Master master(local.grammar, std::vector<int>(1, sockets[0]), [&local] (const TreeGenome &genome) {
+			return local.computeFitnessForIndividual(genome);
+		}, 10, 2);
+		rlimit limit;
+		status = getrlimit(RLIMIT_NOFILE, &limit);
+		assert(status == 0);
+		rlimit noDescriptors = limit;
+		noDescriptors.rlim_cur = 0;
+		status = setrlimit(RLIMIT_NOFILE, &noDescriptors);
+		assert(status == 0);
+		std::fill(fitnesses.begin(), fitnesses.end(), 0.0f);
+		master.computeFitness(genomes, fitnesses);
+		status = setrlimit(RLIMIT_NOFILE, &limit);
+		assert(status == 0);
+		assert(fitnesses == expected && master.liveWorkerCount() == 0);
+		close(sockets[1]);
+	}
+
+	// Without workers the fallback computes the fitness.
+	Master master(local.grammar, std::vector<int>(), [&local] (const TreeGenome &genome) {
+		return local.computeFitnessForIndividual(genome);
+	});
+	std::fill(fitnesses.begin(), fitnesses.end(), 0.0f);
+	master.computeFitness(genomes, fitnesses);
+	assert(fitnesses == expected);
+}
+
+void testParallelVariation() {
+	using namespace genetic;
+
+	{
+		// The known answers of Philox4x32-10.
+		uint32_t block[4];
+		const uint32_t zeroCounter[4] = { 0, 0, 0, 0 }, zeroKey[2] = { 0, 0 };
+		core::Philox4x32::generateBlock(zeroCounter, zeroKey, block);
+		assert(block[0] == 0x6627e8d5u && block[1] == 0xe169c58du && block[2] == 0xbc57ac4cu && block[3] == 0x9b00dbd8u);
+		const uint32_t onesCounter[4] = { 0xffffffffu, 0xffffffffu, 0xffffffffu, 0xffffffffu }, onesKey[2] = { 0xffffffffu, 0xffffffffu };
+		core::Philox4x32::generateBlock(onesCounter, onesKey, block);
+		assert(block[0] == 0x408f276du && block[1] == 0x41c83b0eu && block[2] == 0xa20bc7c6u && block[3] == 0x6d5451fdu);
+		// The streams are independent.
+		core::Philox4x32 a(1, 0), b(1, 0), c(1, 1);
+		a.discard(5);
+		b.discard(5);
+		assert(a() == b() && a() != c());
+	}
+
+	// The parallel variation doesn't depend on the number of threads.
+	auto run = [] (unsigned threadCount, std::vector<uint64_t> &hashes) {
+		EvolutionParameters params;
+		params.rng = std::mt19937(9);
+		params.mutationRate = 0.1f;
+		params.crossoverRate = 0.8f;
+		IntEvolver evolver(params);
+		Population population(41, params, evolver);
+		core::ThreadPool pool(threadCount);
+		bool isParallel = population.setParallelVariation(&pool);
+		assert(isParallel);
+		initializeIntPopulation(population, evolver);
+		population.evaluateGeneration();
+		auto initialFitness = population.getStats().bestFitness;
+		for (int i = 0; i < 15; ++i) {
+			population.nextGeneration(false);
+		}
+		population.evaluateGeneration();
+		auto stats = population.getStats();
+		assert(stats.bestFitness >= initialFitness);
+		hashes.clear();
+		for (size_t i = 0; i < 41; ++i) {
+			assert(population[i][0].subTreeSize() == population[i].getNodeCount());
+			hashes.push_back(population[i].structuralHash());
+		}
+	};
+	std::vector<uint64_t> hashes, otherHashes;
+	run(1, hashes);
+	run(3, otherHashes);
+	assert(hashes == otherHashes);
+
+	// A delegate that can't generate the trees concurrently isn't varied on the pool.
+	struct SerialIntEvolver : EvolvingPopulationDelegate {
+		grammar::Grammar grammar = makeIntGrammar();
+
+		void computeFitness(const std::vector<TreeGenome> &individuals, std::vector<float> &fitnesses) override {
+			std::fill(fitnesses.begin(), fitnesses.begin() + individuals.size(), 0.0f);
+		}
+		TreeGenome generateRandomTreeOfType(TreeGenomeType type) override {
+			return TreeGenome();
+		}
+		const grammar::Grammar &genomeGrammar() override {
+			return grammar;
+		}
+	};
+	EvolutionParameters params;
+	SerialIntEvolver serialEvolver;
+	Population population(5, params, serialEvolver);
+	core::ThreadPool pool(2);
+	assert(!population.setParallelVariation(&pool));
+	assert(population.setParallelVariation(nullptr));
+}
+
+void testTreeGenomeTypeIndex() {
+	using namespace genetic;
+	using namespace genetic::grammar;
+
+	const Type number = type("number"), boolean = type("bool");
+	Grammar grammar({ number, boolean }, {
+		terminal("x", number, 4),
+		terminal("true", boolean, 1),
+		binaryFunction("+", number, {number, number}, 3),
+		ternaryFunction("if", number, {boolean, number, number}, 2),
+		binaryFunction("<", boolean, {number, number}, 2),
+		unaryFunction("not", boolean, boolean, 1)
+	});
+	auto rng = std::mt19937(31);
+	TreeGenerator<std::mt19937> generator(grammar, rng);
+	TreeGenomeTypeIndex index;
+	for (int i = 0; i < 20; ++i) {
+		TreeGenome genome;
+		{
+			TreeGenome::Builder builder(genome);
+			generator.generateGrow(builder, 2 + i % 5, grammar.typeByName("number"));
+		}
+		index.build(genome, grammar);
+		size_t total = 0;
+		for (TreeGenomeType t = 0; t < grammar.typeCount(); ++t) {
+			std::vector<size_t> expected;
+			for (size_t j = 0; j < genome.getNodeCount(); ++j) {
+				if (grammar[genome[j]].getType() == t) {
+					expected.push_back(j);
+				}
+			}
+			assert(index.count(t) == expected.size());
+			for (size_t j = 0; j < expected.size(); ++j) {
+				assert(index.node(t, j) == expected[j]);
+			}
+			total += expected.size();
+		}
+		assert(total == genome.getNodeCount());
+	}
+}
+
+namespace {
+
+// Fits y = x * x + x.
+class RegressionEvolver : public genetic::GPUEvolvingPopulationDelegate {
+public:
+	genetic::EvolutionParameters &params;
+	genetic::grammar::Grammar grammar;
+	genetic::gpu::Dataset cases;
+
+	static genetic::grammar::Grammar makeGrammar() {
+		using namespace genetic::grammar;
+		const Type t = type("float");
+		return Grammar({ t }, {
+			terminal("x", t, 10),
+			terminal("1", t, 5),
+			binaryFunction("+", t, {t, t}, 5),
+			binaryFunction("-", t, {t, t}, 5),
+			binaryFunction("*", t, {t, t}, 5),
+			binaryFunction("/", t, {t, t}, 2),
+			unaryFunction("neg", t, t, 2)
+		});
+	}
+
+	RegressionEvolver(genetic::EvolutionParameters &params, std::unique_ptr<genetic::gpu::Device> device = nullptr) : GPUEvolvingPopulationDelegate(std::move(device)), params(params), grammar(makeGrammar()) {
+		cases.caseCount = 50;
+		cases.variableCount = 1;
+		for (size_t i = 0; i < cases.caseCount; ++i) {
+			float x = float(i) / 10.0f - 2.5f;
+			cases.variables.push_back(x);
+			cases.targets.push_back(x * x + x);
+		}
+	}
+
+	genetic::gpu::OperationDescriptor operationForDefinition(const genetic::grammar::Definition &definition) override {
+		using namespace genetic::gpu;
+		std::string name = definition.getName();
+		if (name == "x") return OperationDescriptor::makeVariable(0);
+		if (name == "1") return OperationDescriptor::makeConstant(1.0f);
+		if (name == "+") return Operation::Add;
+		if (name == "-") return Operation::Subtract;
+		if (name == "*") return Operation::Multiply;
+		if (name == "/") return Operation::Divide;
+		return Operation::Negate;
+	}
+
+	const genetic::gpu::Dataset &dataset() override {
+		return cases;
+	}
+
+	genetic::TreeGenome generateRandomTreeOfType(genetic::TreeGenomeType type) override {
+		genetic::TreeGenome genome;
+		genetic::TreeGenerator<genetic::EvolutionParameters::RNG> generator(grammar, params.rng);
+		genetic::TreeGenome::Builder builder(genome);
+		generator.generateGrow(builder, 2, type);
+		return genome;
+	}
+
+	const genetic::grammar::Grammar &genomeGrammar() override {
+		return grammar;
+	}
+};
+
+// Evaluate the given node for the given value of x.
+float evaluateRegressionNode(const genetic::grammar::Grammar &grammar, const genetic::TreeGenome::Node &node, float x) {
+	std::string name = grammar[node].getName();
+	if (name == "x") return x;
+	if (name == "1") return 1.0f;
+	float a = evaluateRegressionNode(grammar, node[0], x);
+	if (name == "neg") return -a;
+	float b = evaluateRegressionNode(grammar, node[1], x);
+	if (name == "+") return a + b;
+	if (name == "-") return a - b;
+	if (name == "*") return a * b;
+	return b == 0.0f ? 1.0f : a / b;
+}
+
+} // end anonymous namespace
+
+void testGPUEvaluator() {
+	using namespace genetic;
+
+	EvolutionParameters params;
+	params.rng = std::mt19937(19);
+	params.mutationRate = 0.1f;
+	params.crossoverRate = 0.8f;
+	RegressionEvolver evolver(params, std::unique_ptr<gpu::Device>(new gpu::ReferenceDevice()));
+	const auto &grammar = evolver.grammar;
+	TreeGenerator<std::mt19937> generator(grammar, params.rng);
+	std::vector<TreeGenome> genomes(30);
+	for (size_t i = 0; i < genomes.size(); ++i) {
+		TreeGenome::Builder builder(genomes[i]);
+		generator.generateGrow(builder, 1 + int(i % 6));
+	}
+	// x * x + x is a perfect fit.
+	{
+		genomes[0] = TreeGenome();
+		TreeGenome::Builder perfectBuilder(genomes[0]);
+		perfectBuilder.push(grammar[grammar["+"].singleDefinition()].getNodeValue());
+		perfectBuilder.push(grammar[grammar["*"].singleDefinition()].getNodeValue());
+		perfectBuilder.add(grammar[grammar["x"].singleDefinition()].getNodeValue());
+		perfectBuilder.add(grammar[grammar["x"].singleDefinition()].getNodeValue());
+		perfectBuilder.pop();
+		perfectBuilder.add(grammar[grammar["x"].singleDefinition()].getNodeValue());
+		perfectBuilder.pop();
+	}
+
+	gpu::PopulationProgram program;
+	program.compile(grammar, genomes);
+	assert(program.size() == genomes.size());
+	for (size_t i = 0; i < genomes.size(); ++i) {
+		assert(program.offsets[i + 1] - program.offsets[i] == genomes[i].getNodeCount());
+	}
+
+	std::vector<float> fitnesses(genomes.size());
+	evolver.computeFitness(genomes, fitnesses);
+	assert(fitnesses[0] == 0.0f);
+	const auto &cases = evolver.dataset();
+	for (size_t i = 0; i < genomes.size(); ++i) {
+		float error = 0;
+		for (size_t c = 0; c < cases.caseCount; ++c) {
+			error += std::fabs(evaluateRegressionNode(grammar, genomes[i].first(), cases.variables[c]) - cases.targets[c]);
+		}
+		assert(fitnesses[i] == gpu::finiteFitness(error));
+	}
+
+	// The delegate drives a population with the default device.
+	RegressionEvolver defaultEvolver(params);
+	Population population(40, params, defaultEvolver);
+	RampedHalfAndHalfInitializer<EvolutionParameters::RNG> init(defaultEvolver.grammar, params.rng);
+	population.initialize(4, init);
+	population.evaluateGeneration();
+	auto initialFitness = population.getStats().bestFitness;
+	for (int i = 0; i < 10; ++i) {
+		population.nextGeneration(false);
+	}
+	population.evaluateGeneration();
+	assert(population.getStats().bestFitness >= initialFitness);
+}
+
+void testCheckpoint() {
+	using namespace genetic;
+
+	auto makeParams = [] {
+		EvolutionParameters params;
+		params.rng = std::mt19937(29);
+		params.mutationRate = 0.1f;
+		params.crossoverRate = 0.8f;
+		return params;
+	};
+	auto hashes = [] (Population &population) {
+		std::vector<uint64_t> result;
+		for (size_t i = 0; i < population.size(); ++i) {
+			result.push_back(population[i].structuralHash());
+		}
+		return result;
+	};
+	const std::string path = "/tmp/fyp-genetic-checkpoint-test.bin";
+
+	auto params = makeParams();
+	IntEvolver evolver(params);
+	Population population(30, params, evolver);
+	initializeIntPopulation(population, evolver);
+	for (int i = 0; i < 5; ++i) {
+		population.nextGeneration(false);
+	}
+	{
+		CheckpointWriter writer;
+		writer.write(path, population, params, evolver.grammar);
+		assert(writer.wait());
+	}
+	for (int i = 0; i < 5; ++i) {
+		population.nextGeneration(false);
+	}
+	population.evaluateGeneration();
+
+	// The restored population continues exactly like the original one, without evaluating the restored generation.
+	auto restoredParams = makeParams();
+	IntEvolver restoredEvolver(restoredParams);
+	Population restored(30, restoredParams, restoredEvolver);
+	{
+		MappedCheckpoint checkpoint(path);
+		assert(checkpoint.isLoaded());
+		assert(checkpoint.generation() == 5 && checkpoint.individualCount() == 30);
+		assert(checkpoint.restore(restored, restoredParams, restoredEvolver.grammar));
+		// A different grammar or population size is rejected.
+		auto otherGrammar = RegressionEvolver::makeGrammar();
+		assert(!checkpoint.restore(restored, restoredParams, otherGrammar));
+		Population smaller(10, restoredParams, restoredEvolver);
+		assert(!checkpoint.restore(smaller, restoredParams, restoredEvolver.grammar));
+	}
+	restored.evaluateGeneration();
+	assert(restoredEvolver.evaluationCount == 0);
+	for (int i = 0; i < 5; ++i) {
+		restored.nextGeneration(false);
+	}
+	restored.evaluateGeneration();
+	assert(restored.generation == population.generation);
+	assert(hashes(restored) == hashes(population));
+	for (size_t i = 0; i < population.size(); ++i) {
+		assert(restored.getFitness(i) == population.getFitness(i));
+	}
+
+	// A truncated checkpoint is rejected.
+	{
+		std::vector<char> bytes;
+		{
+			std::ifstream file(path, std::ios::binary);
+			bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		}
+		std::ofstream(path, std::ios::binary).write(bytes.data(), std::streamsize(bytes.size() / 2));
+		MappedCheckpoint checkpoint(path);
+		assert(!checkpoint.isLoaded());
+	}
+	{
+		std::vector<uint8_t> bytes;
+		checkpoint::serialize(population, params, evolver.grammar, bytes);
+		checkpoint::Header header;
+		std::memcpy(&header, bytes.data(), sizeof(header));
+		// A count whose sections would overflow the bounds checks is rejected.
+		auto corrupted = bytes;
+		auto overflowingHeader = header;
+		overflowingHeader.individualCount = (uint64_t(1) << 62) + 1;
+		std::memcpy(corrupted.data(), &overflowingHeader, sizeof(header));
+		assert(checkpoint::writeFile(path, corrupted));
+		assert(!MappedCheckpoint(path).isLoaded());
+		// A node that isn't valid for the grammar is rejected when the genomes are restored.
+		corrupted = bytes;
+		checkpoint::Node node;
+		std::memcpy(&node, corrupted.data() + header.nodesOffset, sizeof(node));
+		node.value = evolver.grammar.getNodeLimit();
+		std::memcpy(corrupted.data() + header.nodesOffset, &node, sizeof(node));
+		assert(checkpoint::writeFile(path, corrupted));
+		MappedCheckpoint checkpoint(path);
+		assert(checkpoint.isLoaded());
+		assert(!checkpoint.restore(restored, restoredParams, restoredEvolver.grammar));
+	}
+	std::remove(path.c_str());
+	assert(!MappedCheckpoint(path).isLoaded());
+}
+
+void testStatisticsRecorder() {
+	using namespace genetic;
+
+	{
+		// A single node has a depth of 1.
+		core::Tree<int> tree;
+		core::Tree<int>::Builder builder(tree);
+		builder.push(1);
+		builder.push(2);
+		builder.push(3);
+		builder.pop();
+		builder.pop();
+		builder.push(4);
+		builder.pop();
+		builder.pop();
+		assert(tree.getDepth() == 3);
+		assert(tree.getSubTree(3).getDepth() == 1);
+	}
+
+	// Recording the statistics doesn't change the evolution.
+	auto run = [] (StatisticsRecorder *recorder, std::vector<uint64_t> &hashes) {
+		EvolutionParameters params;
+		params.rng = std::mt19937(17);
+		params.mutationRate = 0.1f;
+		params.crossoverRate = 0.8f;
+		IntEvolver evolver(params);
+		Population population(30, params, evolver);
+		FitnessCache cache(1000);
+		population.setFitnessCache(&cache);
+		population.setStatisticsRecorder(recorder);
+		initializeIntPopulation(population, evolver);
+		for (int i = 0; i < 10; ++i) {
+			population.nextGeneration(false);
+		}
+		hashes.clear();
+		for (size_t i = 0; i < population.size(); ++i) {
+			hashes.push_back(population[i].structuralHash());
+		}
+	};
+	std::vector<GenerationRecord> records;
+	std::vector<uint64_t> hashes, recordedHashes;
+	run(nullptr, hashes);
+	{
+		CallbackStatisticsSink sink([&] (const GenerationRecord &record) {
+			records.push_back(record);
+		});
+		StatisticsRecorder recorder(sink);
+		run(&recorder, recordedHashes);
+		assert(recorder.getDroppedCount() == 0);
+	}
+	assert(hashes == recordedHashes);
+	assert(records.size() == 10);
+	bool hasCacheHits = false;
+	for (size_t i = 0; i < records.size(); ++i) {
+		const auto &record = records[i];
+		assert(record.generation == int64_t(i) && record.individualCount == 30);
+		assert(record.minFitness <= record.averageFitness && record.averageFitness <= record.maxFitness);
+		assert(record.fitnessStandardDeviation >= 0);
+		assert(record.minNodeCount >= 1 && record.minNodeCount <= record.averageNodeCount && record.averageNodeCount <= record.maxNodeCount);
+		assert(record.minDepth >= 1 && record.minDepth <= record.averageDepth && record.averageDepth <= record.maxDepth);
+		assert(record.maxDepth <= record.maxNodeCount);
+		assert(record.cacheHitRate >= 0 && record.cacheHitRate <= 1);
+		hasCacheHits = hasCacheHits || record.cacheHitRate > 0;
+	}
+	// The elites are always found in the cache.
+	assert(hasCacheHits);
+
+	// The CSV and the binary sinks.
+	std::ostringstream csv, binary;
+	{
+		CSVStatisticsSink csvSink(csv);
+		BinaryStatisticsSink binarySink(binary);
+		for (const auto &record : records) {
+			csvSink.write(record);
+			binarySink.write(record);
+		}
+	}
+	auto text = csv.str();
+	assert(std::count(text.begin(), text.end(), '\n') == 11);
+	assert(text.compare(0, 11, "generation,") == 0);
+	auto bytes = binary.str();
+	assert(bytes.size() == records.size() * BinaryStatisticsSink::recordSize);
+	auto last = BinaryStatisticsSink::read(reinterpret_cast<const uint8_t *>(bytes.data()) + bytes.size() - BinaryStatisticsSink::recordSize);
+	assert(last.generation == 9 && last.maxFitness == records.back().maxFitness);
+	assert(last.individualCount == records.back().individualCount && last.cacheHitRate == records.back().cacheHitRate);
+	assert(last.variationTime == records.back().variationTime && last.averageDepth == records.back().averageDepth);
+	// The generation is the first field, in little endian.
+	const size_t lastOffset = bytes.size() - BinaryStatisticsSink::recordSize;
+	assert(bytes[lastOffset] == 9 && bytes[lastOffset + 1] == 0 && bytes[lastOffset + 8] == 30);
+
+	// The records that don't fit into the queue are dropped instead of blocking the evolution.
+	{
+		std::mutex blockMutex;
+		std::unique_lock<std::mutex> block(blockMutex);
+		size_t writtenCount = 0;
+		CallbackStatisticsSink slowSink([&] (const GenerationRecord &) {
+			std::lock_guard<std::mutex> wait(blockMutex);
+			++writtenCount;
+		});
+		{
+			StatisticsRecorder recorder(slowSink, 4);
+			for (int i = 0; i < 20; ++i) {
+				recorder.record(records[0]);
+			}
+			assert(recorder.getDroppedCount() >= 20 - 4 - 1);
+			block.unlock();
+		}
+		assert(writtenCount >= 4 && writtenCount <= 5);
+	}
+}
+
+void testSizeLimits() {
+	using namespace genetic;
+
+	{
+		// The depth of a sub-tree and the level of a node.
+		core::Tree<int> tree;
+		core::Tree<int>::Builder builder(tree);
+		builder.push(1);
+		builder.add(2);
+		builder.push(3);
+		builder.push(4);
+		builder.add(5);
+		builder.pop();
+		builder.pop();
+		builder.pop();
+		assert(tree.getDepth() == 4);
+		assert(tree.getSubTreeDepth(1) == 1 && tree.getSubTreeDepth(2) == 3);
+		assert(tree.getLevel(0) == 1 && tree.getLevel(2) == 2 && tree.getLevel(4) == 4);
+	}
+
+	// Mutation and crossover never grow a tree beyond the limits, serially and concurrently.
+	for (unsigned threadCount = 0; threadCount <= 2; threadCount += 2) {
+		EvolutionParameters params;
+		params.rng = std::mt19937(31);
+		params.mutationRate = 0.3f;
+		params.crossoverRate = 0.6f;
+		params.maxDepth = 5;
+		params.maxNodeCount = 15;
+		IntEvolver evolver(params);
+		Population population(40, params, evolver);
+		std::unique_ptr<core::ThreadPool> pool(threadCount ? new core::ThreadPool(threadCount) : nullptr);
+		population.setParallelVariation(pool.get());
+		// The initial trees are within the limits.
+		initializeIntPopulation(population, evolver, 3);
+		for (int i = 0; i < 30; ++i) {
+			population.nextGeneration(false);
+			for (size_t j = 0; j < population.size(); ++j) {
+				assert(population[j].getNodeCount() <= 15 && population[j].getDepth() <= 5);
+				assert(population[j][0].subTreeSize() == population[j].getNodeCount());
+			}
+		}
+	}
+
+	// The lexicographic parsimony tournament breaks the ties in favour of the smaller individual.
+	EvolutionParameters params;
+	IntEvolver evolver(params);
+	Population population(20, params, evolver);
+	initializeIntPopulation(population, evolver);
+	std::vector<TreeGenome> individuals(20);
+	for (size_t i = 0; i < 20; ++i) {
+		individuals[i].assign(population[i]);
+	}
+	population.restore(0, std::move(individuals), std::vector<float>(20, 1.0f));
+	bool isSmallerSelected = false;
+	for (int i = 0; i < 200; ++i) {
+		params.rng = std::mt19937(unsigned(i));
+		params.useLexicographicParsimony = false;
+		auto selected = population.selectIndividual();
+		params.rng = std::mt19937(unsigned(i));
+		params.useLexicographicParsimony = true;
+		auto parsimoniousSelected = population.selectIndividual();
+		assert(population[parsimoniousSelected].getNodeCount() <= population[selected].getNodeCount());
+		isSmallerSelected = isSmallerSelected || population[parsimoniousSelected].getNodeCount() < population[selected].getNodeCount();
+	}
+	assert(isSmallerSelected);
+}
+
+namespace {
+
+// Evolves integer trees that evaluate to 42, generating the mutated sub-trees into reusable buffers.
+class IterativeIntEvolver : public IntEvolver {
+public:
+	genetic::IterativeTreeGenerator<genetic::EvolutionParameters::RNG> generator;
+	size_t generatedCount = 0;
+
+	IterativeIntEvolver(genetic::EvolutionParameters &params) : IntEvolver(params), generator(grammar, params.rng) { }
+
+	size_t generateRandomTreeOfTypeInto(genetic::TreeGenomeType type, std::vector<genetic::TreeGenome::NodeStorageType> &nodes) override {
+		++generatedCount;
+		return generator.generateGrow(nodes, 2, type);
+	}
+};
+
+} // end anonymous namespace
+
+void testIterativeTreeGenerator() {
+	using namespace genetic;
+	using namespace genetic::grammar;
+
+	{
+		// The alias table draws the indices in proportion to their weights.
+		AliasTable table({ 1, 2, 7, 0 });
+		std::mt19937 rng(3);
+		size_t counts[4] = { 0, 0, 0, 0 };
+		const size_t sampleCount = 100000;
+		for (size_t i = 0; i < sampleCount; ++i) {
+			counts[table.sample(rng)]++;
+		}
+		assert(counts[3] == 0);
+		assert(std::abs(float(counts[0]) / sampleCount - 0.1f) < 0.01f);
+		assert(std::abs(float(counts[1]) / sampleCount - 0.2f) < 0.01f);
+		assert(std::abs(float(counts[2]) / sampleCount - 0.7f) < 0.01f);
+	}
+
+	// The generated trees respect the types of the arguments and the depth.
+	const Type scalar = type("float");
+	const Type vec = type("float3");
+	Grammar grammar = Grammar({ scalar, vec }, {
+		terminal("x", scalar, 10),
+		terminal("randomColor", vec, 5),
+		terminal("y", scalar, 10),
+		binaryFunction("+", scalar, {scalar, scalar}, 5),
+		ternaryFunction("rgb", vec, { scalar, scalar, scalar }, 5),
+		binaryFunction("darker", vec, { vec, scalar }, 2),
+		unaryFunction("sin", scalar, scalar, 3),
+		unaryFunction("grayscale", vec, vec, 8)
+	});
+	const auto vectorType = grammar.typeByName("float3");
+	std::mt19937 rng(5);
+	IterativeTreeGenerator<std::mt19937> generator(grammar, rng);
+	IterativeTreeGenerator<std::mt19937>::NodeBuffer nodes;
+	TreeGenome genome;
+	std::function<void (const TreeGenome::Node &, TreeGenomeType)> checkTypes = [&] (const TreeGenome::Node &node, TreeGenomeType type) {
+		const auto &definition = grammar[node];
+		assert(definition.getType() == type && node.size() == definition.getNumArguments());
+		unsigned i = 0;
+		for (auto child : node) {
+			checkTypes(child, definition.getTypeForArgument(i++));
+		}
+	};
+	for (int depth = 1; depth <= 6; ++depth) {
+		auto fullDepth = generator.generate(genome, nodes, depth, IterativeTreeGenerator<std::mt19937>::Strategy::Full, vectorType);
+		assert(fullDepth == size_t(depth) && genome.getDepth() == size_t(depth));
+		checkTypes(genome.first(), vectorType);
+		auto growDepth = generator.generateGrow(nodes, depth, vectorType);
+		assert(growDepth <= size_t(depth) && TreeGenome::isValidNodeArray(nodes.data(), nodes.size()));
+		genome.assignNodes(nodes.data(), nodes.size());
+		assert(genome.getDepth() == growDepth);
+		checkTypes(genome.first(), vectorType);
+	}
+
+	// The trees have the same distribution as the trees of the recursive generator.
+	auto grammarForSizes = makeIntGrammar();
+	double recursiveNodeCount = 0, iterativeNodeCount = 0;
+	const int treeCount = 20000;
+	{
+		std::mt19937 rng(7);
+		TreeGenerator<std::mt19937> recursiveGenerator(grammarForSizes, rng);
+		IterativeTreeGenerator<std::mt19937> iterativeGenerator(grammarForSizes, rng);
+		for (int i = 0; i < treeCount; ++i) {
+			TreeGenome tree;
+			{
+				TreeGenome::Builder builder(tree);
+				recursiveGenerator.generateGrow(builder, 5);
+			}
+			recursiveNodeCount += double(tree.getNodeCount());
+			iterativeGenerator.generateGrow(nodes, 5);
+			iterativeNodeCount += double(nodes.size());
+		}
+	}
+	assert(std::abs(recursiveNodeCount - iterativeNodeCount) / recursiveNodeCount < 0.05);
+
+	// The initializer ramps the depth like the ramped half and half initializer.
+	{
+		std::mt19937 rng(9);
+		IterativeRampedHalfAndHalfInitializer<std::mt19937> initializer(grammarForSizes, rng);
+		InitializationOptions options;
+		options.maxTreeGenomeDepth = 4;
+		options.populationSize = 20;
+		std::vector<TreeGenome> genomes;
+		initializer.initialize(options, [&] (TreeGenome genome) {
+			genomes.push_back(std::move(genome));
+		});
+		assert(genomes.size() == 20);
+		assert(genomes[0].getDepth() == 1 && genomes[9].getDepth() == 4);
+		for (const auto &genome : genomes) {
+			assert(genome.getDepth() <= 4 && genome[0].subTreeSize() == genome.getNodeCount());
+		}
+	}
+
+	// The mutation uses the buffers when the delegate generates into them.
+	EvolutionParameters params;
+	params.rng = std::mt19937(11);
+	params.mutationRate = 0.5f;
+	params.crossoverRate = 0.4f;
+	params.maxNodeCount = 30;
+	IterativeIntEvolver evolver(params);
+	Population population(30, params, evolver);
+	initializeIntPopulation(population, evolver, 3);
+	for (int i = 0; i < 20; ++i) {
+		population.nextGeneration(false);
+	}
+	assert(evolver.generatedCount != 0);
+	for (size_t i = 0; i < population.size(); ++i) {
+		assert(population[i].getNodeCount() <= 30 && population[i][0].subTreeSize() == population[i].getNodeCount());
+	}
+}
+
+void testTreeGenomeSimplifier() {
+	using namespace genetic;
+	using namespace grammar;
+
+	static const Type intType = type("int");
+	Grammar grammar({
+		intType
+	}, {
+		terminal("x", intType, 2),
+		terminal("1", intType, 1),
+		binaryFunction("+", intType, { intType, intType }, 1),
+		binaryFunction("-", intType, { intType, intType }, 1),
+		binaryFunction("*", intType, { intType, intType }, 1)
+	});
+	auto definitions = GrammarDefinitionAccessor(grammar);
+	const auto &x = definitions["x"], &one = definitions["1"];
+	const unsigned add = definitions["+"].getDefinitionId(), sub = definitions["-"].getDefinitionId(), mul = definitions["*"].getDefinitionId();
+
+	struct Operations {
+		unsigned add, sub;
+
+		int apply(unsigned definitionId, int a, int b) const {
+			return definitionId == add ? a + b : definitionId == sub ? a - b : a * b;
+		}
+	};
+	const Operations ops = { add, sub };
+	struct Evaluator : TreeGenomeProgramEvaluator<int, Evaluator> {
+		const Operations &ops;
+		unsigned x;
+		int xValue = 0;
+
+		Evaluator(const Operations &ops, unsigned x) : ops(ops), x(x) { }
+
+		int evaluateTerminal(unsigned definitionId, TreeGenomeValue value) {
+			return definitionId == x ? xValue : 1;
+		}
+		int evaluateBinaryFunction(unsigned definitionId, int a, int b) {
+			return ops.apply(definitionId, a, b);
+		}
+	};
+	struct Delegate : TreeGenomeSimplifierDelegate<int> {
+		const Operations &ops;
+		unsigned one, mul;
+		TreeGenomeValue xValue;
+
+		Delegate(const Operations &ops, unsigned one, unsigned mul, TreeGenomeValue xValue) : ops(ops), one(one), mul(mul), xValue(xValue) { }
+
+		AlgebraicProperties<int> propertiesForFunction(unsigned definitionId) override {
+			AlgebraicProperties<int> properties;
+			properties.isConstantFoldable = true;
+			properties.isCommutative = definitionId != ops.sub;
+			properties.hasIdentity = true;
+			properties.identity = definitionId == mul ? 1 : 0;
+			properties.hasAnnihilator = definitionId == mul;
+			properties.isCancelling = definitionId == ops.sub;
+			return properties;
+		}
+		bool valueForConstantTerminal(unsigned definitionId, TreeGenomeValue value, int &result) override {
+			result = 1;
+			return definitionId == one;
+		}
+		// Both of the raw values of x are the same terminal.
+		TreeGenomeValue canonicalValueForTerminal(unsigned definitionId, TreeGenomeValue value) override {
+			return definitionId == one ? value : xValue;
+		}
+		int evaluateFunction(unsigned definitionId, const int *arguments, unsigned argumentCount) override {
+			assert(argumentCount == 2);
+			return ops.apply(definitionId, arguments[0], arguments[1]);
+		}
+	};
+	Delegate delegate(ops, one.getDefinitionId(), mul, x.getNodeValue());
+	TreeGenomeSimplifier<int> simplifier(grammar, delegate);
+	Evaluator evaluator(ops, x.getDefinitionId());
+	// (+ (* x 1) (- x x)) is x, even though the two x in (- x x) have different raw values.
+	TreeGenome genome;
+	{
+		TreeGenome::Builder builder(genome);
+		builder.push(grammar[add].getNodeValue());
+		builder.push(grammar[mul].getNodeValue());
+		builder.add(x.getNodeValue());
+		builder.add(one.getNodeValue());
+		builder.pop();
+		builder.push(grammar[sub].getNodeValue());
+		builder.add(x.getNodeValue());
+		builder.add(x.getNodeValue() + 1);
+		builder.pop();
+		builder.pop();
+	}
+	auto program = simplifier(genome);
+	assert(program.size() == 1);
+	assert(program.instructions[0].definitionId == x.getDefinitionId());
+	assert(program.maxStackDepth == 1);
+
+	// (* (+ 1 1) x) folds into (* 2 x).
+	genome = TreeGenome();
+	{
+		TreeGenome::Builder builder(genome);
+		builder.push(grammar[mul].getNodeValue());
+		builder.push(grammar[add].getNodeValue());
+		builder.add(one.getNodeValue());
+		builder.add(one.getNodeValue());
+		builder.pop();
+		builder.add(x.getNodeValue());
+		builder.pop();
+	}
+	simplifier.simplify(genome, program);
+	assert(program.size() == 3);
+	assert(program.constants.size() == 1 && program.constants[0] == 2);
+	assert(program.instructions[1].definitionId == TreeGenomeProgram::constantDefinitionId);
+	evaluator.xValue = 21;
+	assert(evaluator(program) == 42);
+
+	// (* x (- 1 1)) is annihilated by the folded 0.
+	genome = TreeGenome();
+	{
+		TreeGenome::Builder builder(genome);
+		builder.push(grammar[mul].getNodeValue());
+		builder.add(x.getNodeValue());
+		builder.push(grammar[sub].getNodeValue());
+		builder.add(one.getNodeValue());
+		builder.add(one.getNodeValue());
+		builder.pop();
+		builder.pop();
+	}
+	simplifier.simplify(genome, program);
+	assert(program.size() == 1 && evaluator(program) == 0);
+
+	// The simplified random trees compute the same values as the trees, with fewer instructions.
+	auto rng = std::mt19937(11);
+	TreeGenerator<std::mt19937> generator(grammar, rng);
+	TreeGenomeProgram original;
+	size_t originalSize = 0, simplifiedSize = 0;
+	for (int i = 0; i < 200; ++i) {
+		genome = TreeGenome();
+		{
+			TreeGenome::Builder builder(genome);
+			generator.generateGrow(builder, 2 + i % 6);
+		}
+		original.compile(grammar, genome);
+		simplifier.simplify(genome, program);
+		assert(program.size() <= original.size());
+		originalSize += original.size();
+		simplifiedSize += program.size();
+		for (int xValue = -3; xValue <= 3; ++xValue) {
+			evaluator.xValue = xValue;
+			auto expected = evaluator(original);
+			assert(evaluator(program) == expected);
+		}
+	}
+	assert(simplifiedSize < originalSize * 3 / 4);
+}
+
+void testTreeGenomeDAG() {
+	using namespace genetic;
+	using namespace grammar;
+
+	// Random trees that are hash-consed compute the same values as their programs.
+	{
+		auto grammar = makeIntGrammar();
+		struct Delegate : TreeGenomeDAGDelegate {
+			const Grammar &grammar;
+
+			Delegate(const Grammar &grammar) : grammar(grammar) { }
+
+			// All of the raw values of a terminal evaluate to the same value.
+			TreeGenomeValue canonicalValueForTerminal(unsigned definitionId, TreeGenomeValue value) override {
+				return grammar[definitionId].getNodeValue();
+			}
+		};
+		struct Evaluator : TreeGenomeDAGEvaluator<int, Evaluator> {
+			IntOperations ops;
+
+			Evaluator(const Grammar &grammar) : ops(grammar) { }
+
+			int evaluateTerminal(unsigned definitionId, TreeGenomeValue value) {
+				return ops.terminal(definitionId);
+			}
+			int evaluateUnaryFunction(unsigned definitionId, int x) {
+				return ops.unary(definitionId, x);
+			}
+			int evaluateBinaryFunction(unsigned definitionId, int x, int y) {
+				return ops.binary(definitionId, x, y);
+			}
+			int evaluateFunction(unsigned definitionId, const int *arguments, unsigned argumentCount) {
+				assert(argumentCount == 3);
+				return ops.ternary(definitionId, arguments);
+			}
+		};
+		Delegate delegate(grammar);
+		Evaluator evaluator(grammar);
+		IntProgramEvaluator programEvaluator(grammar);
+		auto rng = std::mt19937(5);
+		TreeGenerator<std::mt19937> generator(grammar, rng);
+		TreeGenomeDAG dag;
+		size_t nodeCount = 0, dagSize = 0;
+		for (int i = 0; i < 100; ++i) {
+			TreeGenome genome;
+			{
+				TreeGenome::Builder builder(genome);
+				generator.generateFull(builder, 2 + i % 6);
+			}
+			dag.compile(grammar, genome, delegate);
+			assert(dag.functionCount() == 0);
+			assert(dag.size() <= genome.getNodeCount());
+			nodeCount += genome.getNodeCount();
+			dagSize += dag.size();
+			assert(evaluator(dag) == programEvaluator(TreeGenomeProgram(grammar, genome)));
+		}
+		// Full trees over two terminals repeat most of their sub-trees.
+		assert(dagSize < nodeCount / 2);
+	}
+
+	// The bodies of a function set are compiled once, and the functions can call the functions before them.
+	static const Type intType = type("int");
+	static const Type setType = type("function-set");
+	Grammar grammar({
+		intType, setType
+	}, {
+		terminal("x", intType, 1),
+		terminal("y", intType, 1),
+		terminal("1", intType, 1),
+		binaryFunction("+", intType, { intType, intType }, 1),
+		binaryFunction("call0", intType, { intType, intType }, 1),
+		binaryFunction("call1", intType, { intType, intType }, 1),
+		function("functions", setType, { intType, intType, intType }, 1)
+	});
+	auto definitions = GrammarDefinitionAccessor(grammar);
+	struct Delegate : TreeGenomeDAGDelegate {
+		unsigned x, y, call0, call1, functions;
+
+		unsigned functionCountForRoot(unsigned definitionId) override {
+			return definitionId == functions ? 2 : 0;
+		}
+		int functionIndexForCall(unsigned definitionId) override {
+			return definitionId == call0 ? 0 : definitionId == call1 ? 1 : -1;
+		}
+		int parameterIndexForTerminal(unsigned definitionId, TreeGenomeValue value) override {
+			return definitionId == x ? 0 : definitionId == y ? 1 : -1;
+		}
+	};
+	Delegate delegate;
+	delegate.x = definitions["x"].getDefinitionId();
+	delegate.y = definitions["y"].getDefinitionId();
+	delegate.call0 = definitions["call0"].getDefinitionId();
+	delegate.call1 = definitions["call1"].getDefinitionId();
+	delegate.functions = definitions["functions"].getDefinitionId();
+	struct Evaluator : TreeGenomeDAGEvaluator<int, Evaluator> {
+		int evaluateTerminal(unsigned definitionId, TreeGenomeValue value) {
+			return 1;
+		}
+		int evaluateBinaryFunction(unsigned definitionId, int x, int y) {
+			return x + y;
+		}
+	};
+	auto value = [&] (const char *name) {
+		return definitions[name].getNodeValue();
+	};
+	// F0(x, y) = x + y, F1(x, y) = F0(F0(x, y), F0(x, y)) and the main body is F1(F1(x, 1), y).
+	TreeGenome genome;
+	{
+		TreeGenome::Builder builder(genome);
+		builder.push(value("functions"));
+		builder.push(value("+"));
+		builder.add(value("x"));
+		builder.add(value("y"));
+		builder.pop();
+		builder.push(value("call0"));
+		for (int i = 0; i < 2; ++i) {
+			builder.push(value("call0"));
+			builder.add(value("x"));
+			builder.add(value("y"));
+			builder.pop();
+		}
+		builder.pop();
+		builder.push(value("call1"));
+		builder.push(value("call1"));
+		builder.add(value("x"));
+		builder.add(value("1"));
+		builder.pop();
+		builder.add(value("y"));
+		builder.pop();
+		builder.pop();
+	}
+	TreeGenomeDAG dag(grammar, genome, delegate);
+	assert(dag.functionCount() == 2);
+	// The two calls of F0 in F1 are the same node.
+	assert(dag.bodies[0].nodeCount == 3 && dag.bodies[1].nodeCount == 4 && dag.bodies[2].nodeCount == 5);
+	Evaluator evaluator;
+	for (int x = -2; x <= 2; ++x) {
+		for (int y = -2; y <= 2; ++y) {
+			int parameters[] = { x, y };
+			assert(evaluator(dag, parameters, 2) == 2 * (2 * (x + 1) + y));
+		}
+	}
+}
+
+void testRacingEvaluation() {
+	using namespace genetic;
+
+	// Finds x + x - y over cases with different values of x and y.
+	struct RacingIntEvolver : RacingEvolvingPopulationDelegate {
+		struct CaseEvaluator : TreeGenomeProgramEvaluator<int, CaseEvaluator> {
+			IntOperations ops;
+			int x = 0, y = 0;
+
+			CaseEvaluator(const grammar::Grammar &grammar) : ops(grammar) { }
+
+			int evaluateTerminal(unsigned definitionId, TreeGenomeValue value) {
+				return definitionId == ops.x ? x : y;
+			}
+			int evaluateUnaryFunction(unsigned definitionId, int x) {
+				return ops.unary(definitionId, x);
+			}
+			int evaluateBinaryFunction(unsigned definitionId, int x, int y) {
+				return ops.binary(definitionId, x, y);
+			}
+			int evaluateFunction(unsigned definitionId, const int *arguments, unsigned argumentCount) {
+				return ops.ternary(definitionId, arguments);
+			}
+		};
+
+		EvolutionParameters &params;
+		grammar::Grammar grammar;
+
+		RacingIntEvolver(EvolutionParameters &params, RacingOptions options) : RacingEvolvingPopulationDelegate(options, 2), params(params), grammar(makeIntGrammar()) { }
+
+		size_t fitnessCaseCount() override {
+			return 1000;
+		}
+		float computeCaseBatchFitness(const TreeGenome &individual, size_t firstCase, size_t caseCount) override {
+			TreeGenomeProgram program(grammar, individual);
+			CaseEvaluator evaluator(grammar);
+			float sum = 0;
+			for (size_t c = firstCase; c < firstCase + caseCount; ++c) {
+				evaluator.x = int(c % 37) - 18;
+				evaluator.y = int(c % 11);
+				auto error = abs(evaluator(program) - (evaluator.x + evaluator.x - evaluator.y));
+				sum += 1.0f - float(std::min(error, 100)) / 100.0f;
+			}
+			return sum;
+		}
+		float maxCaseFitness() override {
+			return 1.0f;
+		}
+		float fitnessForCaseFitness(const TreeGenome &individual, float caseFitnessSum) override {
+			return caseFitnessSum / float(fitnessCaseCount()) - float(individual.getNodeCount()) * 0.001f;
+		}
+		TreeGenome generateRandomTreeOfType(TreeGenomeType type) override {
+			TreeGenome genome;
+			TreeGenerator<EvolutionParameters::RNG> generator(grammar, params.rng);
+			TreeGenome::Builder builder(genome);
+			generator.generateGrow(builder, 2, type);
+			return genome;
+		}
+		const grammar::Grammar &genomeGrammar() override {
+			return grammar;
+		}
+	};
+
+	auto evolve = [] (RacingMode mode, size_t &evaluatedCaseCount, float &bestFitness) {
+		EvolutionParameters params;
+		params.rng = std::mt19937(17);
+		params.mutationRate = 0.2f;
+		params.crossoverRate = 0.7f;
+		RacingOptions options;
+		options.mode = mode;
+		options.batchSize = 50;
+		RacingIntEvolver evolver(params, options);
+		Population population(60, params, evolver);
+		RampedHalfAndHalfInitializer<EvolutionParameters::RNG> initializer(evolver.grammar, params.rng);
+		population.initialize(5, initializer);
+		evaluatedCaseCount = 0;
+		for (int i = 0; i < 10; ++i) {
+			population.nextGeneration(false);
+			evaluatedCaseCount += evolver.getEvaluatedCaseCount();
+			if (mode == RacingMode::None) {
+				assert(evolver.getPrunedCount() == 0);
+			}
+		}
+		auto best = population.evaluateGeneration();
+		bestFitness = population.getFitness(best);
+		// The fitness of the best individual was computed from all of the cases.
+		if (mode == RacingMode::Threshold) {
+			assert(std::abs(bestFitness - evolver.computeFitnessForIndividual(population[best])) < 1e-4f);
+		}
+	};
+	size_t fullCount, thresholdCount, halvingCount;
+	float fullFitness, thresholdFitness, halvingFitness;
+	evolve(RacingMode::None, fullCount, fullFitness);
+	evolve(RacingMode::Threshold, thresholdCount, thresholdFitness);
+	evolve(RacingMode::SuccessiveHalving, halvingCount, halvingFitness);
+	assert(fullCount == 10 * 60 * 1000);
+	assert(thresholdCount < fullCount);
+	assert(halvingCount < fullCount / 3);
+	// The races still make progress.
+	assert(thresholdFitness > 0.5f && halvingFitness > 0.5f);
+
+	// The estimated fitnesses of the pruned individuals aren't stored in the fitness cache.
+	for (auto mode : { RacingMode::Threshold, RacingMode::SuccessiveHalving }) {
+		EvolutionParameters params;
+		params.rng = std::mt19937(17);
+		params.mutationRate = 0.2f;
+		params.crossoverRate = 0.7f;
+		RacingOptions options;
+		options.mode = mode;
+		options.batchSize = 50;
+		RacingIntEvolver evolver(params, options);
+		Population population(60, params, evolver);
+		FitnessCache cache(1024);
+		population.setFitnessCache(&cache);
+		RampedHalfAndHalfInitializer<EvolutionParameters::RNG> initializer(evolver.grammar, params.rng);
+		population.initialize(5, initializer);
+		size_t prunedCount = 0;
+		for (int i = 0; i < 10; ++i) {
+			population.nextGeneration(false);
+			prunedCount += evolver.getPrunedCount();
+			for (size_t j = 0; j < population.size(); ++j) {
+				float fitness;
+				if (cache.lookup(population[j], fitness)) {
+					assert(std::abs(fitness - evolver.computeFitnessForIndividual(population[j])) < 1e-4f);
+				}
+			}
+		}
+		assert(prunedCount > 0);
+	}
+}
+
+void testLexicaseSelection() {
+	using namespace genetic;
+
+	// C is never the best on a case, so only the epsilon-lexicase selection can select it.
+	CaseErrorMatrix errors;
+	errors.resize(3, 2);
+	const float rows[3][2] = { { 0, 5 }, { 5, 0 }, { 1, 1 } };
+	for (size_t i = 0; i < 3; ++i) {
+		std::copy(rows[i], rows[i] + 2, errors.row(i));
+	}
+	assert(errors(2, 1) == 1);
+	auto rng = std::mt19937(3);
+	LexicaseSelectionBuffer buffer;
+	size_t counts[3] = { 0, 0, 0 };
+	for (int i = 0; i < 300; ++i) {
+		++counts[selectByLexicase(errors, rng, buffer)];
+	}
+	assert(counts[0] > 100 && counts[1] > 100 && counts[2] == 0);
+	errors.computeEpsilons();
+	assert(errors.epsilon(0) == 1 && errors.epsilon(1) == 1);
+	counts[0] = counts[1] = counts[2] = 0;
+	for (int i = 0; i < 300; ++i) {
+		++counts[selectByLexicase(errors, rng, buffer)];
+	}
+	assert(counts[2] > 100);
+
+	// An individual whose errors are NaN never empties the candidates, with or without the errors made finite.
+	const float nan = std::numeric_limits<float>::quiet_NaN();
+	const float nanRows[3][2] = { { nan, nan }, { 2, nan }, { 1, 3 } };
+	for (size_t i = 0; i < 3; ++i) {
+		std::copy(nanRows[i], nanRows[i] + 2, errors.row(i));
+	}
+	errors.clearEpsilons();
+	for (int i = 0; i < 100; ++i) {
+		assert(selectByLexicase(errors, rng, buffer) != 0);
+	}
+	errors.replaceNonFiniteErrors();
+	assert(errors(0, 0) == std::numeric_limits<float>::infinity() && errors(2, 1) == 3);
+	errors.computeEpsilons();
+	assert(errors.epsilon(0) == 1 && errors.epsilon(1) == 0);
+	counts[0] = counts[1] = counts[2] = 0;
+	for (int i = 0; i < 300; ++i) {
+		++counts[selectByLexicase(errors, rng, buffer)];
+	}
+	assert(counts[0] == 0 && counts[2] > 0);
+
+	// Finds x + x - y with down-sampled epsilon-lexicase selection, which evaluates a tenth of the cases.
+	struct LexicaseIntEvolver : ParallelEvolvingPopulationDelegate, ConcurrentTreeGeneratorDelegate {
+		EvolutionParameters &params;
+		grammar::Grammar grammar;
+		std::atomic<size_t> evaluatedCaseCount;
+
+		LexicaseIntEvolver(EvolutionParameters &params) : ParallelEvolvingPopulationDelegate(2), params(params), grammar(makeIntGrammar()), evaluatedCaseCount(0) { }
+
+		size_t fitnessCaseCount() override {
+			return 1000;
+		}
+		bool computeCaseErrorsForIndividual(const TreeGenome &individual, const size_t *cases, size_t caseCount, float *errors) override {
+			struct CaseEvaluator : TreeGenomeProgramEvaluator<int, CaseEvaluator> {
+				IntOperations ops;
+				int x = 0, y = 0;
+
+				CaseEvaluator(const grammar::Grammar &grammar) : ops(grammar) { }
+
+				int evaluateTerminal(unsigned definitionId, TreeGenomeValue value) {
+					return definitionId == ops.x ? x : y;
+				}
+				int evaluateUnaryFunction(unsigned definitionId, int x) {
+					return ops.unary(definitionId, x);
+				}
+				int evaluateBinaryFunction(unsigned definitionId, int x, int y) {
+					return ops.binary(definitionId, x, y);
+				}
+				int evaluateFunction(unsigned definitionId, const int *arguments, unsigned argumentCount) {
+					return ops.ternary(definitionId, arguments);
+				}
+			};
+			TreeGenomeProgram program(grammar, individual);
+			CaseEvaluator evaluator(grammar);
+			for (size_t i = 0; i < caseCount; ++i) {
+				evaluator.x = int(cases[i] % 37) - 18;
+				evaluator.y = int(cases[i] % 11);
+				errors[i] = float(abs(evaluator(program) - (evaluator.x + evaluator.x - evaluator.y)));
+			}
+			evaluatedCaseCount.fetch_add(caseCount);
+			return true;
+		}
+		float computeFitnessForIndividual(const TreeGenome &individual) override {
+			assert(false && "The fitness is derived from the case errors");
+			return 0;
+		}
+		TreeGenome generateRandomTreeOfType(TreeGenomeType type) override {
+			TreeGenome genome;
+			TreeGenerator<EvolutionParameters::RNG> generator(grammar, params.rng);
+			TreeGenome::Builder builder(genome);
+			generator.generateGrow(builder, 2, type);
+			return genome;
+		}
+		TreeGenome generateRandomTreeOfTypeConcurrently(TreeGenomeType type, core::Philox4x32 &rng) override {
+			TreeGenome genome;
+			TreeGenerator<core::Philox4x32> generator(grammar, rng);
+			TreeGenome::Builder builder(genome);
+			generator.generateGrow(builder, 2, type);
+			return genome;
+		}
+		const grammar::Grammar &genomeGrammar() override {
+			return grammar;
+		}
+	};
+	for (int isParallel = 0; isParallel < 2; ++isParallel) {
+		EvolutionParameters params;
+		params.rng = std::mt19937(21);
+		params.mutationRate = 0.2f;
+		params.crossoverRate = 0.7f;
+		params.selection = SelectionMethod::EpsilonLexicase;
+		params.caseSampleRate = 0.1f;
+		LexicaseIntEvolver evolver(params);
+		core::ThreadPool pool(2);
+		Population population(60, params, evolver);
+		if (isParallel) {
+			population.setParallelVariation(&pool);
+		}
+		RampedHalfAndHalfInitializer<EvolutionParameters::RNG> initializer(evolver.grammar, params.rng);
+		population.initialize(5, initializer);
+		float initialFitness = 0;
+		for (int i = 0; i < 15; ++i) {
+			population.nextGeneration(false);
+			if (i == 0) {
+				initialFitness = population.getStats().bestFitness;
+			}
+		}
+		assert(evolver.evaluatedCaseCount == 15 * 60 * 100);
+		auto best = population.evaluateGeneration();
+		// The fitness is the negated mean error of the sampled cases.
+		assert(population.getFitness(best) <= 0 && population.getFitness(best) >= initialFitness);
+	}
+}
+
+void testRandomStreams() {
+	using namespace genetic;
+
+	{
+		// The bounded sampling stays below the bound and is roughly uniform.
+		core::Philox4x32 rng(3, 0);
+		size_t counts[7] = { 0 };
+		for (int i = 0; i < 7000; ++i) {
+			auto value = core::uniformBelow(rng, 7);
+			assert(value < 7);
+			++counts[value];
+		}
+		for (auto count : counts) {
+			assert(count > 800 && count < 1200);
+		}
+		for (int i = 0; i < 100; ++i) {
+			auto p = core::uniformProbability(rng);
+			assert(p >= 0 && p < 1);
+			assert(core::uniformIndex(rng, 1) == 0);
+		}
+	}
+
+	{
+		// Every generation, individual and operation has its own stream.
+		core::RandomStreams streams(11);
+		auto a = streams.stream(2, 5, 1), b = streams.stream(2, 5, 1);
+		for (int i = 0; i < 10; ++i) {
+			assert(a() == b());
+		}
+		auto first = streams.stream(2, 5, 1)();
+		assert(first != streams.stream(3, 5, 1)());
+		assert(first != streams.stream(2, 6, 1)());
+		assert(first != streams.stream(2, 5, 0)());
+		assert(first != core::RandomStreams(12).stream(2, 5, 1)());
+	}
+
+	// The serial variation produces the same generations as the parallel one.
+	auto run = [] (unsigned threadCount, std::vector<uint64_t> &hashes) {
+		EvolutionParameters params;
+		params.rng = std::mt19937(5);
+		params.mutationRate = 0.1f;
+		params.crossoverRate = 0.8f;
+		params.useRandomStreams = true;
+		params.streamSeed = 17;
+		IntEvolver evolver(params);
+		Population population(37, params, evolver);
+		std::unique_ptr<core::ThreadPool> pool;
+		if (threadCount) {
+			pool.reset(new core::ThreadPool(threadCount));
+			population.setParallelVariation(pool.get());
+		}
+		initializeIntPopulation(population, evolver);
+		for (int i = 0; i < 10; ++i) {
+			population.nextGeneration(false);
+		}
+		hashes.clear();
+		for (size_t i = 0; i < 37; ++i) {
+			assert(population[i][0].subTreeSize() == population[i].getNodeCount());
+			hashes.push_back(population[i].structuralHash());
+		}
+	};
+	std::vector<uint64_t> serialHashes, parallelHashes;
+	run(0, serialHashes);
+	run(3, parallelHashes);
+	assert(serialHashes == parallelHashes);
+}
+
+void testMappedDataset() {
+	using namespace genetic;
+
+	const std::string csvPath = "/tmp/fyp-genetic-dataset-test.csv", path = "/tmp/fyp-genetic-dataset-test.bin";
+	std::ofstream(csvPath) << "x, \"y\",target\n1,2,0.5\n-3,4,1e3\r\n\n5,60000,-2.25\n";
+	assert(dataset::convertCsv(csvPath, path));
+	{
+		MappedDataset data(path);
+		assert(data.isLoaded());
+		assert(data.rowCount() == 3 && data.columnCount() == 3);
+		assert(data.columnName(1) == "y" && data.columnIndex("target") == 2 && data.columnIndex("z") == -1);
+		assert(data.columnType(0) == dataset::ColumnType::Int32 && data.columnType(2) == dataset::ColumnType::Float32);
+		auto x = data.column<int32_t>("x"), y = data.column<int32_t>(1);
+		auto target = data.column<float>("target");
+		assert(x[0] == 1 && x[1] == -3 && x[2] == 5 && y[2] == 60000);
+		assert(target[0] == 0.5f && target[1] == 1000.0f && target[2] == -2.25f);
+		// Every column is aligned for vector loads.
+		assert(uintptr_t(x.data()) % dataset::columnAlignment == 0 && uintptr_t(target.data()) % dataset::columnAlignment == 0);
+		int sum = 0;
+		for (auto value : x) {
+			sum += value;
+		}
+		assert(sum == 3);
+		data.prefetch();
+	}
+
+	// The other types and the options.
+	std::ofstream(csvPath) << "1;2.5\n2;3\n";
+	dataset::CsvConversionOptions options;
+	options.delimiter = ';';
+	options.hasHeader = false;
+	options.inferIntegers = false;
+	options.floatType = dataset::ColumnType::Float64;
+	assert(dataset::convertCsv(csvPath, path, options));
+	{
+		MappedDataset data(path);
+		assert(data.isLoaded() && data.rowCount() == 2 && data.columnName(0) == "x0");
+		auto x = data.column<double>(0), y = data.column<double>("x1");
+		assert(x[1] == 2.0 && y[0] == 2.5 && y.size() == 2);
+	}
+
+	// The malformed files are rejected, and they don't replace the dataset.
+	std::ofstream(csvPath) << "a,b\n1,2\n3\n";
+	assert(!dataset::convertCsv(csvPath, path));
+	std::ofstream(csvPath) << "a,b\n1,2\n3,four\n";
+	assert(!dataset::convertCsv(csvPath, path));
+	assert(MappedDataset(path).isLoaded());
+	std::ofstream(path, std::ios::binary) << "not a dataset";
+	assert(!MappedDataset(path).isLoaded());
+	assert(!MappedDataset("/tmp/fyp-genetic-no-such-dataset.bin").isLoaded());
+	std::remove(csvPath.c_str());
+	std::remove(path.c_str());
+}
+
+void testProfiler() {
+	using namespace genetic;
+
+	profiling::collect();
+	auto work = [] {
+		profiling::ScopedTimer timer("test::scope");
+		profiling::count("test::counter", 2);
+	};
+	work();
+	std::thread first(work), second(work);
+	first.join();
+	second.join();
+	{
+		profiling::ScopedTimer timer("test::outer");
+		profiling::count("test::counter");
+	}
+	auto report = profiling::collect();
+	// The threads that exited keep their profiles until they're collected.
+	assert(report.threads.size() >= 3);
+	assert(report.timer("test::scope").count == 3 && report.timer("test::outer").count == 1);
+	assert(report.timer("test::outer").totalTime >= report.timer("test::outer").maxTime);
+	assert(report.counter("test::counter") == 7 && report.counter("test::missing") == 0);
+	assert(report.timers().size() == 2 && report.counters().size() == 1);
+	assert(profiling::collect().threads.empty());
+
+	std::ostringstream trace, totals;
+	profiling::writeChromeTrace(report, trace);
+	assert(trace.str().front() == '[' && trace.str().find("{\"name\":\"test::scope\",\"cat\":\"genetic\",\"ph\":\"X\"") != std::string::npos);
+	assert(trace.str().find("\"ph\":\"C\"") != std::string::npos);
+	profiling::writeTotals(report, totals);
+	assert(totals.str().find("\ntest::scope,3,") != std::string::npos && totals.str().find("\ntest::counter,7,,\n") != std::string::npos);
+
+	// The profiles are written by the recorder's thread.
+	std::ostringstream stream;
+	{
+		ChromeTraceStatisticsSink sink(stream);
+		StatisticsRecorder recorder(sink);
+		recorder.record(GenerationRecord());
+		recorder.recordProfile(report);
+	}
+	assert(stream.str().find("\"name\":\"fitness\"") != std::string::npos && stream.str().find("test::outer") != std::string::npos);
+
+	// The library's instrumentation only records when it's compiled in.
+	EvolutionParameters params;
+	params.rng = std::mt19937(3);
+	params.mutationRate = 0.1f;
+	params.crossoverRate = 0.8f;
+	IntEvolver evolver(params);
+	Population population(20, params, evolver);
+	initializeIntPopulation(population, evolver);
+	population.nextGeneration(false);
+	report = profiling::collect();
+	assert(profiling::isEnabled == (report.timer("Population::evaluateGeneration").count != 0));
+	assert(profiling::isEnabled == (report.counter("Tree::nodeAllocations") != 0));
+}
+
+namespace {
+
+// The grammar of makeIntGrammar as a static grammar. The terminals read the values of the fitness case.
+struct IntCases {
+	const int *xs, *ys;
+};
+
+struct StaticX : genetic::grammar::StaticTerminal<10> {
+	static const char *name() { return "x"; }
+	template<typename T>
+	static T evaluate(const IntCases &cases, genetic::TreeGenomeValue offset, size_t fitnessCase) { return cases.xs[fitnessCase]; }
+};
+
+struct StaticY : genetic::grammar::StaticTerminal<10> {
+	static const char *name() { return "y"; }
+	template<typename T>
+	static T evaluate(const IntCases &cases, genetic::TreeGenomeValue offset, size_t fitnessCase) { return cases.ys[fitnessCase]; }
+};
+
+struct StaticAdd : genetic::grammar::StaticBinaryFunction<5> {
+	static const char *name() { return "+"; }
+	template<typename T>
+	static T evaluate(T x, T y) { return x + y; }
+};
+
+struct StaticSubtract : genetic::grammar::StaticBinaryFunction<5> {
+	static const char *name() { return "-"; }
+	template<typename T>
+	static T evaluate(T x, T y) { return x - y; }
+};
+
+struct StaticNegate : genetic::grammar::StaticUnaryFunction<3> {
+	static const char *name() { return "neg"; }
+	template<typename T>
+	static T evaluate(T x) { return -x; }
+};
+
+struct StaticSelect : genetic::grammar::StaticTernaryFunction<3> {
+	static const char *name() { return "select"; }
+	template<typename T>
+	static T evaluate(T x, T y, T z) { return x > 0 ? y : z; }
+};
+
+typedef genetic::grammar::StaticGrammar<StaticX, StaticY, StaticAdd, StaticSubtract, StaticNegate, StaticSelect> StaticIntGrammar;
+
+} // end anonymous namespace
+
+void testStaticGrammar() {
+	using namespace genetic;
+
+	// The layout of the grammar is known at compile time, and it matches the runtime grammar.
+	static_assert(StaticIntGrammar::definitionCount == 6 && StaticIntGrammar::nodeLimit == 36, "");
+	static_assert(StaticIntGrammar::rawValue<2>() == 20 && StaticIntGrammar::definitionId<StaticNegate>() == 4, "");
+	const grammar::Type t = grammar::type("int");
+	auto grammar = StaticIntGrammar::makeGrammar({ t });
+	auto reference = makeIntGrammar();
+	assert(grammar.fingerprint() == reference.fingerprint());
+	for (TreeGenomeValue value = 0; value < StaticIntGrammar::nodeLimit; ++value) {
+		auto definitionId = StaticIntGrammar::definitionIdForRawValue(value);
+		assert(definitionId == reference.definitionIdForTreeGenomeValue(value));
+		assert(StaticIntGrammar::argumentCount(definitionId) == reference[definitionId].getNumArguments());
+	}
+
+	// The static evaluators compute the same values as the runtime evaluators.
+	static const size_t caseCount = 300;
+	std::vector<int> xs(caseCount), ys(caseCount), results(caseCount), oddResults(caseCount);
+	for (size_t i = 0; i < caseCount; ++i) {
+		xs[i] = int(i % 17) - 8;
+		ys[i] = int(i * 5 % 11);
+	}
+	const IntCases cases = { xs.data(), ys.data() };
+	auto rng = std::mt19937(13);
+	TreeGenerator<std::mt19937> generator(grammar, rng);
+	IntProgramEvaluator programEvaluator(reference);
+	StaticTreeGenomeProgramEvaluator<int, StaticIntGrammar, const IntCases> evaluator;
+	StaticTreeGenomeProgramBatchEvaluator<int, StaticIntGrammar, const IntCases> batchEvaluator(64), oddBatchEvaluator(3);
+	TreeGenomeProgram program, staticProgram;
+	for (int i = 0; i < 100; ++i) {
+		TreeGenome genome;
+		{
+			TreeGenome::Builder builder(genome);
+			generator.generateGrow(builder, 1 + i % 6);
+		}
+		program.compile(reference, genome);
+		StaticIntGrammar::compile(genome, staticProgram);
+		assert(staticProgram.size() == program.size() && staticProgram.maxStackDepth == program.maxStackDepth);
+		for (size_t j = 0; j < program.size(); ++j) {
+			assert(staticProgram.instructions[j].definitionId == program.instructions[j].definitionId);
+			assert(staticProgram.instructions[j].argumentCount == program.instructions[j].argumentCount);
+		}
+		// The fixed terminal values of IntOperations.
+		const int x = 3, y = 7;
+		const IntCases fixedCase = { &x, &y };
+		assert(evaluator(staticProgram, fixedCase) == programEvaluator(program));
+		batchEvaluator(staticProgram, cases, caseCount, results.data());
+		oddBatchEvaluator(staticProgram, cases, caseCount, oddResults.data());
+		assert(oddResults == results);
+		for (size_t c = 0; c < caseCount; c += 7) {
+			assert(results[c] == evaluator(staticProgram, cases, c));
+		}
+	}
+}
+
+void testSteadyStateEvolution() {
+	using namespace genetic;
+
+	// Evaluates the individuals concurrently, with a cost that varies with the size of the individual.
+	struct ConcurrentIntEvolver : IntEvolver {
+		std::atomic<size_t> concurrentEvaluationCount;
+
+		ConcurrentIntEvolver(EvolutionParameters &params) : IntEvolver(params), concurrentEvaluationCount(0) { }
+
+		float computeFitnessConcurrently(const TreeGenome &individual) override {
+			++concurrentEvaluationCount;
+			TreeGenomeProgram program(grammar, individual);
+			IntProgramEvaluator evaluator(grammar);
+			return -float(abs(evaluator(program) - 42)) - float(individual.getNodeCount()) * 0.01f;
+		}
+	};
+
+	auto evolve = [] (unsigned threadCount, bool useRandomStreams, std::vector<uint64_t> &hashes) {
+		EvolutionParameters params;
+		params.rng = std::mt19937(23);
+		params.mutationRate = 0.2f;
+		params.crossoverRate = 0.7f;
+		params.useRandomStreams = useRandomStreams;
+		params.streamSeed = 5;
+		ConcurrentIntEvolver evolver(params);
+		Population population(40, params, evolver);
+		initializeIntPopulation(population, evolver);
+		auto initialFitness = population.getFitness(population.evaluateGeneration());
+		core::ThreadPool pool(threadCount);
+		size_t replacementCount = population.evolveSteadyState(pool, 300);
+		replacementCount += population.evolveSteadyState(pool, 300);
+		assert(evolver.concurrentEvaluationCount == 600);
+		assert(replacementCount != 0 && replacementCount <= 600);
+		assert(population.generation == 15);
+		// The fittest individual is never replaced by a less fit one, and the fitness of every slot belongs to its genome.
+		auto best = population.evaluateGeneration();
+		assert(population.getFitness(best) >= initialFitness);
+		hashes.clear();
+		for (size_t i = 0; i < population.size(); ++i) {
+			assert(population[i][0].subTreeSize() == population[i].getNodeCount());
+			assert(population.getFitness(i) == evolver.computeFitnessConcurrently(population[i]));
+			assert(population.getFitness(i) <= population.getFitness(best));
+			hashes.push_back(population[i].structuralHash());
+		}
+		// The generations can follow the steady state evolution, and keep its fittest individual.
+		auto bestFitness = population.getFitness(best);
+		population.nextGeneration(false);
+		assert(population.getFitness(population.evaluateGeneration()) >= bestFitness);
+	};
+	std::vector<uint64_t> hashes, otherHashes;
+	// A single thread is reproducible.
+	evolve(1, false, hashes);
+	evolve(1, false, otherHashes);
+	assert(hashes == otherHashes);
+	evolve(1, true, hashes);
+	evolve(1, true, otherHashes);
+	assert(hashes == otherHashes);
+	evolve(4, false, hashes);
+	evolve(4, true, hashes);
+
+	// The offspring whose fitness is NaN don't replace any individual.
+	struct NanIntEvolver : IntEvolver {
+		NanIntEvolver(EvolutionParameters &params) : IntEvolver(params) { }
+
+		float computeFitnessConcurrently(const TreeGenome &individual) override {
+			return std::numeric_limits<float>::quiet_NaN();
+		}
+	};
+	EvolutionParameters params;
+	params.rng = std::mt19937(23);
+	NanIntEvolver evolver(params);
+	Population population(40, params, evolver);
+	initializeIntPopulation(population, evolver);
+	auto bestFitness = population.getFitness(population.evaluateGeneration());
+	core::ThreadPool pool(2);
+	assert(population.evolveSteadyState(pool, 100) == 0);
+	assert(population.getFitness(population.evaluateGeneration()) == bestFitness);
+}
+
+void testGenomeCodec() {
+	using namespace genetic;
+
+	{
+		// The varints survive the round trip, and the values that don't fit into 32 bits are rejected.
+		std::vector<uint8_t> bytes;
+		const uint32_t values[] = { 0, 1, 127, 128, 16383, 16384, 0x0fffffffu, 0xffffffffu };
+		for (auto value : values) {
+			codec::writeVarint(bytes, value);
+		}
+		assert(bytes.size() == 1 + 1 + 1 + 2 + 2 + 3 + 4 + 5);
+		const uint8_t *position = bytes.data(), *end = bytes.data() + bytes.size();
+		for (auto expected : values) {
+			uint32_t value;
+			assert(codec::readVarint(position, end, value) && value == expected);
+		}
+		assert(position == end);
+		const uint8_t tooLarge[] = { 0xff, 0xff, 0xff, 0xff, 0x1f }, tooLong[] = { 0x80, 0x80, 0x80, 0x80, 0x80, 0x00 }, truncated[] = { 0x80 };
+		uint32_t value;
+		position = tooLarge;
+		assert(!codec::readVarint(position, tooLarge + 5, value));
+		position = tooLong;
+		assert(!codec::readVarint(position, tooLong + 6, value));
+		position = truncated;
+		assert(!codec::readVarint(position, truncated + 1, value));
+	}
+
+	// The raw values of the scaled grammar take several bytes.
+	for (TreeGenomeValue scale : { 1u, 1000u }) {
+		using namespace grammar;
+		const Type t = type("int");
+		const Grammar grammar({ t }, {
+			terminal("x", t, 10 * scale),
+			terminal("y", t, 10 * scale),
+			binaryFunction("+", t, {t, t}, 5 * scale),
+			unaryFunction("neg", t, t, 3 * scale),
+			ternaryFunction("select", t, {t, t, t}, 3 * scale)
+		});
+		std::mt19937 rng(11);
+		TreeGenerator<std::mt19937> generator(grammar, rng);
+		std::vector<TreeGenome> genomes(60);
+		size_t nodeCount = 0;
+		for (size_t i = 0; i < genomes.size(); ++i) {
+			TreeGenome::Builder builder(genomes[i]);
+			generator.generateGrow(builder, 1 + int(i % 7));
+			nodeCount += genomes[i].getNodeCount();
+		}
+
+		// The genomes survive the round trip one by one and in bulk, into genomes whose storage is reused.
+		std::vector<uint8_t> bytes;
+		codec::Decoder<> decoder(grammar);
+		TreeGenome decoded = genomes.back().copy();
+		for (const auto &genome : genomes) {
+			bytes.clear();
+			codec::encode(genome, bytes);
+			const uint8_t *position = bytes.data();
+			assert(decoder.decode(position, bytes.data() + bytes.size(), decoded));
+			assert(position == bytes.data() + bytes.size());
+			assert(decoded.structuralHash() == genome.structuralHash());
+			assert(decoded[0].subTreeSize() == decoded.getNodeCount());
+			// A truncated genome is rejected.
+			position = bytes.data();
+			assert(!decoder.decode(position, bytes.data() + bytes.size() - 1, decoded));
+		}
+		bytes.clear();
+		codec::encode(genomes, bytes);
+		if (scale == 1) {
+			// One byte per node and one for the count.
+			assert(bytes.size() == nodeCount + 1);
+		} else {
+			assert(bytes.size() > nodeCount + 1 && bytes.size() <= nodeCount * 3 + 1);
+		}
+		std::vector<TreeGenome> decodedGenomes(3);
+		assert(decoder.decode(bytes, decodedGenomes));
+		assert(decodedGenomes.size() == genomes.size());
+		for (size_t i = 0; i < genomes.size(); ++i) {
+			assert(decodedGenomes[i].structuralHash() == genomes[i].structuralHash());
+		}
+		// The compact genomes are decoded like the others.
+		std::vector<CompactTreeGenome> compactGenomes;
+		codec::Decoder<CompactTreeGenome::NodeStorageType> compactDecoder(grammar);
+		assert(compactDecoder.decode(bytes, compactGenomes) && compactGenomes.size() == genomes.size());
+		for (size_t i = 0; i < genomes.size(); ++i) {
+			TreeGenome genome;
+			genome.assign(compactGenomes[i]);
+			assert(genome.structuralHash() == genomes[i].structuralHash());
+		}
+		std::vector<uint8_t> compactBytes;
+		codec::encode(compactGenomes, compactBytes);
+		assert(compactBytes == bytes);
+
+		// Trailing bytes, a missing genome and raw values outside of the grammar are rejected.
+		auto invalid = bytes;
+		invalid.push_back(0);
+		assert(!decoder.decode(invalid, decodedGenomes));
+		invalid = bytes;
+		invalid[0] = uint8_t(genomes.size() + 1);
+		assert(!decoder.decode(invalid, decodedGenomes));
+		invalid.clear();
+		codec::writeVarint(invalid, 1);
+		codec::writeVarint(invalid, grammar.getNodeLimit());
+		assert(!decoder.decode(invalid, decodedGenomes));
+	}
+
+	{
+		// A whole population is encoded into one buffer.
+		EvolutionParameters params;
+		params.rng = std::mt19937(3);
+		IntEvolver evolver(params);
+		Population population(30, params, evolver);
+		initializeIntPopulation(population, evolver);
+		std::vector<uint8_t> bytes;
+		codec::encode(population, bytes);
+		std::vector<TreeGenome> genomes;
+		codec::Decoder<> decoder(evolver.grammar);
+		assert(decoder.decode(bytes, genomes) && genomes.size() == population.size());
+		for (size_t i = 0; i < genomes.size(); ++i) {
+			assert(genomes[i].structuralHash() == population[i].structuralHash());
+		}
+	}
+
+	{
+		// The printer renders the trees like a recursive printing of their roots, with or without a delegate.
+		struct ValuePrinterDelegate : TreeGenomePrinterDelegate {
+			bool printTerminal(const grammar::Definition &definition, const TreeGenome::Node &node, std::ostream &os) override {
+				if (definition.getName() == std::string("x")) {
+					os << "x" << node.value;
+					return true;
+				}
+				return false;
+			}
+		};
+		auto grammar = makeIntGrammar();
+		std::mt19937 rng(5);
+		TreeGenerator<std::mt19937> generator(grammar, rng);
+		TreeGenomePrinter printer(grammar);
+		ValuePrinterDelegate delegate;
+		std::function<void (const TreeGenome::Node &, std::ostream &, TreeGenomePrinterDelegate *)> printRecursively;
+		printRecursively = [&] (const TreeGenome::Node &node, std::ostream &os, TreeGenomePrinterDelegate *printerDelegate) {
+			const auto &definition = grammar[node];
+			if (definition.isTerminal()) {
+				if (!printerDelegate || !printerDelegate->printTerminal(definition, node, os)) {
+					os << definition.getName();
+				}
+				return;
+			}
+			os << "(" << definition.getName();
+			for (auto child : node) {
+				os << " ";
+				printRecursively(child, os, printerDelegate);
+			}
+			os << ")";
+		};
+		std::string buffer;
+		for (int i = 0; i < 40; ++i) {
+			TreeGenome genome;
+			{
+				TreeGenome::Builder builder(genome);
+				generator.generateGrow(builder, 1 + i % 6);
+			}
+			for (TreeGenomePrinterDelegate *printerDelegate : { static_cast<TreeGenomePrinterDelegate *>(nullptr), static_cast<TreeGenomePrinterDelegate *>(&delegate) }) {
+				std::stringstream expected, actual;
+				printRecursively(genome[0], expected, printerDelegate);
+				printer.print(genome, actual, printerDelegate);
+				assert(actual.str() == expected.str());
+				buffer.clear();
+				printer.print(genome, buffer, printerDelegate);
+				assert(buffer == expected.str());
+			}
+		}
+	}
 }
 
 } // end namespace treeGenomeTest
@@ -468,6 +3188,34 @@ int main(int argc, const char * argv[]) {
 	treeGenomeTest::testTreeGenomeTypedGrammar();
 	treeGenomeTest::testTreeGenomePrinter();
 	treeGenomeTest::testRampedHalfAndHalfInitializer();
+	treeGenomeTest::testThreadPool();
+	treeGenomeTest::testTreeGenomeProgram();
+	treeGenomeTest::testTreeGenomeProgramBatchEvaluator();
+	treeGenomeTest::testGrammarRawValueLookup();
+	treeGenomeTest::testTreeSwapSubTrees();
+	treeGenomeTest::testCompactTreeGenome();
+	treeGenomeTest::testFitnessCache();
+	treeGenomeTest::testIncrementalTreeGenomeEvaluator();
+	treeGenomeTest::testTreeGenomeNativeCompiler();
+	treeGenomeTest::testIslandPopulation();
+	treeGenomeTest::testDistributedEvaluation();
+	treeGenomeTest::testParallelVariation();
+	treeGenomeTest::testTreeGenomeTypeIndex();
+	treeGenomeTest::testGPUEvaluator();
+	treeGenomeTest::testCheckpoint();
+	treeGenomeTest::testStatisticsRecorder();
+	treeGenomeTest::testSizeLimits();
+	treeGenomeTest::testIterativeTreeGenerator();
+	treeGenomeTest::testTreeGenomeSimplifier();
+	treeGenomeTest::testTreeGenomeDAG();
+	treeGenomeTest::testRacingEvaluation();
+	treeGenomeTest::testLexicaseSelection();
+	treeGenomeTest::testRandomStreams();
+	treeGenomeTest::testMappedDataset();
+	treeGenomeTest::testProfiler();
+	treeGenomeTest::testStaticGrammar();
+	treeGenomeTest::testSteadyStateEvolution();
+	treeGenomeTest::testGenomeCodec();
 
 	// Test GP solvers.
     testFunctionSolver();
@@ -1,7 +1,7 @@
 #include "geneticProgramming.h"
 #include "grammar.h"
 #include "treePrinter.h"
-#include "treeEvaluator.h"
+#include "dagEvaluator.h"
 #include "rampedHalfAndHalfInitializer.h"
 #include <iostream>
 #include <sstream>
@@ -42,39 +42,58 @@ static const Grammar fnGrammar = Grammar({
 	binaryFunction("functions", setType, { baseType, fnType }, 50)
 });
 
-struct FnEvaluator : TreeGenomeEvaluator<int> {
-	DefinitionSet x, y, one, add, sub, mul, call;
-	int px, py;
-	TreeGenome::Node baseFN;
+// Maps the function set root, the calls and the parameters of the grammar to the graph.
+struct FnDAGDelegate : TreeGenomeDAGDelegate {
+	DefinitionSet x, y, call;
+	unsigned functions;
 public:
-	FnEvaluator(TreeGenome::Node baseFN, int px, int py) : TreeGenomeEvaluator<int>(fnGrammar), px(px), py(py), baseFN(baseFN) {
+	FnDAGDelegate() {
 		x = fnGrammar["x"];
 		y = fnGrammar["y"];
+		call = fnGrammar["call"];
+		functions = GrammarDefinitionAccessor(fnGrammar)["functions"].getDefinitionId();
+	}
+
+	unsigned functionCountForRoot(unsigned definitionId) override {
+		return definitionId == functions ? 1 : 0;
+	}
+
+	int functionIndexForCall(unsigned definitionId) override {
+		return call.contains(definitionId) ? 0 : -1;
+	}
+
+	int parameterIndexForTerminal(unsigned definitionId, TreeGenomeValue value) override {
+		if (x.contains(definitionId)) {
+			return 0;
+		} else if (y.contains(definitionId)) {
+			return 1;
+		}
+		return -1;
+	}
+};
+
+// Evaluates the graph of a genome, in which x and y are the parameters of the fitness case, or
+// the arguments of the call in the base function.
+struct FnEvaluator : TreeGenomeDAGEvaluator<int, FnEvaluator> {
+	DefinitionSet one, add, sub, mul;
+public:
+	FnEvaluator() {
 		one = fnGrammar["1"];
 		add = fnGrammar["+"];
 		sub = fnGrammar["-"];
 		mul = fnGrammar["*"];
-		call = fnGrammar["call"];
 	}
 	
-	int evaluteTerminal(unsigned definitionId, const TreeGenome::Node &node) override {
-		if (x.contains(definitionId)) {
-			return px;
-		} else if (y.contains(definitionId)) {
-			return py;
-		}
+	int evaluateTerminal(unsigned definitionId, TreeGenomeValue value) {
 		assert(one.contains(definitionId));
 		return 1;
 	}
 	
-	int evaluateBinaryFunction(unsigned definitionId, const TreeGenome::Node &node, int x, int y) override {
+	int evaluateBinaryFunction(unsigned definitionId, int x, int y) {
 		if (add.contains(definitionId)) {
 			return x + y;
 		} else if (sub.contains(definitionId)) {
 			return x - y;
-		} else if (call.contains(definitionId)) {
-			FnEvaluator evaluator(baseFN, x, y);
-			return evaluator(baseFN);
 		}
 		assert(mul.contains(definitionId));
 		return x * y;
@@ -97,7 +116,7 @@ public:
 	}
 };
 
-class FnEvolver: public EvolvingPopulationDelegate {
+class FnEvolver: public ParallelEvolvingPopulationDelegate {
 public:
 	EvolutionParameters &params;
 	
@@ -112,22 +131,17 @@ public:
 		return genome;
 	}
 	
-	int evaluate(const TreeGenome &tree, const std::vector<int> &parameters) {
-		assert(parameters.size() == 2);
-		auto root = tree.first();
-		const auto &rootDef = fnGrammar[root];
-		assert(rootDef.getDefinitionId() == GrammarDefinitionAccessor(fnGrammar)["functions"].getDefinitionId());
-		assert(rootDef.getNumArguments() == 2);
-		FnEvaluator eval(root[0], parameters[0], parameters[1]);
-		return eval(root[1]);
-	}
-	
-	float computeFitnessForIndividual(const TreeGenome &i) {
+	float computeFitnessForIndividual(const TreeGenome &i) override {
 		static const std::vector<std::vector<int>> parameters = { {1,2}, {4,5}, {6,7}, {8,9}, {10, 11}, {45, 11}, {450, 660}, {2017, 13} };
+		// Hash-cons the genome once, so the base function is compiled once for all of the calls and fitness cases.
+		FnDAGDelegate dagDelegate;
+		TreeGenomeDAG dag(fnGrammar, i, dagDelegate);
+		assert(dag.functionCount() == 1);
+		FnEvaluator eval;
 		float fitness = 0.0;
 		for (const auto &p : parameters) {
 			auto expectedAnswer = f(p[0], p[1]);
-			auto answer = evaluate(i, p);
+			auto answer = eval(dag, p.data(), unsigned(p.size()));
 			fitness += 1.0f - (float(abs(answer - expectedAnswer)) / 1000.0f);
 		}
 		fitness /= float(parameters.size());
@@ -136,12 +150,6 @@ public:
 		return fitness;
 	}
 	
-	void computeFitness(const std::vector<TreeGenome> &individuals, std::vector<float> &fitnesses) override {
-		for (size_t i = 0; i < individuals.size(); ++i) {
-			fitnesses[i] = computeFitnessForIndividual(individuals[i]);
-		}
-	}
-	
 	const grammar::Grammar &genomeGrammar() override {
 		return fnGrammar;
 	}